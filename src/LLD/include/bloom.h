@@ -0,0 +1,291 @@
+/*__________________________________________________________________________________________
+            
+            (c) Hash(BEGIN(Satoshi[2010]), END(Sunny[2012])) == Videlicet[2017] ++
+            
+            (c) Copyright The Nexus Developers 2014 - 2017
+            
+            Distributed under the MIT software license, see the accompanying
+            file COPYING or http://www.opensource.org/licenses/mit-license.php.
+            
+            "fides in stellis, virtus in numeris" - Faith in the Stars, Power in Numbers
+
+____________________________________________________________________________________________*/
+
+#ifndef NEXUS_LLD_INCLUDE_BLOOM_H
+#define NEXUS_LLD_INCLUDE_BLOOM_H
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "keyhash.h"
+
+namespace LLD
+{
+    
+    /* Words of a filter block. A block is one 64 byte cache line, and a key sets one bit in each word. */
+    const unsigned int BLOOM_BLOCK_WORDS = 8;
+    
+    
+    /* Keys a new filter is sized for, it is rebuilt twice as large when more are added. */
+    const unsigned int BLOOM_MIN_CAPACITY = 65536;
+    
+    
+    /* False positive rate a filter is sized for unless set with -bloomfpr. */
+    const double DEFAULT_BLOOM_FALSE_POSITIVE = 0.01;
+    
+    
+    /* Persisted filter file identification. */
+    const unsigned int BLOOM_MAGIC   = 0x424c4c4c; //LLLB
+    const unsigned int BLOOM_VERSION = 2;
+    
+    
+    /** Bloom Filter:
+    *
+    * Blocked Bloom filter over binary keys. The high half of a key's hash picks
+    * a cache line sized block, the low half is multiplied by a salt per word to
+    * pick one bit in each of its eight words. A lookup touches one cache line,
+    * and the eight words are tested with the same operations.
+    *
+    * Keys can't be removed, erased keys stay until the filter is rebuilt.
+    * Words are set with an atomic or and read with atomic loads, so keys can
+    * be inserted while other threads test them. Reset, Load and Swap need the
+    * filter to themselves.
+    *
+    */
+    class BloomFilter
+    {
+    protected:
+        
+        /* The blocks, aligned to cache lines. */
+        std::atomic<uint64>* pWords;
+        
+        
+        /* Number of blocks, the keys they were sized for, and the keys added. */
+        uint64 nBlocks, nCapacity, nKeys;
+        
+        
+        /* False positive rate the filter was sized for. */
+        double dFalsePositive;
+        
+        
+        /* Build the bit of each word of a block a hash sets. */
+        static void Mask(unsigned int nHash, uint64 nMask[BLOOM_BLOCK_WORDS])
+        {
+            static const unsigned int SALTS[BLOOM_BLOCK_WORDS] = { 0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU, 0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U };
+            
+            for(unsigned int i = 0; i < BLOOM_BLOCK_WORDS; i++)
+                nMask[i] = 1ULL << ((nHash * SALTS[i]) >> 26);
+        }
+        
+        
+        /* The block a hash falls in. */
+        std::atomic<uint64>* Block(uint64 nHash) const
+        {
+            return pWords + ((((nHash >> 32) * nBlocks) >> 32) * BLOOM_BLOCK_WORDS);
+        }
+        
+        
+        /* Allocate zeroed, cache line aligned blocks. */
+        void Allocate(uint64 nBlocksIn)
+        {
+            static_assert(sizeof(std::atomic<uint64>) == sizeof(uint64), "Filter words are saved as plain words");
+            
+            free(pWords);
+            
+            nBlocks = std::max(nBlocksIn, (uint64)1);
+            if(posix_memalign((void**)&pWords, 64, nBlocks * BLOOM_BLOCK_WORDS * sizeof(uint64)) != 0)
+                throw std::bad_alloc();
+            
+            for(uint64 i = 0; i < nBlocks * BLOOM_BLOCK_WORDS; i++)
+                new (&pWords[i]) std::atomic<uint64>(0);
+        }
+    
+    
+    public:
+        
+        BloomFilter() : pWords(NULL), nBlocks(0), nCapacity(0), nKeys(0), dFalsePositive(DEFAULT_BLOOM_FALSE_POSITIVE)
+        {
+            Reset(BLOOM_MIN_CAPACITY, DEFAULT_BLOOM_FALSE_POSITIVE);
+        }
+        
+        
+        ~BloomFilter()
+        {
+            free(pWords);
+        }
+        
+        
+        /** Empty the filter, sizing it for a number of keys.
+        *
+        * @param[in] nCapacityIn The keys it is sized for
+        * @param[in] dFalsePositiveIn The false positive rate at that many keys
+        *
+        */
+        void Reset(uint64 nCapacityIn, double dFalsePositiveIn)
+        {
+            nCapacity      = std::max(nCapacityIn, (uint64)BLOOM_MIN_CAPACITY);
+            dFalsePositive = std::min(std::max(dFalsePositiveIn, 0.000001), 0.5);
+            nKeys          = 0;
+            
+            /* Bits per key of a standard filter, a quarter more to make up for the keys not spreading as evenly over blocks. */
+            double dBitsPerKey = -log(dFalsePositive) / (log(2.0) * log(2.0)) * 1.25;
+            Allocate((uint64)ceil(nCapacity * dBitsPerKey / (BLOOM_BLOCK_WORDS * 64)));
+        }
+        
+        
+        /* Add a key. */
+        void Insert(const std::vector<unsigned char>& vKey)
+        {
+            uint64 nHash = KeyHash(vKey);
+            
+            uint64 nMask[BLOOM_BLOCK_WORDS];
+            Mask((unsigned int)nHash, nMask);
+            
+            std::atomic<uint64>* pBlock = Block(nHash);
+            for(unsigned int i = 0; i < BLOOM_BLOCK_WORDS; i++)
+                pBlock[i].fetch_or(nMask[i], std::memory_order_relaxed);
+            
+            nKeys++;
+        }
+        
+        
+        /* Check if a key may have been added. False means it never was. */
+        bool MayContain(const std::vector<unsigned char>& vKey) const
+        {
+            uint64 nHash = KeyHash(vKey);
+            
+            uint64 nMask[BLOOM_BLOCK_WORDS];
+            Mask((unsigned int)nHash, nMask);
+            
+            const std::atomic<uint64>* pBlock = Block(nHash);
+            uint64 nMissing = 0;
+            for(unsigned int i = 0; i < BLOOM_BLOCK_WORDS; i++)
+                nMissing |= nMask[i] & ~pBlock[i].load(std::memory_order_relaxed);
+            
+            return (nMissing == 0);
+        }
+        
+        
+        /* Exchange the blocks and sizes with another filter. */
+        void Swap(BloomFilter& filter)
+        {
+            std::swap(pWords, filter.pWords);
+            std::swap(nBlocks, filter.nBlocks);
+            std::swap(nCapacity, filter.nCapacity);
+            std::swap(nKeys, filter.nKeys);
+            std::swap(dFalsePositive, filter.dFalsePositive);
+        }
+        
+        
+        /* Whether more keys were added than it was sized for. */
+        bool Full() const { return nKeys > nCapacity; }
+        
+        
+        /* The keys added, and the keys it was sized for. */
+        uint64 Keys() const { return nKeys; }
+        uint64 Capacity() const { return nCapacity; }
+        
+        
+        /* Bytes of the blocks. */
+        uint64 Bytes() const { return nBlocks * BLOOM_BLOCK_WORDS * sizeof(uint64); }
+        
+        
+        /** Write the filter to disk.
+        *
+        * @param[in] strFilename The file to write, replaced atomically
+        *
+        * @return True if the file was written
+        *
+        */
+        bool Save(const std::string& strFilename) const
+        {
+            std::vector<unsigned char> vHeader(sizeof(unsigned int) * 2 + sizeof(uint64) * 3 + sizeof(double));
+            unsigned char* pHeader = &vHeader[0];
+            memcpy(pHeader, &BLOOM_MAGIC, sizeof(unsigned int));      pHeader += sizeof(unsigned int);
+            memcpy(pHeader, &BLOOM_VERSION, sizeof(unsigned int));    pHeader += sizeof(unsigned int);
+            memcpy(pHeader, &nBlocks, sizeof(uint64));                pHeader += sizeof(uint64);
+            memcpy(pHeader, &nCapacity, sizeof(uint64));              pHeader += sizeof(uint64);
+            memcpy(pHeader, &nKeys, sizeof(uint64));                  pHeader += sizeof(uint64);
+            memcpy(pHeader, &dFalsePositive, sizeof(double));
+            
+            unsigned int nChecksum = LLC::HASH::SK32((const unsigned char*)pWords, (const unsigned char*)pWords + Bytes()) ^ LLC::HASH::SK32(vHeader);
+            
+            std::string strTemp = strFilename + ".tmp";
+            std::ofstream fStream(strTemp.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+            fStream.write((char*)&vHeader[0], vHeader.size());
+            fStream.write((char*)pWords, Bytes());
+            fStream.write((char*)&nChecksum, sizeof(nChecksum));
+            fStream.close();
+            
+            if(!fStream)
+                return error(FUNCTION "Failed to Write %s\n", __PRETTY_FUNCTION__, strTemp.c_str());
+            
+            return (rename(strTemp.c_str(), strFilename.c_str()) == 0);
+        }
+        
+        
+        /** Read a filter written by Save.
+        *
+        * @param[in] strFilename The file to read
+        *
+        * @return True if the file was read and its checksum matched
+        *
+        */
+        bool Load(const std::string& strFilename)
+        {
+            std::ifstream fStream(strFilename.c_str(), std::ios::in | std::ios::binary);
+            if(!fStream)
+                return false;
+            
+            std::vector<unsigned char> vHeader(sizeof(unsigned int) * 2 + sizeof(uint64) * 3 + sizeof(double));
+            if(!fStream.read((char*)&vHeader[0], vHeader.size()))
+                return error(FUNCTION "Failed to Read Header of %s\n", __PRETTY_FUNCTION__, strFilename.c_str());
+            
+            unsigned int nMagic, nVersion;
+            uint64 nBlocksIn, nCapacityIn, nKeysIn;
+            double dFalsePositiveIn;
+            
+            const unsigned char* pHeader = &vHeader[0];
+            memcpy(&nMagic, pHeader, sizeof(unsigned int));            pHeader += sizeof(unsigned int);
+            memcpy(&nVersion, pHeader, sizeof(unsigned int));          pHeader += sizeof(unsigned int);
+            memcpy(&nBlocksIn, pHeader, sizeof(uint64));               pHeader += sizeof(uint64);
+            memcpy(&nCapacityIn, pHeader, sizeof(uint64));             pHeader += sizeof(uint64);
+            memcpy(&nKeysIn, pHeader, sizeof(uint64));                 pHeader += sizeof(uint64);
+            memcpy(&dFalsePositiveIn, pHeader, sizeof(double));
+            
+            if(nMagic != BLOOM_MAGIC || nVersion != BLOOM_VERSION || nBlocksIn == 0)
+                return error(FUNCTION "Unknown Format of %s\n", __PRETTY_FUNCTION__, strFilename.c_str());
+            
+            Allocate(nBlocksIn);
+            
+            unsigned int nChecksum;
+            if(!fStream.read((char*)pWords, Bytes()) || !fStream.read((char*)&nChecksum, sizeof(nChecksum)))
+                return error(FUNCTION "Failed to Read %s\n", __PRETTY_FUNCTION__, strFilename.c_str());
+            
+            if(nChecksum != (LLC::HASH::SK32((const unsigned char*)pWords, (const unsigned char*)pWords + Bytes()) ^ LLC::HASH::SK32(vHeader)))
+                return error(FUNCTION "Checksum Mismatch in %s\n", __PRETTY_FUNCTION__, strFilename.c_str());
+            
+            nCapacity      = nCapacityIn;
+            nKeys          = nKeysIn;
+            dFalsePositive = dFalsePositiveIn;
+            
+            return true;
+        }
+        
+        
+        /* Dump the filter statistics to the debug console. */
+        void PrintStats() const
+        {
+            printf(FUNCTION "Keys: %" PRIu64 " of %" PRIu64 " | %" PRIu64 " bytes | %.2f bits/key | Sized for %.4f%% false positives\n", __PRETTY_FUNCTION__, nKeys, nCapacity, Bytes(), Bytes() * 8.0 / std::max(nKeys, (uint64)1), dFalsePositive * 100);
+        }
+    };
+}
+
+#endif
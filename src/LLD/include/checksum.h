@@ -0,0 +1,206 @@
+/*__________________________________________________________________________________________
+            
+            (c) Hash(BEGIN(Satoshi[2010]), END(Sunny[2012])) == Videlicet[2017] ++
+            
+            (c) Copyright The Nexus Developers 2014 - 2017
+            
+            Distributed under the MIT software license, see the accompanying
+            file COPYING or http://www.opensource.org/licenses/mit-license.php.
+            
+            "fides in stellis, virtus in numeris" - Faith in the Stars, Power in Numbers
+
+____________________________________________________________________________________________*/
+
+#ifndef NEXUS_LLD_INCLUDE_CHECKSUM_H
+#define NEXUS_LLD_INCLUDE_CHECKSUM_H
+
+#include <stddef.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define LLD_CRC32C_SSE42
+#include <nmmintrin.h>
+#endif
+
+#include "../../LLC/hash/SK.h"
+#include "../../Util/include/args.h"
+
+namespace LLD
+{
+    
+    /** Checksums a sector's data can be written with. The one a record used is kept in its Sector Key.
+        Records written before there was a choice are SK32, which stays readable. **/
+    enum
+    {
+        CHECKSUM_SK32   = 0,
+        CHECKSUM_CRC32C = 1,
+        
+        CHECKSUM_TYPES  = 2
+    };
+    
+    
+    /* The checksum named by -checksum, CRC32C unless it says sk32. */
+    inline unsigned char ChecksumType(const std::string& strName)
+    {
+        return (strName == "sk32" ? CHECKSUM_SK32 : CHECKSUM_CRC32C);
+    }
+    
+    
+    inline const char* ChecksumName(unsigned char nType)
+    {
+        return (nType == CHECKSUM_SK32 ? "SK32" : nType == CHECKSUM_CRC32C ? "CRC32C" : "Unknown");
+    }
+    
+    
+    /** CRC32C Table:
+    *
+    * Slicing by eight tables of the Castagnoli polynomial, for processors
+    * without the SSE4.2 crc32 instruction. Built the first time it is used.
+    *
+    */
+    struct CRC32CTable
+    {
+        unsigned int TABLE[8][256];
+        
+        CRC32CTable()
+        {
+            for(unsigned int n = 0; n < 256; n++)
+            {
+                unsigned int nCRC = n;
+                for(unsigned int nBit = 0; nBit < 8; nBit++)
+                    nCRC = (nCRC >> 1) ^ (0x82f63b78 & (0 - (nCRC & 1)));
+                
+                TABLE[0][n] = nCRC;
+            }
+            
+            for(unsigned int n = 0; n < 256; n++)
+                for(unsigned int nSlice = 1; nSlice < 8; nSlice++)
+                    TABLE[nSlice][n] = (TABLE[nSlice - 1][n] >> 8) ^ TABLE[0][TABLE[nSlice - 1][n] & 0xff];
+        }
+        
+        static const CRC32CTable& Get()
+        {
+            static const CRC32CTable table;
+            
+            return table;
+        }
+    };
+    
+    
+    /* CRC32C of a buffer through the tables, eight bytes a step. */
+    inline unsigned int CRC32CSoftware(unsigned int nCRC, const unsigned char* p, size_t nLength)
+    {
+        const CRC32CTable& table = CRC32CTable::Get();
+        
+        for(; nLength >= 8; p += 8, nLength -= 8)
+        {
+            unsigned int nLow, nHigh;
+            memcpy(&nLow,  p,     4);
+            memcpy(&nHigh, p + 4, 4);
+            nLow ^= nCRC;
+            
+            nCRC = table.TABLE[7][nLow & 0xff] ^ table.TABLE[6][(nLow >> 8) & 0xff] ^ table.TABLE[5][(nLow >> 16) & 0xff] ^ table.TABLE[4][nLow >> 24] ^
+                   table.TABLE[3][nHigh & 0xff] ^ table.TABLE[2][(nHigh >> 8) & 0xff] ^ table.TABLE[1][(nHigh >> 16) & 0xff] ^ table.TABLE[0][nHigh >> 24];
+        }
+        
+        for(; nLength > 0; p++, nLength--)
+            nCRC = (nCRC >> 8) ^ table.TABLE[0][(nCRC ^ *p) & 0xff];
+        
+        return nCRC;
+    }
+    
+    
+#ifdef LLD_CRC32C_SSE42
+    
+    /** CRC32C of a buffer through the SSE4.2 crc32 instruction.
+    *
+    * Eight bytes a step once aligned. Compiled for SSE4.2 on its own, and
+    * only called once the processor is known to have it, so the build needs
+    * no flags.
+    *
+    */
+    __attribute__((target("sse4.2"))) inline unsigned int CRC32CHardware(unsigned int nCRC, const unsigned char* p, size_t nLength)
+    {
+        uint64 nCRC64 = nCRC;
+        
+        for(; nLength > 0 && ((size_t)p & 7); p++, nLength--)
+            nCRC64 = _mm_crc32_u8((unsigned int)nCRC64, *p);
+        
+        for(; nLength >= 8; p += 8, nLength -= 8)
+        {
+            uint64 nWord;
+            memcpy(&nWord, p, 8);
+            nCRC64 = _mm_crc32_u64(nCRC64, nWord);
+        }
+        
+        for(; nLength > 0; p++, nLength--)
+            nCRC64 = _mm_crc32_u8((unsigned int)nCRC64, *p);
+        
+        return (unsigned int)nCRC64;
+    }
+    
+    
+    /* Whether the processor has the crc32 instruction, asked once. */
+    inline bool CRC32CHardwareSupported()
+    {
+        static const bool fSupported = __builtin_cpu_supports("sse4.2");
+        
+        return fSupported;
+    }
+    
+#endif
+    
+    
+    /** CRC32C:
+    *
+    * The Castagnoli CRC of a buffer, in hardware where the processor has it.
+    * Catches every burst of errors up to 32 bits and every odd number of flipped
+    * bits, which is all the corruption check a sector needs.
+    *
+    * @param[in] pbegin The start of the data
+    * @param[in] pend The end of the data
+    *
+    * @return The CRC
+    *
+    */
+    inline unsigned int CRC32C(const unsigned char* pbegin, const unsigned char* pend)
+    {
+#ifdef LLD_CRC32C_SSE42
+        if(CRC32CHardwareSupported())
+            return ~CRC32CHardware(0xffffffff, pbegin, pend - pbegin);
+#endif
+        
+        return ~CRC32CSoftware(0xffffffff, pbegin, pend - pbegin);
+    }
+    
+    
+    /** Checksum:
+    *
+    * The checksum of a sector's data, the way a Sector Key says it was made.
+    *
+    * @param[in] nType The checksum, CHECKSUM_SK32 or CHECKSUM_CRC32C
+    * @param[in] pbegin The start of the data
+    * @param[in] pend The end of the data
+    *
+    * @return The checksum
+    *
+    */
+    inline unsigned int Checksum(unsigned char nType, const unsigned char* pbegin, const unsigned char* pend)
+    {
+        if(nType == CHECKSUM_CRC32C)
+            return CRC32C(pbegin, pend);
+        
+        return LLC::HASH::SK32(pbegin, pend);
+    }
+    
+    
+    inline unsigned int Checksum(unsigned char nType, const std::vector<unsigned char>& vData)
+    {
+        return Checksum(nType, vData.data(), vData.data() + vData.size());
+    }
+}
+
+#endif
@@ -0,0 +1,827 @@
+/*__________________________________________________________________________________________
+            
+            (c) Hash(BEGIN(Satoshi[2010]), END(Sunny[2012])) == Videlicet[2017] ++
+            
+            (c) Copyright The Nexus Developers 2014 - 2017
+            
+            Distributed under the MIT software license, see the accompanying
+            file COPYING or http://www.opensource.org/licenses/mit-license.php.
+            
+            "fides in stellis, virtus in numeris" - Faith in the Stars, Power in Numbers
+
+____________________________________________________________________________________________*/
+
+#ifndef NEXUS_LLD_INCLUDE_COMPRESSION_H
+#define NEXUS_LLD_INCLUDE_COMPRESSION_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <zlib.h>
+
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef USE_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+
+#include "checksum.h"
+#include "keyhash.h"
+
+#include "../../Util/include/debug.h"
+#include "../../Util/include/mutex.h"
+
+namespace LLD
+{
+    
+    /** Compressions a sector's data can be stored with. The one a record used is kept in its Sector Key,
+        so records stored either way are read either way. zlib is always built, LZ4 with USE_LZ4 and
+        Zstd with USE_ZSTD. **/
+    enum
+    {
+        COMPRESS_NONE = 0,
+        COMPRESS_ZLIB = 1,
+        COMPRESS_LZ4  = 2,
+        COMPRESS_ZSTD = 3
+    };
+    
+    
+    /* Bytes before the compressed data of a sector: its size uncompressed, and the dictionary it was compressed with, zero for none. */
+    const unsigned int COMPRESS_HEADER_SIZE = 5;
+    
+    
+    /* Largest record a sector is decompressed to, so a damaged header can't ask for more. */
+    const unsigned int COMPRESS_MAX_RECORD = 16 * 1024 * 1024;
+    
+    
+    /* Records smaller than this are stored as they are, unless set with -compressmin. */
+    const unsigned int DEFAULT_COMPRESS_MIN = 64;
+    
+    
+    /* Size of a trained dictionary unless set with -compressdictsize, and records sampled to train it unless set with -compressdictsamples. */
+    const unsigned int DEFAULT_COMPRESS_DICT_SIZE    = 16 * 1024;
+    const unsigned int DEFAULT_COMPRESS_DICT_SAMPLES = 4096;
+    
+    
+    /* Fewest records a dictionary is trained from. */
+    const unsigned int MIN_COMPRESS_DICT_SAMPLES = 64;
+    
+    
+    /* Dictionaries a database can have, numbered from one. */
+    const unsigned int MAX_COMPRESS_DICTIONARIES = 255;
+    
+    
+    /* Dictionary file identification. */
+    const unsigned int COMPRESS_DICT_MAGIC   = 0x444c4c4c; //LLLD
+    const unsigned int COMPRESS_DICT_VERSION = 1;
+    
+    
+    inline bool CompressionAvailable(unsigned char nType)
+    {
+#ifdef USE_LZ4
+        if(nType == COMPRESS_LZ4)
+            return true;
+#endif
+    
+#ifdef USE_ZSTD
+        if(nType == COMPRESS_ZSTD)
+            return true;
+#endif
+        
+        return (nType == COMPRESS_NONE || nType == COMPRESS_ZLIB);
+    }
+    
+    
+    /* The compression named by -compress, none unless it names one. */
+    inline unsigned char CompressionType(const std::string& strName)
+    {
+        if(strName == "zlib")
+            return COMPRESS_ZLIB;
+        
+        if(strName == "lz4")
+            return COMPRESS_LZ4;
+        
+        if(strName == "zstd")
+            return COMPRESS_ZSTD;
+        
+        return COMPRESS_NONE;
+    }
+    
+    
+    inline const char* CompressionName(unsigned char nType)
+    {
+        return (nType == COMPRESS_ZLIB ? "zlib" : nType == COMPRESS_LZ4 ? "LZ4" : nType == COMPRESS_ZSTD ? "Zstd" : "None");
+    }
+    
+    
+    /** Compression Dictionary:
+    *
+    * A dictionary as the codecs take it. Each one loaded has a serial number
+    * of its own in the process, so the digested form a thread keeps of one is
+    * never taken for another allocated where it was.
+    *
+    */
+    struct CompressionDictionary
+    {
+        std::vector<unsigned char> vData;
+        
+        uint64 nSerial;
+        
+        CompressionDictionary(const std::vector<unsigned char>& vDataIn) : vData(vDataIn), nSerial(NextSerial()) { }
+        
+        const unsigned char* data() const { return vData.data(); }
+        
+        size_t size() const { return vData.size(); }
+        
+    private:
+        
+        static uint64 NextSerial()
+        {
+            static std::atomic<uint64> nNext(1);
+            
+            return nNext++;
+        }
+    };
+    
+    
+    /** Zlib Streams:
+    *
+    * This thread's raw deflate and inflate streams. Setting one up allocates
+    * a few hundred kilobytes, so they are reset between records instead.
+    *
+    */
+    struct ZlibStreams
+    {
+        z_stream deflater, inflater;
+        
+        int nLevel;
+        
+        bool fDeflate, fInflate;
+        
+        ZlibStreams() : nLevel(0), fDeflate(false), fInflate(false)
+        {
+            memset(&deflater, 0, sizeof(deflater));
+            memset(&inflater, 0, sizeof(inflater));
+        }
+        
+        ~ZlibStreams()
+        {
+            if(fDeflate)
+                deflateEnd(&deflater);
+            
+            if(fInflate)
+                inflateEnd(&inflater);
+        }
+        
+        static ZlibStreams& Get()
+        {
+            static thread_local ZlibStreams streams;
+            
+            return streams;
+        }
+    };
+    
+    
+    /* Deflate a record to the end of vOut, with no zlib header since the Sector Key says what it is. */
+    inline bool ZlibCompress(const unsigned char* pData, size_t nSize, const CompressionDictionary* pDict, int nLevel, std::vector<unsigned char>& vOut)
+    {
+        ZlibStreams& streams = ZlibStreams::Get();
+        z_stream& stream = streams.deflater;
+        if(!streams.fDeflate || streams.nLevel != nLevel)
+        {
+            if(streams.fDeflate)
+                deflateEnd(&stream);
+            
+            memset(&stream, 0, sizeof(stream));
+            streams.fDeflate = (deflateInit2(&stream, nLevel == 0 ? Z_DEFAULT_COMPRESSION : nLevel, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+            streams.nLevel   = nLevel;
+            if(!streams.fDeflate)
+                return false;
+        }
+        else if(deflateReset(&stream) != Z_OK)
+            return false;
+        
+        if(pDict && deflateSetDictionary(&stream, pDict->data(), pDict->size()) != Z_OK)
+            return false;
+        
+        size_t nOffset = vOut.size();
+        vOut.resize(nOffset + deflateBound(&stream, nSize));
+        
+        stream.next_in   = (Bytef*)pData;
+        stream.avail_in  = nSize;
+        stream.next_out  = &vOut[nOffset];
+        stream.avail_out = vOut.size() - nOffset;
+        if(deflate(&stream, Z_FINISH) != Z_STREAM_END)
+            return false;
+        
+        vOut.resize(nOffset + stream.total_out);
+        
+        return true;
+    }
+    
+    
+    inline bool ZlibExpand(const unsigned char* pData, size_t nSize, const CompressionDictionary* pDict, unsigned char* pOut, size_t nOut)
+    {
+        ZlibStreams& streams = ZlibStreams::Get();
+        z_stream& stream = streams.inflater;
+        if(!streams.fInflate)
+        {
+            streams.fInflate = (inflateInit2(&stream, -15) == Z_OK);
+            if(!streams.fInflate)
+                return false;
+        }
+        else if(inflateReset(&stream) != Z_OK)
+            return false;
+        
+        /* A raw stream takes its dictionary before any input. */
+        if(pDict && inflateSetDictionary(&stream, pDict->data(), pDict->size()) != Z_OK)
+            return false;
+        
+        stream.next_in   = (Bytef*)pData;
+        stream.avail_in  = nSize;
+        stream.next_out  = pOut;
+        stream.avail_out = nOut;
+        
+        return (inflate(&stream, Z_FINISH) == Z_STREAM_END && stream.total_out == nOut);
+    }
+
+    
+#ifdef USE_LZ4
+    
+    /* This thread's LZ4 stream, for compressing with a dictionary. */
+    struct LZ4Stream
+    {
+        LZ4_stream_t* pStream;
+        
+        LZ4Stream() : pStream(LZ4_createStream()) { }
+        
+        ~LZ4Stream() { LZ4_freeStream(pStream); }
+        
+        static LZ4Stream& Get()
+        {
+            static thread_local LZ4Stream stream;
+            
+            return stream;
+        }
+    };
+    
+    
+    /* Compress a record to the end of vOut. The level is LZ4's acceleration, higher is faster and larger. */
+    inline bool LZ4Compress(const unsigned char* pData, size_t nSize, const CompressionDictionary* pDict, int nLevel, std::vector<unsigned char>& vOut)
+    {
+        size_t nOffset = vOut.size();
+        int nBound = LZ4_compressBound(nSize);
+        vOut.resize(nOffset + nBound);
+        
+        int nResult;
+        if(pDict)
+        {
+            LZ4_stream_t* pStream = LZ4Stream::Get().pStream;
+            LZ4_loadDict(pStream, (const char*)pDict->data(), pDict->size());
+            
+            nResult = LZ4_compress_fast_continue(pStream, (const char*)pData, (char*)&vOut[nOffset], nSize, nBound, std::max(nLevel, 1));
+        }
+        else
+            nResult = LZ4_compress_fast((const char*)pData, (char*)&vOut[nOffset], nSize, nBound, std::max(nLevel, 1));
+        
+        if(nResult <= 0)
+            return false;
+        
+        vOut.resize(nOffset + nResult);
+        
+        return true;
+    }
+    
+    
+    inline bool LZ4Expand(const unsigned char* pData, size_t nSize, const CompressionDictionary* pDict, unsigned char* pOut, size_t nOut)
+    {
+        int nResult;
+        if(pDict)
+            nResult = LZ4_decompress_safe_usingDict((const char*)pData, (char*)pOut, nSize, nOut, (const char*)pDict->data(), pDict->size());
+        else
+            nResult = LZ4_decompress_safe((const char*)pData, (char*)pOut, nSize, nOut);
+        
+        return (nResult == (int)nOut);
+    }
+    
+#endif
+
+    
+#ifdef USE_ZSTD
+    
+    /** Zstd Contexts:
+    *
+    * This thread's compression and decompression contexts, with the digested
+    * form of the dictionary they last used. A database compresses with one
+    * dictionary at a time, so it is digested once rather than every record.
+    *
+    */
+    struct ZstdContexts
+    {
+        ZSTD_CCtx* pCompress;
+        ZSTD_DCtx* pExpand;
+        
+        ZSTD_CDict* pCompressDict;
+        ZSTD_DDict* pExpandDict;
+        
+        uint64 nCompressSerial, nExpandSerial;
+        
+        int nLevel;
+        
+        ZstdContexts() : pCompress(ZSTD_createCCtx()), pExpand(ZSTD_createDCtx()), pCompressDict(NULL), pExpandDict(NULL), nCompressSerial(0), nExpandSerial(0), nLevel(0) { }
+        
+        ~ZstdContexts()
+        {
+            ZSTD_freeCDict(pCompressDict);
+            ZSTD_freeDDict(pExpandDict);
+            ZSTD_freeCCtx(pCompress);
+            ZSTD_freeDCtx(pExpand);
+        }
+        
+        static ZstdContexts& Get()
+        {
+            static thread_local ZstdContexts contexts;
+            
+            return contexts;
+        }
+    };
+    
+    
+    /* Compress a record to the end of vOut, at Zstd's default level unless one is given. */
+    inline bool ZstdCompress(const unsigned char* pData, size_t nSize, const CompressionDictionary* pDict, int nLevel, std::vector<unsigned char>& vOut)
+    {
+        ZstdContexts& contexts = ZstdContexts::Get();
+        if(nLevel == 0)
+            nLevel = 3;
+        
+        size_t nOffset = vOut.size();
+        vOut.resize(nOffset + ZSTD_compressBound(nSize));
+        
+        size_t nResult;
+        if(pDict)
+        {
+            if(contexts.nCompressSerial != pDict->nSerial || contexts.nLevel != nLevel)
+            {
+                ZSTD_freeCDict(contexts.pCompressDict);
+                contexts.pCompressDict   = ZSTD_createCDict(pDict->data(), pDict->size(), nLevel);
+                contexts.nCompressSerial = pDict->nSerial;
+                contexts.nLevel          = nLevel;
+            }
+            
+            nResult = ZSTD_compress_usingCDict(contexts.pCompress, &vOut[nOffset], vOut.size() - nOffset, pData, nSize, contexts.pCompressDict);
+        }
+        else
+            nResult = ZSTD_compressCCtx(contexts.pCompress, &vOut[nOffset], vOut.size() - nOffset, pData, nSize, nLevel);
+        
+        if(ZSTD_isError(nResult))
+            return false;
+        
+        vOut.resize(nOffset + nResult);
+        
+        return true;
+    }
+    
+    
+    inline bool ZstdExpand(const unsigned char* pData, size_t nSize, const CompressionDictionary* pDict, unsigned char* pOut, size_t nOut)
+    {
+        ZstdContexts& contexts = ZstdContexts::Get();
+        
+        size_t nResult;
+        if(pDict)
+        {
+            if(contexts.nExpandSerial != pDict->nSerial)
+            {
+                ZSTD_freeDDict(contexts.pExpandDict);
+                contexts.pExpandDict   = ZSTD_createDDict(pDict->data(), pDict->size());
+                contexts.nExpandSerial = pDict->nSerial;
+            }
+            
+            nResult = ZSTD_decompress_usingDDict(contexts.pExpand, pOut, nOut, pData, nSize, contexts.pExpandDict);
+        }
+        else
+            nResult = ZSTD_decompressDCtx(contexts.pExpand, pOut, nOut, pData, nSize);
+        
+        return (!ZSTD_isError(nResult) && nResult == nOut);
+    }
+    
+#endif
+    
+    
+    /** Build Dictionary:
+    *
+    * Train a dictionary for small records from a sample of them. Records too
+    * small to compress well alone share most of their bytes with each other:
+    * type tags, script templates, addresses that recur. With those in a
+    * dictionary each record only has to encode what is its own.
+    *
+    * Built with Zstd's trainer when there is one. Otherwise 16 byte segments
+    * at every 4th byte of the samples are counted by the number of samples they
+    * are in. The most common are taken in turn and grown over the segments
+    * that follow them while those are common too, until the dictionary is full.
+    * The most common go last, closest to the record, where matches cost least.
+    *
+    * @param[in] vSamples The sample records
+    * @param[in] nSize The most bytes the dictionary holds
+    *
+    * @return The dictionary, empty if nothing recurs
+    *
+    */
+    inline std::vector<unsigned char> BuildDictionary(const std::vector< std::vector<unsigned char> >& vSamples, unsigned int nSize)
+    {
+#ifdef USE_ZSTD
+        {
+            std::vector<unsigned char> vConcatenated;
+            std::vector<size_t> vSizes;
+            for(const auto& vSample : vSamples)
+            {
+                vConcatenated.insert(vConcatenated.end(), vSample.begin(), vSample.end());
+                vSizes.push_back(vSample.size());
+            }
+            
+            std::vector<unsigned char> vDict(nSize);
+            size_t nResult = ZDICT_trainFromBuffer(&vDict[0], vDict.size(), vConcatenated.data(), vSizes.data(), vSizes.size());
+            if(!ZDICT_isError(nResult))
+            {
+                vDict.resize(nResult);
+                
+                return vDict;
+            }
+        }
+#endif
+        
+        const unsigned int SEGMENT = 16, STEP = 4;
+        
+        /* The samples each segment is in, and where it was first found. */
+        struct Segment
+        {
+            unsigned int nCount, nLastSample, nSample, nOffset;
+        };
+        
+        std::unordered_map<uint64, Segment> mapSegments;
+        for(unsigned int nSample = 0; nSample < vSamples.size(); nSample++)
+        {
+            const std::vector<unsigned char>& vSample = vSamples[nSample];
+            for(unsigned int nOffset = 0; nOffset + SEGMENT <= vSample.size(); nOffset += STEP)
+            {
+                auto it = mapSegments.find(KeyHash(&vSample[nOffset], SEGMENT));
+                if(it == mapSegments.end())
+                    mapSegments[KeyHash(&vSample[nOffset], SEGMENT)] = { 1, nSample, nSample, nOffset };
+                else if(it->second.nLastSample != nSample)
+                {
+                    it->second.nCount++;
+                    it->second.nLastSample = nSample;
+                }
+            }
+        }
+        
+        std::vector< std::pair<unsigned int, uint64> > vCommon;
+        for(const auto& item : mapSegments)
+            if(item.second.nCount > 1)
+                vCommon.push_back(std::make_pair(item.second.nCount, item.first));
+        
+        std::sort(vCommon.begin(), vCommon.end(), [](const std::pair<unsigned int, uint64>& a, const std::pair<unsigned int, uint64>& b) { return a.first > b.first || (a.first == b.first && a.second < b.second); });
+        
+        /* Take the most common, grown forward over common segments not taken yet. */
+        std::unordered_set<uint64> setTaken;
+        std::vector< std::pair<const unsigned char*, unsigned int> > vPieces;
+        unsigned int nTotal = 0;
+        for(const auto& common : vCommon)
+        {
+            if(nTotal >= nSize)
+                break;
+            
+            if(!setTaken.insert(common.second).second)
+                continue;
+            
+            const Segment& segment = mapSegments[common.second];
+            const std::vector<unsigned char>& vSample = vSamples[segment.nSample];
+            
+            unsigned int nEnd = segment.nOffset + SEGMENT;
+            while(nEnd + STEP <= vSample.size())
+            {
+                uint64 nNext = KeyHash(&vSample[nEnd + STEP - SEGMENT], SEGMENT);
+                auto it = mapSegments.find(nNext);
+                if(it == mapSegments.end() || it->second.nCount < 2 || !setTaken.insert(nNext).second)
+                    break;
+                
+                nEnd += STEP;
+            }
+            
+            vPieces.push_back(std::make_pair(&vSample[segment.nOffset], nEnd - segment.nOffset));
+            nTotal += nEnd - segment.nOffset;
+        }
+        
+        /* Least common first. Whatever is past the size comes off the front. */
+        std::vector<unsigned char> vDict;
+        for(auto it = vPieces.rbegin(); it != vPieces.rend(); ++it)
+            vDict.insert(vDict.end(), it->first, it->first + it->second);
+        
+        if(vDict.size() > nSize)
+            vDict.erase(vDict.begin(), vDict.begin() + (vDict.size() - nSize));
+        
+        return vDict;
+    }
+    
+    
+    /** Sector Compressor:
+    *
+    * Compresses the records of a sector database and decompresses them. A
+    * compressed sector starts with its size uncompressed and the dictionary
+    * it used, then the codec's output with no framing of its own.
+    *
+    * Dictionaries are numbered from one and are never replaced or removed,
+    * since sectors compressed with them may still be read. Each is saved
+    * before any record is compressed with it, and published once, so readers
+    * take them without a lock.
+    *
+    */
+    class SectorCompressor
+    {
+        /* The dictionaries by number, set once each. */
+        std::atomic<const CompressionDictionary*> DICTIONARIES[MAX_COMPRESS_DICTIONARIES + 1];
+        
+        
+        /* The dictionary new records are compressed with, zero for none. */
+        std::atomic<unsigned int> nCurrentDictionary;
+        
+        
+        /* Held while a dictionary is added. */
+        Mutex_t DICTIONARY_MUTEX;
+    
+    public:
+        
+        /* The compression new records are stored with, its level (zero for the codec's default), and the smallest record compressed. */
+        unsigned char nType;
+        int nLevel;
+        unsigned int nMinSize;
+        
+        
+        /* Records compressed and left as they were, bytes before and after, and sectors decompressed. */
+        std::atomic<uint64> nCompressed, nUncompressed, nBytesIn, nBytesOut, nExpanded;
+        
+        
+        SectorCompressor() : nCurrentDictionary(0), nType(COMPRESS_NONE), nLevel(0), nMinSize(DEFAULT_COMPRESS_MIN), nCompressed(0), nUncompressed(0), nBytesIn(0), nBytesOut(0), nExpanded(0)
+        {
+            for(unsigned int nID = 0; nID <= MAX_COMPRESS_DICTIONARIES; nID++)
+                DICTIONARIES[nID].store(NULL);
+        }
+        
+        
+        ~SectorCompressor()
+        {
+            for(unsigned int nID = 0; nID <= MAX_COMPRESS_DICTIONARIES; nID++)
+                delete DICTIONARIES[nID].load();
+        }
+        
+        
+        /* The number of dictionaries. */
+        unsigned int Dictionaries() const { return nCurrentDictionary.load(); }
+        
+        
+        /** Compress a record, if it is worth it.
+        *
+        * @param[in] vData The record
+        * @param[out] vOut The sector to store
+        *
+        * @return False if the record is to be stored as it is
+        *
+        */
+        bool Compress(const std::vector<unsigned char>& vData, std::vector<unsigned char>& vOut)
+        {
+            if(nType == COMPRESS_NONE || vData.size() < nMinSize)
+                return false;
+            
+            unsigned int nDict = nCurrentDictionary.load();
+            const CompressionDictionary* pDict = (nDict ? DICTIONARIES[nDict].load() : NULL);
+            
+            unsigned int nRawSize = vData.size();
+            vOut.resize(COMPRESS_HEADER_SIZE);
+            memcpy(&vOut[0], &nRawSize, 4);
+            vOut[4] = (unsigned char)nDict;
+            
+            bool fCompressed = false;
+            if(nType == COMPRESS_ZLIB)
+                fCompressed = ZlibCompress(vData.data(), vData.size(), pDict, nLevel, vOut);
+#ifdef USE_LZ4
+            else if(nType == COMPRESS_LZ4)
+                fCompressed = LZ4Compress(vData.data(), vData.size(), pDict, nLevel, vOut);
+#endif
+#ifdef USE_ZSTD
+            else if(nType == COMPRESS_ZSTD)
+                fCompressed = ZstdCompress(vData.data(), vData.size(), pDict, nLevel, vOut);
+#endif
+            
+            /* Stored as it is unless an eighth is saved, reading it back isn't free. */
+            if(!fCompressed || vOut.size() > vData.size() - vData.size() / 8)
+            {
+                nUncompressed++;
+                
+                return false;
+            }
+            
+            nCompressed++;
+            nBytesIn  += vData.size();
+            nBytesOut += vOut.size();
+            
+            return true;
+        }
+        
+        
+        /** Decompress a sector.
+        *
+        * @param[in] nTypeIn The compression its Sector Key says it has
+        * @param[in] pbegin The start of the sector
+        * @param[in] pend The end of the sector
+        * @param[out] vOut The record
+        *
+        * @return True if the record was decompressed whole
+        *
+        */
+        bool Expand(unsigned char nTypeIn, const unsigned char* pbegin, const unsigned char* pend, std::vector<unsigned char>& vOut)
+        {
+            if(pend - pbegin < (std::ptrdiff_t)COMPRESS_HEADER_SIZE)
+                return error(FUNCTION "Compressed Sector of %u bytes is Short\n", __PRETTY_FUNCTION__, (unsigned int)(pend - pbegin));
+            
+            unsigned int nRawSize;
+            memcpy(&nRawSize, pbegin, 4);
+            if(nRawSize > COMPRESS_MAX_RECORD)
+                return error(FUNCTION "Compressed Sector claims %u bytes\n", __PRETTY_FUNCTION__, nRawSize);
+            
+            const CompressionDictionary* pDict = NULL;
+            if(pbegin[4] != 0 && !(pDict = DICTIONARIES[pbegin[4]].load()))
+                return error(FUNCTION "Dictionary %u is Missing\n", __PRETTY_FUNCTION__, pbegin[4]);
+            
+            vOut.resize(nRawSize);
+            pbegin += COMPRESS_HEADER_SIZE;
+            
+            nExpanded++;
+            if(nTypeIn == COMPRESS_ZLIB)
+                return ZlibExpand(pbegin, pend - pbegin, pDict, vOut.data(), nRawSize);
+#ifdef USE_LZ4
+            if(nTypeIn == COMPRESS_LZ4)
+                return LZ4Expand(pbegin, pend - pbegin, pDict, vOut.data(), nRawSize);
+#endif
+#ifdef USE_ZSTD
+            if(nTypeIn == COMPRESS_ZSTD)
+                return ZstdExpand(pbegin, pend - pbegin, pDict, vOut.data(), nRawSize);
+#endif
+            
+            return error(FUNCTION "Sector Compressed with %s, which this Build doesn't have\n", __PRETTY_FUNCTION__, CompressionName(nTypeIn));
+        }
+        
+        
+        /** Add a dictionary, for records from now on to be compressed with.
+        *
+        * @param[in] strBase The dictionary files' path, numbered after it
+        * @param[in] vDict The dictionary
+        *
+        * @return True if the dictionary was saved and is in use
+        *
+        */
+        bool AddDictionary(const std::string& strBase, const std::vector<unsigned char>& vDict)
+        {
+            LOCK(DICTIONARY_MUTEX);
+            
+            unsigned int nID = nCurrentDictionary.load() + 1;
+            if(nID > MAX_COMPRESS_DICTIONARIES)
+                return error(FUNCTION "Already have %u Dictionaries\n", __PRETTY_FUNCTION__, MAX_COMPRESS_DICTIONARIES);
+            
+            if(!SaveDictionary(strprintf("%s%03u", strBase.c_str(), nID), nID, vDict))
+                return false;
+            
+            DICTIONARIES[nID].store(new CompressionDictionary(vDict));
+            nCurrentDictionary.store(nID);
+            
+            return true;
+        }
+        
+        
+        /** Load the dictionaries saved by AddDictionary, in order.
+        *
+        * @param[in] strBase The dictionary files' path
+        *
+        * @return False if a dictionary file couldn't be read
+        *
+        */
+        bool LoadDictionaries(const std::string& strBase)
+        {
+            LOCK(DICTIONARY_MUTEX);
+            
+            for(unsigned int nID = nCurrentDictionary.load() + 1; nID <= MAX_COMPRESS_DICTIONARIES; nID++)
+            {
+                std::string strFilename = strprintf("%s%03u", strBase.c_str(), nID);
+                
+                std::ifstream fStream(strFilename.c_str(), std::ios::in | std::ios::binary);
+                if(!fStream)
+                    return true;
+                
+                unsigned int nHeader[4], nChecksum;
+                if(!fStream.read((char*)nHeader, sizeof(nHeader)) || nHeader[0] != COMPRESS_DICT_MAGIC || nHeader[1] != COMPRESS_DICT_VERSION || nHeader[2] != nID || nHeader[3] > COMPRESS_MAX_RECORD)
+                    return error(FUNCTION "Unknown Format of %s\n", __PRETTY_FUNCTION__, strFilename.c_str());
+                
+                std::vector<unsigned char> vDict(nHeader[3]);
+                if(!fStream.read((char*)vDict.data(), vDict.size()) || !fStream.read((char*)&nChecksum, sizeof(nChecksum)))
+                    return error(FUNCTION "Failed to Read %s\n", __PRETTY_FUNCTION__, strFilename.c_str());
+                
+                if(CRC32C(vDict.data(), vDict.data() + vDict.size()) != nChecksum)
+                    return error(FUNCTION "Checksum Mismatch in %s\n", __PRETTY_FUNCTION__, strFilename.c_str());
+                
+                DICTIONARIES[nID].store(new CompressionDictionary(vDict));
+                nCurrentDictionary.store(nID);
+            }
+            
+            return true;
+        }
+        
+        
+        /* Dump the compression statistics to the debug console. */
+        void PrintStats() const
+        {
+            printf(FUNCTION "Compression: %s | Dictionaries: %u | Compressed: %" PRIu64 " Records, %" PRIu64 " to %" PRIu64 " bytes (%.2fx) | Left Whole: %" PRIu64 " | Decompressed: %" PRIu64 "\n", __PRETTY_FUNCTION__, CompressionName(nType), Dictionaries(), nCompressed.load(), nBytesIn.load(), nBytesOut.load(), nBytesIn.load() / (double)std::max(nBytesOut.load(), (uint64)1), nUncompressed.load(), nExpanded.load());
+        }
+    
+    
+    private:
+        
+        /* Write a buffer fully to a descriptor. */
+        static bool WriteAll(int nDescriptor, const void* pBuffer, uint64 nLength)
+        {
+            uint64 nWritten = 0;
+            while(nWritten < nLength)
+            {
+                ssize_t nRet = write(nDescriptor, (const char*)pBuffer + nWritten, nLength - nWritten);
+                if(nRet < 0 && errno == EINTR)
+                    continue;
+                
+                if(nRet <= 0)
+                    return false;
+                
+                nWritten += nRet;
+            }
+            
+            return true;
+        }
+        
+        
+        /** Write a dictionary file, replaced atomically: magic, version, number, size, the dictionary and its CRC32C.
+        *
+        * The file is written beside the target and synced before it is renamed over it, then the
+        * directory is synced so the rename survives a crash. Sectors compressed with the dictionary
+        * are only written once this returns, so none can outlive it.
+        *
+        */
+        bool SaveDictionary(const std::string& strFilename, unsigned int nID, const std::vector<unsigned char>& vDict) const
+        {
+            unsigned int nHeader[4] = { COMPRESS_DICT_MAGIC, COMPRESS_DICT_VERSION, nID, (unsigned int)vDict.size() };
+            unsigned int nChecksum  = CRC32C(vDict.data(), vDict.data() + vDict.size());
+            
+            std::string strTemp = strFilename + ".tmp";
+            int nDescriptor = open(strTemp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if(nDescriptor == -1)
+                return error(FUNCTION "Failed to Create %s\n", __PRETTY_FUNCTION__, strTemp.c_str());
+            
+            bool fSuccess = WriteAll(nDescriptor, nHeader, sizeof(nHeader)) && WriteAll(nDescriptor, vDict.data(), vDict.size()) &&
+                            WriteAll(nDescriptor, &nChecksum, sizeof(nChecksum)) && fsync(nDescriptor) == 0;
+            close(nDescriptor);
+            
+            if(!fSuccess || rename(strTemp.c_str(), strFilename.c_str()) != 0)
+            {
+                unlink(strTemp.c_str());
+                
+                return error(FUNCTION "Failed to Write %s\n", __PRETTY_FUNCTION__, strFilename.c_str());
+            }
+            
+            /* Sync the directory so the renamed file is found after a crash. */
+            std::string::size_type nSlash = strFilename.find_last_of('/');
+            std::string strDirectory = (nSlash == std::string::npos ? std::string(".") : strFilename.substr(0, nSlash + 1));
+            
+            int nDirectory = open(strDirectory.c_str(), O_RDONLY);
+            if(nDirectory == -1)
+                return error(FUNCTION "Failed to Open Directory %s\n", __PRETTY_FUNCTION__, strDirectory.c_str());
+            
+            fSuccess = (fsync(nDirectory) == 0);
+            close(nDirectory);
+            
+            if(!fSuccess)
+                return error(FUNCTION "Failed to Sync Directory %s\n", __PRETTY_FUNCTION__, strDirectory.c_str());
+            
+            return true;
+        }
+    };
+}
+
+#endif
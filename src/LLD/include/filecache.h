@@ -0,0 +1,580 @@
+/*__________________________________________________________________________________________
+            
+            (c) Hash(BEGIN(Satoshi[2010]), END(Sunny[2012])) == Videlicet[2017] ++
+            
+            (c) Copyright The Nexus Developers 2014 - 2017
+            
+            Distributed under the MIT software license, see the accompanying
+            file COPYING or http://www.opensource.org/licenses/mit-license.php.
+            
+            "fides in stellis, virtus in numeris" - Faith in the Stars, Power in Numbers
+
+____________________________________________________________________________________________*/
+
+#ifndef NEXUS_LLD_INCLUDE_FILECACHE_H
+#define NEXUS_LLD_INCLUDE_FILECACHE_H
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <sys/resource.h>
+
+#include <atomic>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../../Util/include/args.h"
+#include "../../Util/include/debug.h"
+#include "../../Util/include/mutex.h"
+
+#include "iobackend.h"
+
+namespace LLD
+{
+    
+    /* Default maximum of file descriptors held open across all databases. Raised to fit the files the databases
+       reserve, unless set with -maxopenfiles. */
+    const unsigned int DEFAULT_MAX_OPEN_FILES = 1024;
+    
+    
+    /* Descriptors left over the files reserved, for the journal and files opened between reservations. */
+    const unsigned int FILE_CACHE_HEADROOM = 32;
+    
+    
+    /* Descriptors of the process not taken by the cache, for sockets and everything else. */
+    const unsigned int FILE_CACHE_RESERVED_DESCRIPTORS = 256;
+    
+    
+    /** File Handle Cache:
+    *
+    * Keeps the files of the sector and keychain databases open between calls,
+    * keyed by (database, file number) and bounded by -maxopenfiles in LRU order.
+    * Each database reserves the files it has, and without -maxopenfiles the
+    * bound grows to hold them all, up to what the process may open, so a
+    * database's files aren't closed and reopened on every other access.
+    *
+    * All I/O goes through pread / pwrite so one descriptor can be shared by any
+    * number of threads without seek state. Handles that are in use are pinned
+    * and never closed underneath a reader.
+    *
+    * Batches of requests go through the I/O backend chosen with -iobackend,
+    * which keeps up to -iodepth of them in flight.
+    *
+    */
+    class FileHandleCache
+    {
+    
+    protected:
+        
+        /* Open file descriptor and its position in the LRU list. */
+        struct FileHandle
+        {
+            int nDescriptor;
+            unsigned int nReferences;
+            std::list<uint64>::iterator nPosition;
+        };
+        
+        
+        /* Mutex for thread concurrency. */
+        Mutex_t CACHE_MUTEX;
+        
+        
+        /* The maximum number of open file descriptors. */
+        unsigned int MAX_OPEN_FILES;
+        
+        
+        /* The maximum before any files were reserved, and whether it was set with -maxopenfiles and so is never raised. */
+        unsigned int nBaseOpenFiles;
+        bool fFixed;
+        
+        
+        /* The files each registered database has, indexed by database id. */
+        std::vector<unsigned int> vReserved;
+        
+        
+        /* The filename prefixes of registered databases, indexed by database id. */
+        std::vector<std::string> vDatabases;
+        
+        
+        /* Whether each registered database opens its files read only, indexed by database id. */
+        std::vector<bool> vReadOnly;
+        
+        
+        /* Open handles keyed by (database << 32 | file). */
+        std::map<uint64, FileHandle> mapHandles;
+        
+        
+        /* Least recently used ordering of the open handles. Front is most recent. */
+        std::list<uint64> listRecent;
+        
+        
+        /* Descriptors of removed files still pinned, and by how many. The last Release closes them. */
+        std::map<int, unsigned int> mapClosing;
+        
+        
+        /* Statistics counters. */
+        std::atomic<uint64> nHits, nMisses, nEvictions;
+        
+        
+        /* The backend batches are submitted to, and how many requests it keeps in flight. */
+        IOBackend* pBackend;
+        unsigned int nDepth;
+        
+        
+        /* Build the handle index from a database and file number. */
+        static uint64 Index(unsigned int nDatabase, unsigned int nFile) { return ((uint64)nDatabase << 32) | nFile; }
+        
+        
+        /* Close least recently used handles that aren't pinned until under limits. */
+        void Evict()
+        {
+            std::list<uint64>::iterator it = listRecent.end();
+            while(mapHandles.size() > MAX_OPEN_FILES && it != listRecent.begin())
+            {
+                --it;
+                
+                std::map<uint64, FileHandle>::iterator handle = mapHandles.find(*it);
+                if(handle->second.nReferences > 0)
+                    continue;
+                
+                close(handle->second.nDescriptor);
+                mapHandles.erase(handle);
+                
+                it = listRecent.erase(it);
+                ++nEvictions;
+            }
+        }
+        
+        
+        /** Pin an open descriptor for the file, opening it if needed.
+        *
+        * @param[in] nDatabase The database id from Register
+        * @param[in] nFile The file number in the database
+        * @param[in] fCreate Create the file if it doesn't exist
+        *
+        * @return The file descriptor, -1 on failure
+        *
+        */
+        int Acquire(unsigned int nDatabase, unsigned int nFile, bool fCreate)
+        {
+            LOCK(CACHE_MUTEX);
+            
+            uint64 nIndex = Index(nDatabase, nFile);
+            std::map<uint64, FileHandle>::iterator it = mapHandles.find(nIndex);
+            if(it != mapHandles.end())
+            {
+                listRecent.splice(listRecent.begin(), listRecent, it->second.nPosition);
+                it->second.nReferences++;
+                ++nHits;
+                
+                return it->second.nDescriptor;
+            }
+            
+            ++nMisses;
+            
+            std::string strFilename = strprintf("%s%05u", vDatabases[nDatabase].c_str(), nFile);
+            int nDescriptor = open(strFilename.c_str(), vReadOnly[nDatabase] ? O_RDONLY : (O_RDWR | (fCreate ? O_CREAT : 0)), 0644);
+            if(nDescriptor == -1)
+                return -1;
+            
+            listRecent.push_front(nIndex);
+            FileHandle handle = { nDescriptor, 1, listRecent.begin() };
+            mapHandles[nIndex] = handle;
+            
+            Evict();
+            
+            return nDescriptor;
+        }
+        
+        
+        /* Unpin a descriptor returned from Acquire, closing it if its file was removed while it was pinned. */
+        void Release(unsigned int nDatabase, unsigned int nFile, int nDescriptor)
+        {
+            LOCK(CACHE_MUTEX);
+            
+            std::map<uint64, FileHandle>::iterator it = mapHandles.find(Index(nDatabase, nFile));
+            if(it != mapHandles.end() && it->second.nDescriptor == nDescriptor)
+            {
+                if(it->second.nReferences > 0)
+                    it->second.nReferences--;
+            }
+            else
+            {
+                std::map<int, unsigned int>::iterator closing = mapClosing.find(nDescriptor);
+                if(closing != mapClosing.end() && --closing->second == 0)
+                {
+                    close(nDescriptor);
+                    mapClosing.erase(closing);
+                }
+            }
+            
+            Evict();
+        }
+    
+    
+    public:
+        
+        /** Cache Constructor
+        *
+        * @param[in] nMaxOpenFiles The maximum number of open file descriptors
+        * @param[in] strBackend The name of the I/O backend for batches
+        * @param[in] nDepthIn The most requests of a batch in flight at once
+        *
+        */
+        FileHandleCache(unsigned int nMaxOpenFiles, const std::string& strBackend = "sync", unsigned int nDepthIn = DEFAULT_IO_DEPTH, bool fFixedIn = true) : MAX_OPEN_FILES(nMaxOpenFiles > 0 ? nMaxOpenFiles : 1), nBaseOpenFiles(MAX_OPEN_FILES), fFixed(fFixedIn), nHits(0), nMisses(0), nEvictions(0), pBackend(CreateIOBackend(strBackend)), nDepth(nDepthIn)
+        {
+            if(!fFixed)
+                MAX_OPEN_FILES = nBaseOpenFiles = std::min(nBaseOpenFiles, DescriptorLimit(nBaseOpenFiles));
+        }
+        
+        
+        /* Close all the descriptors on destruct. */
+        ~FileHandleCache()
+        {
+            for(auto it : mapHandles)
+                close(it.second.nDescriptor);
+            
+            for(auto it : mapClosing)
+                close(it.first);
+            
+            delete pBackend;
+        }
+        
+        
+        /** Register a database with the cache.
+        *
+        * @param[in] strPrefix The filename prefix, file numbers are appended as %05u
+        * @param[in] fReadOnly Open the files read only, and never create them
+        *
+        * @return The database id used for all other calls
+        *
+        */
+        unsigned int Register(const std::string& strPrefix, bool fReadOnly = false)
+        {
+            LOCK(CACHE_MUTEX);
+            
+            for(unsigned int nDatabase = 0; nDatabase < vDatabases.size(); nDatabase++)
+            {
+                if(vDatabases[nDatabase] != strPrefix)
+                    continue;
+                
+                /* Reopen the files in the new mode once they are released. */
+                if(vReadOnly[nDatabase] != fReadOnly)
+                {
+                    vReadOnly[nDatabase] = fReadOnly;
+                    Close(nDatabase);
+                }
+                
+                return nDatabase;
+            }
+            
+            vDatabases.push_back(strPrefix);
+            vReadOnly.push_back(fReadOnly);
+            vReserved.push_back(0);
+            
+            return vDatabases.size() - 1;
+        }
+        
+        
+        /** Reserve descriptors for the files of a database.
+        *
+        * Called when a database opens and whenever it adds or removes a file.
+        * Unless -maxopenfiles was set, the limit is raised to hold the files of
+        * every database, raising the process's own limit if it has to.
+        *
+        * @param[in] nDatabase The database id from Register
+        * @param[in] nFiles The number of files the database has
+        *
+        */
+        void Reserve(unsigned int nDatabase, unsigned int nFiles)
+        {
+            LOCK(CACHE_MUTEX);
+            
+            vReserved[nDatabase] = nFiles;
+            if(fFixed)
+                return;
+            
+            uint64 nWanted = FILE_CACHE_HEADROOM;
+            for(unsigned int nReserved : vReserved)
+                nWanted += nReserved;
+            
+            if(nWanted <= MAX_OPEN_FILES)
+                return;
+            
+            MAX_OPEN_FILES = std::max(nBaseOpenFiles, DescriptorLimit(nWanted));
+            if(nWanted > MAX_OPEN_FILES && GetArg("-verbose", 0) >= 1)
+                printf(FUNCTION "%" PRIu64 " Files Reserved, but only %u Descriptors can be Open\n", __PRETTY_FUNCTION__, nWanted, MAX_OPEN_FILES);
+        }
+        
+        
+        /** Read from a file at a given offset.
+        *
+        * @return True if all the bytes were read
+        *
+        */
+        bool Read(unsigned int nDatabase, unsigned int nFile, uint64 nOffset, void* pBuffer, size_t nLength)
+        {
+            int nDescriptor = Acquire(nDatabase, nFile, false);
+            if(nDescriptor == -1)
+                return false;
+            
+            size_t nRead = 0;
+            while(nRead < nLength)
+            {
+                ssize_t nRet = pread(nDescriptor, (char*)pBuffer + nRead, nLength - nRead, nOffset + nRead);
+                if(nRet < 0 && errno == EINTR)
+                    continue;
+                
+                if(nRet <= 0)
+                    break;
+                
+                nRead += nRet;
+            }
+            
+            Release(nDatabase, nFile, nDescriptor);
+            
+            return (nRead == nLength);
+        }
+        
+        
+        /** Write to a file at a given offset, creating the file if needed.
+        *
+        * @return True if all the bytes were written
+        *
+        */
+        bool Write(unsigned int nDatabase, unsigned int nFile, uint64 nOffset, const void* pBuffer, size_t nLength)
+        {
+            int nDescriptor = Acquire(nDatabase, nFile, true);
+            if(nDescriptor == -1)
+                return false;
+            
+            size_t nWritten = 0;
+            while(nWritten < nLength)
+            {
+                ssize_t nRet = pwrite(nDescriptor, (const char*)pBuffer + nWritten, nLength - nWritten, nOffset + nWritten);
+                if(nRet < 0 && errno == EINTR)
+                    continue;
+                
+                if(nRet <= 0)
+                    break;
+                
+                nWritten += nRet;
+            }
+            
+            Release(nDatabase, nFile, nDescriptor);
+            
+            return (nWritten == nLength);
+        }
+        
+        
+        /** Read and write a batch of a database's files through the I/O backend.
+        *
+        * Writes create their files if needed. Each request's nDone says how much of it was done.
+        *
+        * @return True if every request completed
+        *
+        */
+        bool Submit(unsigned int nDatabase, std::vector<IORequest>& vRequests)
+        {
+            /* Pin a descriptor for each file once. */
+            std::map<unsigned int, int> mapDescriptors;
+            bool fSuccess = true;
+            for(auto& request : vRequests)
+            {
+                if(!mapDescriptors.count(request.nFile))
+                    mapDescriptors[request.nFile] = Acquire(nDatabase, request.nFile, request.fWrite);
+                
+                request.nDescriptor = mapDescriptors[request.nFile];
+                if(request.nDescriptor == -1)
+                    fSuccess = false;
+            }
+            
+            if(fSuccess)
+                fSuccess = pBackend->Submit(vRequests, nDepth);
+            
+            for(auto& item : mapDescriptors)
+                if(item.second != -1)
+                    Release(nDatabase, item.first, item.second);
+            
+            return fSuccess;
+        }
+        
+        
+        /* The name of the I/O backend batches go through. */
+        const char* Backend() const { return pBackend->Name(); }
+        
+        
+        /** Get the current size of a file.
+        *
+        * @return True if the file exists
+        *
+        */
+        bool Size(unsigned int nDatabase, unsigned int nFile, uint64& nSize)
+        {
+            int nDescriptor = Acquire(nDatabase, nFile, false);
+            if(nDescriptor == -1)
+                return false;
+            
+            struct stat sb;
+            bool fRet = (fstat(nDescriptor, &sb) == 0);
+            if(fRet)
+                nSize = sb.st_size;
+            
+            Release(nDatabase, nFile, nDescriptor);
+            
+            return fRet;
+        }
+        
+        
+        /* Flush a file to non-volatile storage. */
+        bool Sync(unsigned int nDatabase, unsigned int nFile)
+        {
+            int nDescriptor = Acquire(nDatabase, nFile, false);
+            if(nDescriptor == -1)
+                return false;
+            
+            bool fRet = (fsync(nDescriptor) == 0);
+            
+            Release(nDatabase, nFile, nDescriptor);
+            
+            return fRet;
+        }
+        
+        
+        /* Cut a file back to a size and flush it to non-volatile storage. */
+        bool Truncate(unsigned int nDatabase, unsigned int nFile, uint64 nSize)
+        {
+            int nDescriptor = Acquire(nDatabase, nFile, false);
+            if(nDescriptor == -1)
+                return false;
+            
+            bool fRet = (ftruncate(nDescriptor, nSize) == 0 && fsync(nDescriptor) == 0);
+            
+            Release(nDatabase, nFile, nDescriptor);
+            
+            return fRet;
+        }
+        
+        
+        /* Close every open file of a database. Used when a database is destructed. */
+        void Close(unsigned int nDatabase)
+        {
+            LOCK(CACHE_MUTEX);
+            
+            for(std::map<uint64, FileHandle>::iterator it = mapHandles.begin(); it != mapHandles.end(); )
+            {
+                if((it->first >> 32) != nDatabase || it->second.nReferences > 0)
+                {
+                    ++it;
+                    
+                    continue;
+                }
+                
+                close(it->second.nDescriptor);
+                listRecent.erase(it->second.nPosition);
+                mapHandles.erase(it++);
+            }
+        }
+        
+        
+        /* Close a file and delete it from disk. A descriptor still pinned by a reader is closed when it is released. */
+        bool Remove(unsigned int nDatabase, unsigned int nFile)
+        {
+            LOCK(CACHE_MUTEX);
+
+            std::map<uint64, FileHandle>::iterator it = mapHandles.find(Index(nDatabase, nFile));
+            if(it != mapHandles.end())
+            {
+                if(it->second.nReferences > 0)
+                    mapClosing[it->second.nDescriptor] = it->second.nReferences;
+                else
+                    close(it->second.nDescriptor);
+                
+                listRecent.erase(it->second.nPosition);
+                mapHandles.erase(it);
+            }
+
+            std::string strFilename = strprintf("%s%05u", vDatabases[nDatabase].c_str(), nFile);
+
+            return (unlink(strFilename.c_str()) == 0);
+        }
+
+
+        /** The descriptors the cache can hold, raising the process's soft limit toward its hard limit to fit nWanted.
+        *
+        * @param[in] nWanted The descriptors the cache would like
+        *
+        * @return The most the cache can hold, up to nWanted
+        *
+        */
+        static unsigned int DescriptorLimit(uint64 nWanted)
+        {
+            struct rlimit limit;
+            if(getrlimit(RLIMIT_NOFILE, &limit) != 0)
+                return (unsigned int)std::min(nWanted, (uint64)DEFAULT_MAX_OPEN_FILES);
+            
+            uint64 nNeeded = nWanted + FILE_CACHE_RESERVED_DESCRIPTORS;
+            if(limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < nNeeded)
+            {
+                struct rlimit raised = limit;
+                raised.rlim_cur = (limit.rlim_max == RLIM_INFINITY ? nNeeded : std::min((uint64)limit.rlim_max, nNeeded));
+                if(setrlimit(RLIMIT_NOFILE, &raised) == 0)
+                    limit = raised;
+            }
+            
+            if(limit.rlim_cur == RLIM_INFINITY)
+                return (unsigned int)nWanted;
+            
+            uint64 nAvailable = (limit.rlim_cur > 2 * FILE_CACHE_RESERVED_DESCRIPTORS ? limit.rlim_cur - FILE_CACHE_RESERVED_DESCRIPTORS : limit.rlim_cur / 2);
+            
+            return (unsigned int)std::max(std::min(nWanted, nAvailable), (uint64)1);
+        }
+        
+        
+        /* Change the descriptor limit at runtime. */
+        void SetMaxOpenFiles(unsigned int nMaxOpenFiles)
+        {
+            LOCK(CACHE_MUTEX);
+            
+            MAX_OPEN_FILES = nBaseOpenFiles = (nMaxOpenFiles > 0 ? nMaxOpenFiles : 1);
+            fFixed = true;
+            Evict();
+        }
+        
+        
+        /* Statistics for the cache. */
+        uint64 GetHits()      const { return nHits.load(); }
+        uint64 GetMisses()    const { return nMisses.load(); }
+        uint64 GetEvictions() const { return nEvictions.load(); }
+        
+        
+        /* Dump the statistics to the debug console. */
+        void PrintStats()
+        {
+            uint64 nTotal = nHits.load() + nMisses.load();
+            printf(FUNCTION "Hits: %" PRIu64 " | Misses: %" PRIu64 " | Evictions: %" PRIu64 " | Hit Rate: %.2f%% | Open: %u of %u | Backend: %s (Depth %u)\n", __PRETTY_FUNCTION__, nHits.load(), nMisses.load(), nEvictions.load(), nTotal > 0 ? (nHits.load() * 100.0) / nTotal : 0.0, (unsigned int)mapHandles.size(), MAX_OPEN_FILES, pBackend->Name(), nDepth);
+            
+            /* Every eviction is a close and a later open, the calls the cache is there to save. */
+            if(nEvictions.load() > 0 && nEvictions.load() * 20 > nTotal)
+                printf(FUNCTION ANSI_COLOR_RED "Thrashing: %.2f%% of Accesses Reopened a File, raise -maxopenfiles above %u\n" ANSI_COLOR_RESET, __PRETTY_FUNCTION__, (nEvictions.load() * 100.0) / nTotal, MAX_OPEN_FILES);
+        }
+    };
+    
+    
+    /** The file handle cache shared by all the databases.
+    *
+    *  Created on first use so -maxopenfiles, -iobackend and -iodepth are read after the arguments are parsed.
+    *
+    */
+    inline FileHandleCache& FileCache()
+    {
+        static FileHandleCache cache(GetArg("-maxopenfiles", DEFAULT_MAX_OPEN_FILES), GetArg("-iobackend", "uring"), GetArg("-iodepth", DEFAULT_IO_DEPTH), mapArgs.count("-maxopenfiles") > 0);
+        
+        return cache;
+    }
+}
+
+#endif
@@ -0,0 +1,385 @@
+/*__________________________________________________________________________________________
+            
+            (c) Hash(BEGIN(Satoshi[2010]), END(Sunny[2012])) == Videlicet[2017] ++
+            
+            (c) Copyright The Nexus Developers 2014 - 2017
+            
+            Distributed under the MIT software license, see the accompanying
+            file COPYING or http://www.opensource.org/licenses/mit-license.php.
+            
+            "fides in stellis, virtus in numeris" - Faith in the Stars, Power in Numbers
+
+____________________________________________________________________________________________*/
+
+#ifndef NEXUS_LLD_INCLUDE_FREESPACE_H
+#define NEXUS_LLD_INCLUDE_FREESPACE_H
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "../../LLC/hash/SK.h"
+#include "../../Util/include/debug.h"
+#include "../../Util/templates/serialize.h"
+
+namespace LLD
+{
+    
+    /* Size classes of the free lists. Class n holds extents of 2^n up to 2^(n + 1) bytes. */
+    const unsigned int FREESPACE_SIZE_CLASSES = 32;
+    
+    
+    /* Extents checked in the class a request falls in before moving up to a class that surely fits. */
+    const unsigned int FREESPACE_MAX_SCAN = 16;
+    
+    
+    /* Version of the persisted free space file. */
+    const unsigned int FREESPACE_VERSION = 1;
+    
+    
+    /** Extent Allocator:
+    *
+    * Tracks the free extents of the sector files so erased and relocated
+    * records leave space to reuse instead of growing the files forever.
+    *
+    * Free extents are indexed by position, to join neighbours as they are
+    * freed, and by size class, to find one for a record. Freed extents wait
+    * in a pending list until Release(), called once the keychain no longer
+    * pointing at them is on disk, so a crash can't leave a key pointing at
+    * data that was reused.
+    *
+    * Not thread safe, the sector database calls it under its lock.
+    *
+    */
+    class ExtentAllocator
+    {
+    protected:
+        
+        /* Free extents by position (file << 32 | start), to their size. */
+        std::map<uint64, unsigned int> mapFree;
+        
+        
+        /* Positions of the free extents in each size class. */
+        std::set<uint64> setClasses[FREESPACE_SIZE_CLASSES];
+        
+        
+        /* Extents freed since the last Release. */
+        std::vector< std::pair<uint64, unsigned int> > vPending;
+        
+        
+        /* Files being compacted, and their free extents held back from allocation meanwhile. */
+        std::set<unsigned int> setRetired;
+        std::map<uint64, unsigned int> mapRetired;
+        
+        
+        /* Statistics. */
+        uint64 nFreeBytes, nPendingBytes, nAllocations, nAllocatedBytes;
+        
+        
+        static uint64 Position(unsigned int nFile, unsigned int nStart) { return ((uint64)nFile << 32) | nStart; }
+        
+        
+        static unsigned int SizeClass(unsigned int nSize)
+        {
+            unsigned int nClass = 0;
+            while(nClass + 1 < FREESPACE_SIZE_CLASSES && (2ull << nClass) <= nSize)
+                nClass++;
+            
+            return nClass;
+        }
+        
+        
+        void Insert(uint64 nPosition, unsigned int nSize)
+        {
+            mapFree[nPosition] = nSize;
+            setClasses[SizeClass(nSize)].insert(nPosition);
+            nFreeBytes += nSize;
+        }
+        
+        
+        void Remove(std::map<uint64, unsigned int>::iterator it)
+        {
+            setClasses[SizeClass(it->second)].erase(it->first);
+            nFreeBytes -= it->second;
+            mapFree.erase(it);
+        }
+        
+        
+        /* Add an extent to the free lists, joined with the free extents on either side of it. */
+        void Join(uint64 nPosition, unsigned int nSize)
+        {
+            if(nSize == 0)
+                return;
+            
+            if(setRetired.count((unsigned int)(nPosition >> 32)))
+            {
+                mapRetired[nPosition] = nSize;
+                
+                return;
+            }
+            
+            auto itNext = mapFree.lower_bound(nPosition);
+            if(itNext != mapFree.begin())
+            {
+                auto itPrev = std::prev(itNext);
+                if((itPrev->first >> 32) == (nPosition >> 32) && itPrev->first + itPrev->second == nPosition)
+                {
+                    nPosition = itPrev->first;
+                    nSize    += itPrev->second;
+                    Remove(itPrev);
+                }
+            }
+            
+            if(itNext != mapFree.end() && (itNext->first >> 32) == (nPosition >> 32) && nPosition + nSize == itNext->first)
+            {
+                nSize += itNext->second;
+                Remove(itNext);
+            }
+            
+            Insert(nPosition, nSize);
+        }
+    
+    
+    public:
+        
+        ExtentAllocator() : nFreeBytes(0), nPendingBytes(0), nAllocations(0), nAllocatedBytes(0) {}
+        
+        
+        /** Find a free extent for a record, splitting off what it doesn't need.
+        *
+        * @param[in] nSize The bytes needed
+        * @param[out] nFile The sector file of the extent
+        * @param[out] nStart The start of the extent in its file
+        *
+        * @return True if a free extent was found, false to append instead
+        *
+        */
+        bool Allocate(unsigned int nSize, unsigned int& nFile, unsigned int& nStart)
+        {
+            if(nSize == 0 || nFreeBytes < nSize)
+                return false;
+            
+            /* The request's own class may hold extents too small, so only part of it is searched. */
+            uint64 nPosition = 0;
+            bool fFound = false;
+            unsigned int nClass = SizeClass(nSize), nScanned = 0;
+            for(auto nCandidate : setClasses[nClass])
+            {
+                if(mapFree[nCandidate] >= nSize)
+                {
+                    nPosition = nCandidate;
+                    fFound = true;
+                    
+                    break;
+                }
+                
+                if(++nScanned >= FREESPACE_MAX_SCAN)
+                    break;
+            }
+            
+            /* Every extent of a larger class fits. The lowest position keeps the files dense. */
+            for(nClass++; !fFound && nClass < FREESPACE_SIZE_CLASSES; nClass++)
+            {
+                if(setClasses[nClass].empty())
+                    continue;
+                
+                nPosition = *setClasses[nClass].begin();
+                fFound = true;
+            }
+            
+            if(!fFound)
+                return false;
+            
+            auto it = mapFree.find(nPosition);
+            unsigned int nExtent = it->second;
+            Remove(it);
+            
+            if(nExtent > nSize)
+                Insert(nPosition + nSize, nExtent - nSize);
+            
+            nFile  = (unsigned int)(nPosition >> 32);
+            nStart = (unsigned int)(nPosition & 0xffffffff);
+            
+            nAllocations++;
+            nAllocatedBytes += nSize;
+            
+            return true;
+        }
+        
+        
+        /** Free an extent, to be reused after the next Release.
+        *
+        * @param[in] nFile The sector file of the extent
+        * @param[in] nStart The start of the extent in its file
+        * @param[in] nSize The size of the extent
+        *
+        */
+        void Free(unsigned int nFile, unsigned int nStart, unsigned int nSize)
+        {
+            if(nSize == 0)
+                return;
+            
+            vPending.push_back(std::make_pair(Position(nFile, nStart), nSize));
+            nPendingBytes += nSize;
+        }
+        
+        
+        /* Let the first extents freed be reused, those counted by Pending before the keychain was synced. */
+        void Release(unsigned int nExtents)
+        {
+            nExtents = std::min(nExtents, (unsigned int)vPending.size());
+            for(unsigned int nIndex = 0; nIndex < nExtents; nIndex++)
+            {
+                Join(vPending[nIndex].first, vPending[nIndex].second);
+                nPendingBytes -= vPending[nIndex].second;
+            }
+            
+            vPending.erase(vPending.begin(), vPending.begin() + nExtents);
+        }
+        
+        
+        /* The freed extents waiting for Release. */
+        unsigned int Pending() const { return vPending.size(); }
+        
+        
+        /* Bytes free to reuse. */
+        uint64 FreeBytes() const { return nFreeBytes; }
+        
+        
+        /* Bytes free to reuse in one sector file. */
+        uint64 FreeBytes(unsigned int nFile) const
+        {
+            uint64 nBytes = 0;
+            for(auto it = mapFree.lower_bound(Position(nFile, 0)); it != mapFree.end() && (it->first >> 32) == nFile; ++it)
+                nBytes += it->second;
+            
+            return nBytes;
+        }
+        
+        
+        /* Stop allocating from a file while it is compacted. Its extents, and those freed in it meanwhile, are held back. */
+        void Retire(unsigned int nFile)
+        {
+            setRetired.insert(nFile);
+            
+            auto it = mapFree.lower_bound(Position(nFile, 0));
+            while(it != mapFree.end() && (it->first >> 32) == nFile)
+            {
+                mapRetired[it->first] = it->second;
+                Remove(it++);
+            }
+        }
+        
+        
+        /* Allocate from a retired file again, after its compaction was abandoned. */
+        void Restore(unsigned int nFile)
+        {
+            setRetired.erase(nFile);
+            
+            auto it = mapRetired.lower_bound(Position(nFile, 0));
+            while(it != mapRetired.end() && (it->first >> 32) == nFile)
+            {
+                Join(it->first, it->second);
+                mapRetired.erase(it++);
+            }
+        }
+        
+        
+        /* Forget the extents of a retired file once it is removed. The file stays retired so nothing is placed in it. */
+        void Drop(unsigned int nFile)
+        {
+            auto it = mapRetired.lower_bound(Position(nFile, 0));
+            while(it != mapRetired.end() && (it->first >> 32) == nFile)
+                mapRetired.erase(it++);
+        }
+        
+        
+        /** Write the free extents to disk. Extents still pending aren't written, so they are lost rather than reused too early.
+        *
+        * @param[in] strFilename The file to write, replaced atomically
+        *
+        * @return True if the file was written
+        *
+        */
+        bool Save(const std::string& strFilename) const
+        {
+            std::vector< std::pair<uint64, unsigned int> > vExtents(mapFree.begin(), mapFree.end());
+            
+            CDataStream ssFile(SER_LLD, DATABASE_VERSION);
+            ssFile << FREESPACE_VERSION << vExtents;
+            
+            std::vector<unsigned char> vData(ssFile.begin(), ssFile.end());
+            unsigned int nChecksum = LLC::HASH::SK32(vData);
+            
+            std::string strTemp = strFilename + ".tmp";
+            std::ofstream fStream(strTemp.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+            fStream.write((char*)&vData[0], vData.size());
+            fStream.write((char*)&nChecksum, sizeof(nChecksum));
+            fStream.close();
+            
+            if(!fStream)
+                return error(FUNCTION "Failed to Write %s\n", __PRETTY_FUNCTION__, strTemp.c_str());
+            
+            return (rename(strTemp.c_str(), strFilename.c_str()) == 0);
+        }
+        
+        
+        /** Read the free extents written by Save.
+        *
+        * @param[in] strFilename The file to read
+        *
+        * @return True if the file was read and its checksum matched
+        *
+        */
+        bool Load(const std::string& strFilename)
+        {
+            std::ifstream fStream(strFilename.c_str(), std::ios::in | std::ios::binary);
+            if(!fStream)
+                return false;
+            
+            std::vector<unsigned char> vData((std::istreambuf_iterator<char>(fStream)), std::istreambuf_iterator<char>());
+            if(vData.size() < sizeof(unsigned int))
+                return false;
+            
+            unsigned int nChecksum;
+            memcpy(&nChecksum, &vData[vData.size() - sizeof(nChecksum)], sizeof(nChecksum));
+            vData.resize(vData.size() - sizeof(nChecksum));
+            if(LLC::HASH::SK32(vData) != nChecksum)
+                return error(FUNCTION "Checksum Mismatch in %s\n", __PRETTY_FUNCTION__, strFilename.c_str());
+            
+            unsigned int nVersion;
+            std::vector< std::pair<uint64, unsigned int> > vExtents;
+            try
+            {
+                CDataStream ssFile(vData, SER_LLD, DATABASE_VERSION);
+                ssFile >> nVersion >> vExtents;
+            }
+            catch(std::exception& e)
+            {
+                return error(FUNCTION "Failed to Read %s: %s\n", __PRETTY_FUNCTION__, strFilename.c_str(), e.what());
+            }
+            
+            if(nVersion != FREESPACE_VERSION)
+                return error(FUNCTION "Unknown Version %u in %s\n", __PRETTY_FUNCTION__, nVersion, strFilename.c_str());
+            
+            for(auto& item : vExtents)
+                Join(item.first, item.second);
+            
+            return true;
+        }
+        
+        
+        /* Dump the free space statistics to the debug console. */
+        void PrintStats() const
+        {
+            printf(FUNCTION "Free: %" PRIu64 " bytes in %u extents | Pending: %" PRIu64 " bytes | Reused: %" PRIu64 " extents, %" PRIu64 " bytes\n", __PRETTY_FUNCTION__, nFreeBytes, (unsigned int)mapFree.size(), nPendingBytes, nAllocations, nAllocatedBytes);
+        }
+    };
+}
+
+#endif
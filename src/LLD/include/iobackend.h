@@ -0,0 +1,385 @@
+/*__________________________________________________________________________________________
+            
+            (c) Hash(BEGIN(Satoshi[2010]), END(Sunny[2012])) == Videlicet[2017] ++
+            
+            (c) Copyright The Nexus Developers 2014 - 2017
+            
+            Distributed under the MIT software license, see the accompanying
+            file COPYING or http://www.opensource.org/licenses/mit-license.php.
+            
+            "fides in stellis, virtus in numeris" - Faith in the Stars, Power in Numbers
+
+____________________________________________________________________________________________*/
+
+#ifndef NEXUS_LLD_INCLUDE_IOBACKEND_H
+#define NEXUS_LLD_INCLUDE_IOBACKEND_H
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "../../Util/include/debug.h"
+
+/* io_uring is used through its system calls directly, so only the kernel headers are needed. Build with NO_IO_URING to leave it out. */
+#if defined(__linux__) && defined(__has_include) && !defined(NO_IO_URING)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define USE_IO_URING
+#endif
+#endif
+
+namespace LLD
+{
+    
+    /* Default number of requests a backend keeps in flight, set with -iodepth. */
+    const unsigned int DEFAULT_IO_DEPTH = 32;
+    
+    
+    /* Most requests a backend keeps in flight. */
+    const unsigned int MAX_IO_DEPTH = 128;
+    
+    
+    /** A read or write of part of a file, submitted to an I/O backend in a batch. **/
+    struct IORequest
+    {
+        /* The file number in its database, and the descriptor it was opened as. */
+        unsigned int nFile;
+        int nDescriptor;
+        
+        /* Where in the file, and the memory read into or written from. */
+        uint64 nOffset;
+        unsigned char* pBuffer;
+        size_t nLength;
+        
+        /* Write rather than read. */
+        bool fWrite;
+        
+        /* Bytes transferred so far. The request is complete once this reaches nLength. */
+        size_t nDone;
+        
+        IORequest(unsigned int nFileIn, uint64 nOffsetIn, unsigned char* pBufferIn, size_t nLengthIn, bool fWriteIn) : nFile(nFileIn), nDescriptor(-1), nOffset(nOffsetIn), pBuffer(pBufferIn), nLength(nLengthIn), fWrite(fWriteIn), nDone(0) {}
+        
+        bool Complete() const { return nDone == nLength; }
+    };
+    
+    
+    /** I/O Backend:
+    *
+    * Moves batches of requests between files and memory. The blocking backend
+    * does them one at a time on the calling thread with pread / pwrite. Others
+    * keep several in flight so the device sees a deep queue.
+    *
+    */
+    class IOBackend
+    {
+    public:
+        virtual ~IOBackend() {}
+        
+        
+        /* The name the backend is chosen by with -iobackend. */
+        virtual const char* Name() const = 0;
+        
+        
+        /** Transfer every request in a batch.
+        *
+        * @param[in] vRequests The requests, each with its descriptor set
+        * @param[in] nDepth The most requests to keep in flight at once
+        *
+        * @return True if every request completed
+        *
+        */
+        virtual bool Submit(std::vector<IORequest>& vRequests, unsigned int nDepth) = 0;
+        
+        
+        /** Finish a request on the calling thread, blocking until it is done. **/
+        static bool Transfer(IORequest& request)
+        {
+            while(request.nDone < request.nLength)
+            {
+                ssize_t nRet = request.fWrite ? pwrite(request.nDescriptor, request.pBuffer + request.nDone, request.nLength - request.nDone, request.nOffset + request.nDone) : pread(request.nDescriptor, request.pBuffer + request.nDone, request.nLength - request.nDone, request.nOffset + request.nDone);
+                if(nRet < 0 && errno == EINTR)
+                    continue;
+                
+                if(nRet <= 0)
+                    return false;
+                
+                request.nDone += nRet;
+            }
+            
+            return true;
+        }
+    };
+    
+    
+    /** Blocking Backend: one request at a time with pread / pwrite, so the queue depth is not used. **/
+    class BlockingBackend : public IOBackend
+    {
+    public:
+        const char* Name() const { return "sync"; }
+        
+        bool Submit(std::vector<IORequest>& vRequests, unsigned int)
+        {
+            bool fSuccess = true;
+            for(auto& request : vRequests)
+                if(!Transfer(request))
+                    fSuccess = false;
+            
+            return fSuccess;
+        }
+    };
+
+
+#if defined(USE_IO_URING)
+    
+    /** io_uring Backend:
+    *
+    * Each thread gets its own submission and completion rings the first time it
+    * submits, so callers never share a ring. Requests go in up to the queue depth
+    * at a time, short transfers are resubmitted for the rest, and anything the
+    * kernel can't do through the ring is finished by blocking.
+    *
+    */
+    class UringBackend : public IOBackend
+    {
+    protected:
+        
+        /* The rings of one thread, mapped from the kernel. */
+        struct Ring
+        {
+            int nDescriptor;
+            
+            void* pSubmitRing;
+            size_t nSubmitRingSize;
+            void* pCompleteRing;
+            size_t nCompleteRingSize;
+            
+            struct io_uring_sqe* pEntries;
+            size_t nEntriesSize;
+            
+            unsigned int *pSubmitHead, *pSubmitTail, *pSubmitMask;
+            unsigned int *pCompleteHead, *pCompleteTail, *pCompleteMask;
+            struct io_uring_cqe* pCompletions;
+            
+            Ring() : nDescriptor(-1), pSubmitRing(MAP_FAILED), nSubmitRingSize(0), pCompleteRing(MAP_FAILED), nCompleteRingSize(0), pEntries((struct io_uring_sqe*)MAP_FAILED), nEntriesSize(0)
+            {
+                struct io_uring_params params;
+                memset(&params, 0, sizeof(params));
+                
+                nDescriptor = syscall(__NR_io_uring_setup, MAX_IO_DEPTH, &params);
+                if(nDescriptor < 0)
+                    return;
+                
+                nSubmitRingSize   = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+                nCompleteRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+                if(params.features & IORING_FEAT_SINGLE_MMAP)
+                    nSubmitRingSize = nCompleteRingSize = std::max(nSubmitRingSize, nCompleteRingSize);
+                
+                pSubmitRing = mmap(NULL, nSubmitRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, nDescriptor, IORING_OFF_SQ_RING);
+                if(pSubmitRing == MAP_FAILED)
+                    return;
+                
+                if(params.features & IORING_FEAT_SINGLE_MMAP)
+                    pCompleteRing = pSubmitRing;
+                else
+                {
+                    pCompleteRing = mmap(NULL, nCompleteRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, nDescriptor, IORING_OFF_CQ_RING);
+                    if(pCompleteRing == MAP_FAILED)
+                        return;
+                }
+                
+                nEntriesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+                pEntries = (struct io_uring_sqe*)mmap(NULL, nEntriesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, nDescriptor, IORING_OFF_SQES);
+                if(pEntries == MAP_FAILED)
+                    return;
+                
+                pSubmitHead   = (unsigned int*)((char*)pSubmitRing + params.sq_off.head);
+                pSubmitTail   = (unsigned int*)((char*)pSubmitRing + params.sq_off.tail);
+                pSubmitMask   = (unsigned int*)((char*)pSubmitRing + params.sq_off.ring_mask);
+                pCompleteHead = (unsigned int*)((char*)pCompleteRing + params.cq_off.head);
+                pCompleteTail = (unsigned int*)((char*)pCompleteRing + params.cq_off.tail);
+                pCompleteMask = (unsigned int*)((char*)pCompleteRing + params.cq_off.ring_mask);
+                pCompletions  = (struct io_uring_cqe*)((char*)pCompleteRing + params.cq_off.cqes);
+                
+                /* Submission slots map one to one onto the entries. */
+                unsigned int* pArray = (unsigned int*)((char*)pSubmitRing + params.sq_off.array);
+                for(unsigned int nIndex = 0; nIndex < params.sq_entries; nIndex++)
+                    pArray[nIndex] = nIndex;
+            }
+            
+            ~Ring()
+            {
+                if(pEntries != MAP_FAILED)
+                    munmap(pEntries, nEntriesSize);
+                
+                if(pCompleteRing != MAP_FAILED && pCompleteRing != pSubmitRing)
+                    munmap(pCompleteRing, nCompleteRingSize);
+                
+                if(pSubmitRing != MAP_FAILED)
+                    munmap(pSubmitRing, nSubmitRingSize);
+                
+                if(nDescriptor >= 0)
+                    close(nDescriptor);
+            }
+            
+            bool IsValid() const { return pEntries != MAP_FAILED; }
+        };
+        
+        
+        /* The ring of the calling thread, set up on first use. */
+        static Ring& ThreadRing()
+        {
+            static thread_local Ring ring;
+            
+            return ring;
+        }
+    
+    
+    public:
+        
+        /* Whether the kernel lets this process set up a ring. */
+        static bool Available()
+        {
+            return ThreadRing().IsValid();
+        }
+        
+        
+        const char* Name() const { return "uring"; }
+        
+        
+        bool Submit(std::vector<IORequest>& vRequests, unsigned int nDepth)
+        {
+            Ring& ring = ThreadRing();
+            if(!ring.IsValid())
+                return BlockingBackend().Submit(vRequests, nDepth);
+            
+            nDepth = std::max(1u, std::min(nDepth, MAX_IO_DEPTH));
+            
+            bool fSuccess = true, fFailed = false;
+            size_t nNext = 0;
+            unsigned int nInFlight = 0, nUnsubmitted = 0;
+            std::deque<size_t> queueRetry;
+            while((!fFailed && (nNext < vRequests.size() || !queueRetry.empty())) || nInFlight > 0)
+            {
+                /* Queue requests until the depth is reached. */
+                unsigned int nTail = *ring.pSubmitTail;
+                while(!fFailed && nInFlight + nUnsubmitted < nDepth && (!queueRetry.empty() || nNext < vRequests.size()))
+                {
+                    size_t nIndex;
+                    if(!queueRetry.empty())
+                    {
+                        nIndex = queueRetry.front();
+                        queueRetry.pop_front();
+                    }
+                    else
+                        nIndex = nNext++;
+                    
+                    IORequest& request = vRequests[nIndex];
+                    if(request.Complete())
+                        continue;
+                    
+                    struct io_uring_sqe* pEntry = &ring.pEntries[nTail & *ring.pSubmitMask];
+                    memset(pEntry, 0, sizeof(*pEntry));
+                    pEntry->opcode    = request.fWrite ? IORING_OP_WRITE : IORING_OP_READ;
+                    pEntry->fd        = request.nDescriptor;
+                    pEntry->off       = request.nOffset + request.nDone;
+                    pEntry->addr      = (uint64)(request.pBuffer + request.nDone);
+                    pEntry->len       = request.nLength - request.nDone;
+                    pEntry->user_data = nIndex;
+                    
+                    nTail++;
+                    nUnsubmitted++;
+                }
+                __atomic_store_n(ring.pSubmitTail, nTail, __ATOMIC_RELEASE);
+                
+                if(nInFlight + nUnsubmitted == 0)
+                    continue;
+                
+                /* Hand the new requests to the kernel and wait for at least one to complete. */
+                int nRet = syscall(__NR_io_uring_enter, ring.nDescriptor, nUnsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+                if(nRet < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY))
+                    nRet = 0;
+                else if(nRet < 0)
+                {
+                    if(fFailed)
+                        return false;
+                    
+                    /* Take back what the kernel hasn't seen. What it has still writes into its buffers, so wait that out. */
+                    error(FUNCTION "io_uring_enter failed: %s\n", __PRETTY_FUNCTION__, strerror(errno));
+                    __atomic_store_n(ring.pSubmitTail, __atomic_load_n(ring.pSubmitHead, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+                    
+                    nRet = nUnsubmitted = 0;
+                    fSuccess = false;
+                    fFailed  = true;
+                }
+                nUnsubmitted -= nRet;
+                nInFlight    += nRet;
+                
+                /* Reap the completions. */
+                unsigned int nHead = *ring.pCompleteHead;
+                unsigned int nCompleteTail = __atomic_load_n(ring.pCompleteTail, __ATOMIC_ACQUIRE);
+                for(; nHead != nCompleteTail; nHead++)
+                {
+                    struct io_uring_cqe* pCompletion = &ring.pCompletions[nHead & *ring.pCompleteMask];
+                    IORequest& request = vRequests[pCompletion->user_data];
+                    int nResult = pCompletion->res;
+                    nInFlight--;
+                    
+                    if(nResult > 0)
+                    {
+                        request.nDone += nResult;
+                        if(!request.Complete())
+                            queueRetry.push_back(pCompletion->user_data);
+                    }
+                    else if(nResult == -EINTR || nResult == -EAGAIN)
+                        queueRetry.push_back(pCompletion->user_data);
+                    else if(nResult == -EINVAL || nResult == -EOPNOTSUPP)
+                    {
+                        /* Kernels before 5.6 don't have plain reads and writes in the ring. */
+                        if(!Transfer(request))
+                            fSuccess = false;
+                    }
+                    else
+                        fSuccess = false;
+                }
+                __atomic_store_n(ring.pCompleteHead, nHead, __ATOMIC_RELEASE);
+            }
+            
+            return fSuccess;
+        }
+    };
+
+#endif
+    
+    
+    /** Create the backend by name, falling back to the blocking backend if it isn't available.
+    *
+    * @param[in] strName "uring" or "sync"
+    *
+    * @return The backend, owned by the caller
+    *
+    */
+    inline IOBackend* CreateIOBackend(const std::string& strName)
+    {
+#if defined(USE_IO_URING)
+        if(strName == "uring")
+        {
+            if(UringBackend::Available())
+                return new UringBackend();
+            
+            printf(FUNCTION "io_uring isn't available, using blocking I/O\n", __PRETTY_FUNCTION__);
+        }
+#endif
+        
+        return new BlockingBackend();
+    }
+}
+
+#endif
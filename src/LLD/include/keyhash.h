@@ -0,0 +1,152 @@
+/*__________________________________________________________________________________________
+            
+            (c) Hash(BEGIN(Satoshi[2010]), END(Sunny[2012])) == Videlicet[2017] ++
+            
+            (c) Copyright The Nexus Developers 2014 - 2017
+            
+            Distributed under the MIT software license, see the accompanying
+            file COPYING or http://www.opensource.org/licenses/mit-license.php.
+            
+            "fides in stellis, virtus in numeris" - Faith in the Stars, Power in Numbers
+
+____________________________________________________________________________________________*/
+
+#ifndef NEXUS_LLD_INCLUDE_KEYHASH_H
+#define NEXUS_LLD_INCLUDE_KEYHASH_H
+
+#include <stddef.h>
+#include <string.h>
+
+#include <vector>
+
+#include "../../Util/include/args.h"
+
+namespace LLD
+{
+    
+    /* Constants of the key hash. Fingerprints made with them are kept on disk, changing them needs the index versions bumped. */
+    const uint64 KEYHASH_SECRET[4] = { 0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL, 0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL };
+    
+    
+    /* Multiply two words into 128 bits, leaving the low half in nA and the high half in nB. */
+    inline void KeyHashMultiply(uint64& nA, uint64& nB)
+    {
+#if defined(__SIZEOF_INT128__)
+        __uint128_t nProduct = (__uint128_t)nA * nB;
+        nA = (uint64)nProduct;
+        nB = (uint64)(nProduct >> 64);
+#else
+        uint64 nAHigh = nA >> 32, nALow = (unsigned int)nA, nBHigh = nB >> 32, nBLow = (unsigned int)nB;
+        uint64 nHighHigh = nAHigh * nBHigh, nHighLow = nAHigh * nBLow, nLowHigh = nALow * nBHigh, nLowLow = nALow * nBLow;
+        
+        uint64 nMiddle = (nLowLow >> 32) + (unsigned int)nHighLow + (unsigned int)nLowHigh;
+        nA = (nMiddle << 32) | (unsigned int)nLowLow;
+        nB = nHighHigh + (nHighLow >> 32) + (nLowHigh >> 32) + (nMiddle >> 32);
+#endif
+    }
+    
+    
+    /* Fold the 128 bit product of two words into one. */
+    inline uint64 KeyHashMix(uint64 nA, uint64 nB)
+    {
+        KeyHashMultiply(nA, nB);
+        
+        return nA ^ nB;
+    }
+    
+    
+    /* Read little endian words of a key. */
+    inline uint64 KeyHashRead8(const unsigned char* p) { uint64 n; memcpy(&n, p, 8); return n; }
+    inline uint64 KeyHashRead4(const unsigned char* p) { unsigned int n; memcpy(&n, p, 4); return n; }
+    
+    
+    /** Key Hash:
+    *
+    * The hash every part of the LLD routes keys with: cache shards, key lock
+    * stripes, the key index and hashmap slots and fingerprints, and the Bloom
+    * filter. Built the way wyhash is, folding 16 bytes at a time through a
+    * 64 x 64 -> 128 bit multiply. Keys longer than 48 bytes are taken in three
+    * independent lanes, so the multiplies of a uint1024 overlap.
+    *
+    * Every bit of the key reaches every bit of the hash, so keys that share a
+    * serialized type prefix or differ only in their last byte spread as well
+    * as random ones, through the low bits or the high bits alike.
+    *
+    * The same on every little endian host and run, fingerprints made with it
+    * are kept on disk.
+    *
+    * @param[in] pKey The key
+    * @param[in] nLength Bytes of the key
+    *
+    * @return The 64 bit hash
+    *
+    */
+    inline uint64 KeyHash(const unsigned char* pKey, size_t nLength)
+    {
+        const unsigned char* p = pKey;
+        uint64 nSeed = KeyHashMix(KEYHASH_SECRET[0], KEYHASH_SECRET[1]);
+        uint64 nA, nB;
+        
+        if(nLength <= 16)
+        {
+            if(nLength >= 4)
+            {
+                nA = (KeyHashRead4(p) << 32) | KeyHashRead4(p + ((nLength >> 3) << 2));
+                nB = (KeyHashRead4(p + nLength - 4) << 32) | KeyHashRead4(p + nLength - 4 - ((nLength >> 3) << 2));
+            }
+            else if(nLength > 0)
+            {
+                nA = ((uint64)p[0] << 16) | ((uint64)p[nLength >> 1] << 8) | p[nLength - 1];
+                nB = 0;
+            }
+            else
+                nA = nB = 0;
+        }
+        else
+        {
+            size_t nRemaining = nLength;
+            if(nRemaining > 48)
+            {
+                uint64 nLane1 = nSeed, nLane2 = nSeed;
+                do
+                {
+                    nSeed  = KeyHashMix(KeyHashRead8(p)      ^ KEYHASH_SECRET[1], KeyHashRead8(p + 8)  ^ nSeed);
+                    nLane1 = KeyHashMix(KeyHashRead8(p + 16) ^ KEYHASH_SECRET[2], KeyHashRead8(p + 24) ^ nLane1);
+                    nLane2 = KeyHashMix(KeyHashRead8(p + 32) ^ KEYHASH_SECRET[3], KeyHashRead8(p + 40) ^ nLane2);
+                    
+                    p += 48;
+                    nRemaining -= 48;
+                }
+                while(nRemaining > 48);
+                
+                nSeed ^= nLane1 ^ nLane2;
+            }
+            
+            while(nRemaining > 16)
+            {
+                nSeed = KeyHashMix(KeyHashRead8(p) ^ KEYHASH_SECRET[1], KeyHashRead8(p + 8) ^ nSeed);
+                
+                p += 16;
+                nRemaining -= 16;
+            }
+            
+            /* The last 16 bytes, overlapping what was folded already if there are fewer left. */
+            nA = KeyHashRead8(p + nRemaining - 16);
+            nB = KeyHashRead8(p + nRemaining - 8);
+        }
+        
+        nA ^= KEYHASH_SECRET[1];
+        nB ^= nSeed;
+        KeyHashMultiply(nA, nB);
+        
+        return KeyHashMix(nA ^ KEYHASH_SECRET[0] ^ nLength, nB ^ KEYHASH_SECRET[1]);
+    }
+    
+    
+    inline uint64 KeyHash(const std::vector<unsigned char>& vKey)
+    {
+        return KeyHash(vKey.empty() ? NULL : &vKey[0], vKey.size());
+    }
+}
+
+#endif
@@ -0,0 +1,598 @@
+/*__________________________________________________________________________________________
+            
+            (c) Hash(BEGIN(Satoshi[2010]), END(Sunny[2012])) == Videlicet[2017] ++
+            
+            (c) Copyright The Nexus Developers 2014 - 2017
+            
+            Distributed under the MIT software license, see the accompanying
+            file COPYING or http://www.opensource.org/licenses/mit-license.php.
+            
+            "fides in stellis, virtus in numeris" - Faith in the Stars, Power in Numbers
+
+____________________________________________________________________________________________*/
+
+#ifndef NEXUS_LLD_INCLUDE_KEYINDEX_H
+#define NEXUS_LLD_INCLUDE_KEYINDEX_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "../../LLC/hash/SK.h"
+#include "../../Util/include/debug.h"
+#include "../../Util/include/mmaplib.h"
+
+#include "keyhash.h"
+
+namespace LLD
+{
+    
+    /* Maximum load (percent of slots used or deleted) before the key index grows. */
+    const unsigned int KEYINDEX_MAX_LOAD = 75;
+    
+    
+    /* Capacity of a new key index. */
+    const unsigned int KEYINDEX_MIN_CAPACITY = 1024;
+    
+    
+    /* Snapshot file identification. */
+    const unsigned int KEYINDEX_SNAPSHOT_MAGIC   = 0x534b4c4c; //LLKS
+    const unsigned int KEYINDEX_SNAPSHOT_VERSION = 2;
+    
+    
+    /** Key Index:
+    *
+    * Open addressing hash table from binary keys to their (file, offset) in a
+    * keychain. Each slot is 16 bytes holding a 64 bit fingerprint of the key and
+    * its location, probed linearly from the fingerprint.
+    *
+    * Full keys are kept back to back in one arena, prefixed by their length.
+    * In fingerprint only mode no keys are kept in memory: a fingerprint match is
+    * checked against the keychain on disk through a verify callback.
+    *
+    */
+    class KeyIndex
+    {
+    
+    protected:
+        
+        /* States of a slot. */
+        enum
+        {
+            SLOT_EMPTY    = 0,
+            SLOT_OCCUPIED = 1,
+            SLOT_DELETED  = 2
+        };
+        
+        
+        /* Fixed width slot. */
+        struct Entry
+        {
+            uint64         nFingerprint;
+            unsigned int   nOffset;
+            unsigned short nFile;
+            unsigned short nState;
+        };
+        
+        
+        /* Only keep fingerprints in memory. */
+        bool fFingerprintOnly;
+        
+        
+        /* The slots of the table. */
+        std::vector<Entry> vEntries;
+        
+        
+        /* Position in the arena of each slot's key. Empty in fingerprint only mode. */
+        std::vector<uint64> vKeyPositions;
+        
+        
+        /* The full keys, each prefixed by a 2 byte length. */
+        std::vector<unsigned char> vArena;
+        
+        
+        /* Live keys, deleted slots, and bytes of the arena held by erased keys. */
+        uint64 nSize, nDeleted, nArenaGarbage;
+        
+        
+        /* Snapshot header, followed by the slots, the key positions and the arena as they are in memory. */
+        struct SnapshotHeader
+        {
+            unsigned int nMagic;
+            unsigned int nVersion;
+            unsigned int fFingerprintOnly;
+            unsigned int nReserved;
+            uint64       nSize;
+            uint64       nDeleted;
+            uint64       nArenaGarbage;
+            uint64       nCapacity;
+            uint64       nArenaSize;
+            uint64       nCursorFile;
+            uint64       nCursorOffset;
+            uint64       nChecksum;
+        };
+        
+        
+        /* Checksum of the snapshot body, one SK64 per section so no copy is needed. */
+        static uint64 SnapshotChecksum(const unsigned char* pEntries, uint64 nEntries, const unsigned char* pPositions, uint64 nPositions, const unsigned char* pArena, uint64 nArena)
+        {
+            uint64 vChecksums[3] =
+            {
+                LLC::HASH::SK64(pEntries, pEntries + nEntries),
+                LLC::HASH::SK64(pPositions, pPositions + nPositions),
+                LLC::HASH::SK64(pArena, pArena + nArena)
+            };
+            
+            return LLC::HASH::SK64((unsigned char*)vChecksums, (unsigned char*)vChecksums + sizeof(vChecksums));
+        }
+        
+        
+        /* Write a buffer fully to a descriptor. */
+        static bool WriteAll(int nDescriptor, const void* pBuffer, uint64 nLength)
+        {
+            uint64 nWritten = 0;
+            while(nWritten < nLength)
+            {
+                ssize_t nRet = write(nDescriptor, (const char*)pBuffer + nWritten, nLength - nWritten);
+                if(nRet < 0 && errno == EINTR)
+                    continue;
+                
+                if(nRet <= 0)
+                    return false;
+                
+                nWritten += nRet;
+            }
+            
+            return true;
+        }
+        
+        
+        /* The first slot probed for a fingerprint. Multiply-shift range reduction so any capacity works. */
+        static uint64 Home(uint64 nFingerprint, uint64 nCapacity)
+        {
+            return (uint64)(((unsigned __int128)nFingerprint * nCapacity) >> 64);
+        }
+        
+        
+        /* Compare a slot's key from the arena. */
+        bool KeyEquals(uint64 nSlot, const unsigned char* pKey, unsigned short nLength) const
+        {
+            const unsigned char* pArenaKey = &vArena[vKeyPositions[nSlot]];
+            
+            unsigned short nArenaLength;
+            memcpy(&nArenaLength, pArenaKey, 2);
+            
+            return (nArenaLength == nLength && memcmp(pArenaKey + 2, pKey, nLength) == 0);
+        }
+        
+        
+        /* Copy a key to the end of the arena for a slot. */
+        void AppendKey(uint64 nSlot, const unsigned char* pKey, unsigned short nLength)
+        {
+            vKeyPositions[nSlot] = vArena.size();
+            vArena.insert(vArena.end(), (unsigned char*)&nLength, (unsigned char*)&nLength + 2);
+            vArena.insert(vArena.end(), pKey, pKey + nLength);
+        }
+        
+        
+        /** Find the slot holding a key.
+        *
+        * @param[in] pKey, nLength The binary key
+        * @param[in] nFingerprint The hash of the key
+        * @param[out] nSlot The slot of the key if found, else the first free slot of the probe
+        * @param[in] fnVerify Callback (nFile, nOffset) checking the key on disk in fingerprint only mode
+        *
+        * @return True if the key was found
+        *
+        */
+        template<typename Verify>
+        bool Find(const unsigned char* pKey, unsigned short nLength, uint64 nFingerprint, uint64& nSlot, Verify fnVerify) const
+        {
+            bool fFree = false;
+            uint64 nCurrent = Home(nFingerprint, vEntries.size());
+            for(uint64 nProbe = 0; nProbe < vEntries.size(); nProbe++, nCurrent = (nCurrent + 1 == vEntries.size() ? 0 : nCurrent + 1))
+            {
+                const Entry& entry = vEntries[nCurrent];
+                
+                if(entry.nState == SLOT_EMPTY)
+                {
+                    if(!fFree)
+                        nSlot = nCurrent;
+                    
+                    return false;
+                }
+                
+                if(entry.nState == SLOT_DELETED)
+                {
+                    if(!fFree)
+                    {
+                        fFree = true;
+                        nSlot = nCurrent;
+                    }
+                    
+                    continue;
+                }
+                
+                if(entry.nFingerprint != nFingerprint)
+                    continue;
+                
+                if(fFingerprintOnly ? fnVerify(entry.nFile, entry.nOffset) : KeyEquals(nCurrent, pKey, nLength))
+                {
+                    nSlot = nCurrent;
+                    
+                    return true;
+                }
+            }
+            
+            return false;
+        }
+        
+        
+        /* Rebuild the table at a new capacity, dropping deleted slots and compacting the arena. */
+        void Rehash(uint64 nCapacity)
+        {
+            std::vector<Entry> vOldEntries(nCapacity);
+            vOldEntries.swap(vEntries);
+            
+            std::vector<uint64> vOldPositions;
+            std::vector<unsigned char> vOldArena;
+            if(!fFingerprintOnly)
+            {
+                vOldPositions.swap(vKeyPositions);
+                vKeyPositions.resize(nCapacity);
+                
+                vOldArena.swap(vArena);
+                vArena.reserve(vOldArena.size() - nArenaGarbage);
+            }
+            
+            for(uint64 nOld = 0; nOld < vOldEntries.size(); nOld++)
+            {
+                if(vOldEntries[nOld].nState != SLOT_OCCUPIED)
+                    continue;
+                
+                uint64 nSlot = Home(vOldEntries[nOld].nFingerprint, nCapacity);
+                while(vEntries[nSlot].nState != SLOT_EMPTY)
+                    nSlot = (nSlot + 1 == nCapacity ? 0 : nSlot + 1);
+                
+                vEntries[nSlot] = vOldEntries[nOld];
+                if(!fFingerprintOnly)
+                {
+                    const unsigned char* pKey = &vOldArena[vOldPositions[nOld]];
+                    
+                    unsigned short nLength;
+                    memcpy(&nLength, pKey, 2);
+                    
+                    vKeyPositions[nSlot] = vArena.size();
+                    vArena.insert(vArena.end(), pKey, pKey + 2 + nLength);
+                }
+            }
+            
+            nDeleted      = 0;
+            nArenaGarbage = 0;
+        }
+    
+    
+    public:
+        
+        /** Key Index Constructor
+        *
+        * @param[in] fFingerprintOnlyIn Keep only fingerprints in memory
+        *
+        */
+        KeyIndex(bool fFingerprintOnlyIn) : fFingerprintOnly(fFingerprintOnlyIn), vEntries(KEYINDEX_MIN_CAPACITY), nSize(0), nDeleted(0), nArenaGarbage(0)
+        {
+            if(!fFingerprintOnly)
+                vKeyPositions.resize(KEYINDEX_MIN_CAPACITY);
+        }
+        
+        
+        /** Get the location of a key.
+        *
+        * @param[in] vKey The binary key
+        * @param[out] nFile The keychain file
+        * @param[out] nOffset The offset in the keychain file
+        * @param[in] fnVerify Callback (nFile, nOffset) checking the key on disk in fingerprint only mode
+        *
+        * @return True if the key was found
+        *
+        */
+        template<typename Verify>
+        bool Get(const std::vector<unsigned char>& vKey, unsigned short& nFile, unsigned int& nOffset, Verify fnVerify) const
+        {
+            uint64 nSlot;
+            if(!Find(vKey.data(), vKey.size(), KeyHash(vKey.data(), vKey.size()), nSlot, fnVerify))
+                return false;
+            
+            nFile   = vEntries[nSlot].nFile;
+            nOffset = vEntries[nSlot].nOffset;
+            
+            return true;
+        }
+        
+        
+        /** Add or update the location of a key.
+        *
+        * @return True if the key was new
+        *
+        */
+        template<typename Verify>
+        bool Set(const unsigned char* pKey, unsigned short nLength, unsigned short nFile, unsigned int nOffset, Verify fnVerify)
+        {
+            uint64 nFingerprint = KeyHash(pKey, nLength), nSlot;
+            if(Find(pKey, nLength, nFingerprint, nSlot, fnVerify))
+            {
+                vEntries[nSlot].nFile   = nFile;
+                vEntries[nSlot].nOffset = nOffset;
+                
+                return false;
+            }
+            
+            /* Grow before taking an empty slot, re-use of a deleted slot never raises the load. */
+            if(vEntries[nSlot].nState == SLOT_EMPTY && (nSize + nDeleted + 1) * 100 > vEntries.size() * KEYINDEX_MAX_LOAD)
+            {
+                Rehash((nSize + 1) * 100 > (vEntries.size() / 2) * KEYINDEX_MAX_LOAD ? vEntries.size() * 2 : vEntries.size());
+                Find(pKey, nLength, nFingerprint, nSlot, fnVerify);
+            }
+            
+            if(vEntries[nSlot].nState == SLOT_DELETED)
+                nDeleted--;
+            
+            Entry entry = { nFingerprint, nOffset, nFile, SLOT_OCCUPIED };
+            vEntries[nSlot] = entry;
+            
+            if(!fFingerprintOnly)
+                AppendKey(nSlot, pKey, nLength);
+            
+            nSize++;
+            
+            return true;
+        }
+        
+        
+        /* Add or update the location of a key held in a vector. */
+        template<typename Verify>
+        bool Set(const std::vector<unsigned char>& vKey, unsigned short nFile, unsigned int nOffset, Verify fnVerify)
+        {
+            return Set(vKey.data(), vKey.size(), nFile, nOffset, fnVerify);
+        }
+        
+        
+        /** Merge another index into this one. Used to combine partial indexes built in parallel.
+        *
+        * Fingerprints are taken as they are, so no keys are hashed again. A key found in
+        * both takes its location from the other index. In fingerprint only mode equal
+        * fingerprints are both kept, lookups tell them apart on disk.
+        *
+        */
+        void Merge(const KeyIndex& indexOther)
+        {
+            if((nSize + nDeleted + indexOther.nSize) * 100 > vEntries.size() * KEYINDEX_MAX_LOAD)
+                Rehash(std::max((uint64)vEntries.size(), ((nSize + indexOther.nSize) * 100) / KEYINDEX_MAX_LOAD + 1));
+            
+            if(!fFingerprintOnly)
+                vArena.reserve(vArena.size() + indexOther.vArena.size() - indexOther.nArenaGarbage);
+            
+            for(uint64 nOther = 0; nOther < indexOther.vEntries.size(); nOther++)
+            {
+                const Entry& entry = indexOther.vEntries[nOther];
+                if(entry.nState != SLOT_OCCUPIED)
+                    continue;
+                
+                const unsigned char* pKey = NULL;
+                unsigned short nLength = 0;
+                if(!fFingerprintOnly)
+                {
+                    pKey = &indexOther.vArena[indexOther.vKeyPositions[nOther]];
+                    memcpy(&nLength, pKey, 2);
+                    pKey += 2;
+                }
+                
+                /* Probe to the first empty slot, stopping early on the same key. */
+                uint64 nSlot = Home(entry.nFingerprint, vEntries.size());
+                while(vEntries[nSlot].nState != SLOT_EMPTY)
+                {
+                    if(!fFingerprintOnly && vEntries[nSlot].nState == SLOT_OCCUPIED && vEntries[nSlot].nFingerprint == entry.nFingerprint && KeyEquals(nSlot, pKey, nLength))
+                        break;
+                    
+                    nSlot = (nSlot + 1 == vEntries.size() ? 0 : nSlot + 1);
+                }
+                
+                if(vEntries[nSlot].nState == SLOT_OCCUPIED)
+                {
+                    vEntries[nSlot].nFile   = entry.nFile;
+                    vEntries[nSlot].nOffset = entry.nOffset;
+                    
+                    continue;
+                }
+                
+                vEntries[nSlot] = entry;
+                if(!fFingerprintOnly)
+                    AppendKey(nSlot, pKey, nLength);
+                
+                nSize++;
+            }
+        }
+        
+        
+        /** Remove a key.
+        *
+        * @return True if the key was found
+        *
+        */
+        template<typename Verify>
+        bool Erase(const std::vector<unsigned char>& vKey, Verify fnVerify)
+        {
+            uint64 nSlot;
+            if(!Find(vKey.data(), vKey.size(), KeyHash(vKey.data(), vKey.size()), nSlot, fnVerify))
+                return false;
+            
+            vEntries[nSlot].nState = SLOT_DELETED;
+            if(!fFingerprintOnly)
+                nArenaGarbage += 2 + vKey.size();
+            
+            nSize--;
+            nDeleted++;
+            
+            return true;
+        }
+        
+        
+        /* Size the table for a number of keys up front. */
+        void Reserve(uint64 nKeys)
+        {
+            uint64 nCapacity = (nKeys * 100) / KEYINDEX_MAX_LOAD + 1;
+            if(nCapacity > vEntries.size())
+                Rehash(nCapacity);
+        }
+        
+        
+        /* Fit the table to its keys at the maximum load and release spare arena. Used once a keychain is loaded. */
+        void Shrink()
+        {
+            uint64 nCapacity = std::max((uint64)KEYINDEX_MIN_CAPACITY, (nSize * 100) / KEYINDEX_MAX_LOAD + 1);
+            if(nCapacity < vEntries.size() || nDeleted > 0)
+                Rehash(nCapacity);
+            
+            vArena.shrink_to_fit();
+        }
+        
+        
+        /** Iterate the keys in the index.
+        *
+        * @param[in] fnCallback Called with (pKey, nLength, nFile, nOffset). pKey is NULL in fingerprint only mode.
+        *
+        */
+        template<typename Callback>
+        void ForEach(Callback fnCallback) const
+        {
+            for(uint64 nSlot = 0; nSlot < vEntries.size(); nSlot++)
+            {
+                if(vEntries[nSlot].nState != SLOT_OCCUPIED)
+                    continue;
+                
+                if(fFingerprintOnly)
+                {
+                    fnCallback((const unsigned char*)NULL, (unsigned short)0, vEntries[nSlot].nFile, vEntries[nSlot].nOffset);
+                    
+                    continue;
+                }
+                
+                const unsigned char* pKey = &vArena[vKeyPositions[nSlot]];
+                
+                unsigned short nLength;
+                memcpy(&nLength, pKey, 2);
+                
+                fnCallback(pKey + 2, nLength, vEntries[nSlot].nFile, vEntries[nSlot].nOffset);
+            }
+        }
+        
+        
+        /* The number of keys in the index. */
+        uint64 Size() const { return nSize; }
+        
+        
+        /* Whether full keys are kept in memory. */
+        bool FingerprintOnly() const { return fFingerprintOnly; }
+        
+        
+        /** Write the index to a snapshot file.
+        *
+        * The file is written beside the target, synced, and renamed over it
+        * so a crash never leaves a partial snapshot in place.
+        *
+        * @param[in] strPath The snapshot file
+        * @param[in] nCursorFile, nCursorOffset The keychain position the index covers up to
+        *
+        * @return True if the snapshot was written
+        *
+        */
+        bool Save(const std::string& strPath, uint64 nCursorFile, uint64 nCursorOffset) const
+        {
+            uint64 nEntries = vEntries.size() * sizeof(Entry), nPositions = vKeyPositions.size() * sizeof(uint64);
+            
+            SnapshotHeader header = { KEYINDEX_SNAPSHOT_MAGIC, KEYINDEX_SNAPSHOT_VERSION, fFingerprintOnly ? 1u : 0u, 0, nSize, nDeleted, nArenaGarbage, vEntries.size(), vArena.size(), nCursorFile, nCursorOffset, 0 };
+            header.nChecksum = SnapshotChecksum((const unsigned char*)vEntries.data(), nEntries, (const unsigned char*)vKeyPositions.data(), nPositions, vArena.data(), vArena.size());
+            
+            std::string strTemp = strPath + ".tmp";
+            int nDescriptor = open(strTemp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if(nDescriptor == -1)
+                return error(FUNCTION "Failed to Create Snapshot %s\n", __PRETTY_FUNCTION__, strTemp.c_str());
+            
+            bool fSuccess = WriteAll(nDescriptor, &header, sizeof(header)) && WriteAll(nDescriptor, vEntries.data(), nEntries) &&
+                            WriteAll(nDescriptor, vKeyPositions.data(), nPositions) && WriteAll(nDescriptor, vArena.data(), vArena.size()) &&
+                            fsync(nDescriptor) == 0;
+            close(nDescriptor);
+            
+            if(!fSuccess || rename(strTemp.c_str(), strPath.c_str()) != 0)
+            {
+                unlink(strTemp.c_str());
+                
+                return error(FUNCTION "Failed to Write Snapshot %s\n", __PRETTY_FUNCTION__, strPath.c_str());
+            }
+            
+            return true;
+        }
+        
+        
+        /** Replace the index with a snapshot file. The file is read through one mapping of it.
+        *
+        * @param[in] strPath The snapshot file
+        * @param[out] nCursorFile, nCursorOffset The keychain position the snapshot covers up to
+        *
+        * @return True if the snapshot was valid and loaded
+        *
+        */
+        bool Load(const std::string& strPath, uint64& nCursorFile, uint64& nCursorOffset)
+        {
+            mmaplib::MemoryMappedFile file(strPath.c_str());
+            if(!file.is_open() || file.size() < sizeof(SnapshotHeader))
+                return false;
+            
+            SnapshotHeader header;
+            memcpy(&header, file.data(), sizeof(header));
+            if(header.nMagic != KEYINDEX_SNAPSHOT_MAGIC || header.nVersion != KEYINDEX_SNAPSHOT_VERSION || header.fFingerprintOnly != (fFingerprintOnly ? 1u : 0u) || header.nCapacity == 0)
+                return false;
+            
+            /* The sizes have to add up to the file before anything is read. */
+            uint64 nEntries = header.nCapacity * sizeof(Entry), nPositions = fFingerprintOnly ? 0 : header.nCapacity * sizeof(uint64);
+            if(file.size() != sizeof(header) + nEntries + nPositions + header.nArenaSize)
+                return error(FUNCTION "Snapshot %s Size Mismatch\n", __PRETTY_FUNCTION__, strPath.c_str());
+            
+            const unsigned char* pEntries   = (const unsigned char*)file.data() + sizeof(header);
+            const unsigned char* pPositions = pEntries + nEntries;
+            const unsigned char* pArena     = pPositions + nPositions;
+            if(SnapshotChecksum(pEntries, nEntries, pPositions, nPositions, pArena, header.nArenaSize) != header.nChecksum)
+                return error(FUNCTION "Snapshot %s Checksum Mismatch\n", __PRETTY_FUNCTION__, strPath.c_str());
+            
+            vEntries.resize(header.nCapacity);
+            memcpy(vEntries.data(), pEntries, nEntries);
+            
+            vKeyPositions.resize(nPositions / sizeof(uint64));
+            if(nPositions > 0)
+                memcpy(vKeyPositions.data(), pPositions, nPositions);
+            
+            vArena.assign(pArena, pArena + header.nArenaSize);
+            
+            nSize         = header.nSize;
+            nDeleted      = header.nDeleted;
+            nArenaGarbage = header.nArenaGarbage;
+            nCursorFile   = header.nCursorFile;
+            nCursorOffset = header.nCursorOffset;
+            
+            return true;
+        }
+        
+        
+        /* The heap memory held by the index in bytes. */
+        uint64 MemoryUsage() const
+        {
+            return vEntries.capacity() * sizeof(Entry) + vKeyPositions.capacity() * sizeof(uint64) + vArena.capacity();
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,221 @@
+/*__________________________________________________________________________________________
+            
+            (c) Hash(BEGIN(Satoshi[2010]), END(Sunny[2012])) == Videlicet[2017] ++
+            
+            (c) Copyright The Nexus Developers 2014 - 2017
+            
+            Distributed under the MIT software license, see the accompanying
+            file COPYING or http://www.opensource.org/licenses/mit-license.php.
+            
+            "fides in stellis, virtus in numeris" - Faith in the Stars, Power in Numbers
+
+____________________________________________________________________________________________*/
+
+#ifndef NEXUS_LLD_INCLUDE_KEYLOCK_H
+#define NEXUS_LLD_INCLUDE_KEYLOCK_H
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include <boost/thread/shared_mutex.hpp>
+
+#include "keyhash.h"
+
+namespace LLD
+{
+    
+    /* Stripes of the key locks unless set with -lockstripes. Rounded up to a power of two. */
+    const unsigned int DEFAULT_KEY_LOCK_STRIPES = 1024;
+    
+    
+    /** Key Locks:
+    *
+    * Shared / exclusive locks striped by the hash of a key. Readers of a key
+    * take its stripe shared, so readers never wait on each other, and a writer
+    * changing a key's sector in place takes it exclusive. Keys that share a
+    * stripe only contend when one of them is written.
+    *
+    * A thread holding more than one stripe takes them through KeyLockSet, in
+    * stripe order, so two of them can't deadlock. Taking every stripe is a
+    * barrier: once held, no reader that started before is still running.
+    *
+    */
+    class KeyLocks
+    {
+    protected:
+        
+        /* The stripes. */
+        boost::shared_mutex* STRIPES;
+        
+        
+        /* Number of stripes less one, to mask a hash with. */
+        unsigned int nMask;
+    
+    
+    public:
+        
+        /* Waits for a stripe held by another thread. */
+        std::atomic<uint64> nSharedWaits, nExclusiveWaits;
+        
+        
+        /** Key Locks Constructor
+        *
+        * @param[in] nStripes The number of stripes, rounded up to a power of two
+        *
+        */
+        KeyLocks(unsigned int nStripes) : nMask(1), nSharedWaits(0), nExclusiveWaits(0)
+        {
+            while(nMask < nStripes)
+                nMask <<= 1;
+            
+            STRIPES = new boost::shared_mutex[nMask];
+            nMask--;
+        }
+        
+        
+        ~KeyLocks()
+        {
+            delete[] STRIPES;
+        }
+        
+        
+        /* The number of stripes. */
+        unsigned int Stripes() const { return nMask + 1; }
+        
+        
+        /* The stripe of a key. */
+        unsigned int Stripe(const std::vector<unsigned char>& vKey) const
+        {
+            return (unsigned int)(KeyHash(vKey) & nMask);
+        }
+        
+        
+        /* Take a stripe shared, counting it if another thread holds it exclusive. */
+        void LockShared(unsigned int nStripe)
+        {
+            if(STRIPES[nStripe].try_lock_shared())
+                return;
+            
+            nSharedWaits++;
+            STRIPES[nStripe].lock_shared();
+        }
+        
+        
+        void UnlockShared(unsigned int nStripe)
+        {
+            STRIPES[nStripe].unlock_shared();
+        }
+        
+        
+        /* Take a stripe exclusive, counting it if another thread holds it. */
+        void Lock(unsigned int nStripe)
+        {
+            if(STRIPES[nStripe].try_lock())
+                return;
+            
+            nExclusiveWaits++;
+            STRIPES[nStripe].lock();
+        }
+        
+        
+        void Unlock(unsigned int nStripe)
+        {
+            STRIPES[nStripe].unlock();
+        }
+    };
+    
+    
+    /** Key Lock:
+    *
+    * Holds the stripe of one key for its lifetime, shared or exclusive.
+    *
+    */
+    class KeyLock
+    {
+        KeyLocks& locks;
+        
+        unsigned int nStripe;
+        
+        bool fExclusive;
+        
+    public:
+        
+        KeyLock(KeyLocks& locksIn, const std::vector<unsigned char>& vKey, bool fExclusiveIn) : locks(locksIn), nStripe(locksIn.Stripe(vKey)), fExclusive(fExclusiveIn)
+        {
+            fExclusive ? locks.Lock(nStripe) : locks.LockShared(nStripe);
+        }
+        
+        
+        ~KeyLock()
+        {
+            fExclusive ? locks.Unlock(nStripe) : locks.UnlockShared(nStripe);
+        }
+    };
+    
+    
+    /** Key Lock Set:
+    *
+    * Holds a set of stripes for its lifetime, shared or exclusive.
+    * Stripes are taken once each, lowest first.
+    *
+    */
+    class KeyLockSet
+    {
+        KeyLocks& locks;
+        
+        /* The stripes held, in order. */
+        std::vector<unsigned int> vStripes;
+        
+        bool fExclusive;
+    
+    public:
+        
+        /** Lock a set of stripes.
+        *
+        * @param[in] locksIn The key locks
+        * @param[in] vStripesIn The stripes of the keys, from KeyLocks::Stripe
+        * @param[in] fExclusiveIn Take them exclusive rather than shared
+        *
+        */
+        KeyLockSet(KeyLocks& locksIn, const std::vector<unsigned int>& vStripesIn, bool fExclusiveIn) : locks(locksIn), vStripes(vStripesIn), fExclusive(fExclusiveIn)
+        {
+            Acquire();
+        }
+        
+        
+        /** Lock every stripe, once no thread holds any of them.
+        *
+        * @param[in] locksIn The key locks
+        *
+        */
+        KeyLockSet(KeyLocks& locksIn) : locks(locksIn), fExclusive(true)
+        {
+            for(unsigned int nStripe = 0; nStripe < locks.Stripes(); nStripe++)
+                vStripes.push_back(nStripe);
+            
+            Acquire();
+        }
+        
+        
+        ~KeyLockSet()
+        {
+            for(auto it = vStripes.rbegin(); it != vStripes.rend(); ++it)
+                fExclusive ? locks.Unlock(*it) : locks.UnlockShared(*it);
+        }
+    
+    
+    private:
+        
+        void Acquire()
+        {
+            std::sort(vStripes.begin(), vStripes.end());
+            vStripes.erase(std::unique(vStripes.begin(), vStripes.end()), vStripes.end());
+            
+            for(unsigned int nStripe : vStripes)
+                fExclusive ? locks.Lock(nStripe) : locks.LockShared(nStripe);
+        }
+    };
+}
+
+#endif
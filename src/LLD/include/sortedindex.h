@@ -0,0 +1,631 @@
+/*__________________________________________________________________________________________
+            
+            (c) Hash(BEGIN(Satoshi[2010]), END(Sunny[2012])) == Videlicet[2017] ++
+            
+            (c) Copyright The Nexus Developers 2014 - 2017
+            
+            Distributed under the MIT software license, see the accompanying
+            file COPYING or http://www.opensource.org/licenses/mit-license.php.
+            
+            "fides in stellis, virtus in numeris" - Faith in the Stars, Power in Numbers
+
+____________________________________________________________________________________________*/
+
+#ifndef NEXUS_LLD_INCLUDE_SORTEDINDEX_H
+#define NEXUS_LLD_INCLUDE_SORTEDINDEX_H
+
+#include <ctype.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "filecache.h"
+
+#include "../../LLC/hash/SK.h"
+#include "../../Util/include/debug.h"
+#include "../../Util/templates/serialize.h"
+
+namespace LLD
+{
+    
+    /* Bytes of entries in a block of a run. A cursor keeps one block of each run in memory. */
+    const unsigned int SORTED_BLOCK_SIZE = 4096;
+    
+    
+    /* Keys held in memory before they are written out as a run. */
+    const unsigned int SORTED_MEMORY_KEYS = 65536;
+    
+    
+    /* Runs kept before they are merged into one. */
+    const unsigned int SORTED_MAX_RUNS = 8;
+    
+    
+    /* Bytes a run is buffered in before it is written. */
+    const unsigned int SORTED_WRITE_BUFFER = 1024 * 1024;
+    
+    
+    /* Version of the sorted index manifest. */
+    const unsigned int SORTED_VERSION = 1;
+    
+    
+    /** Sorted Key Index:
+    *
+    * Keys of a database in byte order, kept as a log structured merge of sorted
+    * runs. New keys and erases go into a sorted map in memory, written out as a
+    * run once it holds SORTED_MEMORY_KEYS. Runs are files of blocks of entries,
+    * an entry being a flag for erased keys, a length and the key, with the first
+    * key of every block in a footer. Once there are more than SORTED_MAX_RUNS
+    * they are merged into one, dropping erased keys.
+    *
+    * Scans merge the memory and the runs from a starting key, holding one block
+    * per run, and return a bounded number of keys so a cursor over any number
+    * of keys uses bounded memory. Not thread safe, the sector database calls it
+    * under its lock.
+    *
+    */
+    class SortedKeyIndex
+    {
+    protected:
+        
+        /* A block of a run, located by the footer. */
+        struct RunBlock
+        {
+            std::vector<unsigned char> vFirst;
+            uint64 nOffset;
+            unsigned int nLength;
+            
+            IMPLEMENT_SERIALIZE
+            (
+                READWRITE(vFirst);
+                READWRITE(nOffset);
+                READWRITE(nLength);
+            )
+        };
+        
+        
+        /* A sorted run on disk. */
+        struct Run
+        {
+            unsigned int nFile;
+            uint64 nKeys;
+            std::vector<RunBlock> vBlocks;
+        };
+        
+        
+        /** Reads the entries of a run in order, one block at a time. **/
+        class RunReader
+        {
+        public:
+            const Run* pRun;
+            unsigned int nFileCacheID;
+            unsigned int nBlock;
+            unsigned int nPosition;
+            std::vector<unsigned char> vBlock;
+            
+            std::vector<unsigned char> vKey;
+            bool fErased;
+            bool fValid;
+            
+            RunReader(const Run* pRunIn, unsigned int nFileCacheIDIn) : pRun(pRunIn), nFileCacheID(nFileCacheIDIn), nBlock(0), nPosition(0), fErased(false), fValid(false) {}
+            
+            
+            /* Read a block and move to its first entry. */
+            bool Load(unsigned int nBlockIn)
+            {
+                nBlock = nBlockIn;
+                if(nBlock >= pRun->vBlocks.size())
+                    return (fValid = false);
+                
+                const RunBlock& block = pRun->vBlocks[nBlock];
+                vBlock.resize(block.nLength);
+                if(!FileCache().Read(nFileCacheID, pRun->nFile, block.nOffset, &vBlock[0], block.nLength))
+                {
+                    fValid = false;
+                    
+                    return error(FUNCTION "Failed to Read Block %u of Run %u\n", __PRETTY_FUNCTION__, nBlock, pRun->nFile);
+                }
+                
+                nPosition = 0;
+                
+                return Next();
+            }
+            
+            
+            /* Move to the next entry, reading the next block at the end of this one. */
+            bool Next()
+            {
+                if(nPosition + 3 > vBlock.size())
+                    return Load(nBlock + 1);
+                
+                unsigned short nLength;
+                memcpy(&nLength, &vBlock[nPosition + 1], 2);
+                
+                fErased = (vBlock[nPosition] != 0);
+                vKey.assign(vBlock.begin() + nPosition + 3, vBlock.begin() + nPosition + 3 + nLength);
+                nPosition += 3 + nLength;
+                
+                return (fValid = true);
+            }
+            
+            
+            /* Move to the first entry at or after a key. */
+            bool Seek(const std::vector<unsigned char>& vFrom)
+            {
+                auto it = std::upper_bound(pRun->vBlocks.begin(), pRun->vBlocks.end(), vFrom, [](const std::vector<unsigned char>& vKeyIn, const RunBlock& block) { return vKeyIn < block.vFirst; });
+                if(!Load(it == pRun->vBlocks.begin() ? 0 : (it - pRun->vBlocks.begin()) - 1))
+                    return false;
+                
+                while(fValid && vKey < vFrom)
+                    Next();
+                
+                return fValid;
+            }
+        };
+        
+        
+        /** Merges the keys in memory and the runs in order. The newest entry of a key wins. **/
+        class MergeCursor
+        {
+        public:
+            std::map<std::vector<unsigned char>, bool>::const_iterator itMemory, itEnd;
+            std::vector<RunReader> vReaders;
+            
+            
+            /* Merge the keys in memory, if given, and runs newest first. */
+            MergeCursor(const std::map<std::vector<unsigned char>, bool>* pMemory, const std::vector<Run>& vRuns, unsigned int nFileCacheID)
+            {
+                if(pMemory)
+                {
+                    itMemory = pMemory->begin();
+                    itEnd    = pMemory->end();
+                }
+                
+                for(auto it = vRuns.rbegin(); it != vRuns.rend(); ++it)
+                    vReaders.push_back(RunReader(&(*it), nFileCacheID));
+            }
+            
+            
+            void Seek(const std::vector<unsigned char>& vFrom, const std::map<std::vector<unsigned char>, bool>* pMemory)
+            {
+                if(pMemory)
+                    itMemory = pMemory->lower_bound(vFrom);
+                
+                for(auto& reader : vReaders)
+                    reader.Seek(vFrom);
+            }
+            
+            
+            /** Take the next key.
+            *
+            * @param[out] vKey The key
+            * @param[out] fErased Whether the newest entry of it is an erase
+            *
+            * @return False once every source is done
+            *
+            */
+            bool Next(std::vector<unsigned char>& vKey, bool& fErased)
+            {
+                const std::vector<unsigned char>* pMin = NULL;
+                if(itMemory != itEnd)
+                {
+                    pMin    = &itMemory->first;
+                    fErased = itMemory->second;
+                }
+                
+                for(auto& reader : vReaders)
+                {
+                    if(reader.fValid && (!pMin || reader.vKey < *pMin))
+                    {
+                        pMin    = &reader.vKey;
+                        fErased = reader.fErased;
+                    }
+                }
+                
+                if(!pMin)
+                    return false;
+                
+                vKey = *pMin;
+                
+                /* Older entries of the same key are passed over. */
+                if(itMemory != itEnd && itMemory->first == vKey)
+                    ++itMemory;
+                
+                for(auto& reader : vReaders)
+                    if(reader.fValid && reader.vKey == vKey)
+                        reader.Next();
+                
+                return true;
+            }
+        };
+        
+        
+        /* File of the runs, and the id of the run files in the file handle cache. */
+        std::string strPrefix;
+        unsigned int nFileCacheID;
+        
+        
+        /* Keys added and erased since the last run was written. True for an erase. */
+        std::map<std::vector<unsigned char>, bool> mapMemory;
+        
+        
+        /* The runs, oldest first, and the number of the next run file. */
+        std::vector<Run> vRuns;
+        unsigned int nNextFile;
+        
+        
+        /* Statistics. */
+        uint64 nRunsWritten, nMerges;
+        
+        
+        /** Write a sorted stream of entries as a run.
+        *
+        * @param[in] fnNext Called for each entry in order, returns false when done
+        * @param[in] fKeepErased Write erases, needed while older runs may hold the key
+        *
+        * @return True if the run was written and added
+        *
+        */
+        template<typename NextFunc>
+        bool WriteRun(NextFunc fnNext, bool fKeepErased, Run& run)
+        {
+            run.nFile = nNextFile++;
+            run.nKeys = 0;
+            run.vBlocks.clear();
+            
+            std::vector<unsigned char> vBuffer;
+            uint64 nWritten = 0, nBlockStart = 0;
+            
+            std::vector<unsigned char> vKey;
+            bool fErased;
+            while(fnNext(vKey, fErased))
+            {
+                if(fErased && !fKeepErased)
+                    continue;
+                
+                /* Start a block once the entry doesn't fit in this one. */
+                uint64 nEnd = nWritten + vBuffer.size();
+                if(run.vBlocks.empty() || nEnd - nBlockStart + 3 + vKey.size() > SORTED_BLOCK_SIZE)
+                {
+                    if(!run.vBlocks.empty())
+                        run.vBlocks.back().nLength = nEnd - nBlockStart;
+                    
+                    RunBlock block;
+                    block.vFirst  = vKey;
+                    block.nOffset = nBlockStart = nEnd;
+                    block.nLength = 0;
+                    run.vBlocks.push_back(block);
+                }
+                
+                unsigned short nLength = vKey.size();
+                vBuffer.push_back(fErased ? 1 : 0);
+                vBuffer.insert(vBuffer.end(), (unsigned char*)&nLength, (unsigned char*)&nLength + 2);
+                vBuffer.insert(vBuffer.end(), vKey.begin(), vKey.end());
+                run.nKeys++;
+                
+                if(vBuffer.size() >= SORTED_WRITE_BUFFER)
+                {
+                    if(!FileCache().Write(nFileCacheID, run.nFile, nWritten, &vBuffer[0], vBuffer.size()))
+                        return error(FUNCTION "Failed to Write Run %u\n", __PRETTY_FUNCTION__, run.nFile);
+                    
+                    nWritten += vBuffer.size();
+                    vBuffer.clear();
+                }
+            }
+            
+            if(!run.vBlocks.empty())
+                run.vBlocks.back().nLength = nWritten + vBuffer.size() - nBlockStart;
+            
+            /* The footer locates the blocks, followed by its offset and checksum. */
+            uint64 nFooter = nWritten + vBuffer.size();
+            CDataStream ssFooter(SER_LLD, DATABASE_VERSION);
+            ssFooter << run.nKeys << run.vBlocks;
+            
+            std::vector<unsigned char> vFooter(ssFooter.begin(), ssFooter.end());
+            unsigned int nChecksum = LLC::HASH::SK32(vFooter);
+            vBuffer.insert(vBuffer.end(), vFooter.begin(), vFooter.end());
+            vBuffer.insert(vBuffer.end(), (unsigned char*)&nFooter, (unsigned char*)&nFooter + sizeof(nFooter));
+            vBuffer.insert(vBuffer.end(), (unsigned char*)&nChecksum, (unsigned char*)&nChecksum + sizeof(nChecksum));
+            
+            if(!FileCache().Write(nFileCacheID, run.nFile, nWritten, &vBuffer[0], vBuffer.size()) || !FileCache().Sync(nFileCacheID, run.nFile))
+                return error(FUNCTION "Failed to Write Run %u\n", __PRETTY_FUNCTION__, run.nFile);
+            
+            nRunsWritten++;
+            
+            return true;
+        }
+        
+        
+        /* Read the footer of a run file. */
+        bool ReadRun(unsigned int nFile, Run& run)
+        {
+            uint64 nSize;
+            if(!FileCache().Size(nFileCacheID, nFile, nSize) || nSize < sizeof(uint64) + sizeof(unsigned int))
+                return error(FUNCTION "Run %u is Missing\n", __PRETTY_FUNCTION__, nFile);
+            
+            uint64 nFooter;
+            unsigned int nChecksum;
+            unsigned char vTail[sizeof(uint64) + sizeof(unsigned int)];
+            if(!FileCache().Read(nFileCacheID, nFile, nSize - sizeof(vTail), vTail, sizeof(vTail)))
+                return false;
+            
+            memcpy(&nFooter, vTail, sizeof(nFooter));
+            memcpy(&nChecksum, vTail + sizeof(nFooter), sizeof(nChecksum));
+            if(nFooter > nSize - sizeof(vTail))
+                return error(FUNCTION "Run %u has a Bad Footer\n", __PRETTY_FUNCTION__, nFile);
+            
+            std::vector<unsigned char> vFooter(nSize - sizeof(vTail) - nFooter);
+            if(!vFooter.empty() && !FileCache().Read(nFileCacheID, nFile, nFooter, &vFooter[0], vFooter.size()))
+                return false;
+            
+            if(LLC::HASH::SK32(vFooter) != nChecksum)
+                return error(FUNCTION "Run %u Failed its Checksum\n", __PRETTY_FUNCTION__, nFile);
+            
+            try
+            {
+                CDataStream ssFooter(vFooter, SER_LLD, DATABASE_VERSION);
+                ssFooter >> run.nKeys >> run.vBlocks;
+            }
+            catch(std::exception& e)
+            {
+                return error(FUNCTION "Failed to Read Run %u: %s\n", __PRETTY_FUNCTION__, nFile, e.what());
+            }
+            
+            run.nFile = nFile;
+            
+            return true;
+        }
+        
+        
+        /* Write the keys in memory as a run, merging the runs once there are too many. */
+        bool FlushMemory()
+        {
+            if(mapMemory.empty())
+                return true;
+            
+            /* Erases are kept, the key may be in an older run. */
+            auto it = mapMemory.begin();
+            Run run;
+            if(!WriteRun([&](std::vector<unsigned char>& vKey, bool& fErased) { if(it == mapMemory.end()) return false; vKey = it->first; fErased = it->second; ++it; return true; }, !vRuns.empty(), run))
+                return false;
+            
+            vRuns.push_back(run);
+            mapMemory.clear();
+            
+            if(vRuns.size() > SORTED_MAX_RUNS)
+                return MergeRuns();
+            
+            return true;
+        }
+        
+        
+        /* Merge every run into one. Nothing is older than it, so erases are dropped. */
+        bool MergeRuns()
+        {
+            MergeCursor cursor(NULL, vRuns, nFileCacheID);
+            cursor.Seek(std::vector<unsigned char>(), NULL);
+            
+            Run run;
+            if(!WriteRun([&](std::vector<unsigned char>& vKey, bool& fErased) { return cursor.Next(vKey, fErased); }, false, run))
+                return false;
+            
+            for(const Run& old : vRuns)
+                FileCache().Remove(nFileCacheID, old.nFile);
+            
+            vRuns.clear();
+            vRuns.push_back(run);
+            nMerges++;
+            
+            return true;
+        }
+    
+    
+    public:
+        
+        /** Sorted Index Constructor
+        *
+        * @param[in] strPrefixIn The path and prefix of the index files
+        *
+        */
+        SortedKeyIndex(const std::string& strPrefixIn) : strPrefix(strPrefixIn), nFileCacheID(FileCache().Register(strPrefixIn + ".")), nNextFile(0), nRunsWritten(0), nMerges(0) {}
+        
+        
+        ~SortedKeyIndex()
+        {
+            FileCache().Close(nFileCacheID);
+        }
+        
+        
+        /* Add a key. */
+        void Insert(const std::vector<unsigned char>& vKey)
+        {
+            mapMemory[vKey] = false;
+            if(mapMemory.size() >= SORTED_MEMORY_KEYS)
+                FlushMemory();
+        }
+        
+        
+        /* Remove a key. */
+        void Erase(const std::vector<unsigned char>& vKey)
+        {
+            mapMemory[vKey] = true;
+            if(mapMemory.size() >= SORTED_MEMORY_KEYS)
+                FlushMemory();
+        }
+        
+        
+        /** Find keys in order.
+        *
+        * @param[in] vFrom The key to start at
+        * @param[in] fInclusive Whether vFrom itself is returned
+        * @param[in] vPrefix Only keys starting with this are returned
+        * @param[in] nMax The most keys to return
+        * @param[out] vKeys The keys found, in byte order
+        *
+        * @return True if there may be more keys after the last returned
+        *
+        */
+        bool Scan(const std::vector<unsigned char>& vFrom, bool fInclusive, const std::vector<unsigned char>& vPrefix, unsigned int nMax, std::vector< std::vector<unsigned char> >& vKeys)
+        {
+            vKeys.clear();
+            
+            MergeCursor cursor(&mapMemory, vRuns, nFileCacheID);
+            cursor.Seek(std::max(vFrom, vPrefix), &mapMemory);
+            
+            std::vector<unsigned char> vKey;
+            bool fErased;
+            while(vKeys.size() < nMax && cursor.Next(vKey, fErased))
+            {
+                /* Past the keys with the prefix. */
+                if(vKey.size() < vPrefix.size() || !std::equal(vPrefix.begin(), vPrefix.end(), vKey.begin()))
+                    return false;
+                
+                if(fErased || (!fInclusive && vKey == vFrom))
+                    continue;
+                
+                vKeys.push_back(vKey);
+            }
+            
+            return (vKeys.size() == nMax);
+        }
+        
+        
+        /* Remove every run and key, and build the index from a list of keys. */
+        bool Rebuild(std::vector< std::vector<unsigned char> >& vKeys)
+        {
+            Clear();
+            
+            std::sort(vKeys.begin(), vKeys.end());
+            
+            auto it = vKeys.begin();
+            Run run;
+            if(!WriteRun([&](std::vector<unsigned char>& vKey, bool& fErased) { if(it == vKeys.end()) return false; vKey = *it++; fErased = false; return true; }, false, run))
+                return false;
+            
+            vRuns.push_back(run);
+            
+            return true;
+        }
+        
+        
+        /* Remove every run file and key. */
+        void Clear()
+        {
+            mapMemory.clear();
+            vRuns.clear();
+            nNextFile = 0;
+            
+            boost::filesystem::path pathPrefix(strPrefix + ".");
+            std::string strFilePrefix = pathPrefix.filename().string();
+            if(!boost::filesystem::exists(pathPrefix.parent_path()))
+                return;
+            
+            for(boost::filesystem::directory_iterator it(pathPrefix.parent_path()), end; it != end; ++it)
+            {
+                std::string strFile = it->path().filename().string();
+                if(strFile.size() > strFilePrefix.size() && strFile.compare(0, strFilePrefix.size(), strFilePrefix) == 0 && isdigit(strFile[strFilePrefix.size()]))
+                    FileCache().Remove(nFileCacheID, atoi(strFile.c_str() + strFilePrefix.size()));
+            }
+        }
+        
+        
+        /** Write the keys in memory as a run and list the runs in the manifest.
+        *
+        * @return True if the index was written
+        *
+        */
+        bool Save()
+        {
+            if(!FlushMemory())
+                return false;
+            
+            std::vector<unsigned int> vFiles;
+            for(const Run& run : vRuns)
+                vFiles.push_back(run.nFile);
+            
+            CDataStream ssManifest(SER_LLD, DATABASE_VERSION);
+            ssManifest << SORTED_VERSION << nNextFile << vFiles;
+            
+            std::vector<unsigned char> vData(ssManifest.begin(), ssManifest.end());
+            unsigned int nChecksum = LLC::HASH::SK32(vData);
+            
+            std::string strTemp = strPrefix + ".tmp";
+            std::ofstream fStream(strTemp.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+            fStream.write((char*)&vData[0], vData.size());
+            fStream.write((char*)&nChecksum, sizeof(nChecksum));
+            fStream.close();
+            
+            if(!fStream)
+                return error(FUNCTION "Failed to Write %s\n", __PRETTY_FUNCTION__, strTemp.c_str());
+            
+            return (rename(strTemp.c_str(), strPrefix.c_str()) == 0);
+        }
+        
+        
+        /** Read the runs listed in the manifest written by Save.
+        *
+        * @return True if the manifest and every run were read
+        *
+        */
+        bool Load()
+        {
+            std::ifstream fStream(strPrefix.c_str(), std::ios::in | std::ios::binary);
+            if(!fStream)
+                return false;
+            
+            std::vector<unsigned char> vData((std::istreambuf_iterator<char>(fStream)), std::istreambuf_iterator<char>());
+            if(vData.size() < sizeof(unsigned int))
+                return false;
+            
+            unsigned int nChecksum;
+            memcpy(&nChecksum, &vData[vData.size() - sizeof(nChecksum)], sizeof(nChecksum));
+            vData.resize(vData.size() - sizeof(nChecksum));
+            if(LLC::HASH::SK32(vData) != nChecksum)
+                return error(FUNCTION "Checksum Mismatch in %s\n", __PRETTY_FUNCTION__, strPrefix.c_str());
+            
+            unsigned int nVersion;
+            std::vector<unsigned int> vFiles;
+            try
+            {
+                CDataStream ssManifest(vData, SER_LLD, DATABASE_VERSION);
+                ssManifest >> nVersion >> nNextFile >> vFiles;
+            }
+            catch(std::exception& e)
+            {
+                return error(FUNCTION "Failed to Read %s: %s\n", __PRETTY_FUNCTION__, strPrefix.c_str(), e.what());
+            }
+            
+            if(nVersion != SORTED_VERSION)
+                return error(FUNCTION "Unknown Version %u in %s\n", __PRETTY_FUNCTION__, nVersion, strPrefix.c_str());
+            
+            vRuns.resize(vFiles.size());
+            for(unsigned int nRun = 0; nRun < vFiles.size(); nRun++)
+                if(!ReadRun(vFiles[nRun], vRuns[nRun]))
+                    return false;
+            
+            return true;
+        }
+        
+        
+        /* Dump the index statistics to the debug console. */
+        void PrintStats() const
+        {
+            uint64 nKeys = 0, nBlocks = 0;
+            for(const Run& run : vRuns)
+            {
+                nKeys   += run.nKeys;
+                nBlocks += run.vBlocks.size();
+            }
+            
+            printf(FUNCTION "Memory: %u keys | Runs: %u with %" PRIu64 " entries in %" PRIu64 " blocks | Runs Written: %" PRIu64 " | Merges: %" PRIu64 "\n", __PRETTY_FUNCTION__, (unsigned int)mapMemory.size(), (unsigned int)vRuns.size(), nKeys, nBlocks, nRunsWritten, nMerges);
+        }
+    };
+}
+
+#endif
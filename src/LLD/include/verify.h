@@ -0,0 +1,143 @@
+/*__________________________________________________________________________________________
+            
+            (c) Hash(BEGIN(Satoshi[2010]), END(Sunny[2012])) == Videlicet[2017] ++
+            
+            (c) Copyright The Nexus Developers 2014 - 2017
+            
+            Distributed under the MIT software license, see the accompanying
+            file COPYING or http://www.opensource.org/licenses/mit-license.php.
+            
+            "fides in stellis, virtus in numeris" - Faith in the Stars, Power in Numbers
+
+____________________________________________________________________________________________*/
+
+#ifndef NEXUS_LLD_INCLUDE_VERIFY_H
+#define NEXUS_LLD_INCLUDE_VERIFY_H
+
+#include <atomic>
+#include <string>
+
+#include "keyhash.h"
+
+namespace LLD
+{
+    
+    /** When a sector read from disk has its checksum verified, set with -verifyreads. **/
+    enum
+    {
+        VERIFY_ALWAYS  = 0, //every read
+        VERIFY_FIRST   = 1, //the first read of each sector since the database was opened
+        VERIFY_SAMPLED = 2, //one read in -verifysample
+        VERIFY_SCRUB   = 3  //only by the scrubber
+    };
+    
+    
+    /* Reads in each verified under VERIFY_SAMPLED, unless set with -verifysample. */
+    const unsigned int DEFAULT_VERIFY_SAMPLE = 64;
+    
+    
+    /* Sectors remembered as verified under VERIFY_FIRST, unless set with -verifyslots. Rounded up to a power of two. */
+    const unsigned int DEFAULT_VERIFY_SLOTS = 1024 * 1024;
+    
+    
+    inline unsigned char VerifyPolicy(const std::string& strName)
+    {
+        if(strName == "first")
+            return VERIFY_FIRST;
+        
+        if(strName == "sampled")
+            return VERIFY_SAMPLED;
+        
+        if(strName == "scrub")
+            return VERIFY_SCRUB;
+        
+        return VERIFY_ALWAYS;
+    }
+    
+    
+    inline const char* VerifyPolicyName(unsigned char nPolicy)
+    {
+        return (nPolicy == VERIFY_FIRST ? "First Read" : nPolicy == VERIFY_SAMPLED ? "Sampled" : nPolicy == VERIFY_SCRUB ? "Scrub Only" : "Always");
+    }
+    
+    
+    /* Tag of a sector: where it is and its checksum, so a sector rewritten in place is a new one. */
+    inline uint64 SectorTag(unsigned short nFile, unsigned int nStart, unsigned short nSize, unsigned int nChecksum)
+    {
+        unsigned char vTag[12];
+        memcpy(vTag,      &nFile,     2);
+        memcpy(vTag + 2,  &nSize,     2);
+        memcpy(vTag + 4,  &nStart,    4);
+        memcpy(vTag + 8,  &nChecksum, 4);
+        
+        /* Zero marks an empty slot. */
+        return KeyHash(vTag, sizeof(vTag)) | 1;
+    }
+    
+    
+    /** Verified Sectors:
+    *
+    * The sectors whose checksums have been verified since the database was
+    * opened. A fixed table of tags, one per slot, written and read without a
+    * lock: a sector whose slot was taken since by another is only verified
+    * again, so the table never grows and is never wrong the unsafe way.
+    *
+    */
+    class VerifiedSectors
+    {
+        std::atomic<uint64>* SLOTS;
+        
+        uint64 nMask;
+        
+        
+        /* The tags' low bit is always set, so their slot is taken above it. */
+        uint64 Slot(uint64 nTag) const { return (nTag >> 1) & nMask; }
+    
+    public:
+        
+        VerifiedSectors(uint64 nSlots) : nMask(1)
+        {
+            while(nMask < nSlots)
+                nMask <<= 1;
+            
+            SLOTS = new std::atomic<uint64>[nMask];
+            nMask--;
+            
+            Clear();
+        }
+        
+        
+        ~VerifiedSectors()
+        {
+            delete[] SLOTS;
+        }
+        
+        
+        bool Contains(uint64 nTag) const
+        {
+            return SLOTS[Slot(nTag)].load(std::memory_order_relaxed) == nTag;
+        }
+        
+        
+        void Insert(uint64 nTag)
+        {
+            SLOTS[Slot(nTag)].store(nTag, std::memory_order_relaxed);
+        }
+        
+        
+        /* Forget a sector, if it is still the one in its slot. */
+        void Erase(uint64 nTag)
+        {
+            SLOTS[Slot(nTag)].compare_exchange_strong(nTag, 0, std::memory_order_relaxed);
+        }
+        
+        
+        void Clear()
+        {
+            for(uint64 nSlot = 0; nSlot <= nMask; nSlot++)
+                SLOTS[nSlot].store(0, std::memory_order_relaxed);
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,127 @@
+/*__________________________________________________________________________________________
+            
+            (c) Hash(BEGIN(Satoshi[2010]), END(Sunny[2012])) == Videlicet[2017] ++
+            
+            (c) Copyright The Nexus Developers 2014 - 2017
+            
+            Distributed under the MIT software license, see the accompanying
+            file COPYING or http://www.opensource.org/licenses/mit-license.php.
+            
+            "fides in stellis, virtus in numeris" - Faith in the Stars, Power in Numbers
+
+____________________________________________________________________________________________*/
+
+#ifndef NEXUS_LLD_TEMPLATES_CODEC_H
+#define NEXUS_LLD_TEMPLATES_CODEC_H
+
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+#include "../../LLC/types/uint1024.h"
+#include "../../Util/templates/serialize.h"
+
+namespace LLD
+{
+    
+    /** Codec:
+    *
+    * Encodes the keys and values of a sector database. Types without a codec
+    * of their own go through the serializer, appending to the buffer and
+    * reading in place.
+    *
+    * A type that always serializes to the same number of bytes can be given a
+    * fixed width codec, which copies it in and out with no stream. It has to
+    * write the same bytes the serializer does, so records written either way
+    * read back either way.
+    *
+    */
+    template<typename Type, typename Enable = void>
+    struct Codec
+    {
+        static const bool FIXED = false;
+        
+        
+        /* Append the encoding of a value to a buffer. */
+        static void Encode(const Type& value, std::vector<unsigned char>& vData)
+        {
+            CDataWriter ssData(vData, SER_LLD, DATABASE_VERSION);
+            ssData << value;
+        }
+        
+        
+        /* Decode a value from memory. False if it couldn't be. */
+        static bool Decode(const unsigned char* pbegin, const unsigned char* pend, Type& value)
+        {
+            try {
+                CDataView ssData(pbegin, pend, SER_LLD, DATABASE_VERSION);
+                ssData >> value;
+            }
+            catch (std::exception &e) {
+                return false;
+            }
+            
+            return true;
+        }
+    };
+    
+    
+    /** Fixed Codec:
+    *
+    * Base of the codecs of types nSize bytes wide. Derived gives the Write and
+    * Read of the bytes, this sizes the buffer around them.
+    *
+    */
+    template<typename Derived, typename Type, unsigned int nSize>
+    struct FixedCodec
+    {
+        static const bool FIXED = true;
+        static const unsigned int SIZE = nSize;
+        
+        
+        static void Encode(const Type& value, std::vector<unsigned char>& vData)
+        {
+            size_t nOffset = vData.size();
+            vData.resize(nOffset + nSize);
+            
+            Derived::Write(value, &vData[nOffset]);
+        }
+        
+        
+        /* Like the serializer, bytes past the value are left alone. */
+        static bool Decode(const unsigned char* pbegin, const unsigned char* pend, Type& value)
+        {
+            if(pend - pbegin < (std::ptrdiff_t)nSize)
+                return false;
+            
+            Derived::Read(pbegin, value);
+            
+            return true;
+        }
+    };
+    
+    
+    /* Codec of a type serialized as its bytes in memory. */
+    template<typename Type>
+    struct RawCodec : FixedCodec<RawCodec<Type>, Type, sizeof(Type)>
+    {
+        static void Write(const Type& value, unsigned char* pData) { memcpy(pData, &value, sizeof(Type)); }
+        static void Read(const unsigned char* pData, Type& value) { memcpy(&value, pData, sizeof(Type)); }
+    };
+    
+    
+    /* Numbers serialize as their bytes. Not bool, which is read back from any byte. */
+    template<typename Type>
+    struct Codec<Type, typename std::enable_if<std::is_arithmetic<Type>::value && !std::is_same<Type, bool>::value>::type> : RawCodec<Type> { };
+    
+    
+    /* The uint types serialize as their words, which are all they hold. */
+    static_assert(sizeof(uint256) == 32 && sizeof(uint512) == 64 && sizeof(uint576) == 72 && sizeof(uint1024) == 128, "uint types hold more than their words");
+    
+    template<> struct Codec<uint256>  : RawCodec<uint256>  { };
+    template<> struct Codec<uint512>  : RawCodec<uint512>  { };
+    template<> struct Codec<uint576>  : RawCodec<uint576>  { };
+    template<> struct Codec<uint1024> : RawCodec<uint1024> { };
+}
+
+#endif
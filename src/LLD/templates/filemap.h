@@ -14,16 +14,18 @@ ________________________________________________________________________________
 #ifndef NEXUS_LLD_TEMPLATES_FILEMAP_H
 #define NEXUS_LLD_TEMPLATES_FILEMAP_H
 
+#include <deque>
 #include <fstream>
 
 #include "key.h"
 
+#include "../include/filecache.h"
+#include "../include/keyindex.h"
+#include "../../Util/include/runtime.h"
+
 namespace LLD
 {  
     
-    /** Total buckets for memory accessing. */
-    const unsigned int FILEMAP_TOTAL_BUCKETS = 256 * 256;
-    
     /* Maximum size a file can be in the keychain. */
     const unsigned int FILEMAP_MAX_FILE_SIZE = 1024 * 1024; //1 GB per File
 
@@ -57,167 +59,347 @@ namespace LLD
         mutable unsigned short nCurrentFile;
         mutable unsigned int nCurrentFileSize;
         
-        /* Hashmap Custom Hash Using SK. */
-        struct SK_Hashmap
-        {
-            std::size_t operator()(const std::vector<unsigned char>& k) const {
-                return LLC::HASH::SK32(k);
-            }
-        };
+        /* The id of the keychain files in the file handle cache. */
+        unsigned int nFileCacheID;
         
-    public:	
-        /** Map to Contain the Binary Positions of Each Key.
+        /** Index to Contain the Binary Positions of Each Key.
             Used to Quickly Read the Database File at Given Position
             To Obtain the Record from its Database Key. This is Read
             Into Memory on Database Initialization. **/
-        mutable typename std::map< std::vector<unsigned char>, std::pair<unsigned short, unsigned int> > mapKeys[FILEMAP_TOTAL_BUCKETS];
+        mutable KeyIndex indexKeys;
+        
+        
+        /* Whether the snapshot file is current, and the keys appended since it was written. */
+        mutable bool fSnapshot;
+        mutable uint64 nSnapshotKeys;
+        
+        
+        /** The snapshot of the key index. **/
+        std::string SnapshotPath() const { return strBaseLocation + "_keychain.snapshot"; }
+        
+        
+        /** Write the key index to the snapshot, covering the keychain up to the append cursor. **/
+        bool WriteSnapshot() const
+        {
+            Timer timer;
+            timer.Start();
+            
+            if(!indexKeys.Save(SnapshotPath(), nCurrentFile, nCurrentFileSize))
+                return false;
+            
+            fSnapshot     = true;
+            nSnapshotKeys = 0;
+            
+            if(GetArg("-verbose", 0) >= 1)
+                printf(FUNCTION "Snapshot of %" PRIu64 " Keys Written in %" PRIu64 " us\n", __PRETTY_FUNCTION__, indexKeys.Size(), timer.ElapsedMicroseconds());
+            
+            return true;
+        }
         
         
-        /** Caching Memory Map. Keep within caching limits. Pop on and off like a stack
-            using seperate caching class if over limits. **/
-        mutable typename std::map< std::vector<unsigned char>, SectorKey > mapKeysCache[FILEMAP_TOTAL_BUCKETS];
+        /** Read the Sector Header and Key of a keychain record in one Operation. **/
+        bool ReadRecord(unsigned short nFile, unsigned int nOffset, unsigned int nLength, std::vector<unsigned char>& vData) const
+        {
+            vData.resize(15 + nLength);
+            
+            return FileCache().Read(nFileCacheID, nFile, nOffset, &vData[0], vData.size());
+        }
+        
+        
+        /** Check a keychain record on disk holds the key. Used for fingerprint only lookups. **/
+        bool KeyMatches(const std::vector<unsigned char>& vKey, unsigned short nFile, unsigned int nOffset) const
+        {
+            std::vector<unsigned char> vData;
+            if(!ReadRecord(nFile, nOffset, vKey.size(), vData))
+                return false;
+            
+            SectorKey cKey;
+            CDataStream ssHeader(vData, SER_LLD, DATABASE_VERSION);
+            ssHeader >> cKey;
+            
+            return (cKey.nLength == vKey.size() && std::equal(vKey.begin(), vKey.end(), vData.begin() + 15));
+        }
         
+    public:	
         
         /** The Database Constructor. To determine file location and the Bytes per Record. **/
-        BinaryFileMap(std::string strBaseLocationIn) : strBaseLocation(strBaseLocationIn), nCurrentFile(0), nCurrentFileSize(0)
+        BinaryFileMap(std::string strBaseLocationIn) : strBaseLocation(strBaseLocationIn), nCurrentFile(0), nCurrentFileSize(0), nFileCacheID(FileCache().Register(strBaseLocationIn + "_filemap.")), indexKeys(GetBoolArg("-keyfingerprint", false)), fSnapshot(false), nSnapshotKeys(0)
         {
             Initialize();
         }
         
         
-        /** Clean up Memory Usage. **/
-        ~BinaryFileMap() {}
+        /** Clean up Memory Usage. The snapshot is brought up to date on a clean shutdown. **/
+        ~BinaryFileMap()
+        {
+            LOCK(KEY_MUTEX);
+            
+            if(GetBoolArg("-keychainsnapshot", true) && (!fSnapshot || nSnapshotKeys > 0) && indexKeys.Size() > 0)
+                WriteSnapshot();
+            
+            FileCache().Close(nFileCacheID);
+        }
         
         
         /** Return the Keys to the Records Held in the Database. **/
         std::vector< std::vector<unsigned char> > GetKeys()
         {
+            LOCK(KEY_MUTEX);
+            
             std::vector< std::vector<unsigned char> > vKeys;
-            for(int i = 0; i < FILEMAP_TOTAL_BUCKETS; i++)
-                for(typename std::map< std::vector<unsigned char>, std::pair<unsigned short, unsigned int> >::iterator nIterator = mapKeys[i].begin(); nIterator != mapKeys[i].end(); nIterator++ )
-                    vKeys.push_back(nIterator->first);
+            vKeys.reserve(indexKeys.Size());
+            indexKeys.ForEach([this, &vKeys](const unsigned char* pKey, unsigned short nLength, unsigned short nFile, unsigned int nOffset)
+            {
+                if(pKey)
+                {
+                    vKeys.push_back(std::vector<unsigned char>(pKey, pKey + nLength));
+                    
+                    return;
+                }
+                
+                /* Keys are only on disk in fingerprint only mode. */
+                std::vector<unsigned char> vData(15, 0);
+                if(!FileCache().Read(nFileCacheID, nFile, nOffset, &vData[0], vData.size()))
+                    return;
+                
+                SectorKey cKey;
+                CDataStream ssHeader(vData, SER_LLD, DATABASE_VERSION);
+                ssHeader >> cKey;
+                
+                if(ReadRecord(nFile, nOffset, cKey.nLength, vData))
+                    vKeys.push_back(std::vector<unsigned char>(vData.begin() + 15, vData.end()));
+            });
                 
             return vKeys;
         }
         
         
         /** Return Whether a Key Exists in the Database. **/
-        bool HasKey(const std::vector<unsigned char>& vKey) { return mapKeys[GetBucket(vKey)].count(vKey); }
+        bool HasKey(const std::vector<unsigned char>& vKey)
+        {
+            LOCK(KEY_MUTEX);
+            
+            unsigned short nFile;
+            unsigned int nOffset;
+            
+            return indexKeys.Get(vKey, nFile, nOffset, [this, &vKey](unsigned short nFileIn, unsigned int nOffsetIn) { return KeyMatches(vKey, nFileIn, nOffsetIn); });
+        }
         
         
-        /** Handle the Assigning of a Map Bucket. **/
-        unsigned int GetBucket(const std::vector<unsigned char>& vKey) const
+        /** The heap memory held by the key index in bytes. **/
+        uint64 MemoryUsage() const
         {
-            uint64 nBucket = 0;
-            for(int i = 0; i < vKey.size() && i < 8; i++)
-                nBucket += vKey[i] << (8 * i);
+            LOCK(KEY_MUTEX);
             
-            return nBucket % FILEMAP_TOTAL_BUCKETS;
+            return indexKeys.MemoryUsage();
         }
         
         
-        /** Read the Database Keys and File Positions. **/
-        void Initialize()
+        /** Flush the keychain files to non-volatile storage. **/
+        bool Sync()
         {
             LOCK(KEY_MUTEX);
             
-            /* Create directories if they don't exist yet. */
-            if(boost::filesystem::create_directories(strBaseLocation))
-                printf(FUNCTION "Generated Path %s\n", __PRETTY_FUNCTION__, strBaseLocation.c_str());
+            for(unsigned int nFile = 0; nFile <= nCurrentFile; nFile++)
+                if(!FileCache().Sync(nFileCacheID, nFile))
+                    return error(FUNCTION "Failed to Sync Keychain File %u\n", __PRETTY_FUNCTION__, nFile);
+            
+            return true;
+        }
+        
+        
+        /** Parse one keychain file into a partial index.
+         *
+         * @param[in] nFile The keychain file number
+         * @param[in] nStart The offset to start from, records before it are already indexed
+         * @param[in] nSize The size of the keychain file
+         * @param[out] indexPartial The index to add the keys to
+         *
+         * @return The number of keys read
+         *
+         */
+        uint64 LoadFile(unsigned short nFile, uint64 nStart, uint64 nSize, KeyIndex& indexPartial) const
+        {
+            if(nStart >= nSize)
+                return 0;
             
-            /* Stats variable for collective keychain size. */
-            unsigned int nKeychainSize = 0, nTotalKeys = 0;
+            std::vector<unsigned char> vKeychain(nSize - nStart, 0);
+            if(!FileCache().Read(nFileCacheID, nFile, nStart, &vKeychain[0], vKeychain.size()))
+            {
+                error(FUNCTION "Failed to Read Keychain File %u\n", __PRETTY_FUNCTION__, nFile);
+                
+                return 0;
+            }
             
+            if(GetArg("-verbose", 0) >= 2)
+                printf(FUNCTION "Keychain File %u Loading [%" PRIu64 " bytes]...\n", __PRETTY_FUNCTION__, nFile, nSize - nStart);
             
-            /* Iterate through the files detected. */
-            while(true)
+            /* Iterator for Key Sectors. */
+            uint64 nKeys = 0;
+            unsigned int nIterator = 0;
+            while(nIterator + 15 <= vKeychain.size())
             {
-                std::string strFilename = strprintf("%s_filemap.%05u", strBaseLocation.c_str(), nCurrentFile);
-                printf(FUNCTION "Checking File %s\n", __PRETTY_FUNCTION__, strFilename.c_str());
                 
-                /* Get the Filename at given File Position. */
-                std::fstream fIncoming(strFilename.c_str(), std::ios::in | std::ios::binary);
-                if(!fIncoming)
-                {
-                    if(nCurrentFile > 0)
-                        nCurrentFile --;
-                    else
-                    {
-                        std::ofstream fStream(strFilename.c_str(), std::ios::out | std::ios::binary);
-                        fStream.close();
-                    }
-                    
+                /* Read the State and Size of Sector Header. */
+                SectorKey cKey;
+                cKey.DecodeHeader(&vKeychain[nIterator]);
+                if(nIterator + cKey.Size() > vKeychain.size())
                     break;
-                }
-                
-                /* Get the Binary Size. */
-                fIncoming.ignore(std::numeric_limits<std::streamsize>::max());
-                nCurrentFileSize = fIncoming.gcount();
-                nKeychainSize += nCurrentFileSize;
                 
-                printf(FUNCTION "Keychain File %u Loading [%u bytes]...\n", __PRETTY_FUNCTION__, nCurrentFile, nCurrentFileSize);
                 
+                /* Skip Empty Sectors for Now. 
+                    TODO: Handle any sector and keys gracfully here to ensure that the Sector is returned to a valid state from the transaction journal in case there was a failure reading and writing in the sector. This will most likely be held in the sector database code. */
+                if(cKey.Ready())
+                {
+                    const unsigned char* pKey = &vKeychain[nIterator + 15];
+                    indexPartial.Set(pKey, cKey.nLength, nFile, nStart + nIterator, [this, pKey, &cKey](unsigned short nFileIn, unsigned int nOffsetIn) { return KeyMatches(std::vector<unsigned char>(pKey, pKey + cKey.nLength), nFileIn, nOffsetIn); });
+                    
+                    nKeys++;
+                }
                 
-                fIncoming.seekg (0, std::ios::beg);
-                std::vector<unsigned char> vKeychain(nCurrentFileSize, 0);
-                fIncoming.read((char*) &vKeychain[0], vKeychain.size());
-                fIncoming.close();
-                
+                /* Increment the Iterator. */
+                nIterator += cKey.Size();
+            }
+            
+            return nKeys;
+        }
+        
+        
+        /** Load every keychain file in parallel.
+         *
+         * -keychainthreads workers each parse the next file into their own partial
+         * index, which are merged once all files are read.
+         *
+         * @return The number of keys loaded
+         *
+         */
+        uint64 LoadParallel(const std::vector<uint64>& vFileSizes, uint64 nDiscoverTime, Timer& timer)
+        {
+            /* Parse the files in parallel. Workers take the next file until none are left. */
+            unsigned int nThreads = std::max(1, std::min((int)vFileSizes.size(), (int)GetArg("-keychainthreads", std::max(1u, boost::thread::hardware_concurrency()))));
+            
+            std::vector<KeyIndex*> vPartial(nThreads);
+            std::vector<uint64> vKeys(nThreads, 0);
+            std::atomic<unsigned int> nNextFile(0);
+            
+            boost::thread_group workers;
+            for(unsigned int nThread = 0; nThread < nThreads; nThread++)
+            {
+                vPartial[nThread] = new KeyIndex(indexKeys.FingerprintOnly());
+                workers.create_thread([this, nThread, &vPartial, &vKeys, &vFileSizes, &nNextFile]()
+                {
+                    for(unsigned int nFile = nNextFile++; nFile < vFileSizes.size(); nFile = nNextFile++)
+                        vKeys[nThread] += LoadFile(nFile, 0, vFileSizes[nFile], *vPartial[nThread]);
+                });
+            }
+            workers.join_all();
+            
+            uint64 nParseTime = timer.ElapsedMicroseconds();
+            
+            
+            /* Take the largest partial index as it is and merge the others into it. */
+            uint64 nTotalKeys = 0;
+            unsigned int nLargest = 0;
+            for(unsigned int nThread = 0; nThread < nThreads; nThread++)
+            {
+                nTotalKeys += vKeys[nThread];
+                if(vKeys[nThread] > vKeys[nLargest])
+                    nLargest = nThread;
+            }
+            
+            std::swap(indexKeys, *vPartial[nLargest]);
+            indexKeys.Reserve(nTotalKeys);
+            for(unsigned int nThread = 0; nThread < nThreads; nThread++)
+            {
+                if(nThread != nLargest)
+                    indexKeys.Merge(*vPartial[nThread]);
                 
-                /* Iterator for Key Sectors. */
-                unsigned int nIterator = 0;
-                while(nIterator < nCurrentFileSize)
+                delete vPartial[nThread];
+            }
+            indexKeys.Shrink();
+            
+            uint64 nMergeTime = timer.ElapsedMicroseconds();
+            printf(FUNCTION "Load Time: Discover %" PRIu64 " us | Parse %" PRIu64 " us (%u Threads) | Merge %" PRIu64 " us | Total %" PRIu64 " us\n", __PRETTY_FUNCTION__, nDiscoverTime, nParseTime - nDiscoverTime, nThreads, nMergeTime - nParseTime, nMergeTime);
+            
+            return nTotalKeys;
+        }
+        
+        
+        /** Read the Database Keys and File Positions.
+         
+            The key index is loaded from the snapshot if there is one, replaying only
+            the keychain written after it. Otherwise every keychain file is parsed. **/
+        void Initialize()
+        {
+            LOCK(KEY_MUTEX);
+            
+            /* Create directories if they don't exist yet. */
+            if(boost::filesystem::create_directories(strBaseLocation))
+                printf(FUNCTION "Generated Path %s\n", __PRETTY_FUNCTION__, strBaseLocation.c_str());
+            
+            Timer timer;
+            timer.Start();
+            
+            
+            /* Find the keychain files and their sizes. */
+            std::vector<uint64> vFileSizes;
+            uint64 nSize = 0, nKeychainSize = 0;
+            while(FileCache().Size(nFileCacheID, vFileSizes.size(), nSize))
+            {
+                vFileSizes.push_back(nSize);
+                nKeychainSize += nSize;
+            }
+            
+            if(vFileSizes.empty())
+            {
+                FileCache().Write(nFileCacheID, 0, 0, NULL, 0);
+                vFileSizes.push_back(0);
+            }
+            
+            nCurrentFile     = vFileSizes.size() - 1;
+            nCurrentFileSize = vFileSizes.back();
+            FileCache().Reserve(nFileCacheID, nCurrentFile + 1);
+            
+            uint64 nDiscoverTime = timer.ElapsedMicroseconds();
+            
+            
+            /* Load the snapshot and replay the keychain written after it. */
+            uint64 nTotalKeys = 0, nCursorFile = 0, nCursorOffset = 0;
+            if(GetBoolArg("-keychainsnapshot", true) && indexKeys.Load(SnapshotPath(), nCursorFile, nCursorOffset))
+            {
+                if(nCursorFile < vFileSizes.size() && nCursorOffset <= vFileSizes[nCursorFile])
                 {
+                    fSnapshot = true;
                     
-                    /* Get Binary Data */
-                    std::vector<unsigned char> vKey(vKeychain.begin() + nIterator, vKeychain.begin() + nIterator + 15);
-                    
+                    uint64 nSnapshotTime = timer.ElapsedMicroseconds(), nReplayed = 0;
+                    for(uint64 nFile = nCursorFile; nFile < vFileSizes.size(); nFile++)
+                        nReplayed += LoadFile(nFile, nFile == nCursorFile ? nCursorOffset : 0, vFileSizes[nFile], indexKeys);
                     
-                    /* Read the State and Size of Sector Header. */
-                    SectorKey cKey;
-                    CDataStream ssKey(vKey, SER_LLD, DATABASE_VERSION);
-                    ssKey >> cKey;
+                    nTotalKeys = indexKeys.Size();
+                    nSnapshotKeys = nReplayed;
                     
-
-                    /* Skip Empty Sectors for Now. 
-                        TODO: Handle any sector and keys gracfully here to ensure that the Sector is returned to a valid state from the transaction journal in case there was a failure reading and writing in the sector. This will most likely be held in the sector database code. */
-                    if(cKey.Ready())
-                    {
-                    
-                        /* Read the Key Data. */
-                        std::vector<unsigned char> vKey(vKeychain.begin() + nIterator + 15, vKeychain.begin() + nIterator + 15 + cKey.nLength);
-                        
-                        /* Set the Key Data. */
-                        unsigned int nBucket = GetBucket(vKey);
-                        mapKeys[nBucket][vKey] = std::make_pair(nCurrentFile, nIterator);
-                        //mapKeysCache[nBucket][vKey] = cKey;
-                        
-                        /* Debug Output of Sector Key Information. */
-                        if(GetArg("-verbose", 0) >= 5)
-                            printf(FUNCTION "State: %u Length: %u File: %u Location: %u Key: %s\n", __PRETTY_FUNCTION__, cKey.nState, cKey.nLength, mapKeys[nBucket][vKey].first, mapKeys[nBucket][vKey].second, HexStr(vKey.begin(), vKey.end()).c_str());
-                    
-                        nTotalKeys++;
-                    }
-                    else 
-                    {
-                        
-                        /* Debug Output of Sector Key Information. */
-                        if(GetArg("-verbose", 0) >= 5)
-                            printf(FUNCTION "Skipping Sector State: %u Length: %u\n", __PRETTY_FUNCTION__, cKey.nState, cKey.nLength);
-                    }
+                    uint64 nReplayTime = timer.ElapsedMicroseconds();
+                    printf(FUNCTION "Load Time: Discover %" PRIu64 " us | Snapshot %" PRIu64 " us (%" PRIu64 " Keys) | Replay %" PRIu64 " us (%" PRIu64 " Keys) | Total %" PRIu64 " us\n", __PRETTY_FUNCTION__, nDiscoverTime, nSnapshotTime - nDiscoverTime, nTotalKeys - nReplayed, nReplayTime - nSnapshotTime, nReplayed, nReplayTime);
+                }
+                else
+                {
+                    error(FUNCTION "Snapshot is Past the End of the Keychain, Loading the Full Keychain\n", __PRETTY_FUNCTION__);
                     
-                    /* Increment the Iterator. */
-                    nIterator += cKey.Size();
+                    indexKeys = KeyIndex(indexKeys.FingerprintOnly());
                 }
+            }
+            
+            if(!fSnapshot)
+            {
+                nTotalKeys = LoadParallel(vFileSizes, nDiscoverTime, timer);
                 
-                /* Iterate the current file. */
-                nCurrentFile++;
-                
-                /* Clear the keychain data. */
-                vKeychain.clear();
+                /* Snapshot a full load straight away so the next start doesn't repeat it. */
+                if(nTotalKeys > 0)
+                    WriteSnapshot();
             }
             
-            printf(FUNCTION "Initialized with %u Keys | Total Size %u | Total Files %u | Current Size %u\n", __PRETTY_FUNCTION__, nTotalKeys, nKeychainSize, nCurrentFile + 1, nCurrentFileSize);
+            printf(FUNCTION "Initialized with %" PRIu64 " Keys | Total Size %" PRIu64 " | Total Files %u | Current Size %u\n", __PRETTY_FUNCTION__, nTotalKeys, nKeychainSize, nCurrentFile + 1, nCurrentFileSize);
+            printf(FUNCTION "Key Index Memory %" PRIu64 " bytes | %.1f bytes/key | Fingerprint Only: %s\n", __PRETTY_FUNCTION__, indexKeys.MemoryUsage(), nTotalKeys > 0 ? indexKeys.MemoryUsage() / (double)nTotalKeys : 0.0, indexKeys.FingerprintOnly() ? "Yes" : "No");
         }
         
         /** Add / Update A Record in the Database **/
@@ -226,8 +408,10 @@ namespace LLD
             LOCK(KEY_MUTEX);
             
             /* Write Header if First Update. */
-            unsigned int nBucket = GetBucket(cKey.vKey);
-            if(!mapKeys[nBucket].count(cKey.vKey))
+            unsigned short nFile;
+            unsigned int nOffset;
+            bool fAppend = !indexKeys.Get(cKey.vKey, nFile, nOffset, [this, &cKey](unsigned short nFileIn, unsigned int nOffsetIn) { return KeyMatches(cKey.vKey, nFileIn, nOffsetIn); });
+            if(fAppend)
             {
                 /* Check the Binary File Size. */
                 if(nCurrentFileSize > FILEMAP_MAX_FILE_SIZE)
@@ -240,20 +424,15 @@ namespace LLD
                     
                     std::ofstream fStream(strprintf("%s_filemap.%05u", strBaseLocation.c_str(), nCurrentFile).c_str(), std::ios::out | std::ios::binary);
                     fStream.close();
+                    
+                    FileCache().Reserve(nFileCacheID, nCurrentFile + 1);
                 }
                 
-                mapKeys[nBucket][cKey.vKey] = std::make_pair(nCurrentFile, nCurrentFileSize);
+                nFile   = nCurrentFile;
+                nOffset = nCurrentFileSize;
             }
             
             
-            /* Establish the Outgoing Stream. */
-            std::fstream fStream(strprintf("%s_filemap.%05u", strBaseLocation.c_str(), mapKeys[nBucket][cKey.vKey].first).c_str(), std::ios::in | std::ios::out | std::ios::binary);
-            
-            
-            /* Seek File Pointer */
-            fStream.seekp(mapKeys[nBucket][cKey.vKey].second, std::ios::beg);
-                
-            
             /* Handle the Sector Key Serialization. */
             CDataStream ssKey(SER_LLD, DATABASE_VERSION);
             ssKey.reserve(cKey.Size());
@@ -263,108 +442,189 @@ namespace LLD
             /* Write to Disk. */
             std::vector<unsigned char> vData(ssKey.begin(), ssKey.end());
             vData.insert(vData.end(), cKey.vKey.begin(), cKey.vKey.end());
-            fStream.write((char*) &vData[0], vData.size());
+            if(!FileCache().Write(nFileCacheID, nFile, nOffset, &vData[0], vData.size()))
+                return error(FUNCTION "Failed to Write Key to Keychain File %u\n", __PRETTY_FUNCTION__, nFile);
             
-            /* Increment current File Size. */
-            nCurrentFileSize += cKey.Size();
+            /* Index the new Key and Increment current File Size. Updates are written in place. */
+            if(fAppend)
+            {
+                indexKeys.Set(cKey.vKey, nFile, nOffset, [](unsigned short, unsigned int) { return false; });
+                nCurrentFileSize += cKey.Size();
+                
+                /* Keep the keychain replayed on startup short. */
+                if(++nSnapshotKeys >= (uint64)GetArg("-snapshotinterval", 1000000) && GetBoolArg("-keychainsnapshot", true))
+                    WriteSnapshot();
+            }
             
             
             /* Debug Output of Sector Key Information. */
             if(GetArg("-verbose", 0) >= 4)
-                printf(FUNCTION "State: %s | Length: %u | Location: %u | File: %u | Sector File: %u | Sector Size: %u | Sector Start: %u | Key: %s | Current File: %u | Current File Size: %u\n", __PRETTY_FUNCTION__, cKey.nState == READY ? "Valid" : "Invalid", cKey.nLength, mapKeys[nBucket][cKey.vKey].second, mapKeys[nBucket][cKey.vKey].first, cKey.nSectorFile, cKey.nSectorSize, cKey.nSectorStart, HexStr(cKey.vKey.begin(), cKey.vKey.end()).c_str(), nCurrentFile, nCurrentFileSize);
+                printf(FUNCTION "State: %s | Length: %u | Location: %u | File: %u | Sector File: %u | Sector Size: %u | Sector Start: %u | Key: %s | Current File: %u | Current File Size: %u\n", __PRETTY_FUNCTION__, cKey.nState == READY ? "Valid" : "Invalid", cKey.nLength, nOffset, nFile, cKey.nSectorFile, cKey.nSectorSize, cKey.nSectorStart, HexStr(cKey.vKey.begin(), cKey.vKey.end()).c_str(), nCurrentFile, nCurrentFileSize);
             
             
             return true;
         }
         
-        /** Simple Erase for now, not efficient in Data Usage of HD but quick to get erase function working. **/
-        bool Erase(const std::vector<unsigned char> vKey)
+        /** Add / Update a Batch of Records in the Database.
+         *
+         * New keys are laid out together and appended with one write per keychain file,
+         * existing keys are overwritten in place. Each key must appear once in the batch.
+         *
+         * @param[in] vKeys The Sector Keys to write
+         *
+         * @return True if every key was written
+         *
+         **/
+        bool Put(const std::vector<SectorKey>& vKeys) const
         {
             LOCK(KEY_MUTEX);
             
-            /* Check for the Key. */
-            unsigned int nBucket = GetBucket(vKey);
-            if(!mapKeys[nBucket].count(vKey))
-                return error(FUNCTION "Key doesn't Exist", __PRETTY_FUNCTION__);
+            std::vector<unsigned char> vAppend;
+            std::vector< std::pair<const SectorKey*, unsigned int> > vIndex;
+            unsigned int nAppendStart = nCurrentFileSize;
             
+            /* Overwrites go to the I/O backend together once the keys are laid out. */
+            std::deque< std::vector<unsigned char> > vOverwrites;
+            std::vector<IORequest> vRequests;
+            for(const SectorKey& cKey : vKeys)
+            {
+                /* Handle the Sector Key Serialization. */
+                CDataStream ssKey(SER_LLD, DATABASE_VERSION);
+                ssKey.reserve(cKey.Size());
+                ssKey << cKey;
+                
+                std::vector<unsigned char> vData(ssKey.begin(), ssKey.end());
+                vData.insert(vData.end(), cKey.vKey.begin(), cKey.vKey.end());
+                
+                /* Overwrite the Sector Key in place if it exists. */
+                unsigned short nFile;
+                unsigned int nOffset;
+                if(indexKeys.Get(cKey.vKey, nFile, nOffset, [this, &cKey](unsigned short nFileIn, unsigned int nOffsetIn) { return KeyMatches(cKey.vKey, nFileIn, nOffsetIn); }))
+                {
+                    vOverwrites.push_back(vData);
+                    vRequests.push_back(IORequest(nFile, nOffset, &vOverwrites.back()[0], vData.size(), true));
+                    
+                    continue;
+                }
+                
+                /* Write out the appends so far before moving to a new file. */
+                if(nCurrentFileSize > FILEMAP_MAX_FILE_SIZE)
+                {
+                    if(vAppend.size() > 0 && !FileCache().Write(nFileCacheID, nCurrentFile, nAppendStart, &vAppend[0], vAppend.size()))
+                        return error(FUNCTION "Failed to Write Keys to Keychain File %u\n", __PRETTY_FUNCTION__, nCurrentFile);
+                    
+                    for(auto item : vIndex)
+                        indexKeys.Set(item.first->vKey, nCurrentFile, item.second, [](unsigned short, unsigned int) { return false; });
+                    
+                    nSnapshotKeys += vIndex.size();
+                    
+                    nCurrentFile ++;
+                    nCurrentFileSize = 0;
+                    nAppendStart     = 0;
+                    vAppend.clear();
+                    vIndex.clear();
+                    
+                    FileCache().Write(nFileCacheID, nCurrentFile, 0, NULL, 0);
+                    FileCache().Reserve(nFileCacheID, nCurrentFile + 1);
+                }
+                
+                vIndex.push_back(std::make_pair(&cKey, nCurrentFileSize));
+                vAppend.insert(vAppend.end(), vData.begin(), vData.end());
+                nCurrentFileSize += vData.size();
+            }
             
-            /* Establish the Outgoing Stream. */
-            std::string strFilename = strprintf("%s_filemap.%05u", strBaseLocation.c_str(), mapKeys[nBucket][vKey].first);
-            std::fstream fStream(strFilename.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+            if(!vRequests.empty() && !FileCache().Submit(nFileCacheID, vRequests))
+                return error(FUNCTION "Failed to Overwrite %u Keys in the Keychain\n", __PRETTY_FUNCTION__, (unsigned int)vRequests.size());
             
+            /* Append the new keys in one operation, then index them. */
+            if(vAppend.size() > 0 && !FileCache().Write(nFileCacheID, nCurrentFile, nAppendStart, &vAppend[0], vAppend.size()))
+                return error(FUNCTION "Failed to Write Keys to Keychain File %u\n", __PRETTY_FUNCTION__, nCurrentFile);
             
-            /* Set to put at the right file and sector position. */
-            fStream.seekp(mapKeys[nBucket][vKey].second, std::ios::beg);
+            for(auto item : vIndex)
+                indexKeys.Set(item.first->vKey, nCurrentFile, item.second, [](unsigned short, unsigned int) { return false; });
+            
+            /* Keep the keychain replayed on startup short. */
+            nSnapshotKeys += vIndex.size();
+            if(nSnapshotKeys >= (uint64)GetArg("-snapshotinterval", 1000000) && GetBoolArg("-keychainsnapshot", true))
+                WriteSnapshot();
+            
+            return true;
+        }
+        
+        
+        /** Simple Erase for now, not efficient in Data Usage of HD but quick to get erase function working. **/
+        bool Erase(const std::vector<unsigned char> vKey)
+        {
+            LOCK(KEY_MUTEX);
+            
+            /* Check for the Key. */
+            unsigned short nFile;
+            unsigned int nOffset;
+            auto fnVerify = [this, &vKey](unsigned short nFileIn, unsigned int nOffsetIn) { return KeyMatches(vKey, nFileIn, nOffsetIn); };
+            if(!indexKeys.Get(vKey, nFile, nOffset, fnVerify))
+                return error(FUNCTION "Key doesn't Exist", __PRETTY_FUNCTION__);
             
             
             /* Establish the Sector State as Empty. */
-            std::vector<unsigned char> vData(1, EMPTY);
-            fStream.write((char*) &vData[0], vData.size());
+            unsigned char nState = EMPTY;
+            if(!FileCache().Write(nFileCacheID, nFile, nOffset, &nState, 1))
+                return error(FUNCTION "Failed to Erase Key from Keychain File %u\n", __PRETTY_FUNCTION__, nFile);
                 
             
-            /* Remove the Sector Key from the Memory Map. */
-            mapKeys[nBucket].erase(vKey);
+            /* Remove the Sector Key from the Memory Index. The record is already empty on disk so match on location. */
+            indexKeys.Erase(vKey, [nFile, nOffset](unsigned short nFileIn, unsigned int nOffsetIn) { return nFileIn == nFile && nOffsetIn == nOffset; });
+            
+            
+            /* Replaying the keychain can't remove keys from a snapshot, so it's dropped until the next one is written. */
+            if(fSnapshot)
+            {
+                boost::filesystem::remove(SnapshotPath());
+                fSnapshot = false;
+            }
             
             
             return true;
         }
         
         /** Get a Record from the Database with Given Key. **/
-        bool Get(const std::vector<unsigned char> vKey, SectorKey& cKey)
+        bool Get(const std::vector<unsigned char>& vKey, SectorKey& cKey)
         {
             LOCK(KEY_MUTEX);
 
             
-            /* Check the Memory Cache. */
-            unsigned int nBucket = GetBucket(vKey);
-            if(mapKeysCache[nBucket].count(vKey)) {
-                cKey = mapKeysCache[nBucket][vKey];
-
-                return true;
-            }
-            
-            
-            /* Read a Record from Binary Data. */
-            if(mapKeys[nBucket].count(vKey))
+            /* Find the Key in the Index. In fingerprint only mode the verify read is kept for below.
+                The record is read into a buffer this thread reuses. */
+            unsigned short nFile;
+            unsigned int nOffset;
+            static thread_local std::vector<unsigned char> vData;
+            vData.clear();
+            if(indexKeys.Get(vKey, nFile, nOffset, [this, &vKey](unsigned short nFileIn, unsigned int nOffsetIn) { return ReadRecord(nFileIn, nOffsetIn, vKey.size(), vData) && std::equal(vKey.begin(), vKey.end(), vData.begin() + 15); }))
             {
                 
-                /* Open the Stream Object. */
-                std::string strFilename = strprintf("%s_filemap.%05u", strBaseLocation.c_str(), mapKeys[nBucket][vKey].first);
-                std::ifstream fStream(strFilename.c_str(), std::ios::in | std::ios::binary);
-
-                
-                /* Seek to the Sector Position on Disk. */
-                fStream.seekg(mapKeys[nBucket][vKey].second, std::ios::beg);
-            
-                
-                /* Read the State and Size of Sector Header. */
-                std::vector<unsigned char> vData(15, 0);
-                fStream.read((char*) &vData[0], 15);
+                /* Read the Sector Header and Key in one Operation. */
+                if(vData.empty() && !ReadRecord(nFile, nOffset, vKey.size(), vData))
+                    return error(FUNCTION "Failed to Read Key from Keychain File %u\n", __PRETTY_FUNCTION__, nFile);
                 
                 
                 /* De-serialize the Header. */
-                CDataStream ssHeader(vData, SER_LLD, DATABASE_VERSION);
+                CDataView ssHeader(vData, SER_LLD, DATABASE_VERSION);
                 ssHeader >> cKey;
                 
                 
                 /* Debug Output of Sector Key Information. */
                 if(GetArg("-verbose", 0) >= 4)
-                    printf(FUNCTION "State: %s | Length: %u | Location: %u | File: %u | Sector File: %u | Sector Size: %u | Sector Start: %u | Key: %s\n", __PRETTY_FUNCTION__, cKey.nState == READY ? "Valid" : "Invalid", cKey.nLength, mapKeys[nBucket][vKey].second, mapKeys[nBucket][vKey].first, cKey.nSectorFile, cKey.nSectorSize, cKey.nSectorStart, HexStr(cKey.vKey.begin(), cKey.vKey.end()).c_str());
+                    printf(FUNCTION "State: %s | Length: %u | Location: %u | File: %u | Sector File: %u | Sector Size: %u | Sector Start: %u | Key: %s\n", __PRETTY_FUNCTION__, cKey.nState == READY ? "Valid" : "Invalid", cKey.nLength, nOffset, nFile, cKey.nSectorFile, cKey.nSectorSize, cKey.nSectorStart, HexStr(cKey.vKey.begin(), cKey.vKey.end()).c_str());
                         
                 
                 /* Skip Empty Sectors for Now. (TODO: Expand to Reads / Writes) */
                 if(cKey.Ready() || cKey.IsTxn()) {
                 
-                    /* Read the Key Data. */
-                    std::vector<unsigned char> vKeyIn(cKey.nLength, 0);
-                    fStream.read((char*) &vKeyIn[0], vKeyIn.size());
-                    
                     /* Check the Keys Match Properly. */
-                    if(vKeyIn != vKey)
-                        return error(FUNCTION "Key Mistmatch: DB:: %s MEM %s\n", __PRETTY_FUNCTION__, HexStr(vKeyIn.begin(), vKeyIn.end()).c_str(), HexStr(vKey.begin(), vKey.end()).c_str());
+                    if(!std::equal(vKey.begin(), vKey.end(), vData.begin() + 15))
+                        return error(FUNCTION "Key Mistmatch: DB:: %s MEM %s\n", __PRETTY_FUNCTION__, HexStr(vData.begin() + 15, vData.end()).c_str(), HexStr(vKey.begin(), vKey.end()).c_str());
                     
                     /* Assign Key to Sector. */
-                    cKey.vKey = vKeyIn;
+                    cKey.vKey = vKey;
                     
                     return true;
                 }
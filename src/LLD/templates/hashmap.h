@@ -1,5 +1,5 @@
 /*__________________________________________________________________________________________
-
+            
             (c) Hash(BEGIN(Satoshi[2010]), END(Sunny[2012])) == Videlicet[2017] ++
             
             (c) Copyright The Nexus Developers 2014 - 2017
@@ -18,20 +18,87 @@ ________________________________________________________________________________
 
 #include "key.h"
 
+#include "../include/filecache.h"
+#include "../include/keyhash.h"
+#include "../../Util/include/runtime.h"
+
 namespace LLD
 {
     
-    /** The Maximum buckets allowed in the hashmap. */
-    const unsigned int HASHMAP_TOTAL_BUCKETS = 256 * 256;
+    /** The size of a page in the hashmap index. A key lookup reads one page. **/
+    const unsigned int HASHMAP_PAGE_SIZE = 4096;
+    
+    
+    /** The number of fixed width slots in each index page. **/
+    const unsigned int HASHMAP_PAGE_SLOTS = HASHMAP_PAGE_SIZE / 16;
+    
+    
+    /** The number of pages in a newly created index. **/
+    const unsigned int HASHMAP_INITIAL_PAGES = 256;
+    
+    
+    /** The load factor (percent of slots used) that triggers doubling of the index. **/
+    const unsigned int HASHMAP_MAX_LOAD = 70;
+    
     
+    /** Maximum size a file can be in the keychain. **/
+    const unsigned int HASHMAP_MAX_FILE_SIZE = 256 * 1024 * 1024; //256 MB per File
     
-    /** The Maximum cache size for allocated keys. **/
-    const unsigned int HASHMAP_MAX_CACHE_SZIE = 1024 * 1024; //1 MB
+    
+    /** Index file identification. **/
+    const unsigned int HASHMAP_INDEX_MAGIC   = 0x48444c4c; //LLDH
+    const unsigned int HASHMAP_INDEX_VERSION = 2;
+    
+    
+    /** States of a Slot in the Index. **/
+    enum
+    {
+        SLOT_EMPTY    = 0,
+        SLOT_OCCUPIED = 1,
+        SLOT_DELETED  = 2
+    };
+    
+    
+    /** Fixed Width Index Slot.
+        
+        Holds the full 64 bit hash of the key as a fingerprint, so the
+        index can be doubled without reading any keys back from disk,
+        plus the location of the Sector Key in the keychain files. **/
+    struct HashmapSlot
+    {
+        uint64         nFingerprint;
+        unsigned int   nOffset;
+        unsigned short nFile;
+        unsigned short nState;
+    };
     
     
-    /** Base Key Database Class.
-        Stores and Contains the Sector Keys to Access the
-        Sector Database.
+    /** Index Header, stored in the first page of the index file. **/
+    struct HashmapHeader
+    {
+        unsigned int nMagic;
+        unsigned int nVersion;
+        unsigned int nPages;
+        unsigned int nMaxLoad;
+        uint64       nEntries;
+        unsigned int fClean;
+        unsigned int nReserved;
+    };
+    
+    
+    /** Binary Hash Map Keychain.
+        
+        Stores and Contains the Sector Keys to Access the Sector Database.
+        
+        Sector Keys are appended to the _hashmap.%05u keychain files. They are
+        located through an on disk hash table in _hashindex.%05u: a header page
+        followed by pages of fixed width slots. A key hashes to a home page and
+        a starting slot, and is probed linearly through the page (spilling into
+        the next page only if the page is full), so a lookup reads one index page
+        and the matching Sector Key.
+        
+        When the load factor passes the threshold the index is rebuilt at twice
+        the pages into the next generation file, using the stored fingerprints.
     **/
     class BinaryHashMap
     {
@@ -40,114 +107,451 @@ namespace LLD
         mutable Mutex_t KEY_MUTEX;
         
         
-        /** The String to hold the Disk Location of Database File. 
+        /** The String to hold the Disk Location of Database File.
             Each Database File Acts as a New Table as in Conventional Design.
             Key can be any Type, which is how the Database Records are Accessed. **/
         std::string strBaseLocation;
         
-        /** Caching Flag
-            TODO: Expand the Caching System. **/
-        bool fMemoryCaching = false;
         
-        /** Caching Size.
-            TODO: Make this a variable actually enforced. **/
-        unsigned int nCacheSize = 0;
+        /** The ids of the keychain and index files in the file handle cache. **/
+        unsigned int nKeychainID;
+        unsigned int nIndexID;
         
         
-        /** Cache of records searched with find. **/
-        mutable std::map<std::vector<unsigned char>, unsigned int> mapBinaryIterators;
+        /** The generation (file number) of the current index. **/
+        unsigned int nGeneration;
         
-    public:	
         
-        /** The Database Constructor. To determine file location and the Bytes per Record. **/
-        BinaryHashMap(std::string strBaseLocationIn) : strBaseLocation(strBaseLocationIn)
+        /** The header of the current index. **/
+        HashmapHeader header;
+        
+        
+        /** Flag to know if the on disk header has been marked as in use. **/
+        bool fDirty;
+        
+        
+        /** The current keychain file being appended to. **/
+        unsigned short nCurrentFile;
+        unsigned int   nCurrentFileSize;
+        
+        
+        /** The home page and starting slot of a fingerprint. **/
+        unsigned int HomePage(uint64 nFingerprint, unsigned int nPages) const { return nFingerprint % nPages; }
+        unsigned int HomeSlot(uint64 nFingerprint) const { return (nFingerprint >> 40) % HASHMAP_PAGE_SLOTS; }
+        
+        
+        /** Read / Write pages and slots of an index generation. Page 0 is the header. **/
+        bool ReadPage(unsigned int nGen, unsigned int nPage, HashmapSlot* pSlots) const
         {
-            Initialize();
+            return FileCache().Read(nIndexID, nGen, (uint64)(nPage + 1) * HASHMAP_PAGE_SIZE, pSlots, HASHMAP_PAGE_SIZE);
         }
         
+        bool WritePage(unsigned int nGen, unsigned int nPage, const HashmapSlot* pSlots) const
+        {
+            return FileCache().Write(nIndexID, nGen, (uint64)(nPage + 1) * HASHMAP_PAGE_SIZE, pSlots, HASHMAP_PAGE_SIZE);
+        }
         
-        /** Clean up Memory Usage. **/
-        ~BinaryHashMap() { }
+        bool WriteSlot(unsigned int nGen, unsigned int nPage, unsigned int nSlot, const HashmapSlot& slot) const
+        {
+            return FileCache().Write(nIndexID, nGen, (uint64)(nPage + 1) * HASHMAP_PAGE_SIZE + nSlot * sizeof(HashmapSlot), &slot, sizeof(HashmapSlot));
+        }
         
         
-        /** Return the Keys to the Records Held in the Database. **/
-        std::vector< std::vector<unsigned char> > GetKeys()
+        /** Write the Header of the current index. **/
+        bool WriteHeader(bool fClean)
         {
-            std::vector< std::vector<unsigned char> > vKeys;
-            //TODO: FINISH
-            return vKeys;
+            header.fClean = fClean ? 1 : 0;
+            
+            return FileCache().Write(nIndexID, nGeneration, 0, &header, sizeof(header));
         }
         
         
-        /** Return Whether a Key Exists in the Database. **/
-        bool HasKey(const std::vector<unsigned char>& vKey)
+        /** Read a Sector Key from the keychain and check it belongs to the key. **/
+        bool ReadKey(const HashmapSlot& slot, const std::vector<unsigned char>& vKey, SectorKey& cKey) const
         {
-            return false;
+            /* Read the Sector Header and Key in one Operation, into a buffer this thread reuses. */
+            static thread_local std::vector<unsigned char> vData;
+            vData.resize(15 + vKey.size());
+            if(!FileCache().Read(nKeychainID, slot.nFile, slot.nOffset, &vData[0], vData.size()))
+                return false;
             
-            if(mapBinaryIterators.count(vKey))
-                return true;
-                
-            /* Get the assigned bucket for the hashmap. */
-            unsigned int nBucket = GetBucket(vKey);
+            /* De-serialize the Header. */
+            CDataView ssHeader(vData, SER_LLD, DATABASE_VERSION);
+            ssHeader >> cKey;
             
-            /* Establish the Stream File for Keychain Bucket. */
-            std::fstream ssFile(strprintf("%s_hashmap.%05u", strBaseLocation.c_str(), nBucket).c_str(), std::ios::in | std::ios::binary);
-            if(!ssFile)
+            if(cKey.nLength != vKey.size() || !std::equal(vKey.begin(), vKey.end(), vData.begin() + 15))
                 return false;
             
+            cKey.vKey = vKey;
             
-            /* Read the Bucket File. */
-            ssFile.ignore(std::numeric_limits<std::streamsize>::max());
-            ssFile.seekg (0, std::ios::beg);
-            std::vector<unsigned char> vBucket(ssFile.gcount(), 0);
-            ssFile.read((char*) &vBucket[0], vBucket.size());
-            ssFile.close();
-                        
-                        
-            /* Iterator for Key Sectors. */
-            unsigned int nIterator = 0;
-            while(nIterator < vBucket.size())
+            return true;
+        }
+        
+        
+        /** Probe the index for a key.
+            
+            @param[in] vKey The binary key
+            @param[in] nFingerprint The hash of the key
+            @param[out] nPage, nSlot The position of the key if found, else the first free slot of the probe
+            @param[out] slot The slot of the key if found
+            
+            @return True if the key was found. **/
+        bool Probe(const std::vector<unsigned char>& vKey, uint64 nFingerprint, unsigned int& nPage, unsigned int& nSlot, HashmapSlot& slot) const
+        {
+            HashmapSlot vSlots[HASHMAP_PAGE_SLOTS];
+            
+            bool fFree = false;
+            unsigned int nHome = HomePage(nFingerprint, header.nPages), nStart = HomeSlot(nFingerprint);
+            for(unsigned int nPageProbe = 0; nPageProbe < header.nPages; nPageProbe++)
             {
-                            
-                /* Get Binary Data */
-                std::vector<unsigned char> vData(vBucket.begin() + nIterator, vBucket.begin() + nIterator + 15);
-                            
-                            
-                /* Read the State and Size of Sector Header. */
-                SectorKey cKey;
-                CDataStream ssKey(vData, SER_LLD, DATABASE_VERSION);
-                ssKey >> cKey;
-                            
-                if(cKey.Ready())
+                unsigned int nCurrentPage = (nHome + nPageProbe) % header.nPages;
+                if(!ReadPage(nGeneration, nCurrentPage, vSlots))
+                    return false;
+                
+                for(unsigned int nSlotProbe = 0; nSlotProbe < HASHMAP_PAGE_SLOTS; nSlotProbe++)
                 {
-                            
-                    /* Read the Key Data. */
-                    std::vector<unsigned char> vKeyIn(vBucket.begin() + nIterator + 15, vBucket.begin() + nIterator + 15 + cKey.nLength);
-                                
-                    /* Found the Binary Position. */
-                    if(vKeyIn == vKey)
+                    unsigned int nCurrentSlot = (nStart + nSlotProbe) % HASHMAP_PAGE_SLOTS;
+                    const HashmapSlot& current = vSlots[nCurrentSlot];
+                    
+                    /* An empty slot ends the probe sequence. */
+                    if(current.nState == SLOT_EMPTY)
                     {
-                        mapBinaryIterators[vKey] = nIterator;
+                        if(!fFree)
+                        {
+                            nPage = nCurrentPage;
+                            nSlot = nCurrentSlot;
+                        }
+                        
+                        return false;
+                    }
+                    
+                    /* Remember the first tombstone for re-use. */
+                    if(current.nState == SLOT_DELETED)
+                    {
+                        if(!fFree)
+                        {
+                            fFree = true;
+                            nPage = nCurrentPage;
+                            nSlot = nCurrentSlot;
+                        }
+                        
+                        continue;
+                    }
+                    
+                    /* Check the key on disk only when the fingerprint matches. */
+                    SectorKey cKey;
+                    if(current.nFingerprint == nFingerprint && ReadKey(current, vKey, cKey))
+                    {
+                        nPage = nCurrentPage;
+                        nSlot = nCurrentSlot;
+                        slot  = current;
                         
                         return true;
                     }
                 }
+            }
+            
+            return false;
+        }
+        
+        
+        /** Place a slot at the first empty position of its probe sequence in an index generation. **/
+        bool Place(unsigned int nGen, unsigned int nPages, const HashmapSlot& slot) const
+        {
+            HashmapSlot vSlots[HASHMAP_PAGE_SLOTS];
+            
+            unsigned int nHome = HomePage(slot.nFingerprint, nPages), nStart = HomeSlot(slot.nFingerprint);
+            for(unsigned int nPageProbe = 0; nPageProbe < nPages; nPageProbe++)
+            {
+                unsigned int nCurrentPage = (nHome + nPageProbe) % nPages;
+                if(!ReadPage(nGen, nCurrentPage, vSlots))
+                    return false;
+                
+                for(unsigned int nSlotProbe = 0; nSlotProbe < HASHMAP_PAGE_SLOTS; nSlotProbe++)
+                {
+                    unsigned int nCurrentSlot = (nStart + nSlotProbe) % HASHMAP_PAGE_SLOTS;
+                    if(vSlots[nCurrentSlot].nState != SLOT_OCCUPIED)
+                        return WriteSlot(nGen, nCurrentPage, nCurrentSlot, slot);
+                }
+            }
+            
+            return false;
+        }
+        
+        
+        /** Place a slot into an in memory page at the first empty position from its starting slot. **/
+        bool PlaceInPage(HashmapSlot* pSlots, const HashmapSlot& slot) const
+        {
+            unsigned int nStart = HomeSlot(slot.nFingerprint);
+            for(unsigned int nSlotProbe = 0; nSlotProbe < HASHMAP_PAGE_SLOTS; nSlotProbe++)
+            {
+                unsigned int nCurrentSlot = (nStart + nSlotProbe) % HASHMAP_PAGE_SLOTS;
+                if(pSlots[nCurrentSlot].nState != SLOT_OCCUPIED)
+                {
+                    pSlots[nCurrentSlot] = slot;
                     
-                nIterator += cKey.Size();
+                    return true;
+                }
             }
             
             return false;
         }
         
         
-        /** Handle the Assigning of a Map Bucket. **/
-        unsigned int GetBucket(const std::vector<unsigned char>& vKey) const
+        /** Create a new empty index generation. The file is left sparse, unwritten pages read as empty slots. **/
+        bool CreateIndex(unsigned int nGen, unsigned int nPages)
+        {
+            HashmapHeader headerNew = { HASHMAP_INDEX_MAGIC, 0, nPages, HASHMAP_MAX_LOAD, 0, 0, 0 };
+            if(!FileCache().Write(nIndexID, nGen, 0, &headerNew, sizeof(headerNew)))
+                return false;
+            
+            /* Extend the file to its full size. */
+            unsigned char nZero = 0;
+            return FileCache().Write(nIndexID, nGen, (uint64)(nPages + 1) * HASHMAP_PAGE_SIZE - 1, &nZero, 1);
+        }
+        
+        
+        /** Switch to a new index generation and remove the old one. **/
+        void Activate(unsigned int nGen, const HashmapHeader& headerNew)
+        {
+            unsigned int nOldGeneration = nGeneration;
+            
+            nGeneration = nGen;
+            header      = headerNew;
+            header.nVersion = HASHMAP_INDEX_VERSION;
+            
+            /* The version is written last, an index without it is an interrupted rebuild. */
+            WriteHeader(false);
+            fDirty = true;
+            
+            if(nOldGeneration != nGen)
+            {
+                FileCache().Close(nIndexID);
+                boost::filesystem::remove(strprintf("%s_hashindex.%05u", strBaseLocation.c_str(), nOldGeneration));
+            }
+        }
+        
+        
+        /** Double the number of pages in the index.
+            
+            Entries in old page P can only route to pages P or P + N of the
+            new index, so both new pages are built in memory from one read of
+            the old page. Entries that had spilled out of their home page are
+            placed by probing once every page is written. **/
+        bool Grow()
+        {
+            Timer timer;
+            timer.Start();
+            
+            unsigned int nPages = header.nPages, nNewPages = header.nPages * 2, nNewGeneration = nGeneration + 1;
+            if(!CreateIndex(nNewGeneration, nNewPages))
+                return error(FUNCTION "Failed to Create Index Generation %u\n", __PRETTY_FUNCTION__, nNewGeneration);
+            
+            std::vector<HashmapSlot> vSpilled;
+            HashmapSlot vSlots[HASHMAP_PAGE_SLOTS], vLow[HASHMAP_PAGE_SLOTS], vHigh[HASHMAP_PAGE_SLOTS];
+            for(unsigned int nPage = 0; nPage < nPages; nPage++)
+            {
+                if(!ReadPage(nGeneration, nPage, vSlots))
+                    return error(FUNCTION "Failed to Read Index Page %u\n", __PRETTY_FUNCTION__, nPage);
+                
+                memset(vLow, 0, sizeof(vLow));
+                memset(vHigh, 0, sizeof(vHigh));
+                for(unsigned int nSlot = 0; nSlot < HASHMAP_PAGE_SLOTS; nSlot++)
+                {
+                    if(vSlots[nSlot].nState != SLOT_OCCUPIED)
+                        continue;
+                    
+                    if(HomePage(vSlots[nSlot].nFingerprint, nPages) != nPage)
+                        vSpilled.push_back(vSlots[nSlot]);
+                    else if(HomePage(vSlots[nSlot].nFingerprint, nNewPages) == nPage)
+                        PlaceInPage(vLow, vSlots[nSlot]);
+                    else
+                        PlaceInPage(vHigh, vSlots[nSlot]);
+                }
+                
+                if(!WritePage(nNewGeneration, nPage, vLow) || !WritePage(nNewGeneration, nPage + nPages, vHigh))
+                    return error(FUNCTION "Failed to Write Index Page %u\n", __PRETTY_FUNCTION__, nPage);
+            }
+            
+            for(auto slot : vSpilled)
+                if(!Place(nNewGeneration, nNewPages, slot))
+                    return error(FUNCTION "Failed to Place Spilled Slot\n", __PRETTY_FUNCTION__);
+            
+            HashmapHeader headerNew = header;
+            headerNew.nPages = nNewPages;
+            Activate(nNewGeneration, headerNew);
+            
+            if(GetArg("-verbose", 0) >= 1)
+                printf(FUNCTION "Index Doubled to %u Pages | %" PRIu64 " Keys | %u Spilled | %" PRIu64 " micro-seconds\n", __PRETTY_FUNCTION__, nNewPages, header.nEntries, (unsigned int)vSpilled.size(), timer.ElapsedMicroseconds());
+            
+            return true;
+        }
+        
+        
+        /** Iterate the records of the keychain files, calling back on each Sector Key. **/
+        template<typename Callback>
+        void ForEachKey(Callback callback) const
+        {
+            for(unsigned int nFile = 0; nFile <= nCurrentFile; nFile++)
+            {
+                uint64 nSize = 0;
+                if(!FileCache().Size(nKeychainID, nFile, nSize) || nSize == 0)
+                    continue;
+                
+                std::vector<unsigned char> vKeychain(nSize, 0);
+                if(!FileCache().Read(nKeychainID, nFile, 0, &vKeychain[0], vKeychain.size()))
+                    continue;
+                
+                unsigned int nIterator = 0;
+                while(nIterator + 15 <= nSize)
+                {
+                    /* Read the State and Size of Sector Header. */
+                    SectorKey cKey;
+                    CDataStream ssKey(std::vector<unsigned char>(vKeychain.begin() + nIterator, vKeychain.begin() + nIterator + 15), SER_LLD, DATABASE_VERSION);
+                    ssKey >> cKey;
+                    
+                    if(nIterator + cKey.Size() > nSize)
+                        break;
+                    
+                    /* Keys written in a transaction are found by Get too, so they are indexed as well. */
+                    if(cKey.Ready() || cKey.IsTxn())
+                    {
+                        cKey.vKey.assign(vKeychain.begin() + nIterator + 15, vKeychain.begin() + nIterator + cKey.Size());
+                        callback(cKey, nFile, nIterator);
+                    }
+                    
+                    nIterator += cKey.Size();
+                }
+            }
+        }
+        
+        
+        /** Rebuild the index from the keychain files. **/
+        bool Rebuild()
+        {
+            unsigned int nPages = HASHMAP_INITIAL_PAGES;
+            
+            /* Count the keys first so the new index is sized without doubling. */
+            uint64 nKeys = 0;
+            ForEachKey([&nKeys](const SectorKey&, unsigned int, unsigned int) { nKeys++; });
+            while(nKeys * 100 >= (uint64)nPages * HASHMAP_PAGE_SLOTS * HASHMAP_MAX_LOAD)
+                nPages *= 2;
+            
+            unsigned int nNewGeneration = nGeneration + 1;
+            if(!CreateIndex(nNewGeneration, nPages))
+                return error(FUNCTION "Failed to Create Index Generation %u\n", __PRETTY_FUNCTION__, nNewGeneration);
+            
+            bool fSuccess = true;
+            ForEachKey([&](const SectorKey& cKey, unsigned int nFile, unsigned int nOffset)
+            {
+                HashmapSlot slot = { KeyHash(cKey.vKey), nOffset, (unsigned short)nFile, SLOT_OCCUPIED };
+                if(!Place(nNewGeneration, nPages, slot))
+                    fSuccess = false;
+            });
+            
+            if(!fSuccess)
+                return error(FUNCTION "Failed to Place Keys in Rebuilt Index\n", __PRETTY_FUNCTION__);
+            
+            HashmapHeader headerNew = { HASHMAP_INDEX_MAGIC, HASHMAP_INDEX_VERSION, nPages, HASHMAP_MAX_LOAD, nKeys, 0, 0 };
+            Activate(nNewGeneration, headerNew);
+            
+            printf(FUNCTION "Rebuilt Index with %" PRIu64 " Keys | %u Pages\n", __PRETTY_FUNCTION__, nKeys, nPages);
+            
+            return true;
+        }
+        
+        
+        /** Count the occupied slots, used when the index wasn't closed cleanly. **/
+        uint64 CountEntries() const
         {
-            uint64 nBucket = 0;
-            for(int i = 0; i < vKey.size() && i < 8; i++)
-                nBucket += vKey[i] << (8 * i);
+            uint64 nEntries = 0;
+            
+            HashmapSlot vSlots[HASHMAP_PAGE_SLOTS];
+            for(unsigned int nPage = 0; nPage < header.nPages; nPage++)
+            {
+                if(!ReadPage(nGeneration, nPage, vSlots))
+                    break;
+                
+                for(unsigned int nSlot = 0; nSlot < HASHMAP_PAGE_SLOTS; nSlot++)
+                    if(vSlots[nSlot].nState == SLOT_OCCUPIED)
+                        nEntries++;
+            }
             
-            return nBucket % HASHMAP_TOTAL_BUCKETS;
+            return nEntries;
+        }
+        
+        
+        /** Mark the index as in use on the first change after opening. **/
+        void SetDirty()
+        {
+            if(fDirty)
+                return;
+            
+            WriteHeader(false);
+            fDirty = true;
+        }
+    
+    public:
+        
+        /** The Database Constructor. To determine file location and the Bytes per Record. **/
+        BinaryHashMap(std::string strBaseLocationIn) : strBaseLocation(strBaseLocationIn), nKeychainID(FileCache().Register(strBaseLocationIn + "_hashmap.")), nIndexID(FileCache().Register(strBaseLocationIn + "_hashindex.")), nGeneration(0), fDirty(false), nCurrentFile(0), nCurrentFileSize(0)
+        {
+            static_assert(sizeof(HashmapSlot) == 16, "Hashmap Slots must be 16 bytes");
+            
+            Initialize();
+        }
+        
+        
+        /** Clean up Memory Usage. **/
+        ~BinaryHashMap()
+        {
+            LOCK(KEY_MUTEX);
+            
+            if(fDirty)
+                WriteHeader(true);
+            
+            FileCache().Close(nKeychainID);
+            FileCache().Close(nIndexID);
+        }
+        
+        
+        /** Return the Keys to the Records Held in the Database. **/
+        std::vector< std::vector<unsigned char> > GetKeys()
+        {
+            LOCK(KEY_MUTEX);
+            
+            std::vector< std::vector<unsigned char> > vKeys;
+            ForEachKey([&vKeys](const SectorKey& cKey, unsigned int, unsigned int) { vKeys.push_back(cKey.vKey); });
+            
+            return vKeys;
+        }
+        
+        
+        /** Return Whether a Key Exists in the Database. **/
+        bool HasKey(const std::vector<unsigned char>& vKey)
+        {
+            LOCK(KEY_MUTEX);
+            
+            unsigned int nPage, nSlot;
+            HashmapSlot slot;
+            
+            return Probe(vKey, KeyHash(vKey), nPage, nSlot, slot);
+        }
+        
+        
+        /** Flush the keychain files and the current index to non-volatile storage. **/
+        bool Sync()
+        {
+            LOCK(KEY_MUTEX);
+            
+            for(unsigned int nFile = 0; nFile <= nCurrentFile; nFile++)
+                if(!FileCache().Sync(nKeychainID, nFile))
+                    return error(FUNCTION "Failed to Sync Keychain File %u\n", __PRETTY_FUNCTION__, nFile);
+            
+            if(!FileCache().Sync(nIndexID, nGeneration))
+                return error(FUNCTION "Failed to Sync Index Generation %u\n", __PRETTY_FUNCTION__, nGeneration);
+            
+            return true;
         }
         
         
@@ -159,159 +563,197 @@ namespace LLD
             /* Create directories if they don't exist yet. */
             if(boost::filesystem::create_directories(strBaseLocation))
                 printf(FUNCTION "Generated Path %s\n", __PRETTY_FUNCTION__, strBaseLocation.c_str());
+            
+            /* Find the keychain file being appended to. */
+            uint64 nSize = 0;
+            while(FileCache().Size(nKeychainID, nCurrentFile + 1, nSize))
+                nCurrentFile++;
+            
+            if(!FileCache().Size(nKeychainID, nCurrentFile, nSize))
+            {
+                nSize = 0;
+                FileCache().Write(nKeychainID, nCurrentFile, 0, NULL, 0);
+            }
+            nCurrentFileSize = nSize;
+            FileCache().Reserve(nKeychainID, nCurrentFile + 1);
+            
+            /* Find the index generations on disk. */
+            std::vector<unsigned int> vGenerations;
+            for(boost::filesystem::directory_iterator it(strBaseLocation); it != boost::filesystem::directory_iterator(); ++it)
+            {
+                std::string strFile = it->path().filename().string();
+                if(strFile.compare(0, 11, "_hashindex.") == 0)
+                    vGenerations.push_back(atoi(strFile.substr(11).c_str()));
+            }
+            std::sort(vGenerations.begin(), vGenerations.end());
+            
+            /* Use the newest complete generation. Leftovers of an interrupted doubling are removed. */
+            bool fFound = false;
+            for(auto nGen : vGenerations)
+            {
+                HashmapHeader headerDisk;
+                bool fValid = FileCache().Size(nIndexID, nGen, nSize) && nSize >= HASHMAP_PAGE_SIZE && FileCache().Read(nIndexID, nGen, 0, &headerDisk, sizeof(headerDisk)) && headerDisk.nMagic == HASHMAP_INDEX_MAGIC && headerDisk.nVersion == HASHMAP_INDEX_VERSION;
+                
+                FileCache().Close(nIndexID);
+                if(fValid && fFound)
+                    boost::filesystem::remove(strprintf("%s_hashindex.%05u", strBaseLocation.c_str(), nGeneration));
+                else if(!fValid)
+                    boost::filesystem::remove(strprintf("%s_hashindex.%05u", strBaseLocation.c_str(), nGen));
+                
+                /* Without a valid index the rebuild is written after the highest generation seen. */
+                if(fValid || !fFound)
+                    nGeneration = nGen;
+                
+                if(fValid)
+                {
+                    fFound = true;
+                    header = headerDisk;
+                }
+            }
+            
+            /* Build the index from the keychain if there is no usable one. */
+            if(!fFound)
+                Rebuild();
+            else if(!header.fClean)
+            {
+                header.nEntries = CountEntries();
+                
+                printf(FUNCTION "Index wasn't Closed Cleanly, Recounted %" PRIu64 " Keys\n", __PRETTY_FUNCTION__, header.nEntries);
+            }
+            
+            printf(FUNCTION "Initialized with %" PRIu64 " Keys | Index Generation %u | %u Pages | Load %.2f%% | Current File %u | Current Size %u\n", __PRETTY_FUNCTION__, header.nEntries, nGeneration, header.nPages, (header.nEntries * 100.0) / ((uint64)header.nPages * HASHMAP_PAGE_SLOTS), nCurrentFile, nCurrentFileSize);
         }
         
         
         /** Add / Update A Record in the Database **/
-        bool Put(SectorKey cKey) const
+        bool Put(SectorKey cKey)
         {
             LOCK(KEY_MUTEX);
             
-            /* Get the bucket for the key */
-            unsigned int nBucket = GetBucket(cKey.vKey);
-            
-            /* Establish the Stream File for Keychain Bucket. */
-            std::ofstream ssFile(strprintf("%s_hashmap.%05u", strBaseLocation.c_str(), nBucket).c_str(), std::ios::out | std::ios::binary);
-            
-            if(mapBinaryIterators.count(cKey.vKey))
-                ssFile.seekp(mapBinaryIterators[cKey.vKey], std::ios::beg);
-            else
-                ssFile.seekp(0, std::ios::end);
-            
-            //for debugging only
-            unsigned int nIterator = ssFile.tellp();
-            
+            SetDirty();
             
             /* Handle the Sector Key Serialization. */
             CDataStream ssKey(SER_LLD, DATABASE_VERSION);
             ssKey.reserve(cKey.Size());
             ssKey << cKey;
-                
             
-            /* Write to Disk. */
             std::vector<unsigned char> vData(ssKey.begin(), ssKey.end());
             vData.insert(vData.end(), cKey.vKey.begin(), cKey.vKey.end());
-            //ssFile.write((char*) &vData[0], vData.size());
-            //ssFile.close();
+            
+            /* Overwrite the Sector Key in place if it exists. */
+            uint64 nFingerprint = KeyHash(cKey.vKey);
+            unsigned int nPage = 0, nSlot = 0;
+            HashmapSlot slot;
+            if(Probe(cKey.vKey, nFingerprint, nPage, nSlot, slot))
+            {
+                if(!FileCache().Write(nKeychainID, slot.nFile, slot.nOffset, &vData[0], vData.size()))
+                    return error(FUNCTION "Failed to Write Key to Keychain File %u\n", __PRETTY_FUNCTION__, slot.nFile);
+            }
+            else
+            {
+                /* Check the Binary File Size. */
+                if(nCurrentFileSize > HASHMAP_MAX_FILE_SIZE)
+                {
+                    if(GetArg("-verbose", 0) >= 4)
+                        printf(FUNCTION "Current File too Large, allocating new File %u\n", __PRETTY_FUNCTION__, nCurrentFile + 1);
+                    
+                    nCurrentFile ++;
+                    nCurrentFileSize = 0;
+                    FileCache().Reserve(nKeychainID, nCurrentFile + 1);
+                }
+                
+                /* Append the Sector Key to the Keychain. */
+                if(!FileCache().Write(nKeychainID, nCurrentFile, nCurrentFileSize, &vData[0], vData.size()))
+                    return error(FUNCTION "Failed to Write Key to Keychain File %u\n", __PRETTY_FUNCTION__, nCurrentFile);
+                
+                /* Point the free slot of the probe at it. */
+                slot.nFingerprint = nFingerprint;
+                slot.nOffset      = nCurrentFileSize;
+                slot.nFile        = nCurrentFile;
+                slot.nState       = SLOT_OCCUPIED;
+                if(!WriteSlot(nGeneration, nPage, nSlot, slot))
+                    return error(FUNCTION "Failed to Write Index Slot %u:%u\n", __PRETTY_FUNCTION__, nPage, nSlot);
+                
+                nCurrentFileSize += vData.size();
+                header.nEntries++;
+                
+                /* Double the index once over the load factor. */
+                if(header.nEntries * 100 > (uint64)header.nPages * HASHMAP_PAGE_SLOTS * header.nMaxLoad)
+                    Grow();
+            }
             
             /* Debug Output of Sector Key Information. */
             if(GetArg("-verbose", 0) >= 4)
-                printf(FUNCTION "State: %s | Length: %u | Position: %u | Bucket: %u | Sector File: %u | Sector Size: %u | Sector Start: %u | Key: %s\n", __PRETTY_FUNCTION__, cKey.nState == READY ? "Valid" : "Invalid", cKey.nLength, nIterator, nBucket, cKey.nSectorFile, cKey.nSectorSize, cKey.nSectorStart, HexStr(cKey.vKey.begin(), cKey.vKey.end()).c_str());
+                printf(FUNCTION "State: %s | Length: %u | Position: %u | File: %u | Page: %u | Slot: %u | Sector File: %u | Sector Size: %u | Sector Start: %u | Key: %s\n", __PRETTY_FUNCTION__, cKey.nState == READY ? "Valid" : "Invalid", cKey.nLength, slot.nOffset, slot.nFile, nPage, nSlot, cKey.nSectorFile, cKey.nSectorSize, cKey.nSectorStart, HexStr(cKey.vKey.begin(), cKey.vKey.end()).c_str());
             
             
             return true;
         }
         
-        /** Simple Erase for now, not efficient in Data Usage of HD but quick to get erase function working. **/
+        /** Add / Update a Batch of Records in the Database under one lock. **/
+        bool Put(const std::vector<SectorKey>& vKeys)
+        {
+            LOCK(KEY_MUTEX);
+            
+            for(const SectorKey& cKey : vKeys)
+                if(!Put(cKey))
+                    return false;
+            
+            return true;
+        }
+        
+        
+        /** Erase a Key, leaving a tombstone in the index and an empty Sector Key in the keychain. **/
         bool Erase(const std::vector<unsigned char> vKey)
         {
             LOCK(KEY_MUTEX);
             
             /* Check for the Key. */
-            unsigned int nBucket = GetBucket(vKey);
+            unsigned int nPage = 0, nSlot = 0;
+            HashmapSlot slot;
+            if(!Probe(vKey, KeyHash(vKey), nPage, nSlot, slot))
+                return error(FUNCTION "Key doesn't Exist", __PRETTY_FUNCTION__);
+            
+            SetDirty();
+            
+            /* Establish the Sector State as Empty. */
+            unsigned char nState = EMPTY;
+            if(!FileCache().Write(nKeychainID, slot.nFile, slot.nOffset, &nState, 1))
+                return error(FUNCTION "Failed to Erase Key from Keychain File %u\n", __PRETTY_FUNCTION__, slot.nFile);
             
-            /* Establish the Outgoing Stream. */
-            std::fstream ssFile(strprintf("%s_hashmap.%05u", strBaseLocation.c_str(), nBucket).c_str(), std::ios::in | std::ios::out | std::ios::binary);
+            /* Leave a Tombstone so probes continue past the slot. */
+            slot.nState = SLOT_DELETED;
+            if(!WriteSlot(nGeneration, nPage, nSlot, slot))
+                return error(FUNCTION "Failed to Write Index Slot %u:%u\n", __PRETTY_FUNCTION__, nPage, nSlot);
             
+            header.nEntries--;
             
             return true;
         }
         
         /** Get a Record from the Database with Given Key. **/
-        bool Get(const std::vector<unsigned char> vKey, SectorKey& cKey)
+        bool Get(const std::vector<unsigned char>& vKey, SectorKey& cKey)
         {
             LOCK(KEY_MUTEX);
             
-            /* Get the assigned bucket for the hashmap. */
-            unsigned int nBucket = GetBucket(vKey);
+            /* Find the Slot of the Key. */
+            unsigned int nPage = 0, nSlot = 0;
+            HashmapSlot slot;
+            if(!Probe(vKey, KeyHash(vKey), nPage, nSlot, slot))
+                return false;
             
-            /* Establish the Stream File for Keychain Bucket. */
-            std::fstream ssFile(strprintf("%s_hashmap.%05u", strBaseLocation.c_str(), nBucket).c_str(), std::ios::in | std::ios::out | std::ios::binary);
+            /* Read the Sector Key it points to. */
+            if(!ReadKey(slot, vKey, cKey))
+                return false;
             
-            if(mapBinaryIterators.count(vKey))
-            {
-                ssFile.seekg(mapBinaryIterators[vKey], std::ios::beg);
-                
-                /* Read the State and Size of Sector Header. */
-                std::vector<unsigned char> vData(15, 0);
-                ssFile.read((char*) &vData[0], 15);
-                
-                
-                /* De-serialize the Header. */
-                CDataStream ssHeader(vData, SER_LLD, DATABASE_VERSION);
-                ssHeader >> cKey;
-                        
-                
-                /* Skip Empty Sectors for Now. (TODO: Expand to Reads / Writes) */
-                if(cKey.Ready())
-                {
-                
-                    /* Read the Key Data. */
-                    std::vector<unsigned char> vKeyIn(cKey.nLength, 0);
-                    ssFile.read((char*) &vKeyIn[0], vKeyIn.size());
-                    
-                    /* Check the Keys Match Properly. */
-                    if(vKeyIn != vKey)
-                        return error(FUNCTION "Key Mistmatch: DB:: %s MEM %s\n", __PRETTY_FUNCTION__, HexStr(vKeyIn.begin(), vKeyIn.end()).c_str(), HexStr(vKey.begin(), vKey.end()).c_str());
-                    
-                    /* Assign Key to Sector. */
-                    cKey.vKey = vKeyIn;
-                    
-                    /* Debug Output of Sector Key Information. */
-                    if(GetArg("-verbose", 0) >= 4)
-                        printf(FUNCTION "State: %s | Length: %u | Position: %u | Bucket: %u | Sector File: %u | Sector Size: %u | Sector Start: %u | Key: %s\n", __PRETTY_FUNCTION__, cKey.nState == READY ? "Valid" : "Invalid", cKey.nLength, mapBinaryIterators[vKey], nBucket, cKey.nSectorFile, cKey.nSectorSize, cKey.nSectorStart, HexStr(cKey.vKey.begin(), cKey.vKey.end()).c_str());
-                    
-                    return true;
-                }
-            }
-            else
-            {
-                /* Read the Bucket File. */
-                ssFile.ignore(std::numeric_limits<std::streamsize>::max());
-                ssFile.seekg (0, std::ios::beg);
-                std::vector<unsigned char> vBucket(ssFile.gcount(), 0);
-                ssFile.read((char*) &vBucket[0], vBucket.size());
-                            
-                            
-                /* Iterator for Key Sectors. */
-                unsigned int nIterator = 0;
-                while(nIterator < vBucket.size())
-                {
-                                
-                    /* Get Binary Data */
-                    std::vector<unsigned char> vData(vBucket.begin() + nIterator, vBucket.begin() + nIterator + 15);
-                                
-                                
-                    /* Read the State and Size of Sector Header. */
-                    CDataStream ssKey(vData, SER_LLD, DATABASE_VERSION);
-                    ssKey >> cKey;
-                                
-                    if(cKey.Ready())
-                    {
-                                
-                        /* Read the Key Data. */
-                        std::vector<unsigned char> vKeyIn(vBucket.begin() + nIterator + 15, vBucket.begin() + nIterator + 15 + cKey.nLength);
-                                    
-                        /* Found the Binary Position. */
-                        if(vKeyIn == vKey)
-                        {
-                            cKey.vKey = vKeyIn;
-                            
-                            /* Debug Output of Sector Key Information. */
-                            if(GetArg("-verbose", 0) >= 4)
-                                printf(FUNCTION "State: %s | Length: %u | Position: %u | Bucket: %u | Sector File: %u | Sector Size: %u | Sector Start: %u | Key: %s\n", __PRETTY_FUNCTION__, cKey.nState == READY ? "Valid" : "Invalid", cKey.nLength, nIterator, nBucket, cKey.nSectorFile, cKey.nSectorSize, cKey.nSectorStart, HexStr(cKey.vKey.begin(), cKey.vKey.end()).c_str());
-                
-                            return true;
-                        }
-                    }
-                        
-                    nIterator += cKey.Size();
-                }
-            }
+            /* Debug Output of Sector Key Information. */
+            if(GetArg("-verbose", 0) >= 4)
+                printf(FUNCTION "State: %s | Length: %u | Position: %u | File: %u | Page: %u | Slot: %u | Sector File: %u | Sector Size: %u | Sector Start: %u | Key: %s\n", __PRETTY_FUNCTION__, cKey.nState == READY ? "Valid" : "Invalid", cKey.nLength, slot.nOffset, slot.nFile, nPage, nSlot, cKey.nSectorFile, cKey.nSectorSize, cKey.nSectorStart, HexStr(cKey.vKey.begin(), cKey.vKey.end()).c_str());
             
-            return false;
+            /* Skip Empty Sectors for Now. (TODO: Expand to Reads / Writes) */
+            return (cKey.Ready() || cKey.IsTxn());
         }
     };
 }
-    
+
 #endif
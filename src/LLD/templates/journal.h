@@ -1,5 +1,5 @@
 /*__________________________________________________________________________________________
-
+            
             (c) Hash(BEGIN(Satoshi[2010]), END(Sunny[2012])) == Videlicet[2017] ++
             
             (c) Copyright The Nexus Developers 2014 - 2017
@@ -14,38 +14,423 @@ ________________________________________________________________________________
 #ifndef NEXUS_LLD_TEMPLATES_JOURNAL_H
 #define NEXUS_LLD_TEMPLATES_JOURNAL_H
 
-#include "sector.h"
-#include "core.h"
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include <atomic>
+#include <map>
+#include <set>
+#include <vector>
+
+#include "key.h"
+
+#include "../include/filecache.h"
 
 namespace LLD
 {
-    /* Journal Database keeps in non-volatile memory the transaction record for rollback.
-    * This will be triggered if the checksums don't match with sector data and the keychain 
-    * 
-    * TODO: Figure out the best Key system to correlate a transaction to the data in the journal
-    * This should be seen by the sector as well, which means that the keychain should keep a list
-    * of the keys that were changed.
-    * 
-    * This should be done with a std::pair(key, txid) for the journal's key. 
-    * Records should be resued,
-    * 
-    * TODO: Get the Sector Chain working properly
-    */
-    class CJournalDB : public SectorDatabase
+    
+    /* Size a journal file can grow to before records go to the next one, unless set with -journalfilesize. */
+    const unsigned int JOURNAL_MAX_FILE_SIZE = 64 * 1024 * 1024; //64 MB per File
+    
+    
+    /* Marks the start of each record so a torn tail is detected on replay. */
+    const unsigned int JOURNAL_RECORD_MAGIC = 0x4a444c4c; //LLDJ
+    
+    
+    /* Bytes before each record body: magic, body length and body checksum. */
+    const unsigned int JOURNAL_RECORD_HEADER = 12;
+    
+    
+    /** A Committed Transaction as it is Written to the Journal. **/
+    class JournalRecord
     {
     public:
-        /** The Database Constructor. To determine file location and the Bytes per Record. **/
-        CJournalDB(const char* pszMode="r+", std::string strID) : SectorDatabase(strID, strID, pszMode) {}
         
-        /* TODO: Delete the Journal Database if it is deconstructed. 
-        *       This should only happen when the database commits the transaction */
+        /* The order of the commit. Records are applied in this order. */
+        uint64 nSequence;
+        
+        
+        /* The keys erased, applied before the writes as in the transaction. */
+        std::vector< std::vector<unsigned char> > vErases;
+        
+        
+        /* The keys and data written. */
+        std::vector< std::pair< std::vector<unsigned char>, std::vector<unsigned char> > > vWrites;
+        
+        
+        IMPLEMENT_SERIALIZE
+        (
+            READWRITE(nSequence);
+            READWRITE(vErases);
+            READWRITE(vWrites);
+        )
+        
+        
+        JournalRecord() : nSequence(0) { }
+    };
+    
+    
+    /** Journal Database:
+        
+        Append only write ahead log for Sector Database transactions. A whole
+        transaction is serialized as one record and written sequentially.
+        
+        Commits are grouped: the first thread to wait on a sync writes every
+        record appended so far and syncs them in one operation, while commits
+        that arrive in the meantime queue up for the next one.
+        
+        Records are applied to the sectors and keychain lazily after they are
+        durable. Once applied and flushed, the journal files holding them are
+        removed in a checkpoint, oldest first, so the files left on disk may
+        not start from the first number. Anything left in the journal on open
+        is replayed.
+    **/
+    class CJournalDB
+    {
+    protected:
+        
+        /* Mutex and condition for the group commit. */
+        boost::mutex JOURNAL_MUTEX;
+        boost::condition_variable SYNC_CONDITION;
+        
+        
+        /* The filename prefix of the journal files. */
+        std::string strBaseLocation;
+        
+        
+        /* The id of the journal files in the file handle cache. */
+        unsigned int nFileCacheID;
+        
+        
+        /* The framed records appended, but not yet written. */
+        std::vector<unsigned char> vPending;
+        
+        
+        /* The last sequence given out, and the last written and synced. */
+        uint64 nLastSequence;
+        uint64 nDurableSequence;
+        
+        
+        /* A thread is writing and syncing the pending records. */
+        bool fSyncing;
+        
+        
+        /* A write or sync failed. The journal refuses commits after this. */
+        bool fFailed;
+        
+        
+        /* The journal file being appended to. */
+        unsigned int nCurrentFile;
+        uint64 nCurrentFileSize;
+        
+        
+        /* Size a journal file is appended to before the next one is started. */
+        uint64 nMaxFileSize;
+        
+        
+        /* The last sequence written to each journal file. */
+        std::map<unsigned int, uint64> mapFileSequence;
+        
+        
+        /* Statistics for the group commit. */
+        std::atomic<uint64> nCommits, nSyncs;
+        
+        
+        /* The filename of a journal file. */
+        std::string FileName(unsigned int nFile) const { return strprintf("%s%05u", strBaseLocation.c_str(), nFile); }
+        
+        
+        /* Sync the directory of the journal files, so a file just created is found after a crash. */
+        bool SyncDirectory() const
+        {
+            std::string strDirectory = boost::filesystem::path(strBaseLocation).parent_path().string();
+            
+            int nDirectory = open(strDirectory.c_str(), O_RDONLY);
+            if(nDirectory == -1)
+                return error(FUNCTION "Failed to Open Directory %s\n", __PRETTY_FUNCTION__, strDirectory.c_str());
+            
+            bool fSuccess = (fsync(nDirectory) == 0);
+            close(nDirectory);
+            
+            if(!fSuccess)
+                return error(FUNCTION "Failed to Sync Directory %s\n", __PRETTY_FUNCTION__, strDirectory.c_str());
+            
+            return true;
+        }
+    
+    
+    public:
+        
+        /** The Journal Constructor.
+            
+            @param[in] strBaseLocationIn The filename prefix of the journal files **/
+        CJournalDB(std::string strBaseLocationIn) : strBaseLocation(strBaseLocationIn), nFileCacheID(FileCache().Register(strBaseLocationIn)), nLastSequence(0), nDurableSequence(0), fSyncing(false), fFailed(false), nCurrentFile(0), nCurrentFileSize(0), nMaxFileSize(GetArg("-journalfilesize", JOURNAL_MAX_FILE_SIZE)), nCommits(0), nSyncs(0) { }
+        
+        
+        /** Close the journal files. **/
         ~CJournalDB()
         {
+            FileCache().Close(nFileCacheID);
+        }
+        
+        
+        /** Append a transaction to the journal. It is not durable until Sync returns for its sequence.
+            
+            @param[in] record The transaction, its sequence is assigned here
+            
+            @return The sequence of the record **/
+        uint64 Append(JournalRecord& record)
+        {
+            boost::unique_lock<boost::mutex> lock(JOURNAL_MUTEX);
             
+            record.nSequence = ++nLastSequence;
+            
+            CDataStream ssRecord(SER_LLD, DATABASE_VERSION);
+            ssRecord << record;
+            std::vector<unsigned char> vBody(ssRecord.begin(), ssRecord.end());
+            
+            unsigned int nHeader[3] = { JOURNAL_RECORD_MAGIC, (unsigned int)vBody.size(), LLC::HASH::SK32(vBody) };
+            vPending.insert(vPending.end(), (unsigned char*)nHeader, (unsigned char*)nHeader + JOURNAL_RECORD_HEADER);
+            vPending.insert(vPending.end(), vBody.begin(), vBody.end());
+            
+            ++nCommits;
+            
+            return record.nSequence;
         }
         
-        bool AddTransaction(uint512 hash, Core::CTxIndex& txindex);
-        bool RemoveTransaction(uint512 hash, const Core::CTxIndex& txindex);
+        
+        /** Wait until a record is durable.
+            
+            The first waiter becomes the leader: it takes every pending record,
+            writes them in one operation and syncs once, then wakes the others.
+            
+            @param[in] nSequence The sequence of the record
+            
+            @return True once the record is on non-volatile storage **/
+        bool Sync(uint64 nSequence)
+        {
+            boost::unique_lock<boost::mutex> lock(JOURNAL_MUTEX);
+            while(nDurableSequence < nSequence)
+            {
+                if(fFailed)
+                    return error(FUNCTION "Journal Failed, Record %" PRIu64 " Not Durable\n", __PRETTY_FUNCTION__, nSequence);
+                
+                if(fSyncing)
+                {
+                    SYNC_CONDITION.wait(lock);
+                    
+                    continue;
+                }
+                
+                /* Lead the group. */
+                fSyncing = true;
+                
+                std::vector<unsigned char> vWrite;
+                vWrite.swap(vPending);
+                uint64 nTarget = nLastSequence;
+                
+                if(nCurrentFileSize > nMaxFileSize)
+                {
+                    nCurrentFile++;
+                    nCurrentFileSize = 0;
+                }
+                unsigned int nFile = nCurrentFile;
+                uint64 nOffset = nCurrentFileSize;
+                
+                /* A write at the start creates the file, so its directory entry is synced too. */
+                lock.unlock();
+                bool fSuccess = FileCache().Write(nFileCacheID, nFile, nOffset, &vWrite[0], vWrite.size()) && FileCache().Sync(nFileCacheID, nFile) && (nOffset > 0 || SyncDirectory());
+                lock.lock();
+                
+                if(fSuccess)
+                {
+                    nCurrentFileSize += vWrite.size();
+                    nDurableSequence  = nTarget;
+                    mapFileSequence[nFile] = nTarget;
+                    
+                    ++nSyncs;
+                }
+                else
+                    fFailed = true;
+                
+                fSyncing = false;
+                SYNC_CONDITION.notify_all();
+            }
+            
+            return true;
+        }
+        
+        
+        /** The last sequence that is durable. Records up to it may be applied. **/
+        uint64 Durable()
+        {
+            boost::unique_lock<boost::mutex> lock(JOURNAL_MUTEX);
+            
+            return nDurableSequence;
+        }
+        
+        
+        /** The bytes in the journal files. **/
+        uint64 Size()
+        {
+            boost::unique_lock<boost::mutex> lock(JOURNAL_MUTEX);
+            
+            uint64 nSize = 0;
+            for(auto it : mapFileSequence)
+            {
+                uint64 nFileSize = 0;
+                if(it.first != nCurrentFile && FileCache().Size(nFileCacheID, it.first, nFileSize))
+                    nSize += nFileSize;
+            }
+            
+            return nSize + nCurrentFileSize;
+        }
+        
+        
+        /** Read the records left in the journal files, in order.
+            
+            The files are found on disk, since a checkpoint removes the oldest
+            while later ones stay. Reading stops at the first record that is torn
+            or fails its checksum, which can only be the tail of the last write
+            before a crash. The file is cut back to the records before it.
+            
+            @param[out] vRecords The records found
+            
+            @return True if the journal was read **/
+        bool Replay(std::vector<JournalRecord>& vRecords)
+        {
+            boost::unique_lock<boost::mutex> lock(JOURNAL_MUTEX);
+            
+            /* Find the journal files. The highest numbered is the one appended to. */
+            boost::filesystem::path pathBase(strBaseLocation);
+            std::string strPrefix = pathBase.filename().string();
+            std::set<unsigned int> setFiles;
+            if(boost::filesystem::is_directory(pathBase.parent_path()))
+            {
+                for(boost::filesystem::directory_iterator it(pathBase.parent_path()), end; it != end; ++it)
+                {
+                    std::string strFile = it->path().filename().string();
+                    if(strFile.size() > strPrefix.size() && strFile.compare(0, strPrefix.size(), strPrefix) == 0 && strFile.find_first_not_of("0123456789", strPrefix.size()) == std::string::npos)
+                        setFiles.insert(atoi(strFile.c_str() + strPrefix.size()));
+                }
+            }
+            
+            for(unsigned int nFile : setFiles)
+            {
+                uint64 nSize = 0;
+                if(!FileCache().Size(nFileCacheID, nFile, nSize))
+                    return error(FUNCTION "Failed to Open Journal File %u\n", __PRETTY_FUNCTION__, nFile);
+                
+                mapFileSequence[nFile] = 0;
+                nCurrentFile           = nFile;
+                nCurrentFileSize       = nSize;
+                if(nSize == 0)
+                    continue;
+                
+                std::vector<unsigned char> vJournal(nSize, 0);
+                if(!FileCache().Read(nFileCacheID, nFile, 0, &vJournal[0], vJournal.size()))
+                    return error(FUNCTION "Failed to Read Journal File %u\n", __PRETTY_FUNCTION__, nFile);
+                
+                uint64 nIterator = 0;
+                while(nIterator + JOURNAL_RECORD_HEADER <= nSize)
+                {
+                    unsigned int nHeader[3];
+                    memcpy(nHeader, &vJournal[nIterator], JOURNAL_RECORD_HEADER);
+                    if(nHeader[0] != JOURNAL_RECORD_MAGIC || nIterator + JOURNAL_RECORD_HEADER + nHeader[1] > nSize)
+                        break;
+                    
+                    std::vector<unsigned char> vBody(vJournal.begin() + nIterator + JOURNAL_RECORD_HEADER, vJournal.begin() + nIterator + JOURNAL_RECORD_HEADER + nHeader[1]);
+                    if(LLC::HASH::SK32(vBody) != nHeader[2])
+                        break;
+                    
+                    JournalRecord record;
+                    try
+                    {
+                        CDataStream ssRecord(vBody, SER_LLD, DATABASE_VERSION);
+                        ssRecord >> record;
+                    }
+                    catch(std::exception& e)
+                    {
+                        break;
+                    }
+                    
+                    vRecords.push_back(record);
+                    mapFileSequence[nFile] = record.nSequence;
+                    nLastSequence = nDurableSequence = std::max(nLastSequence, record.nSequence);
+                    
+                    nIterator += JOURNAL_RECORD_HEADER + nHeader[1];
+                }
+                
+                /* Cut off a torn tail, so a shorter record appended over it can't leave part of it to be read after. */
+                if(nIterator < nSize)
+                {
+                    printf(FUNCTION "Journal File %u has a Torn Tail at %" PRIu64 " of %" PRIu64 " bytes\n", __PRETTY_FUNCTION__, nFile, nIterator, nSize);
+                    
+                    if(!FileCache().Truncate(nFileCacheID, nFile, nIterator))
+                        return error(FUNCTION "Failed to Truncate Journal File %u\n", __PRETTY_FUNCTION__, nFile);
+                    
+                    nCurrentFileSize = nIterator;
+                    
+                    break;
+                }
+            }
+            
+            if(vRecords.size() > 0)
+                printf(FUNCTION "Replaying %u Records from %u Journal Files\n", __PRETTY_FUNCTION__, (unsigned int)vRecords.size(), (unsigned int)mapFileSequence.size());
+            
+            return true;
+        }
+        
+        
+        /** Remove journal files whose records are all applied.
+            
+            The caller must have flushed the applied records to the sectors and
+            keychain first. The current file is retired too when it is fully
+            applied, so the journal restarts empty.
+            
+            @param[in] nApplied The last sequence applied and flushed **/
+        void Checkpoint(uint64 nApplied)
+        {
+            boost::unique_lock<boost::mutex> lock(JOURNAL_MUTEX);
+            
+            if(fSyncing)
+                return;
+            
+            bool fRetireCurrent = (nApplied >= nLastSequence && vPending.empty());
+            for(auto it = mapFileSequence.begin(); it != mapFileSequence.end(); )
+            {
+                if(it->second > nApplied || (it->first == nCurrentFile && !fRetireCurrent))
+                {
+                    ++it;
+                    
+                    continue;
+                }
+                
+                FileCache().Close(nFileCacheID);
+                boost::filesystem::remove(FileName(it->first));
+                
+                mapFileSequence.erase(it++);
+            }
+            
+            /* Start again from the first file once nothing is left. */
+            if(mapFileSequence.empty())
+            {
+                nCurrentFile     = 0;
+                nCurrentFileSize = 0;
+            }
+            else if(fRetireCurrent)
+            {
+                nCurrentFile     = mapFileSequence.rbegin()->first + 1;
+                nCurrentFileSize = 0;
+            }
+        }
+        
+        
+        /** Dump the group commit statistics to the debug console. **/
+        void PrintStats()
+        {
+            printf(FUNCTION "Commits: %" PRIu64 " | Syncs: %" PRIu64 " | Commits per Sync: %.2f\n", __PRETTY_FUNCTION__, nCommits.load(), nSyncs.load(), nSyncs.load() > 0 ? nCommits.load() / (double)nSyncs.load() : 0.0);
+        }
     };
 }
 
@@ -27,6 +27,9 @@ ________________________________________________________________________________
 #include "../../Util/include/hex.h"
 #include "../../Util/templates/serialize.h"
 
+#include "../include/checksum.h"
+#include "../include/compression.h"
+
 
 namespace LLD
 {
@@ -45,6 +48,17 @@ namespace LLD
     };
     
     
+    /** The first byte of a Sector Key on disk holds its state in the low four bits,
+        the checksum its sector was written with in the next two, and its compression
+        in the top two. Keys written before either could be chosen have zero there,
+        SK32 and uncompressed. **/
+    const unsigned char SECTOR_STATE_MASK        = 0x0f;
+    const unsigned char SECTOR_CHECKSUM_SHIFT    = 4;
+    const unsigned char SECTOR_CHECKSUM_MASK     = 0x03;
+    const unsigned char SECTOR_COMPRESSION_SHIFT = 6;
+    const unsigned char SECTOR_COMPRESSION_MASK  = 0x03;
+    
+    
     /** Key Class to Hold the Location of Sectors it is referencing. 
         This Indexes the Sector Database. **/
     class SectorKey
@@ -79,10 +93,20 @@ namespace LLD
             in the middle of a write. **/
         unsigned int nChecksum;
         
+        /* The checksum nChecksum was made with. */
+        unsigned char nChecksumType;
+        
+        /* The compression of the sector, COMPRESS_NONE if it is stored as it was written. */
+        unsigned char nCompression;
+        
         /* Serialization Macro. */
         IMPLEMENT_SERIALIZE
         (
-            READWRITE(nState);
+            unsigned char nHeader = Header();
+            READWRITE(nHeader);
+            if(fRead)
+                const_cast<SectorKey*>(this)->SetHeader(nHeader);
+            
             READWRITE(nLength);
             READWRITE(nSectorFile);
             READWRITE(nSectorSize);
@@ -91,24 +115,61 @@ namespace LLD
         )
         
         /* Constructors. */
-        SectorKey() : nState(0), nLength(0), nSectorFile(0), nSectorSize(0), nSectorStart(0) { }
-        SectorKey(unsigned char nStateIn, std::vector<unsigned char> vKeyIn, unsigned short nSectorFileIn, unsigned int nSectorStartIn, unsigned short nSectorSizeIn) : nState(nStateIn), nSectorFile(nSectorFileIn), nSectorSize(nSectorSizeIn), nSectorStart(nSectorStartIn)
+        SectorKey() : nState(0), nLength(0), nSectorFile(0), nSectorSize(0), nSectorStart(0), nChecksum(0), nChecksumType(CHECKSUM_SK32), nCompression(COMPRESS_NONE) { }
+        SectorKey(unsigned char nStateIn, std::vector<unsigned char> vKeyIn, unsigned short nSectorFileIn, unsigned int nSectorStartIn, unsigned short nSectorSizeIn) : nState(nStateIn), nSectorFile(nSectorFileIn), nSectorSize(nSectorSizeIn), nSectorStart(nSectorStartIn), nChecksum(0), nChecksumType(CHECKSUM_SK32), nCompression(COMPRESS_NONE)
         { 
             nLength = vKeyIn.size();
             vKey    = vKeyIn;
         }
         
         
+        /* Decode the 15 byte header straight from keychain bytes, in the serialized layout. Skips the stream for bulk loads. */
+        void DecodeHeader(const unsigned char* pData)
+        {
+            SetHeader(pData[0]);
+            memcpy(&nLength,      pData + 1,  2);
+            memcpy(&nSectorFile,  pData + 3,  2);
+            memcpy(&nSectorSize,  pData + 5,  2);
+            memcpy(&nSectorStart, pData + 7,  4);
+            memcpy(&nChecksum,    pData + 11, 4);
+        }
+        
+        
+        /* The first byte on disk, the state, the checksum type and the compression. */
+        unsigned char Header() const { return (nState & SECTOR_STATE_MASK) | ((nChecksumType & SECTOR_CHECKSUM_MASK) << SECTOR_CHECKSUM_SHIFT) | ((nCompression & SECTOR_COMPRESSION_MASK) << SECTOR_COMPRESSION_SHIFT); }
+        
+        void SetHeader(unsigned char nHeader)
+        {
+            nState        = nHeader & SECTOR_STATE_MASK;
+            nChecksumType = (nHeader >> SECTOR_CHECKSUM_SHIFT) & SECTOR_CHECKSUM_MASK;
+            nCompression  = (nHeader >> SECTOR_COMPRESSION_SHIFT) & SECTOR_COMPRESSION_MASK;
+        }
+        
+        
+        /* Checksum the data of the sector with the given checksum, recording which. */
+        void SetChecksum(unsigned char nType, const unsigned char* pbegin, const unsigned char* pend)
+        {
+            nChecksumType = nType;
+            nChecksum     = Checksum(nType, pbegin, pend);
+        }
+        
+        void SetChecksum(unsigned char nType, const std::vector<unsigned char>& vData) { SetChecksum(nType, vData.data(), vData.data() + vData.size()); }
+        
+        
+        /* Check the data of the sector against the checksum it was written with. */
+        bool Verify(const unsigned char* pbegin, const unsigned char* pend) const { return nChecksum == Checksum(nChecksumType, pbegin, pend); }
+        
+        
         /* Iterator to the beginning of the raw key. */
         unsigned int Begin() { return 15; }
         
         
         /* Return the Size of the Key Sector on Disk. */
-        unsigned int Size() { return (15 + nLength); }
+        unsigned int Size() const { return (15 + nLength); }
         
         
         /* Dump Key to Debug Console. */
-        void Print() { printf("SectorKey(nState=%u, nLength=%u, nSectorFile=%u, nSectorSize=%u, nSectorStart=%u, nChecksum=%" PRIu64 ")\n", nState, nLength, nSectorFile, nSectorSize, nSectorStart, nChecksum); }
+        void Print() { printf("SectorKey(nState=%u, nLength=%u, nSectorFile=%u, nSectorSize=%u, nSectorStart=%u, nChecksum=%u, nChecksumType=%s, nCompression=%s)\n", nState, nLength, nSectorFile, nSectorSize, nSectorStart, nChecksum, ChecksumName(nChecksumType), CompressionName(nCompression)); }
         
         
         /* Check for Key Activity on Sector. */
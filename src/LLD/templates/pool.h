@@ -13,14 +13,23 @@ ________________________________________________________________________________
 #ifndef NEXUS_LLD_TEMPLATES_MEMCACHEPOOL_H
 #define NEXUS_LLD_TEMPLATES_MEMCACHEPOOL_H
 
+#include <atomic>
+#include <unordered_map>
+
+#include "../include/keyhash.h"
+
 #include "../../Util/templates/serialize.h"
 #include "../../Util/include/mutex.h"
 
 namespace LLD
 {	
     
-    /* The number of buckets available in Cache Pool. */
-    const unsigned int MAX_CACHE_POOL_BUCKETS = 256 * 256;
+    /* The number of shards the Cache Pool is split into, each with its own lock. Must be a power of two. */
+    const unsigned int MAX_CACHE_POOL_SHARDS = 64;
+    
+    
+    /* The percent of the cache that may hold data not yet written to disk. */
+    const unsigned int DEFAULT_CACHE_DIRTY_PERCENT = 25;
     
     
     enum
@@ -35,12 +44,55 @@ namespace LLD
     };
     
 
+    /* An object in the pool: its key and cached data. */
+    struct CachedData;
+    typedef std::pair<const std::vector<unsigned char>, CachedData> CachedObject;
+    
+    
     /* Holding Object for Memory Maps. */
     struct CachedData
     {
         unsigned char  State;
         uint64         Timestamp;
         std::vector<unsigned char> Data;
+        
+        /* Set when the object is read, cleared as the clock hand passes it. */
+        bool           fReferenced;
+        
+        /* Neighbours in the clock ring of the shard. */
+        CachedObject*  pPrev;
+        CachedObject*  pNext;
+        
+        CachedData() : State(MEMORY_ONLY), Timestamp(0), fReferenced(false), pPrev(NULL), pNext(NULL) { }
+    };
+    
+    
+    /* Hash of a key within a shard. */
+    struct CachedKeyHash
+    {
+        std::size_t operator()(const std::vector<unsigned char>& vKey) const
+        {
+            return (std::size_t)KeyHash(vKey);
+        }
+    };
+    
+    
+    /* One shard of the pool: the objects routed to it, the lock that guards them,
+     * and the clock ring they are evicted from. */
+    struct CacheShard
+    {
+        Mutex_t MUTEX;
+        
+        std::unordered_map<std::vector<unsigned char>, CachedData, CachedKeyHash> mapObjects;
+        
+        /* The resident bytes of the shard, including its hash table. */
+        uint64 nSize;
+        uint64 nBucketBytes;
+        
+        /* The clock hand. New objects go in just behind it, so they are the last it reaches. */
+        CachedObject* pHand;
+        
+        CacheShard() : nSize(0), nBucketBytes(0), pHand(NULL) { }
     };
     
     
@@ -54,85 +106,157 @@ namespace LLD
     * A. It can pass data on the relay layers if required.
     * B. It can process data locked as orphans
     * 
+    * Objects are routed to shards by a hash of their key. Each shard has its own
+    * lock, so threads working on different keys rarely wait on each other.
+    * 
+    * Eviction is CLOCK: a read sets the object's referenced bit, and the hand
+    * clears bits as it passes, evicting the first clean object without one.
+    * Objects waiting for writes or transactions are stepped over.
+    * 
+    * Sizes are resident bytes: keys, data, hash table nodes and buckets, and
+    * the copies in the disk buffer, with the heap's per-allocation overhead.
+    * Objects waiting for writes or transactions are dirty. They can't be
+    * evicted, so writers are expected to wait while DirtySize() is over
+    * MaxDirtySize() rather than let them grow without bound.
+    * 
     */
     class MemCachePool
     {
         
     protected:
         
-        /* Destructor flag. */
-        bool fDestruct;
+        /* The Maximum Size of the Cache, and the part of it that may be dirty. Both can change at runtime. */
+        std::atomic<uint64> MAX_CACHE_SIZE;
+        std::atomic<uint64> MAX_DIRTY_SIZE;
         
         
-        /* The Maximum Size of the Cache. */
-        unsigned int MAX_CACHE_SIZE;
+        /* The current size of the pool, and the part of it that is dirty. */
+        std::atomic<uint64> nCurrentSize;
+        std::atomic<uint64> nDirtySize;
         
         
-        /* The current size of the pool. */
-        unsigned int nCurrentSize;
+        /* The objects evicted, and the clock hand steps taken to find them. */
+        std::atomic<uint64> nEvictions, nClockSteps;
         
         
-        /* Mutex for thread concurrencdy. */
-        Mutex_t MUTEX;
+        /* The shards of the pool. */
+        unsigned int nShards;
+        CacheShard* pShards;
         
         
-        /* Map of the current holding data. */
-        std::map<std::vector<unsigned char>, CachedData > mapObjects[MAX_CACHE_POOL_BUCKETS];
+        /* Mutex for the disk buffer. */
+        Mutex_t DISK_MUTEX;
         
         
         /* Disk Buffer Object to flush objects to disk. */
         std::vector< std::pair<std::vector<unsigned char>, std::vector<unsigned char>> > vDiskBuffer;
         
         
-        /* Transaction Disk Buffer Object. */
-        std::vector< std::pair<std::vector<unsigned char>, std::vector<unsigned char>> > vTransactionBuffer;
+        /* The bytes of data waiting in the disk buffer. */
+        std::atomic<uint64> nDiskBufferSize;
+        
+        
+        /** The heap bytes of an allocation, with the allocator's header and rounding. **/
+        static uint64 Allocation(uint64 nBytes)
+        {
+            if(nBytes == 0)
+                return 0;
+            
+            return std::max((uint64)32, (nBytes + sizeof(void*) + 15) & ~(uint64)15);
+        }
         
         
-        /* Thread of cache cleaner. */
-        Thread_t CACHE_THREAD;
+        /** The resident bytes of an object: its hash table node, key and data. **/
+        static uint64 Charge(const CachedObject& object)
+        {
+            return Allocation(sizeof(void*) + sizeof(CachedObject) + sizeof(std::size_t)) + Allocation(object.first.capacity()) + Allocation(object.second.Data.capacity());
+        }
+        
+        
+        /** Whether an object in this state is waiting to be written. **/
+        static bool IsDirty(unsigned char nState)
+        {
+            return (nState == PENDING_WRITE || nState == PENDING_ERASE || nState == PENDING_TX);
+        }
+        
+        
+        /** The share of the cache each shard may hold, after the disk buffer. **/
+        uint64 ShardLimit() const
+        {
+            uint64 nMaxSize = MAX_CACHE_SIZE, nBuffer = nDiskBufferSize;
+            
+            return (nMaxSize > nBuffer ? nMaxSize - nBuffer : 0) / nShards;
+        }
+        
+        
+        /** Add or remove an object from the size accounting, before and after it changes. **/
+        void Account(CacheShard& shard, const CachedObject& object, bool fAdd)
+        {
+            uint64 nCharge = Charge(object);
+            if(fAdd)
+            {
+                shard.nSize  += nCharge;
+                nCurrentSize += nCharge;
+                if(IsDirty(object.second.State))
+                    nDirtySize += nCharge;
+            }
+            else
+            {
+                shard.nSize  -= nCharge;
+                nCurrentSize -= nCharge;
+                if(IsDirty(object.second.State))
+                    nDirtySize -= nCharge;
+            }
+        }
         
         
     public:
         
         /** Base Constructor.
         * 
-        * MAX_CACHE_SIZE default value is 32 MB
-        * MAX_CACHE_BUCKETS default value is 65,539 (2 bytes)
+        * MAX_CACHE_SIZE default value is 1 MB
         * 
         */
-        MemCachePool() : fDestruct(false), MAX_CACHE_SIZE(1024 * 1024), nCurrentSize(0), CACHE_THREAD(boost::bind(&MemCachePool::CacheCleaner, this)) {}
+        MemCachePool() : MAX_CACHE_SIZE(1024 * 1024), MAX_DIRTY_SIZE(1024 * 1024 * DEFAULT_CACHE_DIRTY_PERCENT / 100), nCurrentSize(0), nDirtySize(0), nEvictions(0), nClockSteps(0), nShards(MAX_CACHE_POOL_SHARDS), pShards(new CacheShard[MAX_CACHE_POOL_SHARDS]), nDiskBufferSize(0) {}
         
         
         /** Cache Size Constructor
         * 
-        * @param[in] nCacheSizeIn The maximum size of this Cache Pool
+        * @param[in] nCacheSizeIn The maximum size of this Cache Pool in bytes
+        * @param[in] nShardsIn The number of shards, rounded up to a power of two
+        * @param[in] nDirtyPercent The percent of the cache that may be dirty
         * 
         */
-        MemCachePool(unsigned int nCacheSizeIn) : fDestruct(false), MAX_CACHE_SIZE(nCacheSizeIn), nCurrentSize(0), CACHE_THREAD(boost::bind(&MemCachePool::CacheCleaner, this)) {}
+        MemCachePool(uint64 nCacheSizeIn, unsigned int nShardsIn = MAX_CACHE_POOL_SHARDS, unsigned int nDirtyPercent = DEFAULT_CACHE_DIRTY_PERCENT) : MAX_CACHE_SIZE(nCacheSizeIn), MAX_DIRTY_SIZE(nCacheSizeIn * nDirtyPercent / 100), nCurrentSize(0), nDirtySize(0), nEvictions(0), nClockSteps(0), nShards(RoundShards(nShardsIn)), pShards(new CacheShard[nShards]), nDiskBufferSize(0) {}
         
         
         /* Class Destructor. */
         ~MemCachePool()
         {
-            fDestruct = true;
+            delete[] pShards;
+        }
+        
+        
+        /** Round a shard count up to a power of two. **/
+        static unsigned int RoundShards(unsigned int nShardsIn)
+        {
+            unsigned int nRounded = 1;
+            while(nRounded < nShardsIn)
+                nRounded <<= 1;
             
-            CACHE_THREAD.join();
+            return nRounded;
         }
         
         
-        /** Get the assigned bucket
+        /** Get the assigned shard
         * 
         * @param[in] vKey The binary data of key 
         * 
-        * @return The bucket number through serializaing first two bytes of key.
+        * @return The shard, from the upper bits of the key hash so they are independent of the bits used within it.
         */
-        unsigned int GetBucket(std::vector<unsigned char> vKey) const 
+        CacheShard& GetShard(const std::vector<unsigned char>& vKey) const 
         { 
-            uint64 nBucket = 0;
-            for(int i = 0; i < vKey.size() && i < 8; i++)
-                nBucket += vKey[i] << (8 * i);
-            
-            return nBucket % MAX_CACHE_POOL_BUCKETS;
+            return pShards[(CachedKeyHash()(vKey) >> 40) & (nShards - 1)];
         }
         
         
@@ -143,12 +267,12 @@ namespace LLD
         * @return True/False whether pool contains data by index
         * 
         */
-        bool Has(std::vector<unsigned char> vKey, unsigned int nBucket = MAX_CACHE_POOL_BUCKETS + 1) const 
+        bool Has(const std::vector<unsigned char>& vKey) const 
         { 
-            if(nBucket == MAX_CACHE_POOL_BUCKETS + 1)
-                nBucket = GetBucket(vKey);
+            CacheShard& shard = GetShard(vKey);
+            LOCK(shard.MUTEX);
             
-            return (mapObjects[nBucket].find(vKey) != mapObjects[nBucket].end());
+            return (shard.mapObjects.find(vKey) != shard.mapObjects.end());
         }
         
         
@@ -160,20 +284,68 @@ namespace LLD
         * @return True if object was found, false if none found by index.
         * 
         */
-        bool Get(std::vector<unsigned char> vKey, std::vector<unsigned char>& vData)
+        bool Get(const std::vector<unsigned char>& vKey, std::vector<unsigned char>& vData)
         {
-            LOCK(MUTEX);
+            unsigned char nState;
             
-            /* Check if the Record Exists. */
-            auto nBucket = GetBucket(vKey);
-            if(!Has(vKey, nBucket))
+            return Get(vKey, vData, nState);
+        }
+        
+        
+        /** Get the data and its state by index
+        * 
+        * @param[in] vKey The binary data of the key
+        * @param[out] vData The binary data of the cached record
+        * @param[out] nState The state of the cached record
+        * 
+        * @return True if object was found, false if none found by index.
+        * 
+        */
+        bool Get(const std::vector<unsigned char>& vKey, std::vector<unsigned char>& vData, unsigned char& nState)
+        {
+            CacheShard& shard = GetShard(vKey);
+            LOCK(shard.MUTEX);
+            
+            auto it = shard.mapObjects.find(vKey);
+            if(it == shard.mapObjects.end())
                 return false;
             
-            /* Get the data record. */
-            vData = mapObjects[nBucket][vKey].Data;
+            vData  = it->second.Data;
+            nState = it->second.State;
             
-            /* Update the Object's time (to keep cache of most accessed elements). */
-            mapObjects[nBucket][vKey].Timestamp = Timestamp(true);
+            /* Give the Object another pass of the clock hand (to keep cache of most accessed elements). */
+            it->second.fReferenced = true;
+            
+            return true;
+        }
+        
+        
+        /** Read an object in place rather than copying its data out
+        * 
+        * The object is pinned by its shard lock while fnRead runs, so fnRead
+        * must not call back into the pool.
+        * 
+        * @param[in] vKey The binary data of the key
+        * @param[out] nState The state of the cached record
+        * @param[in] fnRead Called with the binary data of the cached record
+        * 
+        * @return True if object was found, false if none found by index.
+        * 
+        */
+        template<typename ReadFunc>
+        bool View(const std::vector<unsigned char>& vKey, unsigned char& nState, ReadFunc fnRead)
+        {
+            CacheShard& shard = GetShard(vKey);
+            LOCK(shard.MUTEX);
+            
+            auto it = shard.mapObjects.find(vKey);
+            if(it == shard.mapObjects.end())
+                return false;
+            
+            nState = it->second.State;
+            it->second.fReferenced = true;
+            
+            fnRead(it->second.Data);
             
             return true;
         }
@@ -191,11 +363,11 @@ namespace LLD
         */
         bool Get(std::vector< std::pair<std::vector<unsigned char>, std::vector<unsigned char>> >& vObjects, unsigned char nState = MEMORY_ONLY, unsigned int nLimit = 0)
         {
-            LOCK(MUTEX);
-            
-            for(int nBucket = 0; nBucket < MAX_CACHE_POOL_BUCKETS; nBucket++)
+            for(unsigned int nShard = 0; nShard < nShards; nShard++)
             {
-                for(auto obj : mapObjects[nBucket])
+                LOCK(pShards[nShard].MUTEX);
+                
+                for(auto& obj : pShards[nShard].mapObjects)
                 {
                     if(nLimit != 0 && vObjects.size() >= nLimit)
                         return true;
@@ -223,11 +395,11 @@ namespace LLD
         */
         bool GetIndexes(std::vector< std::vector<unsigned char> >& vIndexes, unsigned char nState = MEMORY_ONLY, unsigned int nLimit = 0)
         {
-            LOCK(MUTEX);
-            
-            for(int nBucket = 0; nBucket < MAX_CACHE_POOL_BUCKETS; nBucket++)
+            for(unsigned int nShard = 0; nShard < nShards; nShard++)
             {
-                for(auto obj : mapObjects[nBucket])
+                LOCK(pShards[nShard].MUTEX);
+                
+                for(auto& obj : pShards[nShard].mapObjects)
                 {
                     if(nLimit != 0 && vIndexes.size() >= nLimit)
                         return true;
@@ -251,25 +423,49 @@ namespace LLD
         * @param[in] nTimestamp The Time record was Put (ms)
         * 
         */
-        void Put(std::vector<unsigned char> vKey, std::vector<unsigned char> vData, unsigned char nState = MEMORY_ONLY, uint64 nTimestamp = Timestamp(true))
+        void Put(const std::vector<unsigned char>& vKey, const std::vector<unsigned char>& vData, unsigned char nState = MEMORY_ONLY, uint64 nTimestamp = Timestamp(true))
         {
-            LOCK(MUTEX);
+            CacheShard& shard = GetShard(vKey);
+            LOCK(shard.MUTEX);
+            
+            /* Overwrite existing objects. New ones join the clock ring. */
+            auto it = shard.mapObjects.find(vKey);
+            if(it == shard.mapObjects.end())
+            {
+                it = shard.mapObjects.emplace(vKey, CachedData()).first;
+                Link(shard, &(*it));
+                
+                /* Charge the hash table buckets as they grow. */
+                uint64 nBucketBytes = shard.mapObjects.bucket_count() * sizeof(void*);
+                shard.nSize  += nBucketBytes - shard.nBucketBytes;
+                nCurrentSize += nBucketBytes - shard.nBucketBytes;
+                shard.nBucketBytes = nBucketBytes;
+            }
+            else
+            {
+                Account(shard, *it, false);
+                it->second.fReferenced = true;
+            }
+            
+            CachedData& cacheObject = it->second;
+            cacheObject.State     = nState;
+            cacheObject.Timestamp = nTimestamp;
+            cacheObject.Data      = vData;
             
-            auto nBucket = GetBucket(vKey);
-            if(!Has(vKey, nBucket))
-                nCurrentSize += vData.size();
+            Account(shard, *it, true);
             
-            /* Handle the Writing Buffer, out of transaction orders. */
+            /* Handle the Writing Buffer, out of transaction orders. Kept under the shard lock so writes to a key stay in order. */
             if(nState == PENDING_WRITE)
+            {
+                LOCK(DISK_MUTEX);
+                
                 vDiskBuffer.push_back(std::make_pair(vKey, vData));
+                nDiskBufferSize += sizeof(vDiskBuffer[0]) + Allocation(vKey.size()) + Allocation(vData.size());
+            }
             
-            /* Handle a Pending Transaction, write to buffer */
-            else if(nState == PENDING_TX)
-                vTransactionBuffer.push_back(std::make_pair(vKey, vData));
-                
-            /* Overwrite existing objects. */
-            CachedData cacheObject = { nState, nTimestamp, vData };
-            mapObjects[nBucket][vKey] = cacheObject;
+            /* Once the cache is full, keep the shard within its share of it. */
+            if(Size() > MAX_CACHE_SIZE && shard.nSize > ShardLimit())
+                Evict(shard, ShardLimit());
         }
         
         
@@ -280,34 +476,71 @@ namespace LLD
         */
         bool GetDiskBuffer(std::vector< std::pair<std::vector<unsigned char>, std::vector<unsigned char>> >& vBuffer)
         {
-            LOCK(MUTEX);
+            LOCK(DISK_MUTEX);
             
             if(vDiskBuffer.size() == 0)
                 return false;
             
-            vBuffer = vDiskBuffer;
+            vBuffer.swap(vDiskBuffer);
             vDiskBuffer.clear();
+            nDiskBufferSize = 0;
             
             return true;
         }
         
         
-        /** Get Transaction Buffer.
+        /** The bytes of data waiting in the disk buffer. **/
+        uint64 DiskBufferSize() const
+        {
+            return nDiskBufferSize;
+        }
+        
+        
+        /** The resident bytes of the pool, including the disk buffer. **/
+        uint64 Size() const
+        {
+            return nCurrentSize + nDiskBufferSize;
+        }
+        
+        
+        /** The resident bytes of dirty objects, including the disk buffer. **/
+        uint64 DirtySize() const
+        {
+            return nDirtySize + nDiskBufferSize;
+        }
+        
+        
+        /** The bytes of dirty objects writers should wait for the disk to catch up at. **/
+        uint64 MaxDirtySize() const
+        {
+            return MAX_DIRTY_SIZE;
+        }
+        
+        
+        /** Change the size of the cache while it is in use, evicting down to it if it shrank.
+        * 
+        * @param[in] nCacheSizeIn The maximum size of this Cache Pool in bytes
+        * @param[in] nDirtyPercent The percent of the cache that may be dirty
         * 
-        *  Returns the current disk buffer ready for writing.
-        *
         */
-        bool GetTransactionBuffer(std::vector< std::pair<std::vector<unsigned char>, std::vector<unsigned char>> >& vBuffer)
+        void SetMaxSize(uint64 nCacheSizeIn, unsigned int nDirtyPercent = DEFAULT_CACHE_DIRTY_PERCENT)
         {
-            LOCK(MUTEX);
-            
-            if(vTransactionBuffer.size() == 0)
-                return false;
+            MAX_CACHE_SIZE = nCacheSizeIn;
+            MAX_DIRTY_SIZE = nCacheSizeIn * nDirtyPercent / 100;
             
-            vBuffer = vTransactionBuffer;
-            vTransactionBuffer.clear();
-            
-            return true;
+            for(unsigned int nShard = 0; nShard < nShards && Size() > MAX_CACHE_SIZE; nShard++)
+            {
+                LOCK(pShards[nShard].MUTEX);
+                
+                Evict(pShards[nShard], ShardLimit());
+            }
+        }
+        
+        
+        /** The maximum size of the cache in bytes. **/
+        uint64 MaxSize() const
+        {
+            return MAX_CACHE_SIZE;
         }
         
         
@@ -317,14 +550,46 @@ namespace LLD
         * @param[in] nState The new state of the object.
         * 
         */
-        void SetState(std::vector<unsigned char> vKey, unsigned short nState)
+        void SetState(const std::vector<unsigned char>& vKey, unsigned short nState)
         {
-            auto nBucket = GetBucket(vKey);
-            if(!Has(vKey, nBucket))
+            CacheShard& shard = GetShard(vKey);
+            LOCK(shard.MUTEX);
+            
+            auto it = shard.mapObjects.find(vKey);
+            if(it == shard.mapObjects.end())
                 return;
             
-            mapObjects[nBucket][vKey].Timestamp = Timestamp(true);
-            mapObjects[nBucket][vKey].State = nState;
+            Account(shard, *it, false);
+            it->second.Timestamp = Timestamp(true);
+            it->second.State = nState;
+            Account(shard, *it, true);
+        }
+        
+        
+        /** Set the state of the data in cache if it hasn't changed since it was read
+        * 
+        * @param[in] vKey The key in binary form
+        * @param[in] nState The new state of the object
+        * @param[in] nFromState The state the object must still be in
+        * @param[in] vData The data the object must still hold
+        * 
+        * @return True if the state was changed
+        * 
+        */
+        bool SetState(const std::vector<unsigned char>& vKey, unsigned char nState, unsigned char nFromState, const std::vector<unsigned char>& vData)
+        {
+            CacheShard& shard = GetShard(vKey);
+            LOCK(shard.MUTEX);
+            
+            auto it = shard.mapObjects.find(vKey);
+            if(it == shard.mapObjects.end() || it->second.State != nFromState || it->second.Data != vData)
+                return false;
+            
+            Account(shard, *it, false);
+            it->second.State = nState;
+            Account(shard, *it, true);
+            
+            return true;
         }
         
         
@@ -335,21 +600,40 @@ namespace LLD
         * @return True on successful removal, false if it fails
         * 
         */
-        bool Remove(std::vector<unsigned char> vKey)
+        bool Remove(const std::vector<unsigned char>& vKey)
         {
-            LOCK(MUTEX);
+            CacheShard& shard = GetShard(vKey);
+            LOCK(shard.MUTEX);
             
             /* Check if the Record Exists. */
-            auto nBucket = GetBucket(vKey);
-            if(!Has(vKey, nBucket))
+            auto it = shard.mapObjects.find(vKey);
+            if(it == shard.mapObjects.end())
                 return false;
             
-            nCurrentSize -= mapObjects[nBucket][vKey].Data.size();
+            Erase(shard, it);
             
-            //if(mapObjects[nBucket][vKey].State == PENDING_TX)
-            //    mapObjects[nBucket][vKey].State = PENDING_ERASE;
-            //else
-            mapObjects[nBucket].erase(vKey);
+            return true;
+        }
+        
+        
+        /** Remove Object by Index if it is still in the given State
+        * 
+        * @param[in] vKey Binary Data of the Key
+        * @param[in] nState The State the object must still be in
+        * 
+        * @return True on successful removal, false if it fails
+        * 
+        */
+        bool Remove(const std::vector<unsigned char>& vKey, unsigned char nState)
+        {
+            CacheShard& shard = GetShard(vKey);
+            LOCK(shard.MUTEX);
+            
+            auto it = shard.mapObjects.find(vKey);
+            if(it == shard.mapObjects.end() || it->second.State != nState)
+                return false;
+            
+            Erase(shard, it);
             
             return true;
         }
@@ -370,51 +654,95 @@ namespace LLD
             GetIndexes(vKeys, nState);
             
             for(auto Key : vKeys)
-                Remove(Key);
+                Remove(Key, nState);
+        }
+        
+        
+        /** The number of shards in the pool. **/
+        unsigned int Shards() const { return nShards; }
+        
+        
+        /** Add an object to the clock ring of its shard, just behind the hand. **/
+        void Link(CacheShard& shard, CachedObject* pObject)
+        {
+            if(!shard.pHand)
+            {
+                pObject->second.pPrev = pObject->second.pNext = pObject;
+                shard.pHand = pObject;
+                
+                return;
+            }
+            
+            CachedObject* pTail = shard.pHand->second.pPrev;
+            pObject->second.pPrev = pTail;
+            pObject->second.pNext = shard.pHand;
+            pTail->second.pNext = pObject;
+            shard.pHand->second.pPrev = pObject;
         }
         
         
-        static bool SortByTime(const std::pair< std::vector<unsigned char>, CachedData>& a, const std::pair< std::vector<unsigned char>, CachedData>& b)
+        /** Take an object out of its shard, unlinking it from the clock ring. **/
+        void Erase(CacheShard& shard, std::unordered_map<std::vector<unsigned char>, CachedData, CachedKeyHash>::iterator it)
         {
-            return a.second.Timestamp < b.second.Timestamp;
+            CachedObject* pObject = &(*it);
+            if(pObject->second.pNext == pObject)
+                shard.pHand = NULL;
+            else
+            {
+                pObject->second.pPrev->second.pNext = pObject->second.pNext;
+                pObject->second.pNext->second.pPrev = pObject->second.pPrev;
+                
+                if(shard.pHand == pObject)
+                    shard.pHand = pObject->second.pNext;
+            }
+            
+            Account(shard, *pObject, false);
+            shard.mapObjects.erase(it);
         }
         
         
-        /** Clean up older data from the Cache Pool to keep within Cache Limits. 
+        /** Run the clock hand of a shard until it is within its share of the cache.
+        * 
+        * Objects waiting for writes or transactions are stepped over. The hand gives up
+        * after two full turns without an eviction, when everything left is pinned.
+        * 
+        * @param[in] shard The shard to trim, its lock held by the caller
+        * @param[in] nLimit The bytes the shard may hold
         * 
-        *  This is a Worker Thread.
         */
-        void CacheCleaner()
+        void Evict(CacheShard& shard, uint64 nLimit)
         {
-            while(!fDestruct)
+            uint64 nSteps = 0, nIdle = 0;
+            while(shard.nSize > nLimit && shard.pHand && nIdle <= 2 * shard.mapObjects.size())
             {
-                /* Trim off less used objects if reached cache limits. */
-                if(nCurrentSize > MAX_CACHE_SIZE)
+                CachedObject* pObject = shard.pHand;
+                shard.pHand = pObject->second.pNext;
+                nSteps++;
+                nIdle++;
+                
+                if(IsDirty(pObject->second.State))
+                    continue;
+                
+                if(pObject->second.fReferenced)
                 {
-                    std::vector< std::pair< std::vector<unsigned char>, CachedData > > vKeys;
-                    for(int nBucket = 0; nBucket < MAX_CACHE_POOL_BUCKETS; nBucket++)
-                    {
-                        for(auto obj : mapObjects[nBucket])
-                        {
-                            /* Don't clear objects waiting for writes or transactions. */
-                            if( (obj.second.State != PENDING_WRITE) && (obj.second.State != PENDING_ERASE) && (obj.second.State != PENDING_TX) )
-                                vKeys.push_back(obj);
-                        }
-                    }
+                    pObject->second.fReferenced = false;
                     
-                    /* Sort by earliest timestamp and remove until cache is balanced. */
-                    std::sort(vKeys.begin(), vKeys.end(), SortByTime);
-                    for(auto obj : vKeys)
-                    {
-                        if(nCurrentSize <= MAX_CACHE_SIZE)
-                            break;
-                        
-                        Remove(obj.first);
-                    }
+                    continue;
                 }
                 
-                Sleep(1);
+                Erase(shard, shard.mapObjects.find(pObject->first));
+                nEvictions++;
+                nIdle = 0;
             }
+            
+            nClockSteps += nSteps;
+        }
+        
+        
+        /** Dump the eviction statistics to the debug console. **/
+        void PrintStats()
+        {
+            printf(FUNCTION "Size: %" PRIu64 " of %" PRIu64 " bytes | Dirty: %" PRIu64 " of %" PRIu64 " bytes | Evictions: %" PRIu64 " | Clock Steps per Eviction: %.2f\n", __PRETTY_FUNCTION__, Size(), MAX_CACHE_SIZE.load(), DirtySize(), MAX_DIRTY_SIZE.load(), nEvictions.load(), nEvictions.load() > 0 ? nClockSteps.load() / (double)nEvictions.load() : 0.0);
         }
     };
 }
@@ -14,11 +14,24 @@ ________________________________________________________________________________
 #ifndef NEXUS_LLD_TEMPLATES_SECTOR_H
 #define NEXUS_LLD_TEMPLATES_SECTOR_H
 
+#include <deque>
+#include <memory>
+
 #include "pool.h"
+#include "codec.h"
 #include "key.h"
+#include "journal.h"
 #include "transaction.h"
 
+#include "../include/bloom.h"
+#include "../include/filecache.h"
+#include "../include/freespace.h"
+#include "../include/keylock.h"
+#include "../include/sortedindex.h"
+#include "../include/verify.h"
+
 #include "../../Util/include/runtime.h"
+#include "../../Util/include/mmaplib.h"
 
 namespace LLD
 {
@@ -27,8 +40,49 @@ namespace LLD
     const unsigned int MAX_SECTOR_FILE_SIZE = 1024 * 1024 * 1024; //1 GB per File
     
     
-    /* Maximum cache buckets for sectors. */
-    const unsigned int MAX_SECTOR_CACHE_SIZE = 1024 * 1024; //1 MB Max Cache
+    /* Default size of the sector cache in megabytes, set with -lldcache. */
+    const unsigned int DEFAULT_SECTOR_CACHE_SIZE = 64;
+    
+    
+    /* Longest a writer waits in milliseconds for the dirty part of the cache to be written. */
+    const unsigned int SECTOR_THROTTLE_TIMEOUT = 1000;
+    
+    
+    /* Size of the chunks memory maps are grown by as sector files are appended. */
+    const unsigned int SECTOR_MMAP_CHUNK_SIZE = 64 * 1024 * 1024; //64 MB per Remap
+    
+    
+    /* Buckets of the flush latency histogram, powers of two in micro-seconds. */
+    const unsigned int SECTOR_FLUSH_HISTOGRAM_BUCKETS = 32;
+    
+    
+    /* Transactions waiting to be applied before the cache writer is woken early. */
+    const unsigned int SECTOR_APPLY_BATCH = 1024;
+    
+    
+    /* Batched reads join sectors up to this many bytes apart, into reads of up to this many bytes. */
+    const unsigned int SECTOR_BATCH_READ_GAP  = 4096;
+    const unsigned int SECTOR_BATCH_READ_SIZE = 1024 * 1024;
+    
+    
+    /* Compaction defaults: milliseconds between checks (-compactinterval), percent of a file free
+        before it is compacted (-compactratio), and kilobytes a second read and written (-compactrate). */
+    const unsigned int DEFAULT_COMPACT_INTERVAL = 10000;
+    const unsigned int DEFAULT_COMPACT_RATIO    = 50;
+    const unsigned int DEFAULT_COMPACT_RATE     = 8192;
+    
+    
+    /* Compaction reads live sectors in spans of up to this many bytes, moving each span under one lock. */
+    const unsigned int SECTOR_COMPACT_BATCH_SIZE = 1024 * 1024;
+    
+    
+    /* Scrub defaults: milliseconds between passes over every sector (-scrubinterval), and kilobytes a second read (-scrubrate). */
+    const unsigned int DEFAULT_SCRUB_INTERVAL = 3600000;
+    const unsigned int DEFAULT_SCRUB_RATE     = 8192;
+    
+    
+    /* Keys a cursor takes from the sorted index at a time. */
+    const unsigned int SECTOR_CURSOR_BATCH = 256;
     
 
     /** Base Template Class for a Sector Database. 
@@ -51,10 +105,10 @@ namespace LLD
         access levels of the sector. This specific class handles the lower
         level disk communications for the sector database.
         
-        If each sector was allowed to be varying sizes it would remove the
-        ability to use free space that becomes available upon an erase of a
-        record. Use this Database purely for fixed size structures. Overflow
-        attempts will trigger an error code.
+        Records may change size. One that shrinks gives back the end of its
+        sector, one that grows is moved to a new sector and its old one freed.
+        Space freed by erases and moves is reused for new records once the
+        keychain no longer pointing at it is synced.
         
         TODO:: Add in the Database File Searching from Sector Keys. Allow Multiple Files.
         
@@ -62,12 +116,21 @@ namespace LLD
     template<typename KeychainType> class SectorDatabase
     {
     protected:
-        /* Mutex for Thread Synchronization. 
-            TODO: Lock Mutex based on Read / Writes on a per Sector Basis. 
-            Will allow higher efficiency for thread concurrency. */
+        /* Mutex for Thread Synchronization. Held by writers: the keychain, the free space, the key filter
+            and the sorted index change under it. Readers don't take it, they hold the lock of their key. */
         Mutex_t SECTOR_MUTEX;
         
         
+        /* Locks striped by key, taken after the sector lock. Readers of a key hold its stripe shared from
+            finding its sector to reading it, writers hold it exclusive while they change the sector in place.
+            Space freed or moved away from is only reused or removed behind a barrier of every stripe. */
+        KeyLocks keyLocks;
+        
+        
+        /* The append cursor, nCurrentFile and nCurrentFileSize. Advanced under the sector lock and this one. */
+        Mutex_t APPEND_MUTEX;
+        
+        
         /* The String to hold the Disk Location of Database File. */
         std::string strBaseLocation;
         
@@ -84,40 +147,166 @@ namespace LLD
         bool fInitialized = false;
         
         
+        /* Memory Map Flag. Sector files are mapped once and read / written through the mapping. */
+        bool fMemoryMap = false;
+        
+        
+        /* The checksum new sectors are written with, from -checksum. A database can choose its own in its constructor.
+           Each Sector Key records the one it used, so sectors written with another are still read. */
+        unsigned char nChecksumType = CHECKSUM_CRC32C;
+        
+        
+        /* Compresses new sectors with -compress, and reads back sectors compressed any way. A database can choose its own compression
+           in its constructor. Each Sector Key records the one its sector has, so compressed and uncompressed sectors are read alike. */
+        SectorCompressor compressor;
+        
+        
         /* Timer for Runtime Calculations. */
         Timer runtime;
         
         
-        /* Class to handle Transaction Data. */
-        SectorTransaction* pTransaction;
+        /* Transactions opened with TxnBegin, one per thread. Each writes to a set of its own until it commits,
+            and reads the records as they were committed when it began. */
+        boost::thread_specific_ptr<SectorTransaction> pThreadTransaction;
+        
+        
+        /* Versions of the records kept for open transactions. Its lock is held by commits from their conflict
+            check until their writes are readable, or with the journal until they are appended, and is taken before
+            the sector lock. */
+        Mutex_t VERSION_MUTEX;
+        SnapshotVersions versions;
+        
+        
+        /* Transactions open, and writes outside a transaction in flight without a version. */
+        std::atomic<uint64> nOpenTransactions, nPendingWrites;
+        
+        
+        /* Wakes a transaction beginning once the pending writes are done, or the commits before its snapshot are readable. */
+        boost::mutex PENDING_MUTEX;
+        boost::condition_variable PENDING_CONDITION;
+        
+        
+        /* Commits refused for writing a key committed since their snapshot. */
+        std::atomic<uint64> nConflicts;
         
         
         /* Sector Keys Database. */
         KeychainType* SectorKeys;
         
         
-        /* Hashmap Custom Hash Using SK. */
-        struct SK_Hashmap
-        {
-            std::size_t operator()(const std::vector<unsigned char>& k) const {
-                return LLC::HASH::SK32(k);
-            }
-        };
-        
-        //std::unordered_map< std::vector<unsigned char>, std::vector<unsigned char>, SK_Hashmap > mapRecordCache;
-        //std::map< std::vector<unsigned char>, std::vector<unsigned char> > mapRecordCache[MAX_SECTOR_CACHE_BUCKETS];
+        /* Records in memory, routed to their shards by the key hash. */
         MemCachePool* cachePool;
         
+        /* The id of the sector files in the file handle cache. */
+        unsigned int nFileCacheID;
+        
         /* The current File Position. */
         mutable unsigned int nCurrentFile;
         mutable unsigned int nCurrentFileSize;
         
+        /* The sector files on disk. Compaction removes files, leaving gaps in the numbering. */
+        std::set<unsigned int> setSectorFiles;
+        
+        /* Size a file is appended to before a new one is started, set with -sectorfilesize. */
+        unsigned int nMaxFileSize;
+        
+        /* Free extents of the sector files, reused before appending. */
+        ExtentAllocator freeSpace;
+        
+        /* Filter of the keys in the keychain, so lookups of missing keys don't reach it. Unused with -bloom=0. */
+        BloomFilter bloomFilter;
+        bool fBloomFilter;
+        
+        /* Keychain lookups the filter answered, and the ones it passed that missed anyway. */
+        std::atomic<uint64> nBloomChecks, nBloomMisses, nBloomFalsePositives;
+        
+        /* Keys of the keychain in order, for cursors. NULL unless enabled with -sortedindex. */
+        SortedKeyIndex* pSortedIndex;
+        
+        /* Journal of Committed Transactions. NULL if transactions are written straight to the sectors. */
+        CJournalDB* pJournal;
+        
+        /* Transactions appended to the journal, waiting to be applied to the sectors and keychain once durable. */
+        std::deque<JournalRecord> queueApply;
+        
+        /* The last record appended, the last readable from the cache, and the last before which every record is
+            readable or dropped. Records after them wait for the journal to sync them. */
+        uint64 nAppendedSequence;
+        uint64 nPublishedSequence;
+        std::atomic<uint64> nSettledSequence;
+        
+        /* The last transaction applied, the last covered by a checkpoint, and the time of that checkpoint. */
+        uint64 nAppliedSequence;
+        uint64 nCheckpointSequence;
+        uint64 nLastCheckpoint;
+        
+        /* Held across a checkpoint, taken before the sector lock. Sector files aren't removed while it syncs them. */
+        Mutex_t CHECKPOINT_MUTEX;
+        
+        /* Sector files written since the last checkpoint, the ones it syncs. Changed under the sector lock. */
+        std::set<unsigned int> setDirtyFiles;
+        
+        /* Wakes the cache writer before its flush interval is up, and the writers waiting on it once it has flushed. */
+        boost::mutex FLUSH_MUTEX;
+        boost::condition_variable FLUSH_CONDITION;
+        boost::condition_variable FLUSHED_CONDITION;
+        unsigned int nThrottled;
+        
+        /* The cache size and dirty percent last applied to the cache pool. */
+        uint64 nCacheSize;
+        unsigned int nCacheDirty;
+        
+        /* Milliseconds between flushes, and the bytes waiting that trigger one early. */
+        unsigned int nFlushInterval;
+        uint64 nFlushSize;
+        
+        /* Flush statistics and latency histogram. */
+        uint64 nFlushes, nFlushRecords, nFlushBytes, nFlushWrites;
+        uint64 nFlushHistogram[SECTOR_FLUSH_HISTOGRAM_BUCKETS];
+        
+        /* Writes held back while the cache was too dirty, and the time spent waiting. */
+        std::atomic<uint64> nThrottles, nThrottleMicroseconds;
+        
+        /* Compaction statistics: files removed, live bytes moved, file bytes reclaimed, time taken. */
+        uint64 nCompactions, nCompactMoved, nCompactReclaimed, nCompactMicroseconds;
+        
+        /* When reads verify checksums, from -verifyreads, with one read in nVerifySample under VERIFY_SAMPLED. */
+        unsigned char nVerifyPolicy;
+        unsigned int nVerifySample;
+        
+        /* The sectors verified since the database was opened, under VERIFY_FIRST. */
+        VerifiedSectors* pVerified;
+        
+        /* Sectors the scrubber found corrupt with nothing to repair them from. Their reads fail under every policy. */
+        std::set<uint64> setCorrupt;
+        std::atomic<uint64> nCorrupt;
+        Mutex_t CORRUPT_MUTEX;
+        
+        /* Reads from disk verified, passed by the policy unverified, and failed. */
+        std::atomic<uint64> nReadsVerified, nReadsUnverified, nReadFailures;
+        
+        /* Scrub statistics: passes, sectors and bytes checked, mismatches found and repaired, time taken. One pass runs at a time. */
+        std::atomic<uint64> nScrubs, nScrubSectors, nScrubBytes, nScrubMismatches, nScrubRepaired, nScrubMicroseconds;
+        Mutex_t SCRUB_MUTEX;
+        
         /* Cache Writer Thread. */
         Thread_t CacheWriterThread;
         
+        /* Compactor Thread. */
+        Thread_t CompactorThread;
+        
+        /* Scrubber Thread. */
+        Thread_t ScrubberThread;
+        
+#if !defined(_WIN32)
+        /* Memory Maps of the Sector Files, opened on first access. Readers open them too, so they have a lock of their own. */
+        std::map<unsigned int, mmaplib::GrowableMemoryMappedFile*> mapSectorFiles;
+        Mutex_t MAP_MUTEX;
+#endif
+        
     public:
         /** The Database Constructor. To determine file location and the Bytes per Record. **/
-        SectorDatabase(std::string strName, const char* pszMode="r+") : strBaseLocation(GetDataDir().string() + "/" + strName + "/datachain/"), cachePool(new MemCachePool(MAX_SECTOR_CACHE_SIZE)), nCurrentFile(0), nCurrentFileSize(0), CacheWriterThread(boost::bind(&SectorDatabase::CacheWriter, this))
+        SectorDatabase(std::string strName, const char* pszMode="r+") : keyLocks(GetArg("-lockstripes", DEFAULT_KEY_LOCK_STRIPES)), strBaseLocation(GetDataDir().string() + "/" + strName + "/datachain/"), nOpenTransactions(0), nPendingWrites(0), nConflicts(0), cachePool(new MemCachePool(GetArg("-lldcache", DEFAULT_SECTOR_CACHE_SIZE) * 1024 * 1024, MAX_CACHE_POOL_SHARDS, GetArg("-lldcachedirty", DEFAULT_CACHE_DIRTY_PERCENT))), nCurrentFile(0), nCurrentFileSize(0), nMaxFileSize(GetArg("-sectorfilesize", MAX_SECTOR_FILE_SIZE)), fBloomFilter(GetBoolArg("-bloom", true)), nBloomChecks(0), nBloomMisses(0), nBloomFalsePositives(0), pSortedIndex(NULL), pJournal(NULL), nAppendedSequence(0), nPublishedSequence(0), nSettledSequence(0), nAppliedSequence(0), nCheckpointSequence(0), nLastCheckpoint(0), nThrottled(0), nCacheSize(cachePool->MaxSize()), nCacheDirty(GetArg("-lldcachedirty", DEFAULT_CACHE_DIRTY_PERCENT)), nFlushInterval(GetArg("-flushinterval", 100)), nFlushSize(GetArg("-flushsize", 4 * 1024 * 1024)), nFlushes(0), nFlushRecords(0), nFlushBytes(0), nFlushWrites(0), nFlushHistogram(), nThrottles(0), nThrottleMicroseconds(0), nCompactions(0), nCompactMoved(0), nCompactReclaimed(0), nCompactMicroseconds(0), nVerifyPolicy(VerifyPolicy(GetArg("-verifyreads", "always"))), nVerifySample(std::max((int)GetArg("-verifysample", DEFAULT_VERIFY_SAMPLE), 1)), pVerified(NULL), nCorrupt(0), nReadsVerified(0), nReadsUnverified(0), nReadFailures(0), nScrubs(0), nScrubSectors(0), nScrubBytes(0), nScrubMismatches(0), nScrubRepaired(0), nScrubMicroseconds(0), CacheWriterThread(boost::bind(&SectorDatabase::CacheWriter, this)), CompactorThread(boost::bind(&SectorDatabase::Compactor, this)), ScrubberThread(boost::bind(&SectorDatabase::Scrubber, this))
         {
             if(GetBoolArg("-runtime", false))
                 runtime.Start();
@@ -125,12 +314,48 @@ namespace LLD
             /* Read only flag when instantiating new database. */
             fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
             
+#if !defined(_WIN32)
+            /* Memory map flag for sector reads and writes. */
+            fMemoryMap = GetBoolArg("-mmap", false);
+#endif
+            
+            nChecksumType = ChecksumType(GetArg("-checksum", "crc32c"));
+            
+            /* Compress new sectors if asked to, with zlib if the compression asked for wasn't built. */
+            compressor.nType    = CompressionType(GetArg("-compress", "none"));
+            compressor.nLevel   = GetArg("-compresslevel", 0);
+            compressor.nMinSize = GetArg("-compressmin", DEFAULT_COMPRESS_MIN);
+            if(!CompressionAvailable(compressor.nType))
+            {
+                printf(FUNCTION "%s Compression isn't in this Build, using zlib\n", __PRETTY_FUNCTION__, CompressionName(compressor.nType));
+                compressor.nType = COMPRESS_ZLIB;
+            }
+            
+            /* Remember the sectors verified if only their first reads are. */
+            if(nVerifyPolicy == VERIFY_FIRST)
+                pVerified = new VerifiedSectors(GetArg("-verifyslots", DEFAULT_VERIFY_SLOTS));
+            
             /* Initialize the Keys Class. */
             SectorKeys = new KeychainType((GetDataDir().string() + "/" + strName + "/keychain/"));
             
+            /* Register the sector files with the file handle cache, read only if the database is. */
+            nFileCacheID = FileCache().Register(strBaseLocation + "_block.", fReadOnly);
+            
+            /* Journal the transactions unless they are written straight to the sectors. */
+            if(GetBoolArg("-journal", true))
+                pJournal = new CJournalDB(strBaseLocation + "_journal.");
+            
+            /* Keep the keys in order for cursors if asked to. */
+            if(GetBoolArg("-sortedindex", false))
+                pSortedIndex = new SortedKeyIndex(strBaseLocation + "_sortedindex");
+            
             /* Initialize the Database. */
             Initialize();
             
+            /* Train a dictionary for small records from the ones written so far, if there isn't one. */
+            if(compressor.nType != COMPRESS_NONE && compressor.Dictionaries() == 0 && GetBoolArg("-compressdict", false) && !fReadOnly)
+                TrainDictionary();
+            
             if(GetBoolArg("-runtime", false))
                 printf(ANSI_COLOR_GREEN FUNCTION "executed in %u micro-seconds\n" ANSI_COLOR_RESET, __PRETTY_FUNCTION__, runtime.ElapsedMicroseconds());
         }
@@ -139,11 +364,37 @@ namespace LLD
         {
             fDestruct = true;
             
+            /* The compactor stops between spans, its last records are flushed with the rest. */
+            CompactorThread.join();
+            ScrubberThread.join();
+            
+            NotifyWriter();
             CacheWriterThread.join();
             
-            delete pTransaction;
+            /* Keep the free extents and key filter for the next run. The writer's last checkpoint released the pending extents. */
+            if(!fReadOnly)
+            {
+                freeSpace.Save(strBaseLocation + "_freespace");
+                
+                if(fBloomFilter)
+                    bloomFilter.Save(strBaseLocation + "_bloom");
+                
+                if(pSortedIndex)
+                    pSortedIndex->Save();
+            }
+            
             delete cachePool;
             delete SectorKeys; 
+            delete pJournal;
+            delete pSortedIndex;
+            delete pVerified;
+            
+            FileCache().Close(nFileCacheID);
+            
+#if !defined(_WIN32)
+            for(auto it : mapSectorFiles)
+                delete it.second;
+#endif
         }
         
         
@@ -154,38 +405,94 @@ namespace LLD
             if(boost::filesystem::create_directories(strBaseLocation))
                 printf(FUNCTION "Generated Path %s\n", __PRETTY_FUNCTION__, strBaseLocation.c_str());
             
-            /* Find the most recent append file. */
-            while(true)
+            /* Find the sector files. The highest numbered is the one appended to. */
+            for(boost::filesystem::directory_iterator it(strBaseLocation), end; it != end; ++it)
             {
+                std::string strFile = it->path().filename().string();
+                if(strFile.size() > 7 && strFile.compare(0, 7, "_block.") == 0 && strFile.find_first_not_of("0123456789", 7) == std::string::npos)
+                    setSectorFiles.insert(atoi(strFile.c_str() + 7));
+            }
             
-                /* TODO: Make a worker or thread to check sizes of files and automatically create new file.
-                    Keep independent of reads and writes for efficiency. */
-                std::fstream fIncoming(strprintf("%s_block.%05u", strBaseLocation.c_str(), nCurrentFile).c_str(), std::ios::in | std::ios::binary);
-                if(!fIncoming) {
-                    
-                    /* Assign the Current Size and File. */
-                    if(nCurrentFile > 0)
-                        nCurrentFile--;
-                    else
+            if(setSectorFiles.empty())
+            {
+                /* Create a new file if it doesn't exist. */
+                std::ofstream cStream(strprintf("%s_block.%05u", strBaseLocation.c_str(), nCurrentFile).c_str(), std::ios::binary);
+                cStream.close();
+                
+                setSectorFiles.insert(nCurrentFile);
+            }
+            
+            /* Assign the Current Size and File. */
+            nCurrentFile     = *setSectorFiles.rbegin();
+            nCurrentFileSize = boost::filesystem::file_size(strprintf("%s_block.%05u", strBaseLocation.c_str(), nCurrentFile));
+            FileCache().Reserve(nFileCacheID, setSectorFiles.size());
+            
+            /* Load the dictionaries sectors were compressed with, before any is read. */
+            if(!compressor.LoadDictionaries(strBaseLocation + "_dictionary."))
+                printf(FUNCTION "Failed to Load Compression Dictionaries, Sectors Compressed with them won't be Read\n", __PRETTY_FUNCTION__);
+            
+            /* Load the free extents saved at the last shutdown. The file is removed so that after a
+                crash the space freed since is leaked, rather than a sector still in use handed out. */
+            if(!fReadOnly)
+            {
+                std::string strFreeSpace = strBaseLocation + "_freespace";
+                if(freeSpace.Load(strFreeSpace) && GetArg("-verbose", 0) >= 2)
+                    freeSpace.PrintStats();
+                
+                remove(strFreeSpace.c_str());
+            }
+            
+            /* Load the key filter saved at the last shutdown, or build it from the keychain. Like the
+                free extents it is removed, a filter missing keys written after it would hide them. */
+            if(fBloomFilter)
+            {
+                std::string strBloom = strBaseLocation + "_bloom";
+                if(!bloomFilter.Load(strBloom))
+                    RebuildBloomFilter();
+                
+                if(!fReadOnly)
+                    remove(strBloom.c_str());
+                
+                if(GetArg("-verbose", 0) >= 2)
+                    bloomFilter.PrintStats();
+            }
+            
+            /* Load the sorted index listed at the last shutdown, or build it from the keychain. The
+                manifest is removed too, runs written after it would be missing from it after a crash. */
+            if(pSortedIndex)
+            {
+                std::string strManifest = strBaseLocation + "_sortedindex";
+                if(!pSortedIndex->Load())
+                {
+                    std::vector< std::vector<unsigned char> > vKeys = SectorKeys->GetKeys();
+                    pSortedIndex->Rebuild(vKeys);
+                }
+                
+                if(!fReadOnly)
+                    remove(strManifest.c_str());
+                
+                if(GetArg("-verbose", 0) >= 2)
+                    pSortedIndex->PrintStats();
+            }
+            
+            /* Apply the transactions left in the journal from the last run. */
+            if(pJournal)
+            {
+                std::vector<JournalRecord> vRecords;
+                if(pJournal->Replay(vRecords))
+                {
+                    for(auto record : vRecords)
                     {
-                        /* Create a new file if it doesn't exist. */
-                        std::ofstream cStream(strprintf("%s_block.%05u", strBaseLocation.c_str(), nCurrentFile).c_str(), std::ios::binary);
-                        cStream.close();
+                        if(!ApplyRecord(record, true))
+                            break;
+                        
+                        nAppliedSequence = record.nSequence;
                     }
                     
-                    break;
+                    Checkpoint(true);
                 }
-                
-                /* Get the Binary Size. */
-                fIncoming.seekg(0, std::ios::end);
-                nCurrentFileSize = fIncoming.tellg();
-                fIncoming.close();
-                
-                /* Increment the Current File */
-                nCurrentFile++;
             }
             
-            pTransaction = NULL;
             fInitialized = true;
         }
         
@@ -194,421 +501,2089 @@ namespace LLD
         std::vector< std::vector<unsigned char> > GetKeys() { return SectorKeys->GetKeys(); }
         
         
-        template<typename Key>
-        bool Exists(const Key& key)
-        {
-            /** Serialize Key into Bytes. **/
-            CDataStream ssKey(SER_LLD, DATABASE_VERSION);
-            ssKey.reserve(GetSerializeSize(key, SER_LLD, DATABASE_VERSION));
-            ssKey << key;
-            std::vector<unsigned char> vKey(ssKey.begin(), ssKey.end());
+        /** Find Keys in Order, starting from a Key and limited to a Prefix.
             
-            /** Return the Key existance in the Keychain Database. **/
-            return SectorKeys->HasKey(vKey);
-        }
-        
-        template<typename Key>
-        bool Erase(const Key& key)
+            With the sorted index up to nMax keys are found at a time. Without it every
+            matching key is found at once, from a copy of the keychain's keys.
+            
+            @param[in] vFrom The key to start at
+            @param[in] fInclusive Whether vFrom itself is found
+            @param[in] vPrefix Only keys starting with this are found
+            @param[in] nMax The most keys to find with the sorted index
+            @param[out] vKeys The keys found, in byte order
+            
+            @return True if there may be more keys after the last found **/
+        bool ScanKeys(const std::vector<unsigned char>& vFrom, bool fInclusive, const std::vector<unsigned char>& vPrefix, unsigned int nMax, std::vector< std::vector<unsigned char> >& vKeys)
         {
-            if(GetBoolArg("-runtime", false))
-                runtime.Start();
+            LOCK(SECTOR_MUTEX);
             
-            /** Serialize Key into Bytes. **/
-            CDataStream ssKey(SER_LLD, DATABASE_VERSION);
-            ssKey.reserve(GetSerializeSize(key, SER_LLD, DATABASE_VERSION));
-            ssKey << key;
-            std::vector<unsigned char> vKey(ssKey.begin(), ssKey.end());
+            if(pSortedIndex)
+                return pSortedIndex->Scan(vFrom, fInclusive, vPrefix, nMax, vKeys);
             
-            if(pTransaction){
-                pTransaction->EraseTransaction(vKey);
+            vKeys.clear();
+            for(auto& vKey : SectorKeys->GetKeys())
+            {
+                if(vKey.size() < vPrefix.size() || !std::equal(vPrefix.begin(), vPrefix.end(), vKey.begin()))
+                    continue;
                 
-                return true;
+                if(vKey < vFrom || (!fInclusive && vKey == vFrom))
+                    continue;
+                
+                vKeys.push_back(vKey);
             }
-
             
-            /** Return the Key existance in the Keychain Database. **/
-            return SectorKeys->Erase(vKey);
+            std::sort(vKeys.begin(), vKeys.end());
             
-            if(GetBoolArg("-runtime", false))
-                printf(ANSI_COLOR_GREEN FUNCTION "executed in %u micro-seconds\n" ANSI_COLOR_RESET, __PRETTY_FUNCTION__, runtime.ElapsedMicroseconds());
+            return false;
         }
         
-        template<typename Key, typename Type>
-        bool Read(const Key& key, Type& value)
-        {
-            /** Serialize Key into Bytes. **/
-            CDataStream ssKey(SER_LLD, DATABASE_VERSION);
-            ssKey << key;
-            std::vector<unsigned char> vKey(ssKey.begin(), ssKey.end());
+        
+        /** Cursor over the Records of the Database in Key Order.
             
-            /** Get the Data from Sector Database. **/
-            std::vector<unsigned char> vData;
-            if(!Get(vKey, vData))
-                return false;
-
-            /** Deserialize Value. **/
-            try {
-                CDataStream ssValue(vData, SER_LLD, DATABASE_VERSION);
-                ssValue >> value;
-            }
-            catch (std::exception &e) {
-                return false;
-            }
-
-
-            return true;
-        }
-
-        template<typename Key, typename Type>
-        bool Write(const Key& key, const Type& value)
+            Keys are ordered by their serialized bytes, so a prefix of a key's serialization
+            finds every record under it. Keys are taken from the sorted index a batch at a
+            time and values are read as they are reached, so a cursor holds one batch of keys
+            whatever the size of the database. Records written or erased while a cursor is
+            open show up if they are past the batch it holds.
+            
+            Without -sortedindex a cursor sorts a copy of every matching key when opened. **/
+        class Cursor
         {
-            if (fReadOnly)
-                assert(!"Write called on database in read-only mode");
-
-            /** Serialize the Key. **/
-            CDataStream ssKey(SER_LLD, DATABASE_VERSION);
-            ssKey << key;
-            std::vector<unsigned char> vKey(ssKey.begin(), ssKey.end());
-
-            /** Serialize the Value **/
-            CDataStream ssValue(SER_LLD, DATABASE_VERSION);
-            ssValue << value;
-            std::vector<unsigned char> vData(ssValue.begin(), ssValue.end());
-
-            /** Commit to the Database. **/
-            if(pTransaction)
-            {
+            SectorDatabase* pDatabase;
+            
+            /* Prefix of the keys, and the last key returned. */
+            std::vector<unsigned char> vPrefix;
+            std::vector<unsigned char> vLast;
+            
+            /* The batch of keys, and the next of them to return. */
+            std::vector< std::vector<unsigned char> > vKeys;
+            unsigned int nPosition;
+            
+            /* Whether a key has been returned, and whether there are keys past the batch. */
+            bool fStarted;
+            bool fMore;
+            
+        public:
+            Cursor(SectorDatabase* pDatabaseIn, const std::vector<unsigned char>& vPrefixIn) : pDatabase(pDatabaseIn), vPrefix(vPrefixIn), nPosition(0), fStarted(false), fMore(true) {}
+            
+            
+            /** Move to the first record at or after a key.
                 
-                std::vector<unsigned char> vOriginalData;
-                //Get(vKey, vOriginalData);
+                @param[in] vFrom The binary key to start at **/
+            void Seek(const std::vector<unsigned char>& vFrom)
+            {
+                vLast    = vFrom;
+                fStarted = false;
+                fMore    = true;
                 
-                return pTransaction->AddTransaction(vKey, vData, vOriginalData);
+                vKeys.clear();
+                nPosition = 0;
             }
             
-            return Put(vKey, vData);
-        }
-        
-        /** Get a Record from the Database with Given Key. **/
-        bool Get(std::vector<unsigned char> vKey, std::vector<unsigned char>& vData)
-        {
-            LOCK(SECTOR_MUTEX);
-            
-            if(cachePool->Get(vKey, vData))
-                return true;
             
-            if(SectorKeys->HasKey(vKey))
-            {	
-                /* Check that the key is not pending in a transaction for Erase. */
-                if(pTransaction && pTransaction->mapEraseData.count(vKey))
-                    return false;
+            /** Take the next Record as Bytes.
+                
+                @param[out] vKey The binary key
+                @param[out] vData The binary value
                 
-                /* Check if the new data is set in a transaction to ensure that the database knows what is in volatile memory. */
-                if(pTransaction && pTransaction->mapTransactions.count(vKey))
+                @return False once there are no more records **/
+            bool Next(std::vector<unsigned char>& vKey, std::vector<unsigned char>& vData)
+            {
+                while(true)
                 {
-                    vData = pTransaction->mapTransactions[vKey];
+                    if(nPosition == vKeys.size())
+                    {
+                        if(!fMore)
+                            return false;
+                        
+                        fMore = pDatabase->ScanKeys(vLast, !fStarted, vPrefix, SECTOR_CURSOR_BATCH, vKeys);
+                        nPosition = 0;
+                        
+                        if(vKeys.empty())
+                            return false;
+                    }
                     
-                    if(GetArg("-verbose", 0) >= 4)
-                        printf(FUNCTION "%s\n", __PRETTY_FUNCTION__, HexStr(vData.begin(), vData.end()).c_str());
+                    vKey.swap(vKeys[nPosition++]);
+                    vLast    = vKey;
+                    fStarted = true;
                     
-                    return true;
+                    /* Erased since the batch was taken. */
+                    if(pDatabase->Get(vKey, vData))
+                        return true;
                 }
-                
-                /** Read the Sector Key from Keychain. **/
-                SectorKey cKey;
-                if(!SectorKeys->Get(vKey, cKey))
-                    return false;
-                
-                /** Open the Stream to Read the data from Sector on File. **/
-                /* Open the Stream to Read the data from Sector on File. */
-                std::string strFilename = strprintf("%s_block.%05u", strBaseLocation.c_str(), cKey.nSectorFile);
-                std::fstream fStream(strFilename.c_str(), std::ios::in | std::ios::binary);
-                if(!fStream)
-                    return error(FUNCTION "Sector File %s Doesn't Exist\n", __PRETTY_FUNCTION__, strFilename.c_str());
-                
-                /** Seek to the Sector Position on Disk. **/
-                fStream.seekg(cKey.nSectorStart, std::ios::beg);
-                
-                //TODO: Add Sector Data available checks. WILL CHECK IF DATABASE FAILED TO FINISH WRITING SECTOR
+            }
+            
             
-                /** Read the State and Size of Sector Header. **/
-                vData.resize(cKey.nSectorSize);
-                fStream.read((char*) &vData[0], vData.size());
-                fStream.close();
+            /** Take the next Record, deserializing its Key and Value.
                 
-                /** Check the Data Integrity of the Sector by comparing the Checksums. **/
-                unsigned int nChecksum = LLC::HASH::SK32(vData);
-                if(cKey.nChecksum != nChecksum)
-                    return error(FUNCTION "Checksums don't match data. Corrupted Sector.", __PRETTY_FUNCTION__);
+                @param[out] key The key
+                @param[out] value The value
                 
-                if(GetArg("-verbose", 0) >= 4)
-                    printf(FUNCTION "%s\n", __PRETTY_FUNCTION__, HexStr(vData.begin(), vData.end()).c_str());
+                @return False once there are no more records **/
+            template<typename Key, typename Type>
+            bool Next(Key& key, Type& value)
+            {
+                std::vector<unsigned char> vKey, vData;
+                while(Next(vKey, vData))
+                {
+                    if(Deserialize(vKey.data(), vKey.data() + vKey.size(), key) && Deserialize(vData.data(), vData.data() + vData.size(), value))
+                        return true;
+                }
                 
-                return true;
+                return false;
             }
-            else
-                return error(FUNCTION "KEY NOT FOUND", __PRETTY_FUNCTION__);
+        };
+        
+        
+        /** Open a Cursor over every Record in Key Order.
+            Records waiting in the cache are written first so the cursor finds them. Those of
+            committed transactions are found once the cache writer has applied them. **/
+        Cursor Iterate()
+        {
+            FlushDiskBuffer();
             
-            return false;
+            return Cursor(this, std::vector<unsigned char>());
         }
         
         
-        /** Add / Update A Record in the Database **/
-        bool Put(std::vector<unsigned char> vKey, std::vector<unsigned char> vData)
+        /** Open a Cursor over the Records whose Keys start with the Serialization of a Prefix.
+            
+            @param[in] prefix The leading part of the keys, a type tag for instance **/
+        template<typename Prefix>
+        Cursor IteratePrefix(const Prefix& prefix)
         {
-            LOCK(SECTOR_MUTEX);
+            FlushDiskBuffer();
             
-            if(!GetBoolArg("-forcewrite", false))
+            std::vector<unsigned char> vPrefix;
+            Codec<Prefix>::Encode(prefix, vPrefix);
+            
+            return Cursor(this, vPrefix);
+        }
+        
+        
+#if !defined(_WIN32)
+        /** Get the Memory Map of a Sector File, mapping it on first access. **/
+        mmaplib::GrowableMemoryMappedFile* GetSectorMap(unsigned int nFile)
+        {
+            LOCK(MAP_MUTEX);
+            
+            auto it = mapSectorFiles.find(nFile);
+            if(it != mapSectorFiles.end())
+                return it->second;
+            
+            std::string strFilename = strprintf("%s_block.%05u", strBaseLocation.c_str(), nFile);
+            mmaplib::GrowableMemoryMappedFile* pMap = new mmaplib::GrowableMemoryMappedFile(strFilename.c_str(), SECTOR_MMAP_CHUNK_SIZE, fReadOnly);
+            if(!pMap->is_open())
             {
-                cachePool->Put(vKey, vData, PENDING_WRITE);
+                delete pMap;
+                
+                return NULL;
+            }
             
+            mapSectorFiles[nFile] = pMap;
+            
+            return pMap;
+        }
+#endif
+        
+        
+        /** Find the Binary Data of a Sector without Copying it.
+            Points into the memory map, or a read buffer this thread reuses, valid until the sector lock is released. **/
+        bool ViewSector(unsigned int nFile, unsigned int nStart, unsigned int nSize, const unsigned char*& pData)
+        {
+#if !defined(_WIN32)
+            if(fMemoryMap)
+            {
+                mmaplib::GrowableMemoryMappedFile* pMap = GetSectorMap(nFile);
+                if(!pMap)
+                    return error(FUNCTION "Sector File %u Couldn't be Mapped\n", __PRETTY_FUNCTION__, nFile);
+                
+                if(nStart + nSize > pMap->size())
+                    return error(FUNCTION "Sector %u:%u Out of Range of Mapped File\n", __PRETTY_FUNCTION__, nFile, nStart);
+                
+                pData = (const unsigned char*)pMap->data() + nStart;
+                
                 return true;
             }
+#endif
             
-            if(GetBoolArg("-runtime", false))
-                runtime.Start();
+            /* Read the Sector Data through the File Handle Cache. */
+            static thread_local std::vector<unsigned char> vBuffer;
+            vBuffer.resize(std::max(nSize, 1u));
+            if(!FileCache().Read(nFileCacheID, nFile, nStart, &vBuffer[0], nSize))
+                return error(FUNCTION "Failed to Read Sector %u:%u\n", __PRETTY_FUNCTION__, nFile, nStart);
+            
+            pData = &vBuffer[0];
+            
+            return true;
+        }
+        
+        
+        /** Write the Binary Data of a Sector to Disk. Called with the sector lock held. **/
+        bool WriteSector(unsigned int nFile, unsigned int nStart, const std::vector<unsigned char>& vData)
+        {
+            setDirtyFiles.insert(nFile);
             
-            /* Write Header if First Update. */
-            if(!SectorKeys->HasKey(vKey))
+#if !defined(_WIN32)
+            if(fMemoryMap)
             {
-                if(nCurrentFileSize > MAX_SECTOR_FILE_SIZE)
-                {
-                    if(GetArg("-verbose", 0) >= 4)
-                        printf(FUNCTION "Current File too Large, allocating new File %u\n", __PRETTY_FUNCTION__, nCurrentFileSize, nCurrentFile + 1);
-                        
-                    nCurrentFile ++;
-                    nCurrentFileSize = 0;
-                    
-                    std::ofstream fStream(strprintf("%s_block.%05u", strBaseLocation.c_str(), nCurrentFile).c_str(), std::ios::out | std::ios::binary);
-                    fStream.close();
-                }
+                mmaplib::GrowableMemoryMappedFile* pMap = GetSectorMap(nFile);
+                if(!pMap)
+                    return error(FUNCTION "Sector File %u Couldn't be Mapped\n", __PRETTY_FUNCTION__, nFile);
                 
-                /* Open the Stream to Read the data from Sector on File. */
-                std::string strFilename = strprintf("%s_block.%05u", strBaseLocation.c_str(), nCurrentFile);
-                std::fstream fStream(strFilename.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+                /* Growing past the mapping remaps the file, moving it under readers. Only appends do, with no stripe held. */
+                std::unique_ptr<KeyLockSet> pBarrier;
+                if(nStart + vData.size() > pMap->capacity())
+                    pBarrier.reset(new KeyLockSet(keyLocks));
                 
-                /* If it is a New Sector, Assign a Binary Position. 
-                    TODO: Track Sector Database File Sizes. */
-                fStream.seekp(nCurrentFileSize, std::ios::beg);
-                fStream.write((char*) &vData[0], vData.size());
-                fStream.close();
+                if(!pMap->write(nStart, &vData[0], vData.size()))
+                    return error(FUNCTION "Failed to Write Sector %u:%u to Mapped File\n", __PRETTY_FUNCTION__, nFile, nStart);
                 
-                /* Create a new Sector Key. */
-                SectorKey cKey(READY, vKey, nCurrentFile, nCurrentFileSize, vData.size()); 
+                return true;
+            }
+#endif
+            
+            /* Write the Sector Data through the File Handle Cache. */
+            if(!FileCache().Write(nFileCacheID, nFile, nStart, &vData[0], vData.size()))
+                return error(FUNCTION "Failed to Write Sector %u:%u\n", __PRETTY_FUNCTION__, nFile, nStart);
+            
+            return true;
+        }
+        
+        
+        template<typename Key>
+        bool Exists(const Key& key)
+        {
+            /** Encode Key into a Buffer this Thread Reuses. **/
+            static thread_local std::vector<unsigned char> vKey;
+            vKey.clear();
+            Codec<Key>::Encode(key, vKey);
+            
+            /** Check the Snapshot of this Thread's Transaction. **/
+            if(SectorTransaction* pTx = ThreadTransaction())
+            {
+                std::vector<unsigned char> vData;
+                
+                return TxnGet(pTx, vKey, vData);
+            }
+            
+            /** Check the Cache for Transactions not yet Applied to the Keychain. **/
+            unsigned char nState;
+            if(cachePool->View(vKey, nState, [](const std::vector<unsigned char>&) { }))
+                return (nState != PENDING_ERASE);
+            
+            /** Return the Key existance in the Keychain Database. **/
+            KeyLock lock(keyLocks, vKey, false);
+            
+            return HasSectorKey(vKey);
+        }
+        
+        template<typename Key>
+        bool Erase(const Key& key)
+        {
+            if(GetBoolArg("-runtime", false))
+                runtime.Start();
+            
+            /** Encode Key into a Buffer this Thread Reuses. **/
+            static thread_local std::vector<unsigned char> vKey;
+            vKey.clear();
+            Codec<Key>::Encode(key, vKey);
+            
+            if(SectorTransaction* pTx = ThreadTransaction())
+                return pTx->EraseTransaction(vKey);
+            
+            /** Erase through the Journal while it is on, failing as below if the Key isn't there. **/
+            if(pJournal)
+            {
+                std::vector<unsigned char> vData;
+                if(!Get(vKey, vData))
+                    return false;
+                
+                JournalRecord record;
+                record.vErases.push_back(vKey);
+                
+                return WriteJournal(record);
+            }
+            
+            return WriteDirect([]() { return std::vector< std::vector<unsigned char> >(1, vKey); }, [&]()
+            {
+                /** Remove the Key from the Cache so it isn't Read after Erase. **/
+                cachePool->Remove(vKey);
+                
+                /** Erase the Key from the Keychain, freeing its Sector. **/
+                return EraseSector(vKey);
+            });
+            
+            if(GetBoolArg("-runtime", false))
+                printf(ANSI_COLOR_GREEN FUNCTION "executed in %u micro-seconds\n" ANSI_COLOR_RESET, __PRETTY_FUNCTION__, runtime.ElapsedMicroseconds());
+        }
+        
+        template<typename Key, typename Type>
+        bool Read(const Key& key, Type& value)
+        {
+            /** Encode Key into a Buffer this Thread Reuses. **/
+            static thread_local std::vector<unsigned char> vKey;
+            vKey.clear();
+            Codec<Key>::Encode(key, vKey);
+            
+            /** Read the Snapshot of this Thread's Transaction. **/
+            if(SectorTransaction* pTx = ThreadTransaction())
+            {
+                std::vector<unsigned char> vData;
+                
+                return TxnGet(pTx, vKey, vData) && Deserialize(vData.data(), vData.data() + vData.size(), value);
+            }
+            
+            /** Deserialize Value straight from the Cache while its Shard holds it. **/
+            bool fRead = false;
+            unsigned char nState;
+            if(cachePool->View(vKey, nState, [&](const std::vector<unsigned char>& vData) { fRead = (nState != PENDING_ERASE && Deserialize(vData.data(), vData.data() + vData.size(), value)); }))
+                return fRead;
+            
+            /** Otherwise straight from the Sector on Disk. **/
+            return View(vKey, [&value](const unsigned char* pbegin, const unsigned char* pend) { return Deserialize(pbegin, pend, value); });
+        }
+        
+        
+        /** Decode a Value from Memory without Copying it. **/
+        template<typename Type>
+        static bool Deserialize(const unsigned char* pbegin, const unsigned char* pend, Type& value)
+        {
+            return Codec<Type>::Decode(pbegin, pend, value);
+        }
+
+        template<typename Key, typename Type>
+        bool Write(const Key& key, const Type& value)
+        {
+            if (fReadOnly)
+                assert(!"Write called on database in read-only mode");
+
+            /** Encode the Key and Value into Buffers this Thread Reuses. **/
+            static thread_local std::vector<unsigned char> vKey, vData;
+            vKey.clear();
+            Codec<Key>::Encode(key, vKey);
+            
+            vData.clear();
+            Codec<Type>::Encode(value, vData);
+
+            /** Commit to the Database. **/
+            if(SectorTransaction* pTx = ThreadTransaction())
+                return pTx->AddTransaction(vKey, vData, std::vector<unsigned char>());
+            
+            /** Forced Writes go through the Journal while it is on. **/
+            if(pJournal && GetBoolArg("-forcewrite", false))
+            {
+                JournalRecord record;
+                record.vWrites.push_back(std::make_pair(vKey, vData));
+                
+                return WriteJournal(record);
+            }
+            
+            return WriteDirect([]() { return std::vector< std::vector<unsigned char> >(1, vKey); }, [&]() { return Put(vKey, vData); });
+        }
+        
+        
+        /** Read many Records at once.
+            
+            Cached records are read in place. The rest are found under one lock, sorted by
+            where they are on disk, and sectors close together are read with one I/O.
+            
+            @param[in] vKeys The keys to read
+            @param[out] vValues The values read, in the order of the keys
+            @param[out] vFound Whether each key was read
+            
+            @return True if every key was read **/
+        template<typename Key, typename Type>
+        bool ReadBatch(const std::vector<Key>& vKeys, std::vector<Type>& vValues, std::vector<bool>& vFound)
+        {
+            vValues.resize(vKeys.size());
+            vFound.assign(vKeys.size(), false);
+            
+            /** Read the Snapshot of this Thread's Transaction one Key at a Time. **/
+            if(SectorTransaction* pTx = ThreadTransaction())
+            {
+                std::vector<unsigned char> vKey, vData;
+                for(unsigned int nIndex = 0; nIndex < vKeys.size(); nIndex++)
+                {
+                    vKey.clear();
+                    Codec<Key>::Encode(vKeys[nIndex], vKey);
+                    
+                    vFound[nIndex] = (TxnGet(pTx, vKey, vData) && Deserialize(vData.data(), vData.data() + vData.size(), vValues[nIndex]));
+                }
+                
+                return (std::count(vFound.begin(), vFound.end(), true) == (int)vFound.size());
+            }
+            
+            /** Serialize the Keys, reading those in the Cache as we go. **/
+            std::vector< std::vector<unsigned char> > vBinaryKeys(vKeys.size());
+            std::vector<unsigned int> vMisses;
+            for(unsigned int nIndex = 0; nIndex < vKeys.size(); nIndex++)
+            {
+                Codec<Key>::Encode(vKeys[nIndex], vBinaryKeys[nIndex]);
+                
+                bool fRead = false;
+                unsigned char nState;
+                if(cachePool->View(vBinaryKeys[nIndex], nState, [&](const std::vector<unsigned char>& vData) { fRead = (nState != PENDING_ERASE && Deserialize(vData.data(), vData.data() + vData.size(), vValues[nIndex])); }))
+                    vFound[nIndex] = fRead;
+                else
+                    vMisses.push_back(nIndex);
+            }
+            
+            if(!vMisses.empty())
+            {
+                /** Hold the Stripes of the Keys until their Data is Read. **/
+                std::vector<unsigned int> vStripes;
+                for(auto nIndex : vMisses)
+                    vStripes.push_back(keyLocks.Stripe(vBinaryKeys[nIndex]));
+                
+                KeyLockSet lock(keyLocks, vStripes, false);
+                
+                /** Find the Sectors of the Rest. **/
+                std::vector< std::pair<SectorKey, unsigned int> > vSectors;
+                for(auto nIndex : vMisses)
+                {
+                    SectorKey cKey;
+                    if(HasSectorKey(vBinaryKeys[nIndex]) && SectorKeys->Get(vBinaryKeys[nIndex], cKey))
+                        vSectors.push_back(std::make_pair(cKey, nIndex));
+                }
+                
+                /** Join the Sectors in File Order into Runs close enough together to read at once. **/
+                std::sort(vSectors.begin(), vSectors.end(), [](const std::pair<SectorKey, unsigned int>& a, const std::pair<SectorKey, unsigned int>& b) { return a.first.nSectorFile < b.first.nSectorFile || (a.first.nSectorFile == b.first.nSectorFile && a.first.nSectorStart < b.first.nSectorStart); });
+                
+                std::vector<unsigned int> vRunEnds;
+                std::vector<IORequest> vRequests;
+                uint64 nRunBytes = 0;
+                for(unsigned int nFirst = 0; nFirst < vSectors.size(); )
+                {
+                    unsigned int nFile = vSectors[nFirst].first.nSectorFile, nStart = vSectors[nFirst].first.nSectorStart;
+                    unsigned int nEnd  = nStart + vSectors[nFirst].first.nSectorSize;
+                    
+                    unsigned int nLast = nFirst + 1;
+                    for(; nLast < vSectors.size(); nLast++)
+                    {
+                        const SectorKey& cNext = vSectors[nLast].first;
+                        unsigned int nNextEnd = std::max(nEnd, cNext.nSectorStart + cNext.nSectorSize);
+                        if(cNext.nSectorFile != nFile || cNext.nSectorStart > nEnd + SECTOR_BATCH_READ_GAP || nNextEnd - nStart > SECTOR_BATCH_READ_SIZE)
+                            break;
+                        
+                        nEnd = nNextEnd;
+                    }
+                    
+                    vRunEnds.push_back(nLast);
+                    vRequests.push_back(IORequest(nFile, nStart, NULL, nEnd - nStart, false));
+                    nRunBytes += nEnd - nStart;
+                    nFirst = nLast;
+                }
+                
+                /** Without the Memory Map, the Runs are Read in one Batch through the I/O Backend. **/
+                std::vector<unsigned char> vRunData;
+                if(!fMemoryMap && !vRequests.empty())
+                {
+                    vRunData.resize(nRunBytes);
+                    
+                    uint64 nOffset = 0;
+                    for(auto& request : vRequests)
+                    {
+                        request.pBuffer = &vRunData[0] + nOffset;
+                        nOffset += request.nLength;
+                    }
+                    
+                    FileCache().Submit(nFileCacheID, vRequests);
+                }
+                
+                for(unsigned int nRun = 0, nFirst = 0; nRun < vRequests.size(); nFirst = vRunEnds[nRun++])
+                {
+                    const IORequest& request = vRequests[nRun];
+                    
+                    const unsigned char* pRun = request.pBuffer;
+                    if(fMemoryMap ? !ViewSector(request.nFile, request.nOffset, request.nLength, pRun) : !request.Complete())
+                    {
+                        error(FUNCTION "Failed to Read Sectors %u:%" PRIu64 "\n", __PRETTY_FUNCTION__, request.nFile, request.nOffset);
+                        
+                        continue;
+                    }
+                    
+                    for(; nFirst < vRunEnds[nRun]; nFirst++)
+                    {
+                        const SectorKey& cKey = vSectors[nFirst].first;
+                        const unsigned char* pbegin = pRun + (cKey.nSectorStart - request.nOffset);
+                        const unsigned char* pend   = pbegin + cKey.nSectorSize;
+                        
+                        /** Check the Data Integrity of the Sector by comparing the Checksums. **/
+                        if(!VerifyRead(cKey, pbegin, pend))
+                        {
+                            error(FUNCTION "Checksums don't match data. Corrupted Sector.", __PRETTY_FUNCTION__);
+                            
+                            continue;
+                        }
+                        
+                        if(!Unpack(cKey, pbegin, pend))
+                            continue;
+                        
+                        vFound[vSectors[nFirst].second] = Deserialize(pbegin, pend, vValues[vSectors[nFirst].second]);
+                    }
+                }
+            }
+            
+            return (std::count(vFound.begin(), vFound.end(), true) == (int)vFound.size());
+        }
+        
+        
+        /** Write many Records at once.
+            
+            The records are serialized through one stream and added under one lock. With
+            -forcewrite they are laid out on disk together, the way the cache writer flushes.
+            
+            @param[in] vRecords The keys and values to write
+            
+            @return True if every record was written **/
+        template<typename Key, typename Type>
+        bool WriteBatch(const std::vector< std::pair<Key, Type> >& vRecords)
+        {
+            if (fReadOnly)
+                assert(!"WriteBatch called on database in read-only mode");
+            
+            /** Serialize the Records, Latest Write of a Key winning. **/
+            std::map< std::vector<unsigned char>, std::vector<unsigned char> > mapWrites;
+            std::vector<unsigned char> vBuffer;
+            for(auto& item : vRecords)
+            {
+                vBuffer.clear();
+                Codec<Key>::Encode(item.first, vBuffer);
+                
+                unsigned int nKeySize = vBuffer.size();
+                Codec<Type>::Encode(item.second, vBuffer);
+                
+                mapWrites[std::vector<unsigned char>(vBuffer.begin(), vBuffer.begin() + nKeySize)].assign(vBuffer.begin() + nKeySize, vBuffer.end());
+            }
+            
+            /** Commit to the Database. **/
+            if(SectorTransaction* pTx = ThreadTransaction())
+            {
+                for(auto& item : mapWrites)
+                    pTx->AddTransaction(item.first, item.second, std::vector<unsigned char>());
+                
+                return true;
+            }
+            
+            /** Forced Writes go through the Journal while it is on, as one record. **/
+            if(pJournal && GetBoolArg("-forcewrite", false))
+            {
+                JournalRecord record;
+                record.vWrites.assign(mapWrites.begin(), mapWrites.end());
+                
+                return WriteJournal(record);
+            }
+            
+            auto fnKeys = [&mapWrites]()
+            {
+                std::vector< std::vector<unsigned char> > vKeys;
+                for(auto& item : mapWrites)
+                    vKeys.push_back(item.first);
+                
+                return vKeys;
+            };
+            
+            return WriteDirect(fnKeys, [&]()
+            {
+                /** Cached writes only take the locks of the cache shards. **/
+                if(!GetBoolArg("-forcewrite", false))
+                {
+                    Throttle();
+                    
+                    for(auto& item : mapWrites)
+                        cachePool->Put(item.first, item.second, PENDING_WRITE);
+                    
+                    if(cachePool->DiskBufferSize() >= nFlushSize)
+                        NotifyWriter();
+                    
+                    return true;
+                }
+                
+                LOCK(SECTOR_MUTEX);
+                
+                for(auto& item : mapWrites)
+                    cachePool->Remove(item.first);
+                
+                std::vector<SectorKey> vKeys;
+                unsigned int nWrites;
+                
+                return WriteRecords(mapWrites, vKeys, nWrites);
+            });
+        }
+        
+        /** Get a Record from the Database with Given Key. **/
+        bool Get(const std::vector<unsigned char>& vKey, std::vector<unsigned char>& vData)
+        {
+            /* Records erased in a transaction not yet applied stay in the cache until they are.
+                The cache locks its own shards, so hits don't wait on the sector lock. */
+            unsigned char nState;
+            if(cachePool->Get(vKey, vData, nState))
+                return (nState != PENDING_ERASE);
+            
+            return View(vKey, [&vData](const unsigned char* pbegin, const unsigned char* pend) { vData.assign(pbegin, pend); return true; });
+        }
+        
+        
+        /** Train a dictionary from a sample of the records written, for small records from now on to be compressed with.
+            Records already written keep the dictionary they were compressed with, or none. Set with -compressdict,
+            the size of the dictionary with -compressdictsize and the records sampled with -compressdictsamples.
+            
+            @return True if a dictionary was trained and is in use **/
+        bool TrainDictionary()
+        {
+            if(compressor.nType == COMPRESS_NONE)
+                return error(FUNCTION "Database doesn't Compress\n", __PRETTY_FUNCTION__);
+            
+            /* Records spread evenly over the keychain, so the sample isn't only the ones written first. */
+            std::vector< std::vector<unsigned char> > vKeys = SectorKeys->GetKeys();
+            uint64 nSamples = std::max((int)GetArg("-compressdictsamples", DEFAULT_COMPRESS_DICT_SAMPLES), 1);
+            uint64 nStep    = std::max((uint64)vKeys.size() / nSamples, (uint64)1);
+            
+            std::vector< std::vector<unsigned char> > vSamples;
+            std::vector<unsigned char> vData;
+            for(uint64 nIndex = 0; nIndex < vKeys.size() && vSamples.size() < nSamples; nIndex += nStep)
+                if(Get(vKeys[nIndex], vData))
+                    vSamples.push_back(vData);
+            
+            /* Not an error, a new database has nothing to train from yet. */
+            if(vSamples.size() < MIN_COMPRESS_DICT_SAMPLES)
+            {
+                if(GetArg("-verbose", 0) >= 1)
+                    printf(FUNCTION "Only %u Records to Train from\n", __PRETTY_FUNCTION__, (unsigned int)vSamples.size());
+                
+                return false;
+            }
+            
+            std::vector<unsigned char> vDict = BuildDictionary(vSamples, GetArg("-compressdictsize", DEFAULT_COMPRESS_DICT_SIZE));
+            if(vDict.empty())
+                return error(FUNCTION "%u Records have Nothing in Common\n", __PRETTY_FUNCTION__, (unsigned int)vSamples.size());
+            
+            if(!compressor.AddDictionary(strBaseLocation + "_dictionary.", vDict))
+                return false;
+            
+            if(GetArg("-verbose", 0) >= 1)
+                printf(FUNCTION "Trained Dictionary %u of %u bytes from %u Records\n", __PRETTY_FUNCTION__, compressor.Dictionaries(), (unsigned int)vDict.size(), (unsigned int)vSamples.size());
+            
+            return true;
+        }
+        
+        
+        /** Check a sector read from disk against its checksum, as often as -verifyreads asks.
+            
+            @param[in] cKey The sector's key
+            @param[in] pbegin The start of the sector's data
+            @param[in] pend The end of the sector's data
+            
+            @return False if the sector is corrupt **/
+        bool VerifyRead(const SectorKey& cKey, const unsigned char* pbegin, const unsigned char* pend)
+        {
+            uint64 nTag = 0;
+            if(nVerifyPolicy != VERIFY_ALWAYS)
+            {
+                /* Sectors the scrubber couldn't repair fail whether or not their reads are verified. */
+                if(nCorrupt.load() > 0)
+                {
+                    LOCK(CORRUPT_MUTEX);
+                    if(setCorrupt.count(SectorTag(cKey.nSectorFile, cKey.nSectorStart, cKey.nSectorSize, cKey.nChecksum)))
+                    {
+                        nReadFailures++;
+                        
+                        return false;
+                    }
+                }
+                
+                bool fSkip = true;
+                if(nVerifyPolicy == VERIFY_FIRST)
+                {
+                    nTag  = SectorTag(cKey.nSectorFile, cKey.nSectorStart, cKey.nSectorSize, cKey.nChecksum);
+                    fSkip = pVerified->Contains(nTag);
+                }
+                else if(nVerifyPolicy == VERIFY_SAMPLED)
+                {
+                    static thread_local unsigned int nSample = 0;
+                    fSkip = (++nSample % nVerifySample != 0);
+                }
+                
+                if(fSkip)
+                {
+                    nReadsUnverified++;
+                    
+                    return true;
+                }
+            }
+            
+            nReadsVerified++;
+            if(!cKey.Verify(pbegin, pend))
+            {
+                nReadFailures++;
+                
+                return false;
+            }
+            
+            if(pVerified)
+                pVerified->Insert(nTag);
+            
+            return true;
+        }
+        
+        
+        /** Find the record a sector holds, decompressing it if it was stored compressed.
+            
+            @param[in] cKey The sector's key
+            @param[in,out] pbegin The start of the sector's data, then of the record
+            @param[in,out] pend The end of the sector's data, then of the record
+            
+            @return False if the sector couldn't be decompressed **/
+        bool Unpack(const SectorKey& cKey, const unsigned char*& pbegin, const unsigned char*& pend)
+        {
+            if(cKey.nCompression == COMPRESS_NONE)
+                return true;
+            
+            /* Valid until this thread reads another sector. */
+            static thread_local std::vector<unsigned char> vExpanded;
+            if(!compressor.Expand(cKey.nCompression, pbegin, pend, vExpanded))
+            {
+                nReadFailures++;
+                
+                return error(FUNCTION "Failed to Decompress Sector %u:%u\n", __PRETTY_FUNCTION__, cKey.nSectorFile, cKey.nSectorStart);
+            }
+            
+            pbegin = vExpanded.data();
+            pend   = pbegin + vExpanded.size();
+            
+            return true;
+        }
+        
+        
+        /** Compress a record to be written, if the database compresses and it is worth it.
+            
+            @param[in] vData The record
+            @param[out] vPacked Holds the compressed record, which stays where it is as more are added
+            @param[out] nCompression The compression of the data to store
+            
+            @return The data to store, the record itself or the compressed record in vPacked **/
+        const std::vector<unsigned char>& Pack(const std::vector<unsigned char>& vData, std::deque< std::vector<unsigned char> >& vPacked, unsigned char& nCompression)
+        {
+            nCompression = COMPRESS_NONE;
+            if(compressor.nType == COMPRESS_NONE)
+                return vData;
+            
+            vPacked.push_back(std::vector<unsigned char>());
+            if(!compressor.Compress(vData, vPacked.back()))
+            {
+                vPacked.pop_back();
+                
+                return vData;
+            }
+            
+            nCompression = compressor.nType;
+            
+            return vPacked.back();
+        }
+        
+        
+        /** Read a Record that isn't in the Cache in place.
+            
+            fnRead is called with the record's data while the sector lock is held: in the
+            memory map, or in a read buffer this thread reuses, so no copy is made for it.
+            A compressed record is decompressed into another buffer this thread reuses.
+            
+            @param[in] vKey The binary key
+            @param[in] fnRead Called with the bounds of the record's data
+            
+            @return The result of fnRead, or false if the record couldn't be read **/
+        template<typename ReadFunc>
+        bool View(const std::vector<unsigned char>& vKey, ReadFunc fnRead)
+        {
+            /* Hold the key's stripe until its data is read, so its sector isn't changed or reused meanwhile. */
+            KeyLock lock(keyLocks, vKey, false);
+            
+            if(HasSectorKey(vKey))
+            {	
+                /** Read the Sector Key from Keychain, reusing this thread's Key Buffer. **/
+                static thread_local SectorKey cKey;
+                if(!SectorKeys->Get(vKey, cKey))
+                    return false;
+                
+                //TODO: Add Sector Data available checks. WILL CHECK IF DATABASE FAILED TO FINISH WRITING SECTOR
+            
+                /** Find the Sector Data, Mapped or Read from Disk. **/
+                const unsigned char* pbegin;
+                if(!ViewSector(cKey.nSectorFile, cKey.nSectorStart, cKey.nSectorSize, pbegin))
+                    return false;
+                
+                const unsigned char* pend = pbegin + cKey.nSectorSize;
+                
+                /** Check the Data Integrity of the Sector by comparing the Checksums. **/
+                if(!VerifyRead(cKey, pbegin, pend))
+                    return error(FUNCTION "Checksums don't match data. Corrupted Sector.", __PRETTY_FUNCTION__);
+                
+                if(!Unpack(cKey, pbegin, pend))
+                    return false;
+                
+                if(GetArg("-verbose", 0) >= 4)
+                    printf(FUNCTION "%s\n", __PRETTY_FUNCTION__, HexStr(pbegin, pend).c_str());
+                
+                return fnRead(pbegin, pend);
+            }
+            
+            return false;
+        }
+        
+        
+        /** Add / Update A Record in the Database **/
+        bool Put(const std::vector<unsigned char>& vKey, const std::vector<unsigned char>& vData)
+        {
+            /* Cached writes only take the lock of the key's cache shard, which keeps writes to a key in order. */
+            if(!GetBoolArg("-forcewrite", false))
+            {
+                Throttle();
+                
+                cachePool->Put(vKey, vData, PENDING_WRITE);
+                if(cachePool->DiskBufferSize() >= nFlushSize)
+                    NotifyWriter();
+            
+                return true;
+            }
+            
+            LOCK(SECTOR_MUTEX);
+            
+            if(GetBoolArg("-runtime", false))
+                runtime.Start();
+            
+            /* Drop what the cache holds, so neither it nor a transaction waiting to be applied is read over the write. */
+            cachePool->Remove(vKey);
+            if(!PutSector(vKey, vData))
+                return false;
+            
+            if(GetArg("-verbose", 0) >= 4)
+                printf(FUNCTION "%s | Current File: %u | Current File Size: %u\n", __PRETTY_FUNCTION__, HexStr(vData.begin(), vData.end()).c_str(), nCurrentFile, nCurrentFileSize);
+        
+            if(GetBoolArg("-runtime", false))
+                printf(ANSI_COLOR_GREEN FUNCTION "executed in %u micro-seconds\n" ANSI_COLOR_RESET, __PRETTY_FUNCTION__, runtime.ElapsedMicroseconds());
+            
+            return true;
+        }
+        
+        
+        /** Check the Keychain for a Key, unless the Filter shows it was never added. Called with the sector lock or the key's stripe held.
+            Writers set bits with an atomic or while readers load them. Bits are never cleared, so a reader ordered after
+            a key's write by the sector lock or its stripe finds the key's bits. A rebuild swaps in a new filter behind a
+            barrier of every stripe. **/
+        bool HasSectorKey(const std::vector<unsigned char>& vKey)
+        {
+            if(fBloomFilter)
+            {
+                nBloomChecks++;
+                if(!bloomFilter.MayContain(vKey))
+                {
+                    nBloomMisses++;
+                    
+                    return false;
+                }
+            }
+            
+            if(SectorKeys->HasKey(vKey))
+                return true;
+            
+            if(fBloomFilter)
+                nBloomFalsePositives++;
+            
+            return false;
+        }
+        
+        
+        /** Add a Key new to the Keychain to the Filter and the Sorted Index. Called with the sector lock held and no stripe. **/
+        void AddKey(const std::vector<unsigned char>& vKey)
+        {
+            AddBloomKey(vKey);
+            
+            if(pSortedIndex)
+                pSortedIndex->Insert(vKey);
+        }
+        
+        
+        /** Add a Key written to the Keychain to the Filter, rebuilding it larger once it holds more keys than it was sized for.
+            Keys it already matches aren't counted again. Called with the sector lock held. **/
+        void AddBloomKey(const std::vector<unsigned char>& vKey)
+        {
+            if(!fBloomFilter || bloomFilter.MayContain(vKey))
+                return;
+            
+            bloomFilter.Insert(vKey);
+            if(bloomFilter.Full())
+                RebuildBloomFilter();
+        }
+        
+        
+        /** Build the Filter from the Keys in the Keychain, sized for twice as many at -bloomfpr false positives. Called with the sector lock held and no stripe.
+            The sector lock keeps keys from being added while it is built, readers only wait for the new filter to be swapped in. **/
+        void RebuildBloomFilter()
+        {
+            Timer timer;
+            timer.Start();
+            
+            std::vector< std::vector<unsigned char> > vKeys = SectorKeys->GetKeys();
+            BloomFilter filter;
+            filter.Reset(vKeys.size() * 2, atof(GetArg("-bloomfpr", strprintf("%f", DEFAULT_BLOOM_FALSE_POSITIVE)).c_str()));
+            for(const std::vector<unsigned char>& vKey : vKeys)
+                filter.Insert(vKey);
+            
+            {
+                KeyLockSet barrier(keyLocks);
+                bloomFilter.Swap(filter);
+            }
+            
+            if(GetArg("-verbose", 0) >= 2)
+                printf(FUNCTION "Built Filter of %u Keys in %" PRIu64 " micro-seconds\n", __PRETTY_FUNCTION__, (unsigned int)vKeys.size(), timer.ElapsedMicroseconds());
+        }
+        
+        
+        /** Start a new Sector File once the current one is full. Called with the sector and append locks held. **/
+        void RollSectorFile()
+        {
+            if(GetArg("-verbose", 0) >= 4)
+                printf(FUNCTION "Current File too Large, allocating new File %u\n", __PRETTY_FUNCTION__, nCurrentFile + 1);
+            
+            nCurrentFile ++;
+            nCurrentFileSize = 0;
+            
+            std::ofstream fStream(strprintf("%s_block.%05u", strBaseLocation.c_str(), nCurrentFile).c_str(), std::ios::out | std::ios::binary);
+            fStream.close();
+            
+            setSectorFiles.insert(nCurrentFile);
+            FileCache().Reserve(nFileCacheID, setSectorFiles.size());
+        }
+        
+        
+        /** Find Space for a Sector, reusing a free extent before appending to the current file. Called with the sector lock held. **/
+        void AllocateSector(unsigned int nSize, unsigned int& nFile, unsigned int& nStart)
+        {
+            if(freeSpace.Allocate(nSize, nFile, nStart))
+                return;
+            
+            AppendSector(nSize, nFile, nStart);
+        }
+        
+        
+        /** Reserve Space at the end of the Current File, starting a new File once it is full. Called with the sector lock held. **/
+        void AppendSector(unsigned int nSize, unsigned int& nFile, unsigned int& nStart)
+        {
+            LOCK(APPEND_MUTEX);
+            
+            if(nCurrentFileSize > nMaxFileSize)
+                RollSectorFile();
+            
+            nFile  = nCurrentFile;
+            nStart = nCurrentFileSize;
+            
+            nCurrentFileSize += nSize;
+        }
+        
+        
+        /** Write a Record to its Sector and the Keychain.
+            A record that fits its sector is overwritten in place, giving back what it doesn't use.
+            A new record or one that grew is given new space, and the sector it had is freed. **/
+        bool PutSector(const std::vector<unsigned char>& vKey, const std::vector<unsigned char>& vRecord)
+        {
+            LOCK(SECTOR_MUTEX);
+            
+            /* The sector holds the record compressed if it is worth it. */
+            std::deque< std::vector<unsigned char> > vPacked;
+            unsigned char nCompression;
+            const std::vector<unsigned char>& vData = Pack(vRecord, vPacked, nCompression);
+            
+            /* Get the Sector Key from the Keychain. */
+            SectorKey cKey;
+            bool fExists = HasSectorKey(vKey);
+            if(fExists && !SectorKeys->Get(vKey, cKey))
+                return false;
+            
+            /* The part of the old sector the record no longer uses, freed once the key is moved off it. */
+            SectorKey cOld = cKey;
+            if(fExists && vData.size() <= cKey.nSectorSize)
+            {
+                /* Readers of the key wait while its sector is overwritten, until the keychain matches it. */
+                KeyLock lock(keyLocks, vKey, true);
+                
+                /* Write the new data to the sector. */
+                if(!WriteSector(cKey.nSectorFile, cKey.nSectorStart, vData))
+                    return false;
+                
+                cOld.nSectorStart += vData.size();
+                cOld.nSectorSize  -= vData.size();
+                
+                cKey.nState       = READY;
+                cKey.nSectorSize  = vData.size();
+                cKey.nCompression = nCompression;
+                cKey.SetChecksum(nChecksumType, vData);
+                
+                if(!SectorKeys->Put(cKey))
+                    return false;
+            }
+            else
+            {
+                /* New space isn't read by anyone until the keychain points at it. */
+                unsigned int nFile, nStart;
+                AllocateSector(vData.size(), nFile, nStart);
+                if(!WriteSector(nFile, nStart, vData))
+                    return false;
+                
+                /* Create a new Sector Key, with the Checksum of its Data. */
+                cKey = SectorKey(READY, vKey, nFile, nStart, vData.size());
+                cKey.nCompression = nCompression;
+                cKey.SetChecksum(nChecksumType, vData);
+                
+                if(!SectorKeys->Put(cKey))
+                    return false;
+            }
+            
+            if(!fExists)
+                AddKey(vKey);
+            
+            if(fExists)
+                freeSpace.Free(cOld.nSectorFile, cOld.nSectorStart, cOld.nSectorSize);
+            
+            return true;
+        }
+        
+        
+        /** Erase a Key from the Keychain, freeing its Sector to be reused once the Keychain is synced. **/
+        bool EraseSector(const std::vector<unsigned char>& vKey)
+        {
+            LOCK(SECTOR_MUTEX);
+            
+            if(!HasSectorKey(vKey))
+                return false;
+            
+            SectorKey cKey;
+            if(!SectorKeys->Get(vKey, cKey))
+                return SectorKeys->Erase(vKey);
+            
+            if(!SectorKeys->Erase(vKey))
+                return false;
+            
+            if(pSortedIndex)
+                pSortedIndex->Erase(vKey);
+            
+            freeSpace.Free(cKey.nSectorFile, cKey.nSectorStart, cKey.nSectorSize);
+            
+            return true;
+        }
+        
+        
+        /** Whether the cache still holds a key in the state a transaction left it, so no write outside a transaction came since. **/
+        bool HeldByTransaction(const std::vector<unsigned char>& vKey, unsigned char nState)
+        {
+            unsigned char nCached;
+            
+            return cachePool->View(vKey, nCached, [](const std::vector<unsigned char>&) { }) && nCached == nState;
+        }
+        
+        
+        /** Apply a Committed Transaction to the Sectors and Keychain.
+            
+            Outside of replay a key is skipped once a cached write has replaced its cache entry. That write is later
+            than the record and is flushed to the sectors on its own, so the record must not land on top of it. Writes
+            and erases that would go straight to the sectors are records in the journal themselves while it is on.
+            
+            @param[in] record The transaction to apply
+            @param[in] fReplay True if replayed on open, when the cache holds nothing yet **/
+        bool ApplyRecord(const JournalRecord& record, bool fReplay = false)
+        {
+            LOCK(SECTOR_MUTEX);
+            
+            /* Erase first, a key erased and written in one transaction keeps the write. */
+            for(auto vKey : record.vErases)
+                if(fReplay || HeldByTransaction(vKey, PENDING_ERASE))
+                    EraseSector(vKey);
+            
+            for(auto item : record.vWrites)
+                if((fReplay || HeldByTransaction(item.first, PENDING_TX)) && !PutSector(item.first, item.second))
+                    return error(FUNCTION "Failed to Apply Transaction %" PRIu64 "\n", __PRETTY_FUNCTION__, record.nSequence);
+            
+            return true;
+        }
+        
+        
+        /** Apply the Transactions that are Durable in the Journal and Readable from the Cache, oldest first.
+            Their cache entries are released once the sectors hold the same data. **/
+        void ApplyJournal()
+        {
+            while(true)
+            {
+                JournalRecord record;
+                {
+                    LOCK(SECTOR_MUTEX);
+                    
+                    if(queueApply.empty() || queueApply.front().nSequence > nPublishedSequence)
+                        break;
+                    
+                    std::swap(record, queueApply.front());
+                    queueApply.pop_front();
+                }
+                
+                if(!ApplyRecord(record))
+                    break;
+                
+                /* Release the cache entries, unless a later transaction changed them again. */
+                for(auto vKey : record.vErases)
+                    cachePool->Remove(vKey, PENDING_ERASE);
+                
+                for(auto item : record.vWrites)
+                    cachePool->SetState(item.first, MEMORY_ONLY, PENDING_TX, item.second);
+                
+                nAppliedSequence = record.nSequence;
+            }
+        }
+        
+        
+        /** Flush the Sectors and Keychain, then remove the Journal Files they cover and let the Sectors freed before it be reused.
+            Runs every -journalcheckpoint milliseconds while there is something to retire, or now if forced. Only the sector
+            files written since the last checkpoint are synced, without the sector lock, so writers carry on meanwhile.
+            
+            @return True if everything written so far is on disk **/
+        bool Checkpoint(bool fForce)
+        {
+            LOCK(CHECKPOINT_MUTEX);
+            
+            /* What the sync covers: the transactions applied, the extents freed, and the files written before it. */
+            uint64 nSequence;
+            unsigned int nFreed;
+            std::set<unsigned int> setFiles;
+            {
+                LOCK(SECTOR_MUTEX);
+                
+                nFreed = freeSpace.Pending();
+                if(!fForce && ((nAppliedSequence == nCheckpointSequence && nFreed == 0) || Timestamp(true) - nLastCheckpoint < (uint64)GetArg("-journalcheckpoint", 1000)))
+                    return true;
+                
+                nLastCheckpoint = Timestamp(true);
+                nSequence = nAppliedSequence;
+                setFiles.swap(setDirtyFiles);
+            }
+            
+            /* A mapped file's pages are flushed by fsync too, so it's synced through its descriptor, not the mapping a writer may move. */
+            for(auto it = setFiles.begin(); it != setFiles.end(); it = setFiles.erase(it))
+            {
+                if(!FileCache().Sync(nFileCacheID, *it))
+                    break;
+            }
+            
+            /* The files left are synced by the next checkpoint. */
+            bool fSuccess = setFiles.empty() ? SectorKeys->Sync() : error(FUNCTION "Failed to Sync Sector File %u\n", __PRETTY_FUNCTION__, *setFiles.begin());
+            if(!fSuccess)
+            {
+                LOCK(SECTOR_MUTEX);
+                setDirtyFiles.insert(setFiles.begin(), setFiles.end());
+                
+                return false;
+            }
+            
+            if(pJournal)
+                pJournal->Checkpoint(nSequence);
+            
+            nCheckpointSequence = nSequence;
+            
+            /* Nothing on disk points at the sectors freed before the sync anymore, and once every stripe is held no reader does either. */
+            if(nFreed > 0)
+            {
+                LOCK(SECTOR_MUTEX);
+                KeyLockSet barrier(keyLocks);
+                freeSpace.Release(nFreed);
+            }
+            
+            return true;
+        }
+        
+        
+        /** Write the Records Waiting in the Disk Buffer.
+        
+            The latest write of each key wins. New records are laid out together and appended
+            with one write per sector file, overwrites are sorted and adjacent sectors written
+            together. The keychain is updated in bulk once the sectors are written, so no key
+            points at data that isn't on disk.
+            
+            @return True if every record was written **/
+        bool FlushDiskBuffer()
+        {
+            /* Taken before the buffer so flushes from a cursor and the cache writer can't write a key out of order. */
+            LOCK(SECTOR_MUTEX);
+            
+            std::vector< std::pair<std::vector<unsigned char>, std::vector<unsigned char>> > vBuffer;
+            if(!cachePool->GetDiskBuffer(vBuffer))
+                return true;
+            
+            Timer timer;
+            timer.Start();
+            
+            std::map< std::vector<unsigned char>, std::vector<unsigned char> > mapWrites;
+            for(auto& item : vBuffer)
+                mapWrites[item.first].swap(item.second);
+            
+            /* Drop the writes of keys erased or written by a transaction since, their cache entries are gone or no longer pending. */
+            for(auto it = mapWrites.begin(); it != mapWrites.end(); )
+            {
+                unsigned char nState;
+                if(!cachePool->View(it->first, nState, [](const std::vector<unsigned char>&) { }) || nState != PENDING_WRITE)
+                    it = mapWrites.erase(it);
+                else
+                    ++it;
+            }
+            
+            unsigned int nWrites;
+            std::vector<SectorKey> vKeys;
+            bool fSuccess = WriteRecords(mapWrites, vKeys, nWrites);
+            
+            /* Let the cache evict the written records, unless they were changed again. */
+            uint64 nBytes = 0;
+            for(const SectorKey& cKey : vKeys)
+            {
+                const std::vector<unsigned char>& vData = mapWrites[cKey.vKey];
+                cachePool->SetState(cKey.vKey, MEMORY_ONLY, PENDING_WRITE, vData);
+                nBytes += vData.size();
+            }
+            
+            /* Record the flush in the latency histogram. */
+            uint64 nElapsed = timer.ElapsedMicroseconds();
+            unsigned int nBucket = 0;
+            while(nBucket + 1 < SECTOR_FLUSH_HISTOGRAM_BUCKETS && (2ull << nBucket) <= nElapsed)
+                nBucket++;
+            
+            nFlushHistogram[nBucket]++;
+            nFlushes++;
+            nFlushRecords += vKeys.size();
+            nFlushBytes   += nBytes;
+            nFlushWrites  += nWrites;
+            
+            if(GetArg("-verbose", 0) >= 4)
+                printf(FUNCTION "Flushed %u Records | %" PRIu64 " Bytes | %u Writes | %" PRIu64 " micro-seconds | Current File: %u | Current File Size: %u\n", __PRETTY_FUNCTION__, (unsigned int)vKeys.size(), nBytes, nWrites, nElapsed, nCurrentFile, nCurrentFileSize);
+            
+            return fSuccess;
+        }
+        
+        
+        /** Write Records to the Sectors and point the Keychain at them. Called with the sector lock held.
+            
+            Appends are laid out one after another and written once per file. Overwrites are
+            written in file order, joining sectors that follow each other on disk.
+            
+            @param[in] mapWrites The keys and data to write
+            @param[out] vKeys The sector keys of the records written
+            @param[out] nWrites The number of writes made to the sector files
+            
+            @return True if every record was written **/
+        bool WriteRecords(const std::map< std::vector<unsigned char>, std::vector<unsigned char> >& mapWrites, std::vector<SectorKey>& vKeys, unsigned int& nWrites)
+        {
+            bool fSuccess = true;
+            nWrites = 0;
+            std::vector< std::pair<SectorKey, const std::vector<unsigned char>*> > vOverwrites;
+            
+            /* Sectors given up by the records, freed once the keychain points elsewhere. */
+            std::vector<SectorKey> vFrees;
+            
+            /* Keys new to the keychain. */
+            std::vector<const std::vector<unsigned char>*> vNew;
+            
+            /* Stripes of the keys overwritten in place, held while their sectors don't match the keychain. */
+            std::vector<unsigned int> vStripes;
+            
+            /* Lay out the appends, writing them out before moving to a new file. */
+            std::vector<unsigned char> vAppend;
+            unsigned int nAppendFile = 0, nAppendStart = 0;
+            
+            /* The records compressed, kept until they are written. */
+            std::deque< std::vector<unsigned char> > vPacked;
+            for(auto& item : mapWrites)
+            {
+                unsigned char nCompression;
+                const std::vector<unsigned char>& vData = Pack(item.second, vPacked, nCompression);
+                
+                SectorKey cKey;
+                bool fExists = HasSectorKey(item.first);
+                if(fExists && !SectorKeys->Get(item.first, cKey))
+                {
+                    fSuccess = false;
+                    
+                    continue;
+                }
+                
+                /* A record that fits its sector is overwritten in place, giving back what it doesn't use. */
+                if(fExists && vData.size() <= cKey.nSectorSize)
+                {
+                    vFrees.push_back(cKey);
+                    vFrees.back().nSectorStart += vData.size();
+                    vFrees.back().nSectorSize  -= vData.size();
+                    
+                    cKey.nState       = READY;
+                    cKey.nSectorSize  = vData.size();
+                    cKey.nCompression = nCompression;
+                    cKey.SetChecksum(nChecksumType, vData);
+                    vOverwrites.push_back(std::make_pair(cKey, &vData));
+                    vStripes.push_back(keyLocks.Stripe(item.first));
+                    
+                    continue;
+                }
+                
+                /* A record that grew moves, freeing the sector it had. */
+                if(fExists)
+                    vFrees.push_back(cKey);
+                else
+                    vNew.push_back(&item.first);
+                
+                /* Records placed in free extents are written with the overwrites. */
+                unsigned int nFile, nStart;
+                if(freeSpace.Allocate(vData.size(), nFile, nStart))
+                {
+                    cKey = SectorKey(READY, item.first, nFile, nStart, vData.size());
+                    cKey.nCompression = nCompression;
+                    cKey.SetChecksum(nChecksumType, vData);
+                    vOverwrites.push_back(std::make_pair(cKey, &vData));
+                    
+                    continue;
+                }
                 
-                /* Check the Data Integrity of the Sector by comparing the Checksums. */
-                cKey.nChecksum    = LLC::HASH::SK32(vData);
+                /* Appends follow one another until the file is full. */
+                AppendSector(vData.size(), nFile, nStart);
+                if(nFile != nAppendFile || nStart != nAppendStart + vAppend.size())
+                {
+                    if(vAppend.size() > 0)
+                    {
+                        if(!WriteSector(nAppendFile, nAppendStart, vAppend))
+                            return false;
+                        
+                        nWrites++;
+                    }
+                    
+                    nAppendFile  = nFile;
+                    nAppendStart = nStart;
+                    vAppend.clear();
+                }
                 
-                /* Increment the current filesize */
-                nCurrentFileSize += vData.size();
+                /* Create a new Sector Key. */
+                cKey = SectorKey(READY, item.first, nFile, nStart, vData.size());
+                cKey.nCompression = nCompression;
+                cKey.SetChecksum(nChecksumType, vData);
+                vKeys.push_back(cKey);
                 
-                /* Assign the Key to Keychain. */
-                SectorKeys->Put(cKey);
+                vAppend.insert(vAppend.end(), vData.begin(), vData.end());
             }
-            else
+            
+            if(vAppend.size() > 0)
             {
-                /* Get the Sector Key from the Keychain. */
-                SectorKey cKey;
-                if(!SectorKeys->Get(vKey, cKey))
+                if(!WriteSector(nAppendFile, nAppendStart, vAppend))
                     return false;
+                
+                nWrites++;
+            }
+            
+            /* Readers of the keys overwritten in place wait from here until the keychain matches their sectors. */
+            std::unique_ptr<KeyLockSet> pLocks(new KeyLockSet(keyLocks, vStripes, true));
+            
+            /* Overwrite in file order, joining sectors that follow each other on disk. */
+            std::sort(vOverwrites.begin(), vOverwrites.end(), [](const std::pair<SectorKey, const std::vector<unsigned char>*>& a, const std::pair<SectorKey, const std::vector<unsigned char>*>& b) { return a.first.nSectorFile < b.first.nSectorFile || (a.first.nSectorFile == b.first.nSectorFile && a.first.nSectorStart < b.first.nSectorStart); });
+            
+            std::deque< std::vector<unsigned char> > vRuns;
+            std::vector<IORequest> vRequests;
+            for(unsigned int nIndex = 0; nIndex < vOverwrites.size(); )
+            {
+                const SectorKey& cFirst = vOverwrites[nIndex].first;
+                vRuns.push_back(*vOverwrites[nIndex].second);
+                
+                /* A sector joins the run if the one before it fills its sector and ends where it starts. */
+                unsigned int nNext = nIndex + 1;
+                for(; nNext < vOverwrites.size(); nNext++)
+                {
+                    const SectorKey& cPrev = vOverwrites[nNext - 1].first;
+                    const SectorKey& cNext = vOverwrites[nNext].first;
+                    if(vOverwrites[nNext - 1].second->size() != cPrev.nSectorSize || cNext.nSectorFile != cPrev.nSectorFile || cNext.nSectorStart != cPrev.nSectorStart + cPrev.nSectorSize)
+                        break;
+                    
+                    vRuns.back().insert(vRuns.back().end(), vOverwrites[nNext].second->begin(), vOverwrites[nNext].second->end());
+                }
+                
+                /* Without the memory map the runs go to the I/O backend together. */
+                if(fMemoryMap)
+                {
+                    if(!WriteSector(cFirst.nSectorFile, cFirst.nSectorStart, vRuns.back()))
+                        return false;
+                }
+                else if(!vRuns.back().empty())
+                {
+                    vRequests.push_back(IORequest(cFirst.nSectorFile, cFirst.nSectorStart, &vRuns.back()[0], vRuns.back().size(), true));
+                    setDirtyFiles.insert(cFirst.nSectorFile);
+                }
+                
+                for(; nIndex < nNext; nIndex++)
+                    vKeys.push_back(vOverwrites[nIndex].first);
+                
+                nWrites++;
+            }
+            
+            if(!vRequests.empty() && !FileCache().Submit(nFileCacheID, vRequests))
+                return error(FUNCTION "Failed to Write %u Sector Runs\n", __PRETTY_FUNCTION__, (unsigned int)vRequests.size());
+            
+            /* Point the keychain at the new sectors. */
+            if(!SectorKeys->Put(vKeys))
+                return error(FUNCTION "Failed to Update Keychain with %u Keys\n", __PRETTY_FUNCTION__, (unsigned int)vKeys.size());
+            
+            pLocks.reset();
+            
+            for(const SectorKey& cKey : vFrees)
+                freeSpace.Free(cKey.nSectorFile, cKey.nSectorStart, cKey.nSectorSize);
+            
+            for(const std::vector<unsigned char>* pKey : vNew)
+                AddKey(*pKey);
+            
+            return fSuccess;
+        }
+        
+        
+        /** Wake the Cache Writer to flush now rather than at the next interval. **/
+        void NotifyWriter()
+        {
+            boost::lock_guard<boost::mutex> lock(FLUSH_MUTEX);
+            
+            FLUSH_CONDITION.notify_one();
+        }
+        
+        
+        /** Hold a writer back while the dirty part of the cache is over its limit.
+            Dirty data can't be evicted, so this keeps writers from outrunning the disk.
+            The wait is bounded so records the writer can't clear don't stall writers forever. **/
+        void Throttle()
+        {
+            if(cachePool->DirtySize() <= cachePool->MaxDirtySize())
+                return;
+            
+            Timer timer;
+            timer.Start();
+            
+            boost::unique_lock<boost::mutex> lock(FLUSH_MUTEX);
+            boost::system_time tDeadline = boost::get_system_time() + boost::posix_time::milliseconds(SECTOR_THROTTLE_TIMEOUT);
+            nThrottled++;
+            while(!fDestruct && cachePool->DirtySize() > cachePool->MaxDirtySize())
+            {
+                FLUSH_CONDITION.notify_one();
+                if(!FLUSHED_CONDITION.timed_wait(lock, tDeadline))
+                    break;
+            }
+            nThrottled--;
+            
+            nThrottles++;
+            nThrottleMicroseconds += timer.ElapsedMicroseconds();
+        }
+        
+        
+        /** Resize the cache pool if -lldcache or -lldcachedirty changed since it was last applied. **/
+        void UpdateCacheSize()
+        {
+            uint64 nSize = GetArg("-lldcache", DEFAULT_SECTOR_CACHE_SIZE) * 1024 * 1024;
+            unsigned int nDirty = GetArg("-lldcachedirty", DEFAULT_CACHE_DIRTY_PERCENT);
+            if(nSize == nCacheSize && nDirty == nCacheDirty)
+                return;
+            
+            cachePool->SetMaxSize(nSize, nDirty);
+            nCacheSize  = nSize;
+            nCacheDirty = nDirty;
+            
+            if(GetArg("-verbose", 0) >= 2)
+                printf(FUNCTION "Cache resized to %" PRIu64 " bytes | %u%% dirty\n", __PRETTY_FUNCTION__, nSize, nDirty);
+        }
+        
+        
+        /** Dump the flush statistics and latency histogram to the debug console. **/
+        void PrintFlushStats()
+        {
+            printf(FUNCTION "Flushes: %" PRIu64 " | Records: %" PRIu64 " | Bytes: %" PRIu64 " | Writes: %" PRIu64 "\n", __PRETTY_FUNCTION__, nFlushes, nFlushRecords, nFlushBytes, nFlushWrites);
+            for(unsigned int nBucket = 0; nBucket < SECTOR_FLUSH_HISTOGRAM_BUCKETS; nBucket++)
+                if(nFlushHistogram[nBucket] > 0)
+                    printf(FUNCTION "< %" PRIu64 " micro-seconds: %" PRIu64 "\n", __PRETTY_FUNCTION__, 2ull << nBucket, nFlushHistogram[nBucket]);
+            
+            printf(FUNCTION "Throttled Writes: %" PRIu64 " | %" PRIu64 " micro-seconds\n", __PRETTY_FUNCTION__, nThrottles.load(), nThrottleMicroseconds.load());
+            cachePool->PrintStats();
+            
+            {
+                LOCK(VERSION_MUTEX);
+                
+                printf(FUNCTION "Transactions Open: %" PRIu64 " | Conflicts: %" PRIu64 "\n", __PRETTY_FUNCTION__, nOpenTransactions.load(), nConflicts.load());
+                versions.PrintStats();
+            }
+            
+            LOCK(SECTOR_MUTEX);
+            freeSpace.PrintStats();
+            
+            if(fBloomFilter)
+            {
+                printf(FUNCTION "Filter Checks: %" PRIu64 " | Misses Answered: %" PRIu64 " | False Positives: %" PRIu64 "\n", __PRETTY_FUNCTION__, nBloomChecks.load(), nBloomMisses.load(), nBloomFalsePositives.load());
+                bloomFilter.PrintStats();
+            }
+            
+            if(pSortedIndex)
+                pSortedIndex->PrintStats();
+            
+            printf(FUNCTION "Key Locks: %u Stripes | Shared Waits: %" PRIu64 " | Exclusive Waits: %" PRIu64 "\n", __PRETTY_FUNCTION__, keyLocks.Stripes(), keyLocks.nSharedWaits.load(), keyLocks.nExclusiveWaits.load());
+            printf(FUNCTION "Compactions: %" PRIu64 " | Moved: %" PRIu64 " bytes | Reclaimed: %" PRIu64 " bytes | %" PRIu64 " micro-seconds\n", __PRETTY_FUNCTION__, nCompactions, nCompactMoved, nCompactReclaimed, nCompactMicroseconds);
+            printf(FUNCTION "Read Verification: %s | Verified: %" PRIu64 " | Unverified: %" PRIu64 " | Failed: %" PRIu64 " | Known Corrupt: %" PRIu64 "\n", __PRETTY_FUNCTION__, VerifyPolicyName(nVerifyPolicy), nReadsVerified.load(), nReadsUnverified.load(), nReadFailures.load(), nCorrupt.load());
+            printf(FUNCTION "Scrubs: %" PRIu64 " | Sectors: %" PRIu64 " | Bytes: %" PRIu64 " | Mismatches: %" PRIu64 " | Repaired: %" PRIu64 " | %" PRIu64 " micro-seconds\n", __PRETTY_FUNCTION__, nScrubs.load(), nScrubSectors.load(), nScrubBytes.load(), nScrubMismatches.load(), nScrubRepaired.load(), nScrubMicroseconds.load());
+            compressor.PrintStats();
+        }
+        
+        
+        /* Helper Thread to Batch Write to Disk.
+            Flushes every -flushinterval milliseconds, or sooner once -flushsize bytes are waiting
+            or writers are held back by a dirty cache. Picks up changes to -lldcache as it goes. */
+        void CacheWriter()
+        {
+            while(true)
+            {
+                /* Wait for Database to Initialize. */
+                if(!fInitialized)
+                {
+                    Sleep(1, true);
+                    
+                    continue;
+                }
+                
+                {
+                    boost::unique_lock<boost::mutex> lock(FLUSH_MUTEX);
+                    if(!fDestruct && nThrottled == 0 && cachePool->DiskBufferSize() < nFlushSize)
+                        FLUSH_CONDITION.timed_wait(lock, boost::posix_time::milliseconds(nFlushInterval));
+                }
+                
+                /* Read the flag first so the last flush sees every write made before it was set. */
+                bool fLast = fDestruct;
+                
+                /* Apply the committed transactions once they are durable. */
+                if(pJournal)
+                    ApplyJournal();
+                
+                FlushDiskBuffer();
+                
+                /* Retire the applied journal and release the freed sectors. */
+                Checkpoint(fLast);
+                
+                UpdateCacheSize();
+                
+                /* Let the writers held back by Throttle() go. */
+                {
+                    boost::lock_guard<boost::mutex> lock(FLUSH_MUTEX);
+                    FLUSHED_CONDITION.notify_all();
+                }
+                
+                if(fLast)
+                    return;
+            }
+        }
+        
+        
+        /** Compact the Sector File with the most free space, if at least -compactratio percent of it is free.
+            
+            @return True if a file was compacted **/
+        bool Compact()
+        {
+            unsigned int nFile = 0;
+            uint64 nMostFree = 0;
+            {
+                LOCK(SECTOR_MUTEX);
+                
+                for(unsigned int nCandidate : setSectorFiles)
+                {
+                    uint64 nSize, nFree = freeSpace.FreeBytes(nCandidate);
+                    if(nCandidate == nCurrentFile || nFree <= nMostFree || !FileCache().Size(nFileCacheID, nCandidate, nSize))
+                        continue;
                     
-                /* Open the Stream to Read the data from Sector on File. */
-                std::string strFilename = strprintf("%s_block.%05u", strBaseLocation.c_str(), cKey.nSectorFile);
-                std::fstream fStream(strFilename.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+                    if(nFree * 100 >= nSize * GetArg("-compactratio", DEFAULT_COMPACT_RATIO))
+                    {
+                        nFile     = nCandidate;
+                        nMostFree = nFree;
+                    }
+                }
+            }
+            
+            if(nMostFree == 0)
+                return false;
+            
+            return CompactFile(nFile);
+        }
+        
+        
+        /** Move the Live Sectors of a File to the end of the Current File, then remove it.
+            
+            Sectors are read in file order and moved a span at a time under the sector lock,
+            so reads and writes go on between spans. Nothing is allocated in the file while
+            it is emptied, and it is only removed once the keychain pointing at the moved
+            sectors is synced. Reading and writing is held to -compactrate kilobytes a second.
+            
+            @param[in] nFile The sector file to compact, not the one being appended to
+            
+            @return True if the file was removed **/
+        bool CompactFile(unsigned int nFile)
+        {
+            Timer timer;
+            timer.Start();
+            
+            uint64 nSize = 0;
+            std::vector< std::vector<unsigned char> > vKeys;
+            {
+                LOCK(SECTOR_MUTEX);
+                
+                if(fReadOnly || nFile == nCurrentFile || !setSectorFiles.count(nFile))
+                    return error(FUNCTION "Sector File %u can't be Compacted\n", __PRETTY_FUNCTION__, nFile);
+                
+                FileCache().Size(nFileCacheID, nFile, nSize);
+                freeSpace.Retire(nFile);
+                
+                vKeys = SectorKeys->GetKeys();
+            }
+            
+            /* Find the records in the file, a chunk of keys at a time. */
+            std::vector<SectorKey> vSectors;
+            for(unsigned int nIndex = 0; nIndex < vKeys.size(); )
+            {
+                LOCK(SECTOR_MUTEX);
                 
-                /* Locate the Sector Data from Sector Key. 
-                    TODO: Make Paging more Efficient in Keys by breaking data into different locations in Database. */
-                fStream.seekp(cKey.nSectorStart, std::ios::beg);
-                if(vData.size() > cKey.nSectorSize){
-                    fStream.close();
-                    printf(FUNCTION "PUT (TOO LARGE) NO TRUNCATING ALLOWED (Old %u :: New %u):%s\n", __PRETTY_FUNCTION__, cKey.nSectorSize, vData.size(), HexStr(vData.begin(), vData.end()).c_str());
+                for(unsigned int nEnd = std::min((unsigned int)vKeys.size(), nIndex + 1024); nIndex < nEnd; nIndex++)
+                {
+                    SectorKey cKey;
+                    if(SectorKeys->Get(vKeys[nIndex], cKey) && cKey.nSectorFile == nFile)
+                        vSectors.push_back(cKey);
+                }
+            }
+            
+            std::sort(vSectors.begin(), vSectors.end(), [](const SectorKey& a, const SectorKey& b) { return a.nSectorStart < b.nSectorStart; });
+            
+            uint64 nMoved = 0, nTransferred = 0, nRate = GetArg("-compactrate", DEFAULT_COMPACT_RATE) * 1024;
+            for(unsigned int nIndex = 0; nIndex < vSectors.size(); )
+            {
+                if(fDestruct)
+                {
+                    LOCK(SECTOR_MUTEX);
+                    freeSpace.Restore(nFile);
                     
                     return false;
                 }
                 
-                /* Assign the Writing State for Sector. */
-                //TODO: use memory maps
+                /* The span covers the sectors that fit in one read. */
+                unsigned int nStart = vSectors[nIndex].nSectorStart, nNext = nIndex + 1;
+                while(nNext < vSectors.size() && vSectors[nNext].nSectorStart + vSectors[nNext].nSectorSize - nStart <= SECTOR_COMPACT_BATCH_SIZE)
+                    nNext++;
+                
+                unsigned int nSpan = vSectors[nNext - 1].nSectorStart + vSectors[nNext - 1].nSectorSize - nStart;
+                {
+                    LOCK(SECTOR_MUTEX);
+                    
+                    bool fSuccess = true;
+                    const unsigned char* pData;
+                    if(!ViewSector(nFile, nStart, nSpan, pData))
+                        fSuccess = false;
+                    
+                    std::vector<unsigned char> vAppend;
+                    std::vector<SectorKey> vMoved;
+                    for(; fSuccess && nIndex < nNext; nIndex++)
+                    {
+                        /* Records moved out since are left alone. Nothing is placed in the file, so the rest are where they were, or shrunk in place. */
+                        SectorKey cKey;
+                        if(!SectorKeys->HasKey(vSectors[nIndex].vKey) || !SectorKeys->Get(vSectors[nIndex].vKey, cKey) || cKey.nSectorFile != nFile)
+                            continue;
+                        
+                        const unsigned char* pbegin = pData + (cKey.nSectorStart - nStart);
+                        if(cKey.nSectorStart < nStart || cKey.nSectorStart + cKey.nSectorSize > nStart + nSpan || !cKey.Verify(pbegin, pbegin + cKey.nSectorSize))
+                        {
+                            fSuccess = error(FUNCTION "Sector %u:%u Failed its Checksum, leaving File in Place\n", __PRETTY_FUNCTION__, nFile, cKey.nSectorStart);
+                            
+                            break;
+                        }
+                        
+                        cKey.nSectorStart = vAppend.size();
+                        vMoved.push_back(cKey);
+                        
+                        vAppend.insert(vAppend.end(), pbegin, pbegin + cKey.nSectorSize);
+                    }
+                    
+                    /* The moved sectors are appended together, the old ones stay readable until the file is removed. */
+                    if(fSuccess && !vAppend.empty())
+                    {
+                        unsigned int nAppendFile, nAppendStart;
+                        AppendSector(vAppend.size(), nAppendFile, nAppendStart);
+                        for(SectorKey& cMoved : vMoved)
+                        {
+                            cMoved.nSectorFile   = nAppendFile;
+                            cMoved.nSectorStart += nAppendStart;
+                        }
+                        
+                        fSuccess = WriteSector(nAppendFile, nAppendStart, vAppend) && SectorKeys->Put(vMoved);
+                    }
+                    
+                    if(!fSuccess)
+                    {
+                        freeSpace.Restore(nFile);
+                        
+                        return error(FUNCTION "Failed to Compact Sector File %u\n", __PRETTY_FUNCTION__, nFile);
+                    }
+                    
+                    nMoved       += vAppend.size();
+                    nTransferred += nSpan + vAppend.size();
+                }
+                
+                /* Hold to the I/O budget, counting what was read and written. */
+                uint64 nElapsed = timer.ElapsedMicroseconds();
+                if(nRate > 0 && nTransferred * 1000000 / nRate > nElapsed)
+                    Sleep(nTransferred * 1000000 / nRate - nElapsed, true);
+            }
+            
+            /* The moved sectors and their keys must be on disk before the file they were in is gone. */
+            if(!Checkpoint(true))
+            {
+                LOCK(SECTOR_MUTEX);
+                freeSpace.Restore(nFile);
+                
+                return error(FUNCTION "Failed to Sync Compacted Sectors of File %u\n", __PRETTY_FUNCTION__, nFile);
+            }
+            
+            /* A checkpoint syncing the file finishes before it is removed. */
+            LOCK2(CHECKPOINT_MUTEX, SECTOR_MUTEX);
+            
+            /* Readers that found a sector in the file before it was moved are done once every stripe is held. */
+            KeyLockSet barrier(keyLocks);
+            
+#if !defined(_WIN32)
+            {
+                LOCK(MAP_MUTEX);
+                
+                auto it = mapSectorFiles.find(nFile);
+                if(it != mapSectorFiles.end())
+                {
+                    delete it->second;
+                    mapSectorFiles.erase(it);
+                }
+            }
+#endif
+            
+            if(!FileCache().Remove(nFileCacheID, nFile))
+                error(FUNCTION "Failed to Remove Sector File %u\n", __PRETTY_FUNCTION__, nFile);
+            
+            setSectorFiles.erase(nFile);
+            setDirtyFiles.erase(nFile);
+            FileCache().Reserve(nFileCacheID, setSectorFiles.size());
+            freeSpace.Drop(nFile);
+            
+            nCompactions++;
+            nCompactMoved        += nMoved;
+            nCompactReclaimed    += (nSize > nMoved ? nSize - nMoved : 0);
+            nCompactMicroseconds += timer.ElapsedMicroseconds();
+            
+            if(GetArg("-verbose", 0) >= 2)
+                printf(FUNCTION "Compacted File %u | Moved %" PRIu64 " of %" PRIu64 " bytes in %u sectors | %" PRIu64 " micro-seconds\n", __PRETTY_FUNCTION__, nFile, nMoved, nSize, (unsigned int)vSectors.size(), timer.ElapsedMicroseconds());
+            
+            return true;
+        }
+        
+        
+        /* Helper Thread to Compact Sector Files.
+            Every -compactinterval milliseconds compacts the file with the most free space, unless -compact=0. */
+        void Compactor()
+        {
+            uint64 nLastCompact = Timestamp(true);
+            while(!fDestruct)
+            {
+                Sleep(100);
+                
+                if(!fInitialized || fReadOnly || !GetBoolArg("-compact", true) || Timestamp(true) - nLastCompact < (uint64)GetArg("-compactinterval", DEFAULT_COMPACT_INTERVAL))
+                    continue;
+                
+                Compact();
+                nLastCompact = Timestamp(true);
+            }
+        }
+        
+        
+        /** Rewrite a sector that failed its checksum from the cache's copy of its record.
+            
+            A record waiting in the cache to be written replaces the sector when it is. A sector
+            with no copy in the cache is kept as corrupt, so its reads fail until it is written again.
+            
+            @param[in] vKey The binary key
+            @param[in] cKey The sector's key as it was read
+            
+            @return True if the sector was or will be rewritten **/
+        bool RepairSector(const std::vector<unsigned char>& vKey, const SectorKey& cKey)
+        {
+            uint64 nTag = SectorTag(cKey.nSectorFile, cKey.nSectorStart, cKey.nSectorSize, cKey.nChecksum);
+            if(pVerified)
+                pVerified->Erase(nTag);
+            
+            if(!fReadOnly)
+            {
+                /* The cache's copy is only written while it is the newest, flushes of newer ones take this lock. */
+                LOCK(SECTOR_MUTEX);
+                
+                std::vector<unsigned char> vData;
+                unsigned char nState;
+                if(cachePool->Get(vKey, vData, nState))
+                {
+                    if(nState != MEMORY_ONLY || PutSector(vKey, vData))
+                    {
+                        error(FUNCTION "Sector %u:%u Failed its Checksum, Rewritten from the Cache\n", __PRETTY_FUNCTION__, cKey.nSectorFile, cKey.nSectorStart);
+                        
+                        return true;
+                    }
+                }
+            }
+            
+            {
+                LOCK(CORRUPT_MUTEX);
+                if(setCorrupt.insert(nTag).second)
+                    nCorrupt++;
+            }
+            
+            return error(FUNCTION "Sector %u:%u Failed its Checksum, with no Copy to Repair it from\n", __PRETTY_FUNCTION__, cKey.nSectorFile, cKey.nSectorStart);
+        }
+        
+        
+        /** Verify the checksum of every sector, whatever -verifyreads is.
+            
+            Each sector is read under its key's stripe, so it isn't changed or moved while it is checked,
+            and reading is held to -scrubrate kilobytes a second. Sectors that don't match are repaired
+            from the cache where they can be. Sectors that do count as verified under VERIFY_FIRST.
+            
+            @return The number of sectors that failed their checksum **/
+        uint64 Scrub()
+        {
+            LOCK(SCRUB_MUTEX);
+            
+            Timer timer;
+            timer.Start();
+            
+            std::vector< std::vector<unsigned char> > vKeys;
+            {
+                LOCK(SECTOR_MUTEX);
+                vKeys = SectorKeys->GetKeys();
+            }
+            
+            uint64 nSectors = 0, nBytes = 0, nMismatches = 0, nRepaired = 0, nRate = GetArg("-scrubrate", DEFAULT_SCRUB_RATE) * 1024;
+            for(const auto& vKey : vKeys)
+            {
+                if(fDestruct)
+                    break;
+                
+                SectorKey cKey;
+                bool fValid;
+                {
+                    KeyLock lock(keyLocks, vKey, false);
+                    
+                    const unsigned char* pbegin;
+                    if(!HasSectorKey(vKey) || !SectorKeys->Get(vKey, cKey) || !ViewSector(cKey.nSectorFile, cKey.nSectorStart, cKey.nSectorSize, pbegin))
+                        continue;
+                    
+                    fValid = cKey.Verify(pbegin, pbegin + cKey.nSectorSize);
+                }
+                
+                nSectors++;
+                nBytes += cKey.nSectorSize;
+                
+                if(fValid && pVerified)
+                    pVerified->Insert(SectorTag(cKey.nSectorFile, cKey.nSectorStart, cKey.nSectorSize, cKey.nChecksum));
+                
+                if(!fValid)
+                {
+                    nMismatches++;
+                    if(RepairSector(vKey, cKey))
+                        nRepaired++;
+                }
+                
+                /* Hold to the I/O budget, sleeping once at least a millisecond ahead of it. */
+                uint64 nElapsed = timer.ElapsedMicroseconds();
+                if(nRate > 0 && nBytes * 1000000 / nRate > nElapsed + 1000)
+                    Sleep(nBytes * 1000000 / nRate - nElapsed, true);
+            }
+            
+            nScrubs++;
+            nScrubSectors      += nSectors;
+            nScrubBytes        += nBytes;
+            nScrubMismatches   += nMismatches;
+            nScrubRepaired     += nRepaired;
+            nScrubMicroseconds += timer.ElapsedMicroseconds();
+            
+            if(GetArg("-verbose", 0) >= 2 || nMismatches > 0)
+                printf(FUNCTION "Scrubbed %" PRIu64 " Sectors, %" PRIu64 " bytes | %" PRIu64 " Failed their Checksums, %" PRIu64 " Repaired | %" PRIu64 " micro-seconds\n", __PRETTY_FUNCTION__, nSectors, nBytes, nMismatches, nRepaired, timer.ElapsedMicroseconds());
+            
+            return nMismatches;
+        }
+        
+        
+        /* Helper Thread to Scrub the Sectors.
+            Every -scrubinterval milliseconds checks every sector, if -scrub is set or reads are only verified by the scrub. */
+        void Scrubber()
+        {
+            uint64 nLastScrub = Timestamp(true);
+            while(!fDestruct)
+            {
+                Sleep(100);
                 
-                fStream.write((char*) &vData[0], vData.size());
-                fStream.close();
+                if(!fInitialized || !GetBoolArg("-scrub", nVerifyPolicy == VERIFY_SCRUB) || Timestamp(true) - nLastScrub < (uint64)GetArg("-scrubinterval", DEFAULT_SCRUB_INTERVAL))
+                    continue;
                 
-                cKey.nState    = READY;
-                cKey.nChecksum = LLC::HASH::SK32(vData);
+                Scrub();
+                nLastScrub = Timestamp(true);
+            }
+        }
+        
+        
+        /* The transaction this thread opened with TxnBegin, or NULL. */
+        SectorTransaction* ThreadTransaction()
+        {
+            if(nOpenTransactions.load() == 0)
+                return NULL;
+            
+            return pThreadTransaction.get();
+        }
+        
+        
+        /** Read a Record as a Transaction sees it: its own writes, then the snapshot it began with.
+            
+            The database is read before the kept versions. A commit landing in between kept the value
+            it replaced before changing it, so the snapshot's value is found either way.
+            
+            @param[in] pTx The transaction
+            @param[in] vKey The binary key
+            @param[out] vData The record's data
+            
+            @return True if the record exists for the transaction **/
+        bool TxnGet(SectorTransaction* pTx, const std::vector<unsigned char>& vKey, std::vector<unsigned char>& vData)
+        {
+            bool fErased;
+            if(pTx->Find(vKey, vData, fErased))
+                return !fErased;
+            
+            bool fExists = Get(vKey, vData);
+            if(!pTx->fSnapshot)
+                return fExists;
+            
+            LOCK(VERSION_MUTEX);
+            versions.Find(vKey, pTx->nSnapshot, vData, fExists);
+            
+            return fExists;
+        }
+        
+        
+        /** Write outside a Transaction.
+            
+            While no transaction is open the write is only counted, so one opening waits for it to finish
+            before taking its snapshot. Otherwise it is stamped with a version like a commit.
+            
+            @param[in] fnKeys Returns the keys written
+            @param[in] fnWrite Writes them
+            
+            @return The result of fnWrite **/
+        template<typename KeysFunc, typename WriteFunc>
+        bool WriteDirect(KeysFunc fnKeys, WriteFunc fnWrite)
+        {
+            nPendingWrites++;
+            if(nOpenTransactions.load() == 0)
+            {
+                bool fSuccess = fnWrite();
+                EndPendingWrite();
                 
-                SectorKeys->Put(cKey);
+                return fSuccess;
             }
             
-            if(GetArg("-verbose", 0) >= 4)
-                printf(FUNCTION "%s | Current File: %u | Current File Size: %u\n", __PRETTY_FUNCTION__, HexStr(vData.begin(), vData.end()).c_str(), nCurrentFile, nCurrentFileSize);
+            EndPendingWrite();
+            
+            LOCK(VERSION_MUTEX);
+            versions.Stamp(fnKeys(), [this](const std::vector<unsigned char>& vKey, std::vector<unsigned char>& vData) { return GetCommitted(vKey, vData); });
+            
+            return fnWrite();
+        }
         
-            if(GetBoolArg("-runtime", false))
-                printf(ANSI_COLOR_GREEN FUNCTION "executed in %u micro-seconds\n" ANSI_COLOR_RESET, __PRETTY_FUNCTION__, runtime.ElapsedMicroseconds());
+        
+        /* Count a pending write as done, waking a transaction waiting to take its snapshot if it was the last.
+            A beginning transaction is counted before it checks the writes, so one of the two always sees the other. */
+        void EndPendingWrite()
+        {
+            if(--nPendingWrites == 0 && nOpenTransactions.load() > 0)
+            {
+                boost::lock_guard<boost::mutex> lock(PENDING_MUTEX);
+                PENDING_CONDITION.notify_all();
+            }
+        }
+        
+        
+        /* Close the snapshot of a transaction. Called under the version lock. */
+        void CloseSnapshot(SectorTransaction* pTx)
+        {
+            if(!pTx->fSnapshot)
+                return;
             
-            return true;
+            versions.Close(pTx->nSnapshot);
+            pTx->fSnapshot = false;
+            nOpenTransactions--;
         }
         
         
-        /* Helper Thread to Batch Write to Disk. */
-        void CacheWriter()
+        /** Start a New Database Transaction on this Thread.
+            
+            Its writes and erases are kept to itself until TxnCommit, and its reads see the records as
+            they were last committed when it began. Other threads can have transactions of their own open
+            at the same time. It must be committed or aborted by the thread that began it.
+            
+            @return False if this thread already has a transaction open **/
+        bool TxnBegin()
         {
+            if(pThreadTransaction.get())
+                return error(FUNCTION "Transaction already Open on this Thread.", __PRETTY_FUNCTION__);
             
-            //TODO: Add this to data journal with data to be committed first. 
-            //This will tell the database on next keychain init if there was any failed writes for graceful recovery
-            while(true)
+            SectorTransaction* pTx = new SectorTransaction();
+            uint64 nSequence;
             {
-                /* Wait for Database to Initialize. */
-                if(!fInitialized)
-                {
-                    Sleep(1, true);
-                    
-                    continue;
-                }
-                
-                /* Check for data to be written. */
-                std::vector< std::pair<std::vector<unsigned char>, std::vector<unsigned char>> > vIndexes;
-                if(!cachePool->GetDiskBuffer(vIndexes))
-                {
-                    if(fDestruct)
-                        return;
-                    
-                    Sleep(1, true);
-                    
-                    continue;
-                }
+                LOCK(VERSION_MUTEX);
                 
-                /* Allocate new File if Needed. TODO: Check if sectors go over file size, assign new file if so */
-                if(nCurrentFileSize > MAX_SECTOR_FILE_SIZE)
+                /* Writes that didn't see a transaction open have to finish before the snapshot is taken. */
+                nOpenTransactions++;
                 {
-                    if(GetArg("-verbose", 0) >= 4)
-                        printf(FUNCTION "Current File too Large, allocating new File %u\n", __PRETTY_FUNCTION__, nCurrentFileSize, nCurrentFile + 1);
-                                
-                    nCurrentFile ++;
-                    nCurrentFileSize = 0;
-                            
-                    std::ofstream fStream(strprintf("%s_block.%05u", strBaseLocation.c_str(), nCurrentFile).c_str(), std::ios::out | std::ios::binary);
-                    fStream.close();
+                    boost::unique_lock<boost::mutex> lock(PENDING_MUTEX);
+                    while(nPendingWrites.load() > 0)
+                        PENDING_CONDITION.wait(lock);
                 }
                 
-                /* Temp Variable for Reads / Writes. */
-                unsigned int nTempFileSize = nCurrentFileSize;
-                
-                /* Go through and do overwrite operations. */
-                std::vector< unsigned char > vBatch;
-                for(auto vObj : vIndexes)  
-                {
-                    if(nTempFileSize >= MAX_SECTOR_FILE_SIZE)
-                        break;
-                    
-                    /* Setup for batch write on first update. */
-                    if(!SectorKeys->HasKey(vObj.first))
-                    {
-                        /* Create a new Sector Key. */
-                        SectorKey cKey(READY, vObj.first, nCurrentFile, nTempFileSize, vObj.second.size()); 
-                        
-                        /* Check the Data Integrity of the Sector by comparing the Checksums. */
-                        cKey.nChecksum    = LLC::HASH::SK32(vObj.second);
-                        
-                        /* Increment the current filesize */
-                        nTempFileSize += vObj.second.size();
-                        
-                        /* Assign the Key to Keychain. */
-                        SectorKeys->Put(cKey);
-                        
-                        /* Setup the Batch data write. */
-                        vBatch.insert(vBatch.end(), vObj.second.begin(), vObj.second.end());
-                    }
-                    else
-                    {
-                        /* Get the Sector Key from the Keychain. */
-                        SectorKey cKey;
-                        if(!SectorKeys->Get(vObj.first, cKey))
-                            break;
-                            
-                        /* Open the Stream to Read the data from Sector on File. */
-                        std::string strFilename = strprintf("%s_block.%05u", strBaseLocation.c_str(), cKey.nSectorFile);
-                        std::fstream fStream(strFilename.c_str(), std::ios::in | std::ios::out | std::ios::binary);
-                        
-                        /* Locate the Sector Data from Sector Key. 
-                            TODO: Make Paging more Efficient in Keys by breaking data into different locations in Database. */
-                        fStream.seekp(cKey.nSectorStart, std::ios::beg);
-                        if(vObj.second.size() > cKey.nSectorSize){
-                            fStream.close();
-                            printf(FUNCTION "PUT (TOO LARGE) NO TRUNCATING ALLOWED (Old %u :: New %u):%s\n", __PRETTY_FUNCTION__, cKey.nSectorSize, vObj.second.size(), HexStr(vObj.second.begin(), vObj.second.end()).c_str());
-                            
-                            break;
-                        }
-                        
-                        /* Write the new data to the sector. */
-                        fStream.write((char*) &vObj.second[0], vObj.second.size());
-                        fStream.close();
-                        
-                        /* Update the Keychain. */
-                        cKey.nState    = READY;
-                        cKey.nChecksum = LLC::HASH::SK32(vObj.second);
-                        SectorKeys->Put(cKey);
-                        
-                        /* Update the Cache Pool. */
-                        //cachePool.SetState(vObj.first, MEMORY_ONLY);
-                    }
-                }
+                pTx->nSnapshot = versions.Open();
+                pTx->fSnapshot = true;
                 
-                /* Write the data in one operation. */
-                if(vBatch.size() > 0 || fDestruct)
                 {
-                    /* Open the Stream to Read the data from Sector on File. */
-                    std::string strFilename = strprintf("%s_block.%05u", strBaseLocation.c_str(), nCurrentFile);
-                    std::fstream fStream(strFilename.c_str(), std::ios::in | std::ios::out | std::ios::binary);
-                    
-                    /* If it is a New Sector, Assign a Binary Position. 
-                        TODO: Track Sector Database File Sizes. */
-                    fStream.seekp(nCurrentFileSize, std::ios::beg);
-                    //fStream.write((char*) &vBatch[0], vBatch.size());
-                    //fStream.close();
-                    
-                    /* Set the new current file size. */
-                    nCurrentFileSize = nTempFileSize;
-                    
-                    if(GetArg("-verbose", 0) >= 4)
-                        printf(FUNCTION "Batch Data %u Bytes | Current File: %u | Current File Size: %u\n", __PRETTY_FUNCTION__, vBatch.size(), nCurrentFile, nCurrentFileSize);
+                    LOCK(SECTOR_MUTEX);
+                    nSequence = nAppendedSequence;
                 }
             }
-        }
-        
-        /** Start a New Database Transaction. 
-            This will put all the database changes into pending state.
-            If any of the database updates fail in procewss it will roll the database back to its previous state. **/
-        void TxnBegin()
-        {
-            /** Delete a previous database transaction pointer if applicable. **/
-            if(pTransaction)
-                delete pTransaction;
             
-            /** Create the new Database Transaction Object. **/
-            pTransaction = new SectorTransaction();
+            /* Commits in the snapshot are read from the cache, so wait for them to be durable, without holding back later commits. */
+            {
+                boost::unique_lock<boost::mutex> lock(PENDING_MUTEX);
+                while(nSettledSequence.load() < nSequence)
+                    PENDING_CONDITION.wait(lock);
+            }
+            
+            pThreadTransaction.reset(pTx);
             
             if(GetArg("-verbose", 0) >= 4)
-                printf(FUNCTION "New Sector Transaction Started.\n", __PRETTY_FUNCTION__);
+                printf(FUNCTION "New Sector Transaction Started at Version %" PRIu64 ".\n", __PRETTY_FUNCTION__, pTx->nSnapshot);
+            
+            return true;
         }
         
-        /** Abort the current transaction that is pending in the transaction chain. **/
+        /** Abort the transaction this thread has open, dropping its writes. **/
         void TxnAbort()
         {
-            /** Delete the previous transaction pointer if applicable. **/
-            if(pTransaction)
-                delete pTransaction;
+            SectorTransaction* pTx = pThreadTransaction.release();
+            if(!pTx)
+                return;
             
-            /** Set the transaction pointer to null also acting like a flag **/
-            pTransaction = NULL;
-        }
-        
-        /** Return the database state back to its original state before transactions are commited. **/
-        bool RollbackTransactions()
-        {
-                /** Iterate the original data memory map to reset the database to its previous state. **/
-            for(typename std::map< std::vector<unsigned char>, std::vector<unsigned char> >::iterator nIterator = pTransaction->mapOriginalData.begin(); nIterator != pTransaction->mapOriginalData.end(); nIterator++ )
-                if(!Put(nIterator->first, nIterator->second))
-                    return false;
-                
-            return true;
+            {
+                LOCK(VERSION_MUTEX);
+                CloseSnapshot(pTx);
+            }
+            
+            delete pTx;
         }
         
         /** Commit the Data in the Transaction Object to the Database Disk.
@@ -635,24 +2610,253 @@ namespace LLD
             **/
         bool TxnCommit()
         {
-            LOCK(SECTOR_MUTEX);
-            
             if(GetBoolArg("-runtime", false))
                 runtime.Start();
             
             if(GetArg("-verbose", 0) >= 4)
                 printf(FUNCTION "Commiting Transactin to Datachain.\n", __PRETTY_FUNCTION__);
             
+            /** Detach the Transaction so new Writes from this Thread go to the Database. **/
+            SectorTransaction* pTx = pThreadTransaction.release();
+            
             /** Check that there is a valid transaction to apply to the database. **/
-            if(!pTransaction)
+            if(!pTx)
                 return error(FUNCTION "No Transaction data to Commit.", __PRETTY_FUNCTION__);
             
+            bool fSuccess = TxnCommit(pTx);
+            
+            /** Clean up the Sector Transaction. **/
+            delete pTx;
+            
+            if(GetBoolArg("-runtime", false))
+                printf(ANSI_COLOR_GREEN FUNCTION "executed in %u micro-seconds\n" ANSI_COLOR_RESET, __PRETTY_FUNCTION__, runtime.ElapsedMicroseconds());
+            
+            return fSuccess;
+        }
+        
+        
+        /** Commit a Transaction built by the Caller.
+        
+            A transaction opened with TxnBegin fails to commit if a key it writes was committed since it
+            began, the first of two transactions writing a key to commit wins.
+            
+            With the journal, the transaction is written as one record and this returns once it is
+            durable. Commits from other threads waiting at the same time share one sync. The data is
+            readable from the cache once durable and applied to the sectors in the background.
+            
+            Without the journal, the transaction is written straight to the sectors.
+            
+            @param[in] pTx The transaction to commit, owned by the caller
+            
+            @return True once the transaction is durable **/
+        bool TxnCommit(SectorTransaction* pTx)
+        {
+            std::vector< std::vector<unsigned char> > vKeys = pTx->GetKeys();
+            if(pJournal)
+                Throttle();
+            
+            JournalRecord record;
+            {
+                /* Appended in the order of the versions stamped, snapshots taken after wait for it to be readable. */
+                LOCK(VERSION_MUTEX);
+                
+                if(pTx->fSnapshot && versions.Conflicts(vKeys, pTx->nSnapshot))
+                {
+                    CloseSnapshot(pTx);
+                    nConflicts++;
+                    
+                    if(GetArg("-verbose", 0) >= 2)
+                        printf(FUNCTION "Transaction Conflicts with a Commit since Version %" PRIu64 ".\n", __PRETTY_FUNCTION__, pTx->nSnapshot);
+                    
+                    return false;
+                }
+                
+                CloseSnapshot(pTx);
+                versions.Stamp(vKeys, [this](const std::vector<unsigned char>& vKey, std::vector<unsigned char>& vData) { return GetCommitted(vKey, vData); });
+                
+                if(!pJournal)
+                    return CommitTransaction(pTx);
+                
+                for(auto item : pTx->mapEraseData)
+                    record.vErases.push_back(item.first);
+                
+                record.vWrites.assign(pTx->mapTransactions.begin(), pTx->mapTransactions.end());
+                
+                AppendRecord(record);
+            }
+            
+            return PublishRecord(record.nSequence);
+        }
+        
+        
+        /** Append a Record to the Journal and queue it to be applied. Called under the version lock, so records
+            are in the order of the versions stamped for them.
+            
+            @param[in] record The erases and writes, its sequence is assigned here **/
+        void AppendRecord(JournalRecord& record)
+        {
+            LOCK(SECTOR_MUTEX);
+            
+            nAppendedSequence = pJournal->Append(record);
+            queueApply.push_back(record);
+        }
+        
+        
+        /** Get a Record as last Committed, including Records in the Journal not yet Readable. Versions are stamped
+            with it, so a snapshot taken before such a record is readable still finds it in what it reads.
+            
+            @param[in] vKey The binary key
+            @param[out] vData The record's data
+            
+            @return True if the record exists **/
+        bool GetCommitted(const std::vector<unsigned char>& vKey, std::vector<unsigned char>& vData)
+        {
+            {
+                LOCK(SECTOR_MUTEX);
+                
+                for(auto it = queueApply.rbegin(); it != queueApply.rend() && it->nSequence > nPublishedSequence; ++it)
+                {
+                    for(auto& item : it->vWrites)
+                    {
+                        if(item.first == vKey)
+                        {
+                            vData = item.second;
+                            
+                            return true;
+                        }
+                    }
+                    
+                    if(std::find(it->vErases.begin(), it->vErases.end(), vKey) != it->vErases.end())
+                        return false;
+                }
+            }
+            
+            return Get(vKey, vData);
+        }
+        
+        
+        /** Wait for a Record to be Durable, then make it Readable.
+            
+            Every record the sync made durable is put in the cache, in order, so a later record of a key is never
+            replaced by an earlier one. A record that doesn't become durable is dropped before anything read it.
+            
+            @param[in] nSequence The sequence of the record
+            
+            @return True once the record is durable **/
+        bool PublishRecord(uint64 nSequence)
+        {
+            bool fDurable = pJournal->Sync(nSequence);
+            
+            bool fNotify;
+            {
+                LOCK(SECTOR_MUTEX);
+                
+                if(!fDurable)
+                {
+                    for(auto it = queueApply.begin(); it != queueApply.end(); ++it)
+                    {
+                        if(it->nSequence == nSequence)
+                        {
+                            queueApply.erase(it);
+                            
+                            break;
+                        }
+                    }
+                }
+                
+                uint64 nDurable = pJournal->Durable(), nSettled = nAppendedSequence;
+                for(auto& record : queueApply)
+                {
+                    if(record.nSequence <= nPublishedSequence)
+                        continue;
+                    
+                    if(record.nSequence > nDurable)
+                    {
+                        nSettled = record.nSequence - 1;
+                        
+                        break;
+                    }
+                    
+                    /* Hold the new state in the cache until the record is applied. */
+                    for(auto& vKey : record.vErases)
+                        cachePool->Put(vKey, std::vector<unsigned char>(), PENDING_ERASE);
+                    
+                    for(auto& item : record.vWrites)
+                        cachePool->Put(item.first, item.second, PENDING_TX);
+                    
+                    nPublishedSequence = record.nSequence;
+                }
+                
+                nSettledSequence = nSettled;
+                fNotify = (queueApply.size() >= SECTOR_APPLY_BATCH);
+            }
+            
+            /* Wake the transactions beginning that wait for their snapshot to be readable. */
+            if(nOpenTransactions.load() > 0)
+            {
+                boost::lock_guard<boost::mutex> lock(PENDING_MUTEX);
+                PENDING_CONDITION.notify_all();
+            }
+            
+            if(fNotify)
+                NotifyWriter();
+            
+            return fDurable;
+        }
+        
+        
+        /** Write or Erase outside a Transaction through the Journal.
+            
+            Used while the journal is on for the writes that would go straight to the sectors, so they are
+            replayed after a crash in order with the commits around them. Counted until readable while no
+            transaction is open and stamped with a version otherwise, as in WriteDirect.
+            
+            @param[in] record The erases and writes
+            
+            @return True once the record is durable **/
+        bool WriteJournal(JournalRecord& record)
+        {
+            Throttle();
+            
+            nPendingWrites++;
+            if(nOpenTransactions.load() > 0)
+            {
+                EndPendingWrite();
+                
+                std::vector< std::vector<unsigned char> > vKeys(record.vErases);
+                for(auto& item : record.vWrites)
+                    vKeys.push_back(item.first);
+                
+                {
+                    LOCK(VERSION_MUTEX);
+                    versions.Stamp(vKeys, [this](const std::vector<unsigned char>& vKey, std::vector<unsigned char>& vData) { return GetCommitted(vKey, vData); });
+                    
+                    AppendRecord(record);
+                }
+                
+                return PublishRecord(record.nSequence);
+            }
+            
+            AppendRecord(record);
+            
+            bool fSuccess = PublishRecord(record.nSequence);
+            EndPendingWrite();
+            
+            return fSuccess;
+        }
+        
+        
+        /** Write a Transaction straight to the Sectors, flagging its Keys until every Sector is Written. **/
+        bool CommitTransaction(SectorTransaction* pTx)
+        {
+            LOCK(SECTOR_MUTEX);
+            
             /** Habdle setting the sector key flags so the database knows if the transaction was completed properly. **/
             if(GetArg("-verbose", 0) >= 4)
                 printf(FUNCTION "Commiting Keys to Keychain.\n", __PRETTY_FUNCTION__);
             
             /** Set the Sector Keys to an Invalid State to know if there are interuptions the sector was not finished successfully. **/
-            for(typename std::map< std::vector<unsigned char>, std::vector<unsigned char> >::iterator nIterator = pTransaction->mapTransactions.begin(); nIterator != pTransaction->mapTransactions.end(); nIterator++ )
+            for(typename std::map< std::vector<unsigned char>, std::vector<unsigned char> >::iterator nIterator = pTx->mapTransactions.begin(); nIterator != pTx->mapTransactions.end(); nIterator++ )
             {
                 SectorKey cKey;
                 if(SectorKeys->HasKey(nIterator->first)) {
@@ -669,9 +2873,10 @@ namespace LLD
                 printf(FUNCTION "Erasing Sector Keys Flagged for Deletion.\n", __PRETTY_FUNCTION__);
             
             /** Erase all the Transactions that are set to be erased. That way if they are assigned a TRANSACTION flag we know to roll back their key to orginal data. **/
-            for(typename std::map< std::vector<unsigned char>, unsigned int >::iterator nIterator = pTransaction->mapEraseData.begin(); nIterator != pTransaction->mapEraseData.end(); nIterator++ )
+            for(typename std::map< std::vector<unsigned char>, unsigned int >::iterator nIterator = pTx->mapEraseData.begin(); nIterator != pTx->mapEraseData.end(); nIterator++ )
             {
-                if(!SectorKeys->Erase(nIterator->first))
+                cachePool->Remove(nIterator->first);
+                if(!EraseSector(nIterator->first))
                     return error(FUNCTION "Couldn't get the Active Sector Key for Delete.", __PRETTY_FUNCTION__);
             }
             
@@ -679,115 +2884,38 @@ namespace LLD
             if(GetArg("-verbose", 0) >= 4)
                 printf(FUNCTION "Commit Data to Datachain Sector Database.\n", __PRETTY_FUNCTION__);
             
-            for(typename std::map< std::vector<unsigned char>, std::vector<unsigned char> >::iterator nIterator = pTransaction->mapTransactions.begin(); nIterator != pTransaction->mapTransactions.end(); nIterator++ )
+            for(typename std::map< std::vector<unsigned char>, std::vector<unsigned char> >::iterator nIterator = pTx->mapTransactions.begin(); nIterator != pTx->mapTransactions.end(); nIterator++ )
             {
                 /** Declare the Key and Data for easier reference. **/
                 std::vector<unsigned char> vKey  = nIterator->first;
                 std::vector<unsigned char> vData = nIterator->second;
                 
-                /* Write Header if First Update. */
-                if(!SectorKeys->HasKey(vKey))
-                {
-                    if(nCurrentFileSize > MAX_SECTOR_FILE_SIZE)
-                    {
-                        if(GetArg("-verbose", 0) >= 4)
-                            printf(FUNCTION "Current File too Large, allocating new File %u\n", __PRETTY_FUNCTION__, nCurrentFileSize, nCurrentFile + 1);
-                            
-                        nCurrentFile ++;
-                        nCurrentFileSize = 0;
-                        
-                        std::ofstream fStream(strprintf("%s_block.%05u", strBaseLocation.c_str(), nCurrentFile).c_str(), std::ios::out | std::ios::binary);
-                        fStream.close();
-                    }
-                    
-                    /* Open the Stream to Read the data from Sector on File. */
-                    std::string strFilename = strprintf("%s_block.%05u", strBaseLocation.c_str(), nCurrentFile);
-                    std::fstream fStream(strFilename.c_str(), std::ios::in | std::ios::out | std::ios::binary);
-                    
-                    /* If it is a New Sector, Assign a Binary Position. 
-                        TODO: Track Sector Database File Sizes. */
-                    fStream.seekp(nCurrentFileSize, std::ios::beg);
-                    
-                    fStream.write((char*) &vData[0], vData.size());
-                    fStream.close();
-                    
-                    /* Create a new Sector Key. */
-                    SectorKey cKey(READY, vKey, nCurrentFile, nCurrentFileSize, vData.size()); 
-                    
-                    /* Check the Data Integrity of the Sector by comparing the Checksums. */
-                    cKey.nChecksum    = LLC::HASH::SK32(vData);
-                    
-                    /* Increment the current filesize */
-                    nCurrentFileSize += vData.size();
-                    
-                    /* Assign the Key to Keychain. */
-                    SectorKeys->Put(cKey);
-                }
-                else
-                {
-                    /* Get the Sector Key from the Keychain. */
-                    SectorKey cKey;
-                    if(!SectorKeys->Get(vKey, cKey)) {
-                        SectorKeys->Erase(vKey);
-                        
-                        return false;
-                    }
-                        
-                    /* Open the Stream to Read the data from Sector on File. */
-                    std::string strFilename = strprintf("%s_block.%05u", strBaseLocation.c_str(), cKey.nSectorFile);
-                    std::fstream fStream(strFilename.c_str(), std::ios::in | std::ios::out | std::ios::binary);
-                    
-                    /* Locate the Sector Data from Sector Key. 
-                        TODO: Make Paging more Efficient in Keys by breaking data into different locations in Database. */
-                    fStream.seekp(cKey.nSectorStart, std::ios::beg);
-                    if(vData.size() > cKey.nSectorSize){
-                        fStream.close();
-                        printf(FUNCTION "PUT (TOO LARGE) NO TRUNCATING ALLOWED (Old %u :: New %u):%s\n", __PRETTY_FUNCTION__, cKey.nSectorSize, vData.size(), HexStr(vData.begin(), vData.end()).c_str());
-                        
-                        return false;
-                    }
-                    
-                    /* Assign the Writing State for Sector. */
-                    //TODO: use memory maps
-                    
-                    fStream.write((char*) &vData[0], vData.size());
-                    fStream.close();
-                    
-                    cKey.nState    = READY;
-                    cKey.nChecksum = LLC::HASH::SK32(vData);
-                    
-                    SectorKeys->Put(cKey);
-                }
+                if(!PutSector(vKey, vData))
+                    return false;
+                
+                /** Replace what the Cache holds of the Key, so it isn't Read or Flushed over the new Data. **/
+                cachePool->Put(vKey, vData, MEMORY_ONLY);
             }
             
             /** Update the Keychain with Checksums and READY Flag letting sectors know they were written successfully. **/
             if(GetArg("-verbose", 0) >= 4)
                 printf(FUNCTION "Commiting Key Valid States to Keychain.\n", __PRETTY_FUNCTION__);
             
-            for(typename std::map< std::vector<unsigned char>, std::vector<unsigned char> >::iterator nIterator = pTransaction->mapTransactions.begin(); nIterator != pTransaction->mapTransactions.end(); nIterator++ )
+            for(typename std::map< std::vector<unsigned char>, std::vector<unsigned char> >::iterator nIterator = pTx->mapTransactions.begin(); nIterator != pTx->mapTransactions.end(); nIterator++ )
             {
                 /** Assign the Writing State for Sector. **/
                 SectorKey cKey;
                 if(!SectorKeys->Get(nIterator->first, cKey))
                     return error(FUNCTION "Failed to Get Key from Keychain.", __PRETTY_FUNCTION__);
                 
-                /** Set the Sector states back to Active. **/
+                /** Set the Sector states back to Active. The Checksum was made by PutSector, of the Data as it is Stored. **/
                 cKey.nState    = READY;
-                cKey.nChecksum = LLC::HASH::SK32(nIterator->second);
                 
                 /** Commit the Keys to Keychain Database. **/
                 if(!SectorKeys->Put(cKey))
                     return error(FUNCTION "Failed to Commit Key to Keychain.", __PRETTY_FUNCTION__);
             }
             
-            /** Clean up the Sector Transaction Key. 
-                TODO: Delete the Sector and Keychain for Current Transaction Commit ID. **/
-            delete pTransaction;
-            pTransaction = NULL;
-            
-            if(GetBoolArg("-runtime", false))
-                printf(ANSI_COLOR_GREEN FUNCTION "executed in %u micro-seconds\n" ANSI_COLOR_RESET, __PRETTY_FUNCTION__, runtime.ElapsedMicroseconds());
-            
             return true;
         }
     };
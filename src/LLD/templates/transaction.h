@@ -16,6 +16,7 @@ ________________________________________________________________________________
 
 #include <boost/thread.hpp>
 #include <map>
+#include <set>
 #include <vector>
 
 #include "../../LLC/hash/SK.h"
@@ -77,8 +78,12 @@ namespace LLD
         /** Vector to hold the keys of transactions to be erased. **/
         std::map< std::vector<unsigned char>, unsigned int > mapEraseData;
         
+        /** The committed version the transaction reads, if it was opened with TxnBegin. **/
+        uint64 nSnapshot;
+        bool fSnapshot;
+        
         /** Basic Constructor. **/
-        SectorTransaction(){ }
+        SectorTransaction() : nSnapshot(0), fSnapshot(false) { }
         
         /** Add a new Transaction to the Memory Map. **/
         bool AddTransaction(std::vector<unsigned char> vKey, std::vector<unsigned char> vData,
@@ -88,6 +93,7 @@ namespace LLD
             
             mapTransactions[vKey] = vData;
             mapOriginalData[vKey] = vOriginalData;
+            mapEraseData.erase(vKey);
             
             return true;
         }
@@ -114,6 +120,234 @@ namespace LLD
             
             return hashTransaction;
         }
+        
+        /* The keys the transaction writes or erases. */
+        std::vector< std::vector<unsigned char> > GetKeys()
+        {
+            LOCK(TX_MUTEX);
+            
+            std::vector< std::vector<unsigned char> > vKeys;
+            for(auto& item : mapTransactions)
+                vKeys.push_back(item.first);
+            
+            for(auto& item : mapEraseData)
+                vKeys.push_back(item.first);
+            
+            return vKeys;
+        }
+        
+        /** Look up a key in the write set.
+        
+            @param[in] vKey The binary key
+            @param[out] vData The data written, if it was
+            @param[out] fErased Whether the transaction erased it
+            
+            @return True if the transaction wrote or erased the key **/
+        bool Find(const std::vector<unsigned char>& vKey, std::vector<unsigned char>& vData, bool& fErased)
+        {
+            LOCK(TX_MUTEX);
+            
+            fErased = (mapEraseData.count(vKey) > 0);
+            if(fErased)
+                return true;
+            
+            auto it = mapTransactions.find(vKey);
+            if(it == mapTransactions.end())
+                return false;
+            
+            vData = it->second;
+            return true;
+        }
+    };
+    
+    
+    /** Snapshot Versions:
+    
+        Committed versions of a sector database, so a transaction reads the records as they were
+        when it began however many commits land meanwhile.
+        
+        Every commit made while a snapshot is open is stamped with the next version. It keeps the
+        value each of its keys had before it, and records the version as the last write of the key.
+        A snapshot reads a key from the first commit after it that changed the key, or from the
+        database if none has. Two snapshots writing the same key can't both commit: the second finds
+        the key written after its snapshot.
+        
+        Nothing is kept while no snapshot is open, and what is kept goes as the oldest snapshot closes,
+        so a snapshot held open holds every value changed since it began.
+        
+        Not thread safe, the sector database calls it under its lock.
+        
+    **/
+    class SnapshotVersions
+    {
+        /* A value of a key before a commit. */
+        struct KeyVersion
+        {
+            uint64 nVersion;
+            bool fExists;
+            std::vector<unsigned char> vData;
+        };
+        
+        /* The last version committed. */
+        uint64 nVersion;
+        
+        /* The versions the open snapshots read. */
+        std::multiset<uint64> setOpen;
+        
+        /* The version of the last commit to each key. */
+        std::map< std::vector<unsigned char>, uint64 > mapLastWrite;
+        
+        /* The values keys had before each commit to them, oldest first. */
+        std::map< std::vector<unsigned char>, std::vector<KeyVersion> > mapPrevious;
+        
+        /* Bytes of the values kept. */
+        uint64 nBytes;
+        
+        
+        /* Drop what no open snapshot can read. */
+        void Prune()
+        {
+            if(setOpen.empty())
+            {
+                mapLastWrite.clear();
+                mapPrevious.clear();
+                nBytes = 0;
+                
+                return;
+            }
+            
+            uint64 nOldest = *setOpen.begin();
+            for(auto it = mapLastWrite.begin(); it != mapLastWrite.end(); )
+                it = (it->second <= nOldest ? mapLastWrite.erase(it) : std::next(it));
+            
+            for(auto it = mapPrevious.begin(); it != mapPrevious.end(); )
+            {
+                std::vector<KeyVersion>& vVersions = it->second;
+                
+                unsigned int nDrop = 0;
+                while(nDrop < vVersions.size() && vVersions[nDrop].nVersion <= nOldest)
+                    nBytes -= vVersions[nDrop++].vData.size();
+                
+                vVersions.erase(vVersions.begin(), vVersions.begin() + nDrop);
+                it = (vVersions.empty() ? mapPrevious.erase(it) : std::next(it));
+            }
+        }
+    
+    
+    public:
+        
+        SnapshotVersions() : nVersion(0), nBytes(0) { }
+        
+        
+        /* Open a snapshot of the last version committed. */
+        uint64 Open()
+        {
+            setOpen.insert(nVersion);
+            
+            return nVersion;
+        }
+        
+        
+        /* Close a snapshot, dropping what only it could read. */
+        void Close(uint64 nSnapshot)
+        {
+            auto it = setOpen.find(nSnapshot);
+            if(it == setOpen.end())
+                return;
+            
+            bool fOldest = (it == setOpen.begin());
+            setOpen.erase(it);
+            
+            if(fOldest)
+                Prune();
+        }
+        
+        
+        /* The number of snapshots open. */
+        uint64 Snapshots() const { return setOpen.size(); }
+        
+        
+        /* Check if any of the keys was committed after a snapshot. */
+        bool Conflicts(const std::vector< std::vector<unsigned char> >& vKeys, uint64 nSnapshot) const
+        {
+            for(auto& vKey : vKeys)
+            {
+                auto it = mapLastWrite.find(vKey);
+                if(it != mapLastWrite.end() && it->second > nSnapshot)
+                    return true;
+            }
+            
+            return false;
+        }
+        
+        
+        /** Stamp a commit with the next version before it is applied.
+        
+            @param[in] vKeys The keys the commit writes or erases
+            @param[in] fnRead Reads the committed value of a key, returning false if it has none
+            
+            @return The version of the commit, or the last version if no snapshot is open **/
+        template<typename ReadFunc>
+        uint64 Stamp(const std::vector< std::vector<unsigned char> >& vKeys, ReadFunc fnRead)
+        {
+            if(setOpen.empty())
+                return nVersion;
+            
+            nVersion++;
+            for(auto& vKey : vKeys)
+            {
+                uint64& nLast = mapLastWrite[vKey];
+                if(nLast == nVersion)
+                    continue;
+                
+                nLast = nVersion;
+                
+                KeyVersion version;
+                version.nVersion = nVersion;
+                version.fExists  = fnRead(vKey, version.vData);
+                nBytes += version.vData.size();
+                
+                mapPrevious[vKey].push_back(version);
+            }
+            
+            return nVersion;
+        }
+        
+        
+        /** Read a key as it was at a snapshot, if it has changed since.
+        
+            @param[in] vKey The binary key
+            @param[in] nSnapshot The version of the snapshot
+            @param[out] vData The value it had
+            @param[out] fExists Whether it existed
+            
+            @return True if the key was committed after the snapshot, false to read it from the database **/
+        bool Find(const std::vector<unsigned char>& vKey, uint64 nSnapshot, std::vector<unsigned char>& vData, bool& fExists) const
+        {
+            auto it = mapPrevious.find(vKey);
+            if(it == mapPrevious.end())
+                return false;
+            
+            for(auto& version : it->second)
+            {
+                if(version.nVersion > nSnapshot)
+                {
+                    vData   = version.vData;
+                    fExists = version.fExists;
+                    
+                    return true;
+                }
+            }
+            
+            return false;
+        }
+        
+        
+        /* Dump the version statistics to the debug console. */
+        void PrintStats() const
+        {
+            printf(FUNCTION "Version: %" PRIu64 " | Snapshots: %" PRIu64 " | Keys Changed: %" PRIu64 " | Values Kept: %" PRIu64 " bytes\n", __PRETTY_FUNCTION__, nVersion, (uint64)setOpen.size(), (uint64)mapLastWrite.size(), nBytes);
+        }
     };
 }
 
@@ -33,7 +33,9 @@ SOFTWARE.
 #include <sys/mman.h>
 #include <sys/stat.h>
 #endif
+#include <algorithm>
 #include <stdexcept>
+#include <cstring>
 
 namespace mmaplib {
 
@@ -170,6 +172,213 @@ inline void MemoryMappedFile::cleanup()
 #endif
 }
 
+#if !defined(_WIN32)
+
+/* Writable mapping that grows in fixed chunks as the file is appended to.
+   The file and its mapping are grown a whole chunk ahead of the logical size,
+   so appends within a chunk neither truncate nor remap. The file is cut back
+   to its logical size when closed. Only the range written since the last sync
+   is synced. */
+class GrowableMemoryMappedFile
+{
+public:
+    GrowableMemoryMappedFile(const char* path, size_t chunk, bool readonly = false);
+    ~GrowableMemoryMappedFile();
+
+    bool is_open() const;
+    size_t size() const;
+    size_t capacity() const;
+    char* data() const;
+
+    bool reserve(size_t capacity);
+    bool resize(size_t size);
+    bool write(size_t offset, const void* buffer, size_t length);
+    bool sync();
+
+private:
+    void cleanup();
+
+    int    fd_;
+    size_t size_;
+    size_t file_size_;
+    size_t capacity_;
+    size_t dirty_begin_;
+    size_t dirty_end_;
+    size_t chunk_;
+    bool   readonly_;
+    void*  addr_;
+};
+
+inline GrowableMemoryMappedFile::GrowableMemoryMappedFile(const char* path, size_t chunk, bool readonly)
+    : fd_(-1)
+    , size_(0)
+    , file_size_(0)
+    , capacity_(0)
+    , dirty_begin_(0)
+    , dirty_end_(0)
+    , chunk_(chunk)
+    , readonly_(readonly)
+    , addr_(MAP_FAILED)
+{
+    fd_ = open(path, readonly_ ? O_RDONLY : O_RDWR);
+    if (fd_ == -1) {
+        return;
+    }
+
+    struct stat sb;
+    if (fstat(fd_, &sb) == -1) {
+        cleanup();
+        return;
+    }
+    size_ = file_size_ = sb.st_size;
+
+    if (!reserve(size_ > 0 ? size_ : chunk_)) {
+        cleanup();
+    }
+}
+
+inline GrowableMemoryMappedFile::~GrowableMemoryMappedFile()
+{
+    cleanup();
+}
+
+inline bool GrowableMemoryMappedFile::is_open() const
+{
+    return addr_ != MAP_FAILED;
+}
+
+inline size_t GrowableMemoryMappedFile::size() const
+{
+    return size_;
+}
+
+inline size_t GrowableMemoryMappedFile::capacity() const
+{
+    return capacity_;
+}
+
+inline char* GrowableMemoryMappedFile::data() const
+{
+    return (char*)addr_;
+}
+
+inline bool GrowableMemoryMappedFile::reserve(size_t capacity)
+{
+    if (fd_ == -1) {
+        return false;
+    }
+
+    if (addr_ != MAP_FAILED && capacity <= capacity_) {
+        return true;
+    }
+
+    /* Round up to the next chunk boundary. */
+    if (chunk_ > 0) {
+        capacity = ((capacity + chunk_ - 1) / chunk_) * chunk_;
+    }
+
+    void* addr = mmap(NULL, capacity, readonly_ ? PROT_READ : (PROT_READ | PROT_WRITE), MAP_SHARED, fd_, 0);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+
+    if (addr_ != MAP_FAILED) {
+        munmap(addr_, capacity_);
+    }
+
+    addr_     = addr;
+    capacity_ = capacity;
+
+    return true;
+}
+
+inline bool GrowableMemoryMappedFile::resize(size_t size)
+{
+    if (readonly_ || fd_ == -1) {
+        return false;
+    }
+
+    if (size <= size_) {
+        return true;
+    }
+
+    /* Grow the file a chunk at a time, the logical size is kept apart from it. */
+    if (size > file_size_) {
+        size_t file_size = (chunk_ > 0 ? ((size + chunk_ - 1) / chunk_) * chunk_ : size);
+        if (ftruncate(fd_, file_size) == -1) {
+            return false;
+        }
+
+        file_size_ = file_size;
+        if (!reserve(file_size_)) {
+            return false;
+        }
+    }
+
+    size_ = size;
+
+    return true;
+}
+
+inline bool GrowableMemoryMappedFile::write(size_t offset, const void* buffer, size_t length)
+{
+    if (!resize(offset + length)) {
+        return false;
+    }
+
+    memcpy((char*)addr_ + offset, buffer, length);
+
+    if (dirty_end_ == dirty_begin_) {
+        dirty_begin_ = offset;
+        dirty_end_   = offset + length;
+    } else {
+        dirty_begin_ = std::min(dirty_begin_, offset);
+        dirty_end_   = std::max(dirty_end_, offset + length);
+    }
+
+    return true;
+}
+
+inline bool GrowableMemoryMappedFile::sync()
+{
+    if (addr_ == MAP_FAILED) {
+        return false;
+    }
+
+    if (dirty_end_ == dirty_begin_) {
+        return true;
+    }
+
+    /* msync takes a page aligned start. */
+    size_t begin = dirty_begin_ - (dirty_begin_ % sysconf(_SC_PAGESIZE));
+    if (msync((char*)addr_ + begin, dirty_end_ - begin, MS_SYNC) != 0) {
+        return false;
+    }
+
+    dirty_begin_ = dirty_end_ = 0;
+
+    return true;
+}
+
+inline void GrowableMemoryMappedFile::cleanup()
+{
+    if (addr_ != MAP_FAILED) {
+        munmap(addr_, capacity_);
+        addr_ = MAP_FAILED;
+    }
+
+    if (fd_ != -1) {
+        if (!readonly_ && file_size_ > size_) {
+            ftruncate(fd_, size_);
+        }
+
+        close(fd_);
+        fd_ = -1;
+    }
+}
+
+#endif
+
 } // namespace mmaplib
 
 #endif
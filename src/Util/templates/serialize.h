@@ -1043,6 +1043,119 @@ public:
     }
 };
 
+
+/** Read only stream over memory owned by someone else.
+*
+* Unserializes straight from a buffer without copying it the way CDataStream does.
+* The memory must outlive the view and not change while it is read.
+*/
+class CDataView
+{
+protected:
+    const char* pbegin;
+    const char* pend;
+    short state;
+    short exceptmask;
+public:
+    int nType;
+    int nVersion;
+
+    CDataView(const unsigned char* pbeginIn, const unsigned char* pendIn, int nTypeIn, int nVersionIn) : pbegin((const char*)pbeginIn), pend((const char*)pendIn), state(0), exceptmask(std::ios::badbit | std::ios::failbit), nType(nTypeIn), nVersion(nVersionIn) {}
+
+    CDataView(const std::vector<unsigned char>& vchIn, int nTypeIn, int nVersionIn) : pbegin((const char*)vchIn.data()), pend((const char*)vchIn.data() + vchIn.size()), state(0), exceptmask(std::ios::badbit | std::ios::failbit), nType(nTypeIn), nVersion(nVersionIn) {}
+
+    unsigned int size() const    { return pend - pbegin; }
+    bool empty() const           { return pbegin == pend; }
+
+    void setstate(short bits, const char* psz)
+    {
+        state |= bits;
+        if (state & exceptmask)
+            THROW_WITH_STACKTRACE(std::ios_base::failure(psz));
+    }
+
+    bool eof() const             { return size() == 0; }
+    bool fail() const            { return state & (std::ios::badbit | std::ios::failbit); }
+    bool good() const            { return !eof() && (state == 0); }
+
+    int GetType()                { return nType; }
+    int GetVersion()             { return nVersion; }
+
+    CDataView& read(char* pch, int nSize)
+    {
+        assert(nSize >= 0);
+        if (nSize > pend - pbegin)
+        {
+            memset(pch, 0, nSize);
+            nSize = pend - pbegin;
+            memcpy(pch, pbegin, nSize);
+            pbegin = pend;
+            setstate(std::ios::failbit, "CDataView::read() : end of data");
+            return (*this);
+        }
+        memcpy(pch, pbegin, nSize);
+        pbegin += nSize;
+        return (*this);
+    }
+
+    CDataView& ignore(int nSize)
+    {
+        assert(nSize >= 0);
+        if (nSize > pend - pbegin)
+        {
+            pbegin = pend;
+            setstate(std::ios::failbit, "CDataView::ignore() : end of data");
+            return (*this);
+        }
+        pbegin += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    CDataView& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
+
+/** Write only stream appending to a vector owned by someone else.
+*
+* Lets a caller serialize into a buffer it reuses, so the vector's capacity carries over
+* from one use to the next instead of being allocated each time.
+*/
+class CDataWriter
+{
+protected:
+    std::vector<unsigned char>& vch;
+public:
+    int nType;
+    int nVersion;
+
+    CDataWriter(std::vector<unsigned char>& vchIn, int nTypeIn, int nVersionIn) : vch(vchIn), nType(nTypeIn), nVersion(nVersionIn) {}
+
+    int GetType()                { return nType; }
+    int GetVersion()             { return nVersion; }
+
+    CDataWriter& write(const char* pch, int nSize)
+    {
+        // Write to the end of the buffer
+        assert(nSize >= 0);
+        vch.insert(vch.end(), (const unsigned char*)pch, (const unsigned char*)pch + nSize);
+        return (*this);
+    }
+
+    template<typename T>
+    CDataWriter& operator<<(const T& obj)
+    {
+        // Serialize to this stream
+        ::Serialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 #ifdef TESTCDATASTREAM
 // VC6sp6
 // CDataStream:
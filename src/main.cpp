@@ -19,83 +19,2226 @@
 
 #include <db_cxx.h>
 
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+
+/* Heap allocations made by each thread, counted for -benchread. */
+thread_local uint64 nAllocations = 0;
+
+void* operator new(std::size_t nSize)
+{
+    nAllocations++;
+    
+    void* pData = malloc(nSize ? nSize : 1);
+    if(!pData)
+        throw std::bad_alloc();
+    
+    return pData;
+}
+
+void operator delete(void* pData) noexcept
+{
+    free(pData);
+}
+
 class CBlock
 {
-public:
-    unsigned int nBlkVersion;
-    uint1024 hashPrevBlock;
-    uint512 hashMerkleRoot;
-    unsigned int nHeight;
-    unsigned int nChannel;
-    unsigned int nBits;
-    uint64 nNonce;
+public:
+    unsigned int nBlkVersion;
+    uint1024 hashPrevBlock;
+    uint512 hashMerkleRoot;
+    unsigned int nHeight;
+    unsigned int nChannel;
+    unsigned int nBits;
+    uint64 nNonce;
+    
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nBlkVersion);
+        //nVersion = this->nVersion;
+        READWRITE(hashPrevBlock);
+        READWRITE(hashMerkleRoot);
+        READWRITE(nHeight);
+        READWRITE(nChannel);
+        READWRITE(nBits);
+        READWRITE(nNonce);
+    )
+    
+    CBlock()
+    {
+        SetNull();
+    }
+    
+    void SetNull()
+    {
+        nBlkVersion = 0;
+        hashPrevBlock = 0;
+        hashMerkleRoot = 0;
+        nHeight = 0;
+        nChannel = 0;
+        nNonce   = 0;
+    }
+    
+    void SetRandom()
+    {
+        nBlkVersion = GetRandInt(1000);
+        nHeight  = GetRandInt(1000);
+        nChannel = GetRandInt(1000);
+        nBits    = GetRandInt(1000);
+        nNonce   = GetRand(1000000);
+        
+        hashMerkleRoot = GetRand512();
+        hashPrevBlock  = GetRand1024();
+    }
+    
+    uint1024 GetHash() const
+    {
+        return LLC::HASH::SK1024(BEGIN(nBlkVersion), END(nNonce));
+    }
+    
+    void Print()
+    {
+        printf("CBlock(nVersion=%u, hashPrevBlock=%s, hashMerkleRoot=%s, nHeight=%u, nChannel=%u, nBits=%u, nNonce=%" PRIu64 ", hash=" ANSI_COLOR_BRIGHT_BLUE "%s" ANSI_COLOR_RESET ")\n", nBlkVersion, hashPrevBlock.ToString().c_str(), hashMerkleRoot.ToString().c_str(), nHeight, nChannel, nBits, nNonce, GetHash().ToString().c_str());
+    }
+};
+
+
+namespace LLD
+{
+    /* Block headers are fixed width, copied field by field in the order they serialize. */
+    template<> struct Codec<CBlock> : FixedCodec<Codec<CBlock>, CBlock, 216>
+    {
+        static void Write(const CBlock& blk, unsigned char* pData)
+        {
+            memcpy(pData, &blk.nBlkVersion, 4);      pData += 4;
+            memcpy(pData, &blk.hashPrevBlock, 128);  pData += 128;
+            memcpy(pData, &blk.hashMerkleRoot, 64);  pData += 64;
+            memcpy(pData, &blk.nHeight, 4);          pData += 4;
+            memcpy(pData, &blk.nChannel, 4);         pData += 4;
+            memcpy(pData, &blk.nBits, 4);            pData += 4;
+            memcpy(pData, &blk.nNonce, 8);
+        }
+        
+        static void Read(const unsigned char* pData, CBlock& blk)
+        {
+            memcpy(&blk.nBlkVersion, pData, 4);      pData += 4;
+            memcpy(&blk.hashPrevBlock, pData, 128);  pData += 128;
+            memcpy(&blk.hashMerkleRoot, pData, 64);  pData += 64;
+            memcpy(&blk.nHeight, pData, 4);          pData += 4;
+            memcpy(&blk.nChannel, pData, 4);         pData += 4;
+            memcpy(&blk.nBits, pData, 4);            pData += 4;
+            memcpy(&blk.nNonce, pData, 8);
+        }
+    };
+}
+
+
+class TestDB : public LLD::SectorDatabase<LLD::BinaryHashMap>
+{
+public:
+    TestDB(const char* pszMode="r+") : SectorDatabase("testdb", pszMode) {}
+    
+    bool WriteBlock(uint1024 hash, CBlock blk)
+    {
+        return Write(hash, blk);
+    }
+    
+    bool ReadBlock(uint1024 hash, CBlock& blk)
+    {
+        return Read(hash, blk);
+    }
+};
+
+
+class BenchDB : public LLD::SectorDatabase<LLD::BinaryFileMap>
+{
+public:
+    BenchDB(std::string strName, const char* pszMode="r+") : SectorDatabase(strName, pszMode) {}
+    
+    bool WriteBlock(uint1024 hash, CBlock blk)
+    {
+        return Write(hash, blk);
+    }
+    
+    bool ReadBlock(uint1024 hash, CBlock& blk)
+    {
+        return Read(hash, blk);
+    }
+    
+    void PrintJournalStats()
+    {
+        if(pJournal)
+            pJournal->PrintStats();
+    }
+    
+    uint64 CacheSize()
+    {
+        return cachePool->Size();
+    }
+    
+    bool WriteData(uint64 nKey, const std::vector<unsigned char>& vData)
+    {
+        return Write(nKey, vData);
+    }
+    
+    bool ReadData(uint64 nKey, std::vector<unsigned char>& vData)
+    {
+        return Read(nKey, vData);
+    }
+    
+    bool EraseData(uint64 nKey)
+    {
+        return Erase(nKey);
+    }
+    
+    bool WriteBalance(uint64 nAccount, uint64 nBalance)
+    {
+        return Write(nAccount, nBalance);
+    }
+    
+    bool ReadBalance(uint64 nAccount, uint64& nBalance)
+    {
+        return Read(nAccount, nBalance);
+    }
+    
+    uint64 FreeBytes()
+    {
+        LOCK(SECTOR_MUTEX);
+        
+        return freeSpace.FreeBytes();
+    }
+    
+    /* Bytes in the cache not yet on disk. */
+    uint64 UnwrittenBytes()
+    {
+        return cachePool->DirtySize() + cachePool->DiskBufferSize();
+    }
+    
+    uint64 ReadsVerified()
+    {
+        return nReadsVerified.load();
+    }
+    
+    /* Bytes the records take in their sectors, compressed or not, from the keychain. */
+    uint64 StoredBytes()
+    {
+        uint64 nBytes = 0;
+        
+        LLD::SectorKey cKey;
+        for(auto& vKey : SectorKeys->GetKeys())
+            if(SectorKeys->Get(vKey, cKey))
+                nBytes += cKey.nSectorSize;
+        
+        return nBytes;
+    }
+    
+    /* Flip the first byte of a record's sector on disk, behind the database's back. */
+    bool CorruptData(uint64 nKey)
+    {
+        std::vector<unsigned char> vKey;
+        LLD::Codec<uint64>::Encode(nKey, vKey);
+        
+        LLD::SectorKey cKey;
+        unsigned char nByte;
+        if(!SectorKeys->Get(vKey, cKey) || !LLD::FileCache().Read(nFileCacheID, cKey.nSectorFile, cKey.nSectorStart, &nByte, 1))
+            return false;
+        
+        nByte ^= 0xff;
+        
+        return LLD::FileCache().Write(nFileCacheID, cKey.nSectorFile, cKey.nSectorStart, &nByte, 1);
+    }
+};
+
+
+/* Compare file handle cache and memory mapped sector reads at random keys. */
+int BenchmarkMMAP()
+{
+    unsigned int nTotalRecords = GetArg("-benchkeys", 1000000);
+    
+    printf(ANSI_COLOR_BRIGHT_BLUE "\nBenchmarking Sector Reads (pread vs mmap) with %u Keys\n\n" ANSI_COLOR_RESET, nTotalRecords);
+    
+    /* Write the records straight to disk so reads don't come from the cache. */
+    mapArgs["-forcewrite"] = "1";
+    mapArgs["-mmap"]       = "1";
+    
+    CBlock blk;
+    blk.SetRandom();
+    
+    std::vector<uint1024> vKeys;
+    vKeys.reserve(nTotalRecords);
+    
+    boost::filesystem::remove_all(GetDataDir().string() + "/benchmmap/");
+    BenchDB* db = new BenchDB("benchmmap");
+    
+    Timer timer;
+    timer.Start();
+    for(unsigned int i = 0; i < nTotalRecords; i++)
+    {
+        blk.nChannel = i;
+        
+        uint1024 hash = blk.GetHash();
+        db->WriteBlock(hash, blk);
+        vKeys.push_back(hash);
+    }
+    
+    uint64 nElapsed = timer.ElapsedMicroseconds();
+    printf(ANSI_COLOR_GREEN "LLD Write Performance: %" PRIu64 " micro-seconds | %f ops/s\n" ANSI_COLOR_RESET, nElapsed, (nTotalRecords * 1000000.0) / nElapsed);
+    delete db;
+    
+    std::random_shuffle(vKeys.begin(), vKeys.end());
+    for(int nMode = 0; nMode < 2; nMode++)
+    {
+        mapArgs["-mmap"] = nMode ? "1" : "0";
+        db = new BenchDB("benchmmap");
+        
+        unsigned int nFailed = 0;
+        timer.Reset();
+        for(auto hash : vKeys)
+            if(!db->ReadBlock(hash, blk))
+                nFailed++;
+        
+        nElapsed = timer.ElapsedMicroseconds();
+        printf(ANSI_COLOR_GREEN "LLD %s Read Performance: %" PRIu64 " micro-seconds | %f ops/s | %u failed\n" ANSI_COLOR_RESET, nMode ? "mmap" : "pread", nElapsed, (nTotalRecords * 1000000.0) / nElapsed, nFailed);
+        LLD::FileCache().PrintStats();
+        
+        delete db;
+    }
+    
+    mapArgs.erase("-forcewrite");
+    mapArgs.erase("-mmap");
+    
+    return 0;
+}
+
+
+/* Put and Get Sector Keys at random keys directly on a keychain. */
+template<typename KeychainType>
+void BenchmarkKeychainType(std::string strName, const std::vector< std::vector<unsigned char> >& vKeys)
+{
+    std::string strPath = GetDataDir().string() + "/benchkeychain/" + strName + "/";
+    boost::filesystem::remove_all(strPath);
+    
+    KeychainType* keychain = new KeychainType(strPath);
+    
+    Timer timer;
+    timer.Start();
+    for(unsigned int i = 0; i < vKeys.size(); i++)
+        keychain->Put(LLD::SectorKey(LLD::READY, vKeys[i], 0, i, 128));
+    
+    uint64 nElapsed = timer.ElapsedMicroseconds();
+    printf(ANSI_COLOR_GREEN "%s Put Performance: %" PRIu64 " micro-seconds | %f ops/s\n" ANSI_COLOR_RESET, strName.c_str(), nElapsed, (vKeys.size() * 1000000.0) / nElapsed);
+    delete keychain;
+    
+    /* Re-open so the load time is measured too. */
+    timer.Reset();
+    keychain = new KeychainType(strPath);
+    
+    nElapsed = timer.ElapsedMicroseconds();
+    printf(ANSI_COLOR_GREEN "%s Open Time: %" PRIu64 " micro-seconds\n" ANSI_COLOR_RESET, strName.c_str(), nElapsed);
+    
+    std::vector<unsigned int> vOrder(vKeys.size());
+    for(unsigned int i = 0; i < vOrder.size(); i++)
+        vOrder[i] = i;
+    std::random_shuffle(vOrder.begin(), vOrder.end());
+    
+    unsigned int nFailed = 0;
+    timer.Reset();
+    for(auto i : vOrder)
+    {
+        LLD::SectorKey cKey;
+        if(!keychain->Get(vKeys[i], cKey) || cKey.nSectorStart != i)
+            nFailed++;
+    }
+    
+    nElapsed = timer.ElapsedMicroseconds();
+    printf(ANSI_COLOR_GREEN "%s Get Performance: %" PRIu64 " micro-seconds | %f ops/s | %u failed\n" ANSI_COLOR_RESET, strName.c_str(), nElapsed, (vKeys.size() * 1000000.0) / nElapsed, nFailed);
+    delete keychain;
+}
+
+
+/* Compare the on disk hash index against the file map keychain. */
+int BenchmarkKeychain()
+{
+    unsigned int nTotalKeys = GetArg("-benchkeys", 1000000);
+    
+    printf(ANSI_COLOR_BRIGHT_BLUE "\nBenchmarking Keychains (hashmap vs filemap) with %u Keys\n\n" ANSI_COLOR_RESET, nTotalKeys);
+    
+    CBlock blk;
+    blk.SetRandom();
+    
+    std::vector< std::vector<unsigned char> > vKeys;
+    vKeys.reserve(nTotalKeys);
+    for(unsigned int i = 0; i < nTotalKeys; i++)
+    {
+        blk.nChannel = i;
+        
+        uint1024 hash = blk.GetHash();
+        vKeys.push_back(std::vector<unsigned char>(hash.begin(), hash.end()));
+    }
+    
+    BenchmarkKeychainType<LLD::BinaryHashMap>("hashmap", vKeys);
+    BenchmarkKeychainType<LLD::BinaryFileMap>("filemap", vKeys);
+    
+    mapArgs["-keyfingerprint"] = "1";
+    BenchmarkKeychainType<LLD::BinaryFileMap>("filemap-fingerprint", vKeys);
+    
+    LLD::FileCache().PrintStats();
+    
+    return 0;
+}
+
+
+/* Read random keys from a cache pool, counting the hits. */
+void ReadCache(LLD::MemCachePool* pool, const std::vector< std::vector<unsigned char> >* pKeys, unsigned int nReads, uint64 nSeed, unsigned int* pFound)
+{
+    std::vector<unsigned char> vData;
+    for(unsigned int i = 0; i < nReads; i++)
+    {
+        nSeed ^= nSeed << 13;
+        nSeed ^= nSeed >> 7;
+        nSeed ^= nSeed << 17;
+        
+        if(pool->Get((*pKeys)[nSeed % pKeys->size()], vData))
+            (*pFound)++;
+    }
+}
+
+
+/* Read throughput of the cache pool from 1 to -benchthreads threads, with one shard and with the default shards. */
+int BenchmarkCache()
+{
+    unsigned int nTotalKeys  = GetArg("-benchkeys", 100000);
+    unsigned int nReads      = GetArg("-benchreads", 1000000);
+    unsigned int nMaxThreads = GetArg("-benchthreads", 32);
+    
+    printf(ANSI_COLOR_BRIGHT_BLUE "\nBenchmarking Cache Pool Reads with %u Keys\n\n" ANSI_COLOR_RESET, nTotalKeys);
+    
+    CBlock blk;
+    blk.SetRandom();
+    
+    CDataStream ssValue(SER_LLD, DATABASE_VERSION);
+    ssValue << blk;
+    std::vector<unsigned char> vData(ssValue.begin(), ssValue.end());
+    
+    std::vector< std::vector<unsigned char> > vKeys;
+    vKeys.reserve(nTotalKeys);
+    for(unsigned int i = 0; i < nTotalKeys; i++)
+    {
+        blk.nChannel = i;
+        
+        uint1024 hash = blk.GetHash();
+        vKeys.push_back(std::vector<unsigned char>(hash.begin(), hash.end()));
+    }
+    
+    unsigned int nShardCounts[] = { 1, LLD::MAX_CACHE_POOL_SHARDS };
+    for(auto nShards : nShardCounts)
+    {
+        LLD::MemCachePool* pool = new LLD::MemCachePool(nTotalKeys * (vData.size() + 1), nShards);
+        for(auto vKey : vKeys)
+            pool->Put(vKey, vData);
+        
+        for(unsigned int nThreads = 1; nThreads <= nMaxThreads; nThreads *= 2)
+        {
+            std::vector<unsigned int> vFound(nThreads, 0);
+            boost::thread_group threads;
+            
+            Timer timer;
+            timer.Start();
+            for(unsigned int nThread = 0; nThread < nThreads; nThread++)
+                threads.create_thread(boost::bind(&ReadCache, pool, &vKeys, nReads / nThreads, 0x9e3779b97f4a7c15ull * (nThread + 1), &vFound[nThread]));
+            threads.join_all();
+            
+            uint64 nElapsed = timer.ElapsedMicroseconds();
+            unsigned int nTotalReads = (nReads / nThreads) * nThreads, nFound = 0;
+            for(auto nThreadFound : vFound)
+                nFound += nThreadFound;
+            
+            printf(ANSI_COLOR_GREEN "%2u Shards | %2u Threads: %" PRIu64 " micro-seconds | %f reads/s | %u missed\n" ANSI_COLOR_RESET, pool->Shards(), nThreads, nElapsed, (nTotalReads * 1000000.0) / nElapsed, nTotalReads - nFound);
+        }
+        
+        delete pool;
+    }
+    
+    return 0;
+}
+
+
+/* Hit rate and cost of cache eviction under a Zipfian read-through workload, at several cache sizes. */
+int BenchmarkZipf()
+{
+    unsigned int nTotalKeys = GetArg("-benchkeys", 1000000);
+    unsigned int nReads     = GetArg("-benchreads", 2000000);
+    double dSkew            = GetArg("-benchskew", 99) / 100.0;
+    
+    printf(ANSI_COLOR_BRIGHT_BLUE "\nBenchmarking Cache Eviction with %u Keys | Zipf Skew %.2f\n\n" ANSI_COLOR_RESET, nTotalKeys, dSkew);
+    
+    /* Cumulative distribution of key ranks, sampled by binary search. */
+    std::vector<double> vCDF(nTotalKeys);
+    double dTotal = 0;
+    for(unsigned int i = 0; i < nTotalKeys; i++)
+    {
+        dTotal += 1.0 / pow(i + 1, dSkew);
+        vCDF[i] = dTotal;
+    }
+    
+    /* Scatter the ranks over the key space so popular keys don't share shards. */
+    std::vector<uint64> vRanks(nTotalKeys);
+    for(unsigned int i = 0; i < nTotalKeys; i++)
+        vRanks[i] = i;
+    std::random_shuffle(vRanks.begin(), vRanks.end());
+    
+    std::vector<unsigned int> vSequence(nReads);
+    uint64 nSeed = 0x9e3779b97f4a7c15ull;
+    for(unsigned int i = 0; i < nReads; i++)
+    {
+        nSeed ^= nSeed << 13;
+        nSeed ^= nSeed >> 7;
+        nSeed ^= nSeed << 17;
+        
+        double dPick = (nSeed >> 11) * (1.0 / 9007199254740992.0) * dTotal;
+        vSequence[i] = std::lower_bound(vCDF.begin(), vCDF.end(), dPick) - vCDF.begin();
+    }
+    
+    std::vector<unsigned char> vData(200, 0xff);
+    unsigned int nPercents[] = { 1, 5, 10, 25 };
+    for(auto nPercent : nPercents)
+    {
+        LLD::MemCachePool* pool = new LLD::MemCachePool((uint64)nTotalKeys * vData.size() * nPercent / 100);
+        
+        unsigned int nHits = 0;
+        std::vector<unsigned char> vKey(8), vRead;
+        
+        Timer timer;
+        timer.Start();
+        for(auto nRank : vSequence)
+        {
+            memcpy(&vKey[0], &vRanks[nRank], 8);
+            if(pool->Get(vKey, vRead))
+                nHits++;
+            else
+                pool->Put(vKey, vData);
+        }
+        
+        uint64 nElapsed = timer.ElapsedMicroseconds();
+        printf(ANSI_COLOR_GREEN "Cache %2u%% of Keys: %.2f%% hit rate | %" PRIu64 " micro-seconds | %.1f ns/op\n" ANSI_COLOR_RESET, nPercent, nHits * 100.0 / nReads, nElapsed, nElapsed * 1000.0 / nReads);
+        pool->PrintStats();
+        
+        delete pool;
+    }
+    
+    return 0;
+}
+
+
+/* Bytes allocated from the heap, or zero where the allocator can't say. */
+uint64 HeapBytes()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 info = mallinfo2();
+    
+    return info.uordblks + info.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+
+/* Resident bytes of the process from /proc, or zero where there is no /proc. */
+uint64 ResidentBytes()
+{
+    unsigned long long nPages = 0, nResident = 0;
+    FILE* pFile = fopen("/proc/self/statm", "r");
+    if(!pFile)
+        return 0;
+    
+    if(fscanf(pFile, "%llu %llu", &nPages, &nResident) != 2)
+        nResident = 0;
+    fclose(pFile);
+    
+    return nResident * sysconf(_SC_PAGESIZE);
+}
+
+
+/* Compare the bytes the cache pool accounts for with what the heap actually holds, then hold a
+   sector database to -lldcache while writing more than fits, shrinking it halfway through. */
+int BenchmarkMemory()
+{
+    unsigned int nTotalKeys = GetArg("-benchkeys", 1000000);
+    unsigned int nCacheSize = GetArg("-lldcache", 16);
+    
+    printf(ANSI_COLOR_BRIGHT_BLUE "\nBenchmarking Cache Memory Accounting with %u Keys\n\n" ANSI_COLOR_RESET, nTotalKeys);
+    
+    /* Records from 1 to 512 bytes, into a pool large enough to hold them all. */
+    uint64 nHeap = HeapBytes(), nResident = ResidentBytes(), nPayload = 0;
+    LLD::MemCachePool* pool = new LLD::MemCachePool(std::numeric_limits<uint64>::max() / 2);
+    
+    std::vector<unsigned char> vKey(8);
+    for(uint64 i = 0; i < nTotalKeys; i++)
+    {
+        memcpy(&vKey[0], &i, 8);
+        
+        std::vector<unsigned char> vData(1 + (i * 2654435761u) % 512, 0xff);
+        pool->Put(vKey, vData);
+        nPayload += vKey.size() + vData.size();
+    }
+    
+    uint64 nHeapDelta = HeapBytes() - nHeap, nResidentDelta = ResidentBytes() - nResident;
+    printf(ANSI_COLOR_GREEN "Payload: %" PRIu64 " bytes | Accounted: %" PRIu64 " bytes | Heap: %" PRIu64 " bytes (%.2f%% of accounted) | RSS: %" PRIu64 " bytes\n" ANSI_COLOR_RESET, nPayload, pool->Size(), nHeapDelta, nHeapDelta * 100.0 / pool->Size(), nResidentDelta);
+    
+    /* Shrinking the budget evicts down to it. */
+    pool->SetMaxSize(pool->Size() / 4);
+    nHeapDelta = HeapBytes() - nHeap;
+    printf(ANSI_COLOR_GREEN "Shrunk to %" PRIu64 " bytes | Accounted: %" PRIu64 " bytes | Heap: %" PRIu64 " bytes\n" ANSI_COLOR_RESET, pool->MaxSize(), pool->Size(), nHeapDelta);
+    pool->PrintStats();
+    
+    delete pool;
+    
+    /* Write three times the cache through a sector database, halving -lldcache partway. */
+    boost::filesystem::remove_all(GetDataDir().string() + "/benchmemory/");
+    mapArgs["-lldcache"] = strprintf("%u", nCacheSize);
+    BenchDB* db = new BenchDB("benchmemory");
+    
+    CBlock blk;
+    blk.SetRandom();
+    
+    unsigned int nRecords = nCacheSize * 1024 * 1024 * 3 / 512;
+    uint64 nPeak = 0;
+    
+    Timer timer;
+    timer.Start();
+    for(unsigned int i = 0; i < nRecords; i++)
+    {
+        if(i == nRecords / 2)
+            mapArgs["-lldcache"] = strprintf("%u", nCacheSize / 2);
+        
+        blk.nChannel = i;
+        db->WriteBlock(blk.GetHash(), blk);
+        
+        nPeak = std::max(nPeak, db->CacheSize());
+    }
+    
+    uint64 nElapsed = timer.ElapsedMicroseconds();
+    printf(ANSI_COLOR_GREEN "LLD Wrote %u Records into a %u MB Cache: %" PRIu64 " micro-seconds | Peak Cache %" PRIu64 " bytes | Final Cache %" PRIu64 " bytes\n" ANSI_COLOR_RESET, nRecords, nCacheSize, nElapsed, nPeak, db->CacheSize());
+    db->PrintFlushStats();
+    
+    delete db;
+    
+    return 0;
+}
+
+
+/* Read every record of the database, copying through Get and CDataStream the way Read used to when fCopy is set. */
+void ReadBlocks(BenchDB* db, const std::vector<uint1024>& vKeys, bool fCopy, const char* pszName)
+{
+    CBlock blk;
+    unsigned int nFailed = 0;
+    uint64 nStart = nAllocations;
+    
+    Timer timer;
+    timer.Start();
+    for(auto& hash : vKeys)
+    {
+        if(fCopy)
+        {
+            CDataStream ssKey(SER_LLD, DATABASE_VERSION);
+            ssKey << hash;
+            
+            std::vector<unsigned char> vData;
+            if(!db->Get(std::vector<unsigned char>(ssKey.begin(), ssKey.end()), vData))
+            {
+                nFailed++;
+                
+                continue;
+            }
+            
+            CDataStream ssValue(vData, SER_LLD, DATABASE_VERSION);
+            ssValue >> blk;
+        }
+        else if(!db->ReadBlock(hash, blk))
+            nFailed++;
+    }
+    
+    uint64 nElapsed = timer.ElapsedMicroseconds();
+    printf(ANSI_COLOR_GREEN "%s: %.1f ns/read | %.2f allocations/read | %u failed\n" ANSI_COLOR_RESET, pszName, nElapsed * 1000.0 / vKeys.size(), (nAllocations - nStart) / (double)vKeys.size(), nFailed);
+}
+
+
+/* Allocations and time per read from the cache and from disk, against copying the record out first. */
+int BenchmarkRead()
+{
+    unsigned int nTotalRecords = GetArg("-benchkeys", 100000);
+    
+    printf(ANSI_COLOR_BRIGHT_BLUE "\nBenchmarking Reads with %u Keys\n\n" ANSI_COLOR_RESET, nTotalRecords);
+    
+    boost::filesystem::remove_all(GetDataDir().string() + "/benchread/");
+    BenchDB* db = new BenchDB("benchread");
+    
+    CBlock blk;
+    blk.SetRandom();
+    
+    std::vector<uint1024> vKeys;
+    for(unsigned int i = 0; i < nTotalRecords; i++)
+    {
+        blk.nChannel = i;
+        vKeys.push_back(blk.GetHash());
+        
+        db->WriteBlock(vKeys.back(), blk);
+    }
+    
+    /* The records written are still cached. */
+    ReadBlocks(db, vKeys, false, "Cache Read");
+    ReadBlocks(db, vKeys, true,  "Cache Copy");
+    delete db;
+    
+    /* Reopened, nothing is. */
+    db = new BenchDB("benchread");
+    ReadBlocks(db, vKeys, false, "Disk Read ");
+    ReadBlocks(db, vKeys, true,  "Disk Copy ");
+    delete db;
+    
+    return 0;
+}
+
+
+/* Single key reads and writes against ReadBatch and WriteBatch, written straight to disk and read back after reopening. */
+int BenchmarkBatch()
+{
+    unsigned int nTotalRecords = GetArg("-benchkeys", 100000);
+    unsigned int nBatchSize    = GetArg("-benchbatchsize", 1000);
+    
+    printf(ANSI_COLOR_BRIGHT_BLUE "\nBenchmarking Batches of %u with %u Keys\n\n" ANSI_COLOR_RESET, nBatchSize, nTotalRecords);
+    
+    CBlock blk;
+    blk.SetRandom();
+    
+    std::vector< std::pair<uint1024, CBlock> > vRecords;
+    for(unsigned int i = 0; i < nTotalRecords; i++)
+    {
+        blk.nChannel = i;
+        vRecords.push_back(std::make_pair(blk.GetHash(), blk));
+    }
+    
+    mapArgs["-forcewrite"] = "1";
+    for(int nBatch = 0; nBatch < 2; nBatch++)
+    {
+        std::string strName = nBatch ? "benchbatch" : "benchsingle";
+        boost::filesystem::remove_all(GetDataDir().string() + "/" + strName + "/");
+        BenchDB* db = new BenchDB(strName);
+        
+        Timer timer;
+        timer.Start();
+        for(unsigned int i = 0; i < nTotalRecords; i += nBatchSize)
+        {
+            unsigned int nEnd = std::min(nTotalRecords, i + nBatchSize);
+            if(nBatch)
+                db->WriteBatch(std::vector< std::pair<uint1024, CBlock> >(vRecords.begin() + i, vRecords.begin() + nEnd));
+            else
+                for(unsigned int j = i; j < nEnd; j++)
+                    db->WriteBlock(vRecords[j].first, vRecords[j].second);
+        }
+        
+        uint64 nElapsed = timer.ElapsedMicroseconds();
+        printf(ANSI_COLOR_GREEN "LLD %s Write: %" PRIu64 " micro-seconds | %f ops/s\n" ANSI_COLOR_RESET, nBatch ? "Batch " : "Single", nElapsed, (nTotalRecords * 1000000.0) / nElapsed);
+        
+        delete db;
+    }
+    mapArgs.erase("-forcewrite");
+    
+    /* Read the records back in random order, with nothing cached. */
+    std::random_shuffle(vRecords.begin(), vRecords.end());
+    for(int nBatch = 0; nBatch < 2; nBatch++)
+    {
+        BenchDB* db = new BenchDB("benchbatch");
+        
+        unsigned int nFailed = 0;
+        std::vector<uint1024> vKeys;
+        std::vector<CBlock> vBlocks;
+        std::vector<bool> vFound;
+        
+        Timer timer;
+        timer.Start();
+        for(unsigned int i = 0; i < nTotalRecords; i += nBatchSize)
+        {
+            unsigned int nEnd = std::min(nTotalRecords, i + nBatchSize);
+            if(nBatch)
+            {
+                vKeys.clear();
+                for(unsigned int j = i; j < nEnd; j++)
+                    vKeys.push_back(vRecords[j].first);
+                
+                db->ReadBatch(vKeys, vBlocks, vFound);
+                for(unsigned int j = i; j < nEnd; j++)
+                    if(!vFound[j - i] || vBlocks[j - i].nChannel != vRecords[j].second.nChannel)
+                        nFailed++;
+            }
+            else
+                for(unsigned int j = i; j < nEnd; j++)
+                    if(!db->ReadBlock(vRecords[j].first, blk) || blk.nChannel != vRecords[j].second.nChannel)
+                        nFailed++;
+        }
+        
+        uint64 nElapsed = timer.ElapsedMicroseconds();
+        printf(ANSI_COLOR_GREEN "LLD %s Read: %" PRIu64 " micro-seconds | %f ops/s | %u failed\n" ANSI_COLOR_RESET, nBatch ? "Batch " : "Single", nElapsed, (nTotalRecords * 1000000.0) / nElapsed, nFailed);
+        
+        delete db;
+    }
+    
+    return 0;
+}
+
+
+/* Random 4 KB reads of a file through each I/O backend, at queue depths from 1 to 128. */
+int BenchmarkIO()
+{
+    uint64 nFileSize   = GetArg("-benchiosize", 256) * 1024 * 1024;
+    unsigned int nReads = GetArg("-benchreads", 20000);
+    bool fDirect        = GetBoolArg("-benchdirect", false);
+    const unsigned int nBlockSize = 4096;
+    
+    printf(ANSI_COLOR_BRIGHT_BLUE "\nBenchmarking I/O Backends with %u Random Reads of a %" PRIu64 " MB File%s\n\n" ANSI_COLOR_RESET, nReads, nFileSize / (1024 * 1024), fDirect ? " (O_DIRECT)" : "");
+    
+    std::string strFile = GetDataDir().string() + "/benchio.dat";
+    int nDescriptor = open(strFile.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(nDescriptor == -1)
+        return error("Couldn't Create %s", strFile.c_str());
+    
+    std::vector<unsigned char> vChunk(1024 * 1024, 0xff);
+    for(uint64 nOffset = 0; nOffset < nFileSize; nOffset += vChunk.size())
+        if(pwrite(nDescriptor, &vChunk[0], vChunk.size(), nOffset) != (ssize_t)vChunk.size())
+            return error("Couldn't Write %s", strFile.c_str());
+    
+    fsync(nDescriptor);
+    close(nDescriptor);
+    
+#if defined(O_DIRECT)
+    nDescriptor = open(strFile.c_str(), O_RDONLY | (fDirect ? O_DIRECT : 0));
+#else
+    nDescriptor = open(strFile.c_str(), O_RDONLY);
+#endif
+    if(nDescriptor == -1)
+        return error("Couldn't Open %s", strFile.c_str());
+    
+    /* One aligned buffer for every read, so O_DIRECT can be used. */
+    unsigned char* pBuffer = NULL;
+    if(posix_memalign((void**)&pBuffer, nBlockSize, (size_t)nReads * nBlockSize) != 0)
+        return error("Couldn't Allocate Read Buffers");
+    
+    std::vector<LLD::IORequest> vTemplate;
+    uint64 nSeed = 0x9e3779b97f4a7c15ull;
+    for(unsigned int i = 0; i < nReads; i++)
+    {
+        nSeed ^= nSeed << 13;
+        nSeed ^= nSeed >> 7;
+        nSeed ^= nSeed << 17;
+        
+        vTemplate.push_back(LLD::IORequest(0, (nSeed % (nFileSize / nBlockSize)) * nBlockSize, pBuffer + (uint64)i * nBlockSize, nBlockSize, false));
+        vTemplate.back().nDescriptor = nDescriptor;
+    }
+    
+    const char* pszBackends[] = { "sync", "uring" };
+    for(auto pszBackend : pszBackends)
+    {
+        LLD::IOBackend* pBackend = LLD::CreateIOBackend(pszBackend);
+        for(unsigned int nDepth = 1; nDepth <= LLD::MAX_IO_DEPTH; nDepth *= 2)
+        {
+            std::vector<LLD::IORequest> vRequests(vTemplate);
+            
+            Timer timer;
+            timer.Start();
+            bool fSuccess = pBackend->Submit(vRequests, nDepth);
+            uint64 nElapsed = timer.ElapsedMicroseconds();
+            
+            printf(ANSI_COLOR_GREEN "%-5s | Depth %3u: %" PRIu64 " micro-seconds | %.0f IOPS | %.1f MB/s%s\n" ANSI_COLOR_RESET, pBackend->Name(), nDepth, nElapsed, nReads * 1000000.0 / nElapsed, nReads * (double)nBlockSize / nElapsed, fSuccess ? "" : " | FAILED");
+        }
+        
+        delete pBackend;
+    }
+    
+    free(pBuffer);
+    close(nDescriptor);
+    unlink(strFile.c_str());
+    
+    return 0;
+}
+
+
+/* Write and overwrite records through the cache writer, then read them back after reopening. */
+int BenchmarkFlush()
+{
+    unsigned int nTotalRecords = GetArg("-benchkeys", 1000000);
+    
+    printf(ANSI_COLOR_BRIGHT_BLUE "\nBenchmarking Cache Writer Flushes with %u Keys\n\n" ANSI_COLOR_RESET, nTotalRecords);
+    
+    boost::filesystem::remove_all(GetDataDir().string() + "/benchflush/");
+    BenchDB* db = new BenchDB("benchflush");
+    
+    CBlock blk;
+    blk.SetRandom();
+    
+    std::vector<uint1024> vKeys;
+    vKeys.reserve(nTotalRecords);
+    
+    for(int nPass = 0; nPass < 2; nPass++)
+    {
+        Timer timer;
+        timer.Start();
+        for(unsigned int i = 0; i < nTotalRecords; i++)
+        {
+            blk.nChannel = i;
+            blk.nNonce   = nPass;
+            
+            uint1024 hash = blk.GetHash();
+            if(nPass == 0)
+                vKeys.push_back(hash);
+            
+            db->WriteBlock(vKeys[i], blk);
+        }
+        
+        uint64 nElapsed = timer.ElapsedMicroseconds();
+        printf(ANSI_COLOR_GREEN "LLD %s Performance: %" PRIu64 " micro-seconds | %f ops/s\n" ANSI_COLOR_RESET, nPass ? "Overwrite" : "Write", nElapsed, (nTotalRecords * 1000000.0) / nElapsed);
+    }
+    
+    db->PrintFlushStats();
+    delete db;
+    
+    /* Every record must be on disk with the data of the second pass. */
+    db = new BenchDB("benchflush");
+    
+    unsigned int nFailed = 0;
+    for(unsigned int i = 0; i < nTotalRecords; i++)
+        if(!db->ReadBlock(vKeys[i], blk) || blk.nChannel != i || blk.nNonce != 1)
+            nFailed++;
+    
+    printf(ANSI_COLOR_GREEN "LLD Read after Reopen: %u failed\n" ANSI_COLOR_RESET, nFailed);
+    delete db;
+    
+    return 0;
+}
+
+
+/* Bytes in the sector files of a database. */
+uint64 SectorFileBytes(std::string strName)
+{
+    uint64 nBytes = 0;
+    for(boost::filesystem::directory_iterator it(GetDataDir().string() + "/" + strName + "/datachain/"), end; it != end; ++it)
+        if(it->path().filename().string().find("_block.") == 0)
+            nBytes += boost::filesystem::file_size(it->path());
+    
+    return nBytes;
+}
+
+
+/* Records that grow, shrink and are erased at random, showing the sector files stay near the live data as freed space is reused. */
+int BenchmarkFreeSpace()
+{
+    unsigned int nTotalRecords = GetArg("-benchkeys", 20000);
+    unsigned int nRounds       = GetArg("-benchrounds", 10);
+    
+    printf(ANSI_COLOR_BRIGHT_BLUE "\nBenchmarking Free Space Reuse with %u Keys over %u Rounds\n\n" ANSI_COLOR_RESET, nTotalRecords, nRounds);
+    
+    /* Checkpoint every flush so freed sectors are reused as soon as possible. */
+    mapArgs["-journalcheckpoint"] = "0";
+    
+    boost::filesystem::remove_all(GetDataDir().string() + "/benchfree/");
+    BenchDB* db = new BenchDB("benchfree");
+    
+    /* The size of each record, 0 once erased. */
+    std::vector<unsigned int> vSizes(nTotalRecords, 0);
+    std::vector<unsigned char> vData;
+    
+    for(unsigned int nRound = 0; nRound <= nRounds; nRound++)
+    {
+        Timer timer;
+        timer.Start();
+        for(unsigned int i = 0; i < nTotalRecords; i++)
+        {
+            /* The first round writes every record, later rounds change a third of them. */
+            if(nRound > 0 && GetRand(3) != 0)
+                continue;
+            
+            if(nRound > 0 && vSizes[i] > 0 && GetRand(4) == 0)
+            {
+                db->EraseData(i);
+                vSizes[i] = 0;
+                
+                continue;
+            }
+            
+            vSizes[i] = 64 + GetRand(960);
+            vData.assign(vSizes[i], (unsigned char)(i + nRound));
+            db->WriteData(i, vData);
+        }
+        
+        uint64 nElapsed = timer.ElapsedMicroseconds();
+        
+        /* Give the writer time to flush and checkpoint the round. */
+        Sleep(500);
+        
+        uint64 nLive = 0;
+        for(unsigned int i = 0; i < nTotalRecords; i++)
+            if(vSizes[i] > 0)
+                nLive += vSizes[i] + GetSizeOfCompactSize(vSizes[i]);
+        
+        uint64 nFile = SectorFileBytes("benchfree");
+        printf(ANSI_COLOR_GREEN "Round %u: %" PRIu64 " micro-seconds | Live %" PRIu64 " bytes | Sector Files %" PRIu64 " bytes (%.2fx) | Free %" PRIu64 " bytes\n" ANSI_COLOR_RESET, nRound, nElapsed, nLive, nFile, (double)nFile / nLive, db->FreeBytes());
+    }
+    
+    db->PrintFlushStats();
+    delete db;
+    
+    /* Every record must read back after reopening with the free extents reloaded. */
+    db = new BenchDB("benchfree");
+    
+    unsigned int nFailed = 0;
+    for(unsigned int i = 0; i < nTotalRecords; i++)
+    {
+        bool fFound = db->ReadData(i, vData);
+        if(fFound != (vSizes[i] > 0) || (fFound && vData.size() != vSizes[i]))
+            nFailed++;
+    }
+    
+    printf(ANSI_COLOR_GREEN "LLD Read after Reopen: %u failed | Free %" PRIu64 " bytes\n" ANSI_COLOR_RESET, nFailed, db->FreeBytes());
+    delete db;
+    
+    return 0;
+}
+
+
+/* Read random records until told to stop, counting reads that don't match what was written. */
+void ReadRecords(BenchDB* db, const std::vector<unsigned int>* pSizes, volatile bool* pStop, uint64* pReads, uint64* pFailed)
+{
+    std::vector<unsigned char> vData;
+    while(!*pStop)
+    {
+        unsigned int nKey = GetRand(pSizes->size());
+        bool fFound = db->ReadData(nKey, vData);
+        if(fFound != ((*pSizes)[nKey] > 0) || (fFound && (vData.size() != (*pSizes)[nKey] || vData[0] != (unsigned char)nKey)))
+            (*pFailed)++;
+        
+        (*pReads)++;
+    }
+}
+
+
+/* Erase most records from small sector files, then compact them while another thread reads. */
+int BenchmarkCompact()
+{
+    unsigned int nTotalRecords = GetArg("-benchkeys", 100000);
+    
+    printf(ANSI_COLOR_BRIGHT_BLUE "\nBenchmarking Compaction with %u Keys\n\n" ANSI_COLOR_RESET, nTotalRecords);
+    
+    /* Small files and cache so there are files to compact and reads go to them. */
+    mapArgs["-sectorfilesize"]     = "4194304";
+    mapArgs["-lldcache"]           = "1";
+    mapArgs["-journalcheckpoint"]  = "0";
+    mapArgs["-compact"]            = "0";
+    
+    boost::filesystem::remove_all(GetDataDir().string() + "/benchcompact/");
+    BenchDB* db = new BenchDB("benchcompact");
+    
+    std::vector<unsigned int> vSizes(nTotalRecords, 0);
+    std::vector<unsigned char> vData;
+    for(unsigned int i = 0; i < nTotalRecords; i++)
+    {
+        vSizes[i] = 100 + GetRand(200);
+        vData.assign(vSizes[i], (unsigned char)i);
+        db->WriteData(i, vData);
+    }
+    
+    for(unsigned int i = 0; i < nTotalRecords; i++)
+    {
+        if(GetRand(3) == 0)
+            continue;
+        
+        db->EraseData(i);
+        vSizes[i] = 0;
+    }
+    
+    /* Give the writer time to flush and checkpoint the erases. */
+    Sleep(1000);
+    
+    uint64 nBefore = SectorFileBytes("benchcompact");
+    
+    volatile bool fStop = false;
+    uint64 nReads = 0, nFailed = 0;
+    Thread_t reader(boost::bind(&ReadRecords, db, &vSizes, &fStop, &nReads, &nFailed));
+    
+    Timer timer;
+    timer.Start();
+    
+    unsigned int nFiles = 0;
+    while(db->Compact())
+        nFiles++;
+    
+    uint64 nElapsed = timer.ElapsedMicroseconds();
+    fStop = true;
+    reader.join();
+    
+    printf(ANSI_COLOR_GREEN "Compacted %u Files: %" PRIu64 " micro-seconds | Sector Files %" PRIu64 " -> %" PRIu64 " bytes | %" PRIu64 " Reads Alongside (%f ops/s), %" PRIu64 " failed\n" ANSI_COLOR_RESET, nFiles, nElapsed, nBefore, SectorFileBytes("benchcompact"), nReads, nReads * 1000000.0 / nElapsed, nFailed);
+    
+    db->PrintFlushStats();
+    delete db;
+    
+    /* Every record must read back after reopening without the removed files. */
+    db = new BenchDB("benchcompact");
+    
+    unsigned int nReopenFailed = 0;
+    for(unsigned int i = 0; i < nTotalRecords; i++)
+    {
+        bool fFound = db->ReadData(i, vData);
+        if(fFound != (vSizes[i] > 0) || (fFound && (vData.size() != vSizes[i] || vData[0] != (unsigned char)i)))
+            nReopenFailed++;
+    }
+    
+    printf(ANSI_COLOR_GREEN "LLD Read after Reopen: %u failed\n" ANSI_COLOR_RESET, nReopenFailed);
+    delete db;
+    
+    return 0;
+}
+
+
+/* Lookups of keys that were never written, against a hashmap keychain, with and without the key filter. */
+int BenchmarkBloom()
+{
+    unsigned int nTotalRecords = GetArg("-benchkeys", 100000);
+    unsigned int nLookups      = GetArg("-benchreads", 100000);
+    
+    printf(ANSI_COLOR_BRIGHT_BLUE "\nBenchmarking Missing Key Lookups with %u Keys\n\n" ANSI_COLOR_RESET, nTotalRecords);
+    
+    std::vector<unsigned char> vData(64, 0xab);
+    for(int nBloom = 0; nBloom < 2; nBloom++)
+    {
+        mapArgs["-bloom"] = nBloom ? "1" : "0";
+        
+        boost::filesystem::remove_all(GetDataDir().string() + "/benchbloom/");
+        LLD::SectorDatabase<LLD::BinaryHashMap>* db = new LLD::SectorDatabase<LLD::BinaryHashMap>("benchbloom");
+        for(uint64 i = 0; i < nTotalRecords; i++)
+            db->Write(i, vData);
+        
+        delete db;
+        
+        /* Reopen so nothing is cached, and the filter is loaded from disk. */
+        db = new LLD::SectorDatabase<LLD::BinaryHashMap>("benchbloom");
+        
+        Timer timer;
+        timer.Start();
+        
+        unsigned int nFound = 0;
+        for(uint64 i = 0; i < nLookups; i++)
+            if(db->Exists(nTotalRecords + i))
+                nFound++;
+        
+        uint64 nElapsed = timer.ElapsedMicroseconds();
+        
+        /* Every written key must still be found. */
+        unsigned int nMissing = 0;
+        for(uint64 i = 0; i < nTotalRecords; i += 10)
+            if(!db->Exists(i))
+                nMissing++;
+        
+        printf(ANSI_COLOR_GREEN "LLD %s Missing Key Lookups: %" PRIu64 " micro-seconds | %f ops/s | %u wrongly found | %u written keys missing\n" ANSI_COLOR_RESET, nBloom ? "Filtered  " : "Unfiltered", nElapsed, (nLookups * 1000000.0) / nElapsed, nFound, nMissing);
+        db->PrintFlushStats();
+        
+        delete db;
+    }
+    
+    return 0;
+}
+
+
+/* Walk a cursor, counting the records and the keys out of byte order. */
+template<typename CursorType>
+void ScanCursor(CursorType cursor, unsigned int& nRecords, unsigned int& nUnordered)
+{
+    nRecords = nUnordered = 0;
+    
+    std::vector<unsigned char> vKey, vLast, vData;
+    while(cursor.Next(vKey, vData))
+    {
+        if(nRecords > 0 && !(vLast < vKey))
+            nUnordered++;
+        
+        vLast.swap(vKey);
+        nRecords++;
+    }
+}
+
+
+/* Prefix and full ordered scans of records under two type tags, with and without the sorted index. */
+int BenchmarkScan()
+{
+    unsigned int nTotalRecords = GetArg("-benchkeys", 100000);
+    
+    printf(ANSI_COLOR_BRIGHT_BLUE "\nBenchmarking Ordered Scans with %u Keys under each of 2 Tags\n\n" ANSI_COLOR_RESET, nTotalRecords);
+    
+    std::vector<unsigned char> vData(64, 0xab);
+    for(int nIndex = 0; nIndex < 2; nIndex++)
+    {
+        mapArgs["-sortedindex"] = nIndex ? "1" : "0";
+        
+        boost::filesystem::remove_all(GetDataDir().string() + "/benchscan/");
+        LLD::SectorDatabase<LLD::BinaryHashMap>* db = new LLD::SectorDatabase<LLD::BinaryHashMap>("benchscan");
+        for(uint64 i = 0; i < nTotalRecords; i++)
+        {
+            db->Write(std::make_pair(std::string("tx"), i), vData);
+            db->Write(std::make_pair(std::string("blk"), i), vData);
+        }
+        
+        /* Every tenth record of one tag is erased. */
+        unsigned int nErased = 0;
+        for(uint64 i = 0; i < nTotalRecords; i += 10, nErased++)
+            db->Erase(std::make_pair(std::string("tx"), i));
+        
+        delete db;
+        
+        /* Reopen so the index is loaded from disk. */
+        db = new LLD::SectorDatabase<LLD::BinaryHashMap>("benchscan");
+        
+        Timer timer;
+        timer.Start();
+        
+        unsigned int nPrefix, nPrefixUnordered;
+        ScanCursor(db->IteratePrefix(std::string("tx")), nPrefix, nPrefixUnordered);
+        uint64 nPrefixElapsed = timer.ElapsedMicroseconds();
+        
+        timer.Reset();
+        
+        unsigned int nAll, nAllUnordered;
+        ScanCursor(db->Iterate(), nAll, nAllUnordered);
+        uint64 nAllElapsed = timer.ElapsedMicroseconds();
+        
+        /* Typed records from the middle of a tag. */
+        auto cursor = db->IteratePrefix(std::string("blk"));
+        CDataStream ssFrom(SER_LLD, DATABASE_VERSION);
+        ssFrom << std::make_pair(std::string("blk"), (uint64)nTotalRecords / 2);
+        cursor.Seek(std::vector<unsigned char>(ssFrom.begin(), ssFrom.end()));
+        
+        std::pair<std::string, uint64> key;
+        std::vector<unsigned char> vValue;
+        bool fTyped = (cursor.Next(key, vValue) && key.first == "blk" && key.second == nTotalRecords / 2 && vValue == vData);
+        
+        printf(ANSI_COLOR_GREEN "LLD %s Prefix Scan: %u of %u records | %" PRIu64 " micro-seconds | %f records/s | %u out of order\n" ANSI_COLOR_RESET, nIndex ? "Indexed  " : "Unindexed", nPrefix, nTotalRecords - nErased, nPrefixElapsed, (nPrefix * 1000000.0) / std::max(nPrefixElapsed, (uint64)1), nPrefixUnordered);
+        printf(ANSI_COLOR_GREEN "LLD %s Full Scan:   %u of %u records | %" PRIu64 " micro-seconds | %f records/s | %u out of order | Seek %s\n" ANSI_COLOR_RESET, nIndex ? "Indexed  " : "Unindexed", nAll, nTotalRecords * 2 - nErased, nAllElapsed, (nAll * 1000000.0) / std::max(nAllElapsed, (uint64)1), nAllUnordered, fTyped ? "found" : "FAILED");
+        db->PrintFlushStats();
+        
+        delete db;
+    }
+    
+    return 0;
+}
+
+
+/* Read and write random keys from a thread, counting the reads that failed or found another key's record. */
+void MixRecords(BenchDB* db, unsigned int nTotalRecords, unsigned int nOps, unsigned int nWritePercent, uint64 nSeed, unsigned int* pFailed)
+{
+    std::vector<unsigned char> vData(128), vRead;
+    for(unsigned int i = 0; i < nOps; i++)
+    {
+        nSeed ^= nSeed << 13;
+        nSeed ^= nSeed >> 7;
+        nSeed ^= nSeed << 17;
+        
+        uint64 nKey = nSeed % nTotalRecords;
+        if((nSeed >> 32) % 100 < nWritePercent)
+        {
+            memcpy(&vData[0], &nKey, sizeof(nKey));
+            if(!db->WriteData(nKey, vData))
+                (*pFailed)++;
+        }
+        else if(!db->ReadData(nKey, vRead) || vRead.size() != vData.size() || memcmp(&vRead[0], &nKey, sizeof(nKey)) != 0)
+            (*pFailed)++;
+    }
+}
+
+
+/* A mix of reads and -benchwritepercent writes from 1 to -benchthreads threads, through the cache and with -forcewrite. */
+int BenchmarkMix()
+{
+    unsigned int nTotalRecords = GetArg("-benchkeys", 100000);
+    unsigned int nOps          = GetArg("-benchreads", 400000);
+    unsigned int nMaxThreads   = GetArg("-benchthreads", 16);
+    unsigned int nWritePercent = GetArg("-benchwritepercent", 10);
+    
+    printf(ANSI_COLOR_BRIGHT_BLUE "\nBenchmarking Concurrent Reads and %u%% Writes with %u Keys\n\n" ANSI_COLOR_RESET, nWritePercent, nTotalRecords);
+    
+    boost::filesystem::remove_all(GetDataDir().string() + "/benchmix/");
+    BenchDB* db = new BenchDB("benchmix");
+    
+    std::vector<unsigned char> vData(128);
+    for(uint64 i = 0; i < nTotalRecords; i++)
+    {
+        memcpy(&vData[0], &i, sizeof(i));
+        db->WriteData(i, vData);
+    }
+    
+    delete db;
+    
+    /* A cache far smaller than the records, so most reads go to the sectors. */
+    mapArgs["-lldcache"] = "1";
+    
+    for(int nForce = 0; nForce < 2; nForce++)
+    {
+        mapArgs["-forcewrite"] = nForce ? "1" : "0";
+        db = new BenchDB("benchmix");
+        
+        for(unsigned int nThreads = 1; nThreads <= nMaxThreads; nThreads *= 2)
+        {
+            std::vector<unsigned int> vFailed(nThreads, 0);
+            boost::thread_group threads;
+            
+            Timer timer;
+            timer.Start();
+            for(unsigned int nThread = 0; nThread < nThreads; nThread++)
+                threads.create_thread(boost::bind(&MixRecords, db, nTotalRecords, nOps / nThreads, nWritePercent, 0x9e3779b97f4a7c15ull * (nThread + 1), &vFailed[nThread]));
+            threads.join_all();
+            
+            uint64 nElapsed = timer.ElapsedMicroseconds();
+            unsigned int nFailed = 0;
+            for(auto nThreadFailed : vFailed)
+                nFailed += nThreadFailed;
+            
+            printf(ANSI_COLOR_GREEN "LLD %s | %2u Threads: %" PRIu64 " micro-seconds | %f ops/s | %u failed\n" ANSI_COLOR_RESET, nForce ? "Forced Writes" : "Cached Writes", nThreads, nElapsed, ((nOps / nThreads) * nThreads * 1000000.0) / nElapsed, nFailed);
+        }
+        
+        db->PrintFlushStats();
+        delete db;
+    }
+    
+    return 0;
+}
+
+
+/* Commit transactions of blocks from a thread, each thread building its own transactions. */
+void CommitBlocks(BenchDB* db, unsigned int nThread, unsigned int nCommits, unsigned int nWrites, unsigned int* pFailed)
+{
+    CBlock blk;
+    blk.SetRandom();
+    blk.nHeight = nThread;
+    
+    for(unsigned int nCommit = 0; nCommit < nCommits; nCommit++)
+    {
+        LLD::SectorTransaction tx;
+        for(unsigned int nWrite = 0; nWrite < nWrites; nWrite++)
+        {
+            blk.nChannel = nCommit * nWrites + nWrite;
+            
+            CDataStream ssKey(SER_LLD, DATABASE_VERSION);
+            ssKey << blk.GetHash();
+            
+            CDataStream ssValue(SER_LLD, DATABASE_VERSION);
+            ssValue << blk;
+            
+            tx.AddTransaction(std::vector<unsigned char>(ssKey.begin(), ssKey.end()), std::vector<unsigned char>(ssValue.begin(), ssValue.end()), std::vector<unsigned char>());
+        }
+        
+        if(!db->TxnCommit(&tx))
+            (*pFailed)++;
+    }
+}
+
+
+/* Commit transactions from 1 to -benchthreads threads, with and without the journal. */
+int BenchmarkTransactions()
+{
+    unsigned int nTotalCommits = GetArg("-benchcommits", 2000);
+    unsigned int nWrites       = GetArg("-benchtxnsize", 4);
+    unsigned int nMaxThreads   = GetArg("-benchthreads", 32);
+    
+    printf(ANSI_COLOR_BRIGHT_BLUE "\nBenchmarking Transaction Commits (%u Commits of %u Writes)\n\n" ANSI_COLOR_RESET, nTotalCommits, nWrites);
+    
+    for(int nJournal = 1; nJournal >= 0; nJournal--)
+    {
+        mapArgs["-journal"] = nJournal ? "1" : "0";
+        for(unsigned int nThreads = 1; nThreads <= nMaxThreads; nThreads *= 2)
+        {
+            boost::filesystem::remove_all(GetDataDir().string() + "/benchtxn/");
+            BenchDB* db = new BenchDB("benchtxn");
+            
+            std::vector<unsigned int> vFailed(nThreads, 0);
+            boost::thread_group threads;
+            
+            Timer timer;
+            timer.Start();
+            for(unsigned int nThread = 0; nThread < nThreads; nThread++)
+                threads.create_thread(boost::bind(&CommitBlocks, db, nThread, nTotalCommits / nThreads, nWrites, &vFailed[nThread]));
+            threads.join_all();
+            
+            uint64 nElapsed = timer.ElapsedMicroseconds();
+            unsigned int nCommits = (nTotalCommits / nThreads) * nThreads, nFailed = 0;
+            for(auto nThreadFailed : vFailed)
+                nFailed += nThreadFailed;
+            
+            printf(ANSI_COLOR_GREEN "Journal %s | %2u Threads: %" PRIu64 " micro-seconds | %f commits/s | %u failed\n" ANSI_COLOR_RESET, nJournal ? "On " : "Off", nThreads, nElapsed, (nCommits * 1000000.0) / nElapsed, nFailed);
+            db->PrintJournalStats();
+            
+            delete db;
+        }
+    }
+    
+    return 0;
+}
+
+
+/* Move balance between random accounts in transactions from a thread, counting the commits refused for a conflict. */
+void TransferBalances(BenchDB* db, unsigned int nAccounts, unsigned int nTransfers, uint64 nSeed, unsigned int* pConflicts, unsigned int* pFailed)
+{
+    for(unsigned int i = 0; i < nTransfers; i++)
+    {
+        nSeed ^= nSeed << 13;
+        nSeed ^= nSeed >> 7;
+        nSeed ^= nSeed << 17;
+        
+        uint64 nFrom = nSeed % nAccounts, nTo = (nSeed >> 32) % nAccounts, nFromBalance, nToBalance;
+        if(nFrom == nTo)
+            continue;
+        
+        db->TxnBegin();
+        if(!db->ReadBalance(nFrom, nFromBalance) || !db->ReadBalance(nTo, nToBalance))
+        {
+            db->TxnAbort();
+            (*pFailed)++;
+            
+            continue;
+        }
+        
+        uint64 nAmount = std::min(nFromBalance, (uint64)(nSeed % 100));
+        db->WriteBalance(nFrom, nFromBalance - nAmount);
+        db->WriteBalance(nTo, nToBalance + nAmount);
+        
+        if(!db->TxnCommit())
+            (*pConflicts)++;
+    }
+}
+
+
+/* Sum every account in a transaction from a thread until stopped, counting the sums that weren't the total. */
+void SumBalances(BenchDB* db, unsigned int nAccounts, uint64 nTotal, volatile bool* pStop, uint64* pSums, uint64* pTorn)
+{
+    while(!*pStop)
+    {
+        db->TxnBegin();
+        
+        uint64 nSum = 0, nBalance;
+        for(unsigned int nAccount = 0; nAccount < nAccounts; nAccount++)
+            if(db->ReadBalance(nAccount, nBalance))
+                nSum += nBalance;
+        
+        db->TxnAbort();
+        
+        if(nSum != nTotal)
+            (*pTorn)++;
+        
+        (*pSums)++;
+    }
+}
+
+
+/* Transfers between accounts from -benchthreads threads while as many threads sum every account, each in a snapshot of its own. */
+int BenchmarkSnapshots()
+{
+    unsigned int nAccounts  = GetArg("-benchkeys", 1000);
+    unsigned int nTransfers = GetArg("-benchcommits", 20000);
+    unsigned int nThreads   = GetArg("-benchthreads", 4);
+    
+    printf(ANSI_COLOR_BRIGHT_BLUE "\nBenchmarking Snapshot Transactions (%u Accounts, %u Transfers, %u Writers, %u Readers)\n\n" ANSI_COLOR_RESET, nAccounts, nTransfers, nThreads, nThreads);
+    
+    for(int nJournal = 1; nJournal >= 0; nJournal--)
+    {
+        mapArgs["-journal"] = nJournal ? "1" : "0";
+        
+        boost::filesystem::remove_all(GetDataDir().string() + "/benchmvcc/");
+        BenchDB* db = new BenchDB("benchmvcc");
+        
+        for(unsigned int nAccount = 0; nAccount < nAccounts; nAccount++)
+            db->WriteBalance(nAccount, 1000);
+        
+        std::vector<unsigned int> vConflicts(nThreads, 0), vFailed(nThreads, 0);
+        std::vector<uint64> vSums(nThreads, 0), vTorn(nThreads, 0);
+        volatile bool fStop = false;
+        
+        boost::thread_group readers, writers;
+        for(unsigned int nThread = 0; nThread < nThreads; nThread++)
+            readers.create_thread(boost::bind(&SumBalances, db, nAccounts, nAccounts * 1000ull, &fStop, &vSums[nThread], &vTorn[nThread]));
+        
+        Timer timer;
+        timer.Start();
+        for(unsigned int nThread = 0; nThread < nThreads; nThread++)
+            writers.create_thread(boost::bind(&TransferBalances, db, nAccounts, nTransfers / nThreads, 0x9e3779b97f4a7c15ull * (nThread + 1), &vConflicts[nThread], &vFailed[nThread]));
+        writers.join_all();
+        
+        uint64 nElapsed = timer.ElapsedMicroseconds();
+        fStop = true;
+        readers.join_all();
+        
+        uint64 nConflicts = 0, nFailed = 0, nSums = 0, nTorn = 0;
+        for(unsigned int nThread = 0; nThread < nThreads; nThread++)
+        {
+            nConflicts += vConflicts[nThread];
+            nFailed    += vFailed[nThread];
+            nSums      += vSums[nThread];
+            nTorn      += vTorn[nThread];
+        }
+        
+        uint64 nSum = 0, nBalance;
+        for(unsigned int nAccount = 0; nAccount < nAccounts; nAccount++)
+            if(db->ReadBalance(nAccount, nBalance))
+                nSum += nBalance;
+        
+        printf(ANSI_COLOR_GREEN "Journal %s | %" PRIu64 " micro-seconds | %f transfers/s | %" PRIu64 " conflicts | %" PRIu64 " failed | %" PRIu64 " sums (%f/s), %" PRIu64 " torn | Total %s\n" ANSI_COLOR_RESET, nJournal ? "On " : "Off", nElapsed, ((nTransfers / nThreads) * nThreads * 1000000.0) / nElapsed, nConflicts, nFailed, nSums, nSums * 1000000.0 / nElapsed, nTorn, nSum == nAccounts * 1000ull ? "kept" : "LOST");
+        db->PrintFlushStats();
+        
+        delete db;
+    }
+    
+    return 0;
+}
+
+/* Read the records of a journal as it is opened, returning the sequences found. */
+std::vector<uint64> ReplayJournal(std::string strBase)
+{
+    std::vector<LLD::JournalRecord> vRecords;
+    LLD::CJournalDB journal(strBase);
+    journal.Replay(vRecords);
+    
+    std::vector<uint64> vSequences;
+    for(auto& record : vRecords)
+        vSequences.push_back(record.nSequence);
+    
+    return vSequences;
+}
+
+
+/* Reopen a journal that rolled over to later files and had the first ones checkpointed away, as after a crash before the rest were applied. */
+int BenchmarkJournal()
+{
+    unsigned int nRecords = GetArg("-benchcommits", 2000);
+    
+    printf(ANSI_COLOR_BRIGHT_BLUE "\nBenchmarking Journal Reopen (%u Records)\n\n" ANSI_COLOR_RESET, nRecords);
+    
+    std::string strPath = GetDataDir().string() + "/benchjournal/";
+    boost::filesystem::remove_all(strPath);
+    boost::filesystem::create_directories(strPath);
+    
+    /* Small files so the records span many of them. */
+    mapArgs["-journalfilesize"] = "16384";
+    
+    uint64 nCheckpoint = nRecords / 2;
+    {
+        LLD::CJournalDB journal(strPath + "_journal.");
+        for(unsigned int i = 0; i < nRecords; i++)
+        {
+            LLD::JournalRecord record;
+            record.vWrites.push_back(std::make_pair(std::vector<unsigned char>((unsigned char*)&i, (unsigned char*)&i + sizeof(i)), std::vector<unsigned char>(256, (unsigned char)i)));
+            
+            if(!journal.Sync(journal.Append(record)))
+            {
+                error("Failed to Sync Journal Record %u", i);
+                
+                return 1;
+            }
+        }
+        
+        journal.Checkpoint(nCheckpoint);
+    }
+    
+    unsigned int nFiles = 0;
+    for(boost::filesystem::directory_iterator it(strPath), end; it != end; ++it)
+        nFiles++;
+    
+    bool fFirst = boost::filesystem::exists(strPath + "_journal.00000");
+    
+    /* Every record not checkpointed has to come back, in order and with none missing. */
+    std::vector<uint64> vSequences = ReplayJournal(strPath + "_journal.");
+    bool fKept = (!vSequences.empty() && vSequences.front() <= nCheckpoint + 1 && vSequences.back() == nRecords);
+    for(unsigned int i = 1; i < vSequences.size(); i++)
+        if(vSequences[i] != vSequences[i - 1] + 1)
+            fKept = false;
+    
+    printf(ANSI_COLOR_GREEN "Checkpointed to %" PRIu64 " | %u Files Left, First File %s | Replayed %u Records (%" PRIu64 " to %" PRIu64 ") | Records %s\n" ANSI_COLOR_RESET, nCheckpoint, nFiles, fFirst ? "Kept" : "Removed", (unsigned int)vSequences.size(), vSequences.empty() ? 0 : vSequences.front(), vSequences.empty() ? 0 : vSequences.back(), fKept ? "kept" : "LOST");
+    
+    /* A record committed after reopening goes after the ones left, not over them. */
+    {
+        std::vector<LLD::JournalRecord> vRecords;
+        LLD::CJournalDB journal(strPath + "_journal.");
+        journal.Replay(vRecords);
+        
+        LLD::JournalRecord record;
+        record.vErases.push_back(std::vector<unsigned char>(4, 0));
+        if(!journal.Sync(journal.Append(record)))
+        {
+            error("Failed to Sync Journal Record after Reopen");
+            
+            return 1;
+        }
+    }
+    
+    std::vector<uint64> vReopened = ReplayJournal(strPath + "_journal.");
+    bool fAppended = (vReopened.size() == vSequences.size() + 1 && vReopened.back() == nRecords + 1);
+    
+    printf(ANSI_COLOR_GREEN "Reopened after a Commit | Replayed %u Records, Last %" PRIu64 " | Records %s\n" ANSI_COLOR_RESET, (unsigned int)vReopened.size(), vReopened.empty() ? 0 : vReopened.back(), fAppended ? "kept" : "LOST");
+    
+    return (fKept && fAppended) ? 0 : 1;
+}
+
+
+
+/* Time and allocations per record writing then reading every block, streamed and copied the way Write and Read used to when fStream is set. */
+void CodecBlocks(BenchDB* db, const std::vector<uint1024>& vKeys, bool fStream, const char* pszName)
+{
+    CBlock blk;
+    blk.SetRandom();
+    
+    unsigned int nFailed = 0;
+    uint64 nStart = nAllocations;
+    
+    Timer timer;
+    timer.Start();
+    for(unsigned int i = 0; i < vKeys.size(); i++)
+    {
+        blk.nChannel = i;
+        if(fStream)
+        {
+            CDataStream ssKey(SER_LLD, DATABASE_VERSION);
+            ssKey << vKeys[i];
+            
+            CDataStream ssValue(SER_LLD, DATABASE_VERSION);
+            ssValue << blk;
+            
+            if(!db->Put(std::vector<unsigned char>(ssKey.begin(), ssKey.end()), std::vector<unsigned char>(ssValue.begin(), ssValue.end())))
+                nFailed++;
+        }
+        else if(!db->WriteBlock(vKeys[i], blk))
+            nFailed++;
+    }
+    
+    uint64 nWrite = timer.ElapsedMicroseconds();
+    uint64 nWriteAllocations = nAllocations - nStart;
+    
+    nStart = nAllocations;
+    timer.Reset();
+    for(unsigned int i = 0; i < vKeys.size(); i++)
+    {
+        if(fStream)
+        {
+            CDataStream ssKey(SER_LLD, DATABASE_VERSION);
+            ssKey << vKeys[i];
+            
+            std::vector<unsigned char> vData;
+            if(!db->Get(std::vector<unsigned char>(ssKey.begin(), ssKey.end()), vData))
+            {
+                nFailed++;
+                
+                continue;
+            }
+            
+            CDataStream ssValue(vData, SER_LLD, DATABASE_VERSION);
+            ssValue >> blk;
+        }
+        else if(!db->ReadBlock(vKeys[i], blk))
+        {
+            nFailed++;
+            
+            continue;
+        }
+        
+        if(blk.nChannel != i)
+            nFailed++;
+    }
+    
+    uint64 nRead = timer.ElapsedMicroseconds();
+    printf(ANSI_COLOR_GREEN "%s | Writes: %f ops/s, %.2f allocations/write | Reads: %f ops/s, %.2f allocations/read | %u failed\n" ANSI_COLOR_RESET, pszName, vKeys.size() * 1000000.0 / nWrite, nWriteAllocations / (double)vKeys.size(), vKeys.size() * 1000000.0 / nRead, (nAllocations - nStart) / (double)vKeys.size(), nFailed);
+}
+
+
+/* Keys and blocks encoded by their codecs against the serializer, on their own and writing and reading the cache. */
+int BenchmarkCodec()
+{
+    unsigned int nTotalRecords = GetArg("-benchkeys", 100000);
+    
+    printf(ANSI_COLOR_BRIGHT_BLUE "\nBenchmarking Codecs with %u Keys\n\n" ANSI_COLOR_RESET, nTotalRecords);
+    
+    CBlock blk;
+    blk.SetRandom();
+    
+    std::vector<uint1024> vKeys;
+    for(unsigned int i = 0; i < nTotalRecords; i++)
+    {
+        blk.nChannel = i;
+        vKeys.push_back(blk.GetHash());
+    }
+    
+    /* Encoding alone: a stream and a copy per key the way Write used to, against a buffer reused by the codec. */
+    uint64 nBytes = 0, nStart = nAllocations;
+    Timer timer;
+    timer.Start();
+    for(auto& hash : vKeys)
+    {
+        CDataStream ssKey(SER_LLD, DATABASE_VERSION);
+        ssKey << hash;
+        std::vector<unsigned char> vKey(ssKey.begin(), ssKey.end());
+        
+        CDataStream ssValue(SER_LLD, DATABASE_VERSION);
+        ssValue << blk;
+        std::vector<unsigned char> vData(ssValue.begin(), ssValue.end());
+        
+        nBytes += vKey.size() + vData.size();
+    }
+    printf(ANSI_COLOR_GREEN "Stream Encode | %.1f ns/record | %.2f allocations/record | %" PRIu64 " bytes\n" ANSI_COLOR_RESET, timer.ElapsedMicroseconds() * 1000.0 / nTotalRecords, (nAllocations - nStart) / (double)nTotalRecords, nBytes);
+    
+    std::vector<unsigned char> vKey, vData;
+    nBytes = 0;
+    nStart = nAllocations;
+    timer.Reset();
+    for(auto& hash : vKeys)
+    {
+        vKey.clear();
+        LLD::Codec<uint1024>::Encode(hash, vKey);
+        
+        vData.clear();
+        LLD::Codec<CBlock>::Encode(blk, vData);
+        
+        nBytes += vKey.size() + vData.size();
+    }
+    printf(ANSI_COLOR_GREEN "Codec Encode  | %.1f ns/record | %.2f allocations/record | %" PRIu64 " bytes\n" ANSI_COLOR_RESET, timer.ElapsedMicroseconds() * 1000.0 / nTotalRecords, (nAllocations - nStart) / (double)nTotalRecords, nBytes);
+    
+    /* The codec writes the bytes the serializer does. */
+    CDataStream ssCheck(SER_LLD, DATABASE_VERSION);
+    ssCheck << blk;
+    if(std::vector<unsigned char>(ssCheck.begin(), ssCheck.end()) != vData)
+        printf(ANSI_COLOR_RED "Block Codec doesn't match its Serialization\n" ANSI_COLOR_RESET);
+    
+    /* Through the database, each pass with a cache of its own. */
+    boost::filesystem::remove_all(GetDataDir().string() + "/benchcodec/");
+    BenchDB* db = new BenchDB("benchcodec");
+    CodecBlocks(db, vKeys, true, "LLD Stream");
+    delete db;
+    
+    boost::filesystem::remove_all(GetDataDir().string() + "/benchcodec/");
+    db = new BenchDB("benchcodec");
+    CodecBlocks(db, vKeys, false, "LLD Codec ");
+    delete db;
+    
+    return 0;
+}
+
+
+/* The key hash LLD used before, FNV-1a with a 64 bit finalizer, to compare against. */
+uint64 HashFNV(const unsigned char* pKey, size_t nLength)
+{
+    uint64 nHash = 14695981039346656037ULL;
+    for(size_t i = 0; i < nLength; i++)
+    {
+        nHash ^= pKey[i];
+        nHash *= 1099511628211ULL;
+    }
     
-    IMPLEMENT_SERIALIZE
-    (
-        READWRITE(nBlkVersion);
-        //nVersion = this->nVersion;
-        READWRITE(hashPrevBlock);
-        READWRITE(hashMerkleRoot);
-        READWRITE(nHeight);
-        READWRITE(nChannel);
-        READWRITE(nBits);
-        READWRITE(nNonce);
-    )
+    nHash ^= nHash >> 33;
+    nHash *= 0xff51afd7ed558ccdULL;
+    nHash ^= nHash >> 33;
+    nHash *= 0xc4ceb9fe1a85ec53ULL;
+    nHash ^= nHash >> 33;
     
-    CBlock()
+    return nHash;
+}
+
+
+uint64 HashSK32(const unsigned char* pKey, size_t nLength)
+{
+    return LLC::HASH::SK32(pKey, pKey + nLength);
+}
+
+
+/* Chi-squared of bucket counts against an even spread, over its degrees of freedom so an even spread is near 1. */
+double ChiSquared(const std::vector<unsigned int>& vBuckets, uint64 nKeys)
+{
+    double dExpected = nKeys / (double)vBuckets.size(), dChi = 0;
+    for(auto nCount : vBuckets)
+        dChi += (nCount - dExpected) * (nCount - dExpected) / dExpected;
+    
+    return dChi / (vBuckets.size() - 1);
+}
+
+
+/** Check how well a hash spreads a set of keys.
+    
+    The keys are counted into 65536 buckets by the low 16 bits of their hash, the way slots and
+    stripes are picked, and by the high 16 bits, the way shards and hashmap slots are. Then one
+    bit of each of the first keys is flipped at a time, and the bits of the hash that changed counted:
+    every bit of the hash should change half the time. **/
+void HashDistribution(const std::vector< std::vector<unsigned char> >& vKeys, uint64 (*fnHash)(const unsigned char*, size_t), const char* pszName)
+{
+    std::vector<unsigned int> vLow(65536, 0), vHigh(65536, 0);
+    for(auto& vKey : vKeys)
     {
-        SetNull();
+        uint64 nHash = fnHash(&vKey[0], vKey.size());
+        vLow[nHash & 0xffff]++;
+        vHigh[nHash >> 48]++;
     }
     
-    void SetNull()
+    std::vector<uint64> vFlips(64, 0);
+    uint64 nTrials = 0;
+    for(unsigned int nKey = 0; nKey < std::min((size_t)1000, vKeys.size()); nKey++)
     {
-        nBlkVersion = 0;
-        hashPrevBlock = 0;
-        hashMerkleRoot = 0;
-        nHeight = 0;
-        nChannel = 0;
-        nNonce   = 0;
+        std::vector<unsigned char> vKey = vKeys[nKey];
+        uint64 nHash = fnHash(&vKey[0], vKey.size());
+        for(unsigned int nBit = 0; nBit < vKey.size() * 8; nBit++)
+        {
+            vKey[nBit / 8] ^= (1 << (nBit % 8));
+            uint64 nDiff = nHash ^ fnHash(&vKey[0], vKey.size());
+            vKey[nBit / 8] ^= (1 << (nBit % 8));
+            
+            for(unsigned int nOut = 0; nOut < 64; nOut++)
+                vFlips[nOut] += (nDiff >> nOut) & 1;
+            
+            nTrials++;
+        }
     }
     
-    void SetRandom()
+    double dWorst = 0;
+    for(auto nFlips : vFlips)
+        dWorst = std::max(dWorst, fabs(nFlips / (double)nTrials - 0.5));
+    
+    printf(ANSI_COLOR_GREEN "%-8s | Chi-Squared Low %.3f, High %.3f | Fullest Bucket Low %u, High %u of %.1f | Worst Avalanche Bias %.4f\n" ANSI_COLOR_RESET, pszName, ChiSquared(vLow, vKeys.size()), ChiSquared(vHigh, vKeys.size()), *std::max_element(vLow.begin(), vLow.end()), *std::max_element(vHigh.begin(), vHigh.end()), vKeys.size() / 65536.0, dWorst);
+}
+
+
+/* Hashes a second of a key of each length. */
+void HashThroughput(uint64 (*fnHash)(const unsigned char*, size_t), unsigned int nHashes, const char* pszName)
+{
+    std::vector<unsigned char> vKey(1024);
+    for(unsigned int i = 0; i < vKey.size(); i++)
+        vKey[i] = (unsigned char)GetRandInt(255);
+    
+    printf(ANSI_COLOR_GREEN "%-8s |" ANSI_COLOR_RESET, pszName);
+    
+    const unsigned int LENGTHS[] = { 8, 16, 32, 64, 128, 1024 };
+    for(auto nLength : LENGTHS)
     {
-        nBlkVersion = GetRandInt(1000);
-        nHeight  = GetRandInt(1000);
-        nChannel = GetRandInt(1000);
-        nBits    = GetRandInt(1000);
-        nNonce   = GetRand(1000000);
+        uint64 nSink = 0;
+        Timer timer;
+        timer.Start();
+        for(unsigned int i = 0; i < nHashes; i++)
+        {
+            vKey[0] = (unsigned char)i;
+            nSink ^= fnHash(&vKey[0], nLength);
+        }
         
-        hashMerkleRoot = GetRand512();
-        hashPrevBlock  = GetRand1024();
+        uint64 nElapsed = std::max((uint64)timer.ElapsedMicroseconds(), (uint64)1);
+        printf(ANSI_COLOR_GREEN " %4u bytes: %7.1f ns %6.2f GB/s |" ANSI_COLOR_RESET, nLength, nElapsed * 1000.0 / nHashes, (nLength * (double)nHashes) / (nElapsed * 1000.0));
+        
+        /* Keeps the hashes from being optimized out. */
+        if(nSink == 0)
+            printf(" ");
     }
     
-    uint1024 GetHash() const
+    printf("\n");
+}
+
+
+/* Spread and throughput of the key hash against the one it replaced and SK32, over block hashes, keys of a type tag and a height, and counters. */
+int BenchmarkHash()
+{
+    unsigned int nTotalKeys = GetArg("-benchkeys", 1000000);
+    unsigned int nHashes    = GetArg("-benchreads", 2000000);
+    
+    printf(ANSI_COLOR_BRIGHT_BLUE "\nBenchmarking Key Hashes with %u Keys\n\n" ANSI_COLOR_RESET, nTotalKeys);
+    
+    CBlock blk;
+    blk.SetRandom();
+    
+    std::vector< std::vector<unsigned char> > vBlocks(nTotalKeys), vTagged(nTotalKeys), vCounters(nTotalKeys);
+    for(unsigned int i = 0; i < nTotalKeys; i++)
     {
-        return LLC::HASH::SK1024(BEGIN(nBlkVersion), END(nNonce));
+        blk.nChannel = i;
+        LLD::Codec<uint1024>::Encode(blk.GetHash(), vBlocks[i]);
+        LLD::Codec< std::pair<std::string, unsigned int> >::Encode(std::make_pair(std::string("height"), i), vTagged[i]);
+        LLD::Codec<uint64>::Encode((uint64)i, vCounters[i]);
     }
     
-    void Print()
+    const char* KEYS[] = { "Block Hashes (128 bytes)", "Type Tag and Height (11 bytes)", "Counters (8 bytes)" };
+    std::vector< std::vector<unsigned char> >* pKeys[] = { &vBlocks, &vTagged, &vCounters };
+    for(unsigned int nSet = 0; nSet < 3; nSet++)
     {
-        printf("CBlock(nVersion=%u, hashPrevBlock=%s, hashMerkleRoot=%s, nHeight=%u, nChannel=%u, nBits=%u, nNonce=%" PRIu64 ", hash=" ANSI_COLOR_BRIGHT_BLUE "%s" ANSI_COLOR_RESET ")\n", nBlkVersion, hashPrevBlock.ToString().c_str(), hashMerkleRoot.ToString().c_str(), nHeight, nChannel, nBits, nNonce, GetHash().ToString().c_str());
+        printf(ANSI_COLOR_BRIGHT_BLUE "%s\n" ANSI_COLOR_RESET, KEYS[nSet]);
+        HashDistribution(*pKeys[nSet], &LLD::KeyHash, "KeyHash");
+        HashDistribution(*pKeys[nSet], &HashFNV, "FNV-1a");
     }
-};
+    
+    printf(ANSI_COLOR_BRIGHT_BLUE "\nThroughput\n" ANSI_COLOR_RESET);
+    HashThroughput(&LLD::KeyHash, nHashes, "KeyHash");
+    HashThroughput(&HashFNV, nHashes, "FNV-1a");
+    HashThroughput(&HashSK32, nHashes / 20, "SK32");
+    
+    return 0;
+}
 
 
-class TestDB : public LLD::SectorDatabase<LLD::BinaryHashMap>
+uint64 ChecksumSK32(const unsigned char* pbegin, const unsigned char* pend) { return LLC::HASH::SK32(pbegin, pend); }
+uint64 ChecksumCRC32C(const unsigned char* pbegin, const unsigned char* pend) { return LLD::CRC32C(pbegin, pend); }
+uint64 ChecksumCRC32CSoftware(const unsigned char* pbegin, const unsigned char* pend) { return ~LLD::CRC32CSoftware(0xffffffff, pbegin, pend - pbegin); }
+
+
+/* Checksums a second's worth of sectors of each size. */
+void ChecksumThroughput(uint64 (*fnChecksum)(const unsigned char*, const unsigned char*), uint64 nBytes, const char* pszName)
 {
-public:
-    TestDB(const char* pszMode="r+") : SectorDatabase("testdb", pszMode) {}
+    std::vector<unsigned char> vData(65536);
+    for(unsigned int i = 0; i < vData.size(); i++)
+        vData[i] = (unsigned char)GetRandInt(255);
     
-    bool WriteBlock(uint1024 hash, CBlock blk)
+    printf(ANSI_COLOR_GREEN "%-16s |" ANSI_COLOR_RESET, pszName);
+    
+    const unsigned int SIZES[] = { 64, 256, 1024, 4096, 65536 };
+    for(auto nSize : SIZES)
     {
-        return Write(hash, blk);
+        unsigned int nSectors = std::max(nBytes / nSize, (uint64)1);
+        uint64 nSink = 0;
+        Timer timer;
+        timer.Start();
+        for(unsigned int i = 0; i < nSectors; i++)
+        {
+            vData[0] = (unsigned char)i;
+            nSink += fnChecksum(&vData[0], &vData[0] + nSize);
+        }
+        
+        uint64 nElapsed = std::max((uint64)timer.ElapsedMicroseconds(), (uint64)1);
+        printf(ANSI_COLOR_GREEN " %5u bytes: %8.1f ns %6.2f GB/s |" ANSI_COLOR_RESET, nSize, nElapsed * 1000.0 / nSectors, (nSize * (double)nSectors) / (nElapsed * 1000.0));
+        
+        /* Keeps the checksums from being optimized out. */
+        if(nSink == 0)
+            printf(" ");
     }
     
-    bool ReadBlock(uint1024 hash, CBlock& blk)
+    printf("\n");
+}
+
+
+/* Checks CRC32C against its known answer, then times it against SK32 over sector sizes. */
+int BenchmarkChecksum()
+{
+    uint64 nBytes = GetArg("-benchbytes", 256) * 1024 * 1024;
+    
+    printf(ANSI_COLOR_BRIGHT_BLUE "\nBenchmarking Sector Checksums over %" PRIu64 " MB\n\n" ANSI_COLOR_RESET, nBytes / (1024 * 1024));
+    
+    /* The check value of CRC32C, the CRC of the digits 1 to 9. */
+    const unsigned char* pCheck = (const unsigned char*)"123456789";
+    bool fHardware = (ChecksumCRC32C(pCheck, pCheck + 9) == 0xe3069283), fSoftware = (ChecksumCRC32CSoftware(pCheck, pCheck + 9) == 0xe3069283);
+    printf((fHardware && fSoftware ? ANSI_COLOR_GREEN "CRC32C Check Value %s | Tables %s\n\n" ANSI_COLOR_RESET : ANSI_COLOR_RED "CRC32C Check Value %s | Tables %s\n\n" ANSI_COLOR_RESET), fHardware ? "Matches" : "WRONG", fSoftware ? "Match" : "WRONG");
+    if(!fHardware || !fSoftware)
+        return 1;
+    
+    ChecksumThroughput(&ChecksumCRC32C, nBytes, "CRC32C");
+    ChecksumThroughput(&ChecksumCRC32CSoftware, nBytes, "CRC32C Tables");
+    ChecksumThroughput(&ChecksumSK32, nBytes / 16, "SK32");
+    
+    return 0;
+}
+
+
+/* Reads every record in the given order, returning those that failed. */
+unsigned int ReadAllData(BenchDB* db, const std::vector<uint64>& vKeys, uint64& nElapsed)
+{
+    std::vector<unsigned char> vData;
+    unsigned int nFailed = 0;
+    
+    Timer timer;
+    timer.Start();
+    for(auto nKey : vKeys)
+        if(!db->ReadData(nKey, vData))
+            nFailed++;
+    
+    nElapsed = std::max((uint64)timer.ElapsedMicroseconds(), (uint64)1);
+    
+    return nFailed;
+}
+
+
+/** Read the same records from disk under each -verifyreads policy, twice, then check the scrubber.
+    
+    The cache is kept to a megabyte so reads go to the sectors. A sector is then corrupted on disk:
+    while its record is still in the cache the scrubber rewrites it, once the database is reopened
+    there is nothing to repair it from and it is reported, and its reads fail even unverified. **/
+int BenchmarkVerify()
+{
+    unsigned int nTotalRecords = GetArg("-benchkeys", 20000);
+    unsigned int nRecordSize   = GetArg("-benchsize", 4096);
+    
+    printf(ANSI_COLOR_BRIGHT_BLUE "\nBenchmarking Read Verification with %u Records of %u bytes\n\n" ANSI_COLOR_RESET, nTotalRecords, nRecordSize);
+    
+    mapArgs["-forcewrite"] = "1";
+    mapArgs["-mmap"]       = "1";
+    mapArgs["-lldcache"]   = "1";
+    mapArgs["-scrubrate"]  = "0";
+    
+    std::vector<unsigned char> vData(nRecordSize);
+    for(unsigned int i = 0; i < vData.size(); i++)
+        vData[i] = (unsigned char)GetRandInt(255);
+    
+    std::vector<uint64> vKeys;
+    BenchDB* db = new BenchDB("benchverify");
+    for(unsigned int i = 0; i < nTotalRecords; i++)
     {
-        return Read(hash, blk);
+        db->WriteData(i, vData);
+        vKeys.push_back(i);
     }
-};
+    
+    delete db;
+    
+    std::random_shuffle(vKeys.begin(), vKeys.end());
+    
+    const char* POLICIES[] = { "always", "first", "sampled", "scrub" };
+    for(auto pszPolicy : POLICIES)
+    {
+        mapArgs["-verifyreads"] = pszPolicy;
+        db = new BenchDB("benchverify");
+        
+        uint64 nFirst, nSecond;
+        unsigned int nFailed = ReadAllData(db, vKeys, nFirst) + ReadAllData(db, vKeys, nSecond);
+        
+        printf(ANSI_COLOR_GREEN "%-8s | First Pass %10.0f ops/s | Second Pass %10.0f ops/s | %" PRIu64 " Reads Verified | %u failed\n" ANSI_COLOR_RESET, pszPolicy, (nTotalRecords * 1000000.0) / nFirst, (nTotalRecords * 1000000.0) / nSecond, db->ReadsVerified(), nFailed);
+        
+        delete db;
+    }
+    
+    /* A record written through the cache is still there once flushed, to repair its sector from. */
+    mapArgs["-verifyreads"] = "scrub";
+    mapArgs["-forcewrite"]  = "0";
+    db = new BenchDB("benchverify");
+    db->WriteData(vKeys[0], vData);
+    while(db->UnwrittenBytes() > 0)
+        Sleep(10);
+    
+    db->CorruptData(vKeys[0]);
+    
+    uint64 nMismatches = db->Scrub(), nAfter = db->Scrub();
+    printf(ANSI_COLOR_GREEN "Corrupted Sector, Cached     | Scrub Found %" PRIu64 " | Found after Repair %" PRIu64 "\n" ANSI_COLOR_RESET, nMismatches, nAfter);
+    delete db;
+    
+    /* Reopened there is no copy, the sector is reported and its reads fail. */
+    db = new BenchDB("benchverify");
+    db->CorruptData(vKeys[1]);
+    
+    std::vector<unsigned char> vRead;
+    bool fReadBefore = db->ReadData(vKeys[1], vRead);
+    nMismatches = db->Scrub();
+    bool fReadAfter = db->ReadData(vKeys[1], vRead);
+    printf(ANSI_COLOR_GREEN "Corrupted Sector, Not Cached | Unverified Read %s | Scrub Found %" PRIu64 " | Read after Scrub %s\n" ANSI_COLOR_RESET, fReadBefore ? "Passed" : "Failed", nMismatches, fReadAfter ? "Passed" : "Failed");
+    
+    /* Leave the record whole for the next run. */
+    db->WriteData(vKeys[1], vData);
+    delete db;
+    
+    return 0;
+}
+
+
+/* Append the bytes of a hash, or of its first nBytes. */
+template<typename HashType>
+void AppendHash(std::vector<unsigned char>& vData, const HashType& hash, unsigned int nBytes = sizeof(HashType))
+{
+    vData.insert(vData.end(), (const unsigned char*)&hash, (const unsigned char*)&hash + nBytes);
+}
+
+
+/* Append an integer in little endian, nBytes of it. */
+void AppendInt(std::vector<unsigned char>& vData, uint64 nValue, unsigned int nBytes)
+{
+    for(unsigned int i = 0; i < nBytes; i++)
+        vData.push_back((unsigned char)(nValue >> (8 * i)));
+}
+
+
+/** A record laid out like a serialized transaction. Inputs spend earlier transactions with a DER signature
+    and a compressed public key, outputs pay round amounts to pay to key hash scripts. Hashes, signatures and
+    keys are random, but keys and addresses are drawn from a pool so they recur the way they do in a chain.
+    Most inputs spend from one wallet with one key, and most transactions pay their change back to it. **/
+void RandomTransaction(std::vector<unsigned char>& vData, const std::vector<uint256>& vPool, const std::vector<uint256>& vHashes, unsigned int nTime)
+{
+    AppendInt(vData, 1, 4);
+    AppendInt(vData, nTime, 4);
+    
+    const uint256& wallet = vPool[GetRand(vPool.size())];
+    
+    unsigned int nInputs = 1 + GetRand(3);
+    vData.push_back((unsigned char)nInputs);
+    for(unsigned int nInput = 0; nInput < nInputs; nInput++)
+    {
+        AppendHash(vData, vHashes.empty() ? GetRand256() : vHashes[GetRand(vHashes.size())]);
+        AppendInt(vData, GetRand(4), 4);
+        
+        /* Script: the signature and the key it is checked against. */
+        vData.push_back(0x6b);
+        vData.push_back(0x48);
+        vData.push_back(0x30); vData.push_back(0x45);
+        vData.push_back(0x02); vData.push_back(0x21); vData.push_back(0x00);
+        AppendHash(vData, GetRand256());
+        vData.push_back(0x02); vData.push_back(0x20);
+        AppendHash(vData, GetRand256());
+        vData.push_back(0x01);
+        
+        const uint256& key = (GetRand(5) == 0 ? vPool[GetRand(vPool.size())] : wallet);
+        vData.push_back(0x21);
+        vData.push_back(0x02 + (key.Get64() & 1));
+        AppendHash(vData, key);
+        
+        AppendInt(vData, 0xffffffff, 4);
+    }
+    
+    unsigned int nOutputs = 1 + GetRand(3);
+    vData.push_back((unsigned char)nOutputs);
+    for(unsigned int nOutput = 0; nOutput < nOutputs; nOutput++)
+    {
+        bool fChange = (nOutput == nOutputs - 1 && nOutputs > 1 && GetRand(4) != 0);
+        AppendInt(vData, fChange ? GetRand(1000000000) : (1 + GetRand(100000)) * 10000, 8);
+        
+        /* Script: OP_DUP OP_HASH160 <address> OP_EQUALVERIFY OP_CHECKSIG. */
+        vData.push_back(0x19);
+        vData.push_back(0x76); vData.push_back(0xa9); vData.push_back(0x14);
+        AppendHash(vData, fChange ? wallet : vPool[GetRand(vPool.size())], 20);
+        vData.push_back(0x88); vData.push_back(0xac);
+    }
+    
+    AppendInt(vData, 0, 4);
+}
+
+
+/* Write the records with -forcewrite, returning the micro-seconds taken. */
+uint64 WriteAllData(BenchDB* db, const std::vector< std::vector<unsigned char> >& vRecords, unsigned int nCount)
+{
+    Timer timer;
+    timer.Start();
+    for(unsigned int i = 0; i < nCount; i++)
+        db->WriteData(i, vRecords[i]);
+    
+    return std::max((uint64)timer.ElapsedMicroseconds(), (uint64)1);
+}
+
+
+/** Write the records with one compression, report what they take on disk and how fast they were written,
+    then reopen the database with a small cache and report how long a record takes to read at random.
+    With fDictionary a dictionary is first trained from a sample of the records written uncompressed. **/
+void CompressRecords(const std::vector< std::vector<unsigned char> >& vRecords, const std::string& strKind, const std::string& strCompress, bool fDictionary)
+{
+    std::string strName = "benchcompress_" + strKind + "_" + strCompress + (fDictionary ? "_dict" : "");
+    std::string strLabel = strCompress + (fDictionary ? " + dictionary" : "");
+    if(!LLD::CompressionAvailable(LLD::CompressionType(strCompress)))
+    {
+        printf(ANSI_COLOR_GREEN "%-12s | %-17s | not in this build\n" ANSI_COLOR_RESET, strKind.c_str(), strLabel.c_str());
+        
+        return;
+    }
+    
+    boost::filesystem::remove_all(GetDataDir().string() + "/" + strName + "/");
+    mapArgs["-compress"]   = strCompress;
+    mapArgs["-forcewrite"] = "1";
+    mapArgs["-lldcache"]   = "1";
+    
+    /* The records as they are stored uncompressed, with their length. */
+    uint64 nRaw = 0;
+    for(auto& vData : vRecords)
+        nRaw += vData.size() + GetSizeOfCompactSize(vData.size());
+    
+    /* The records sampled are written first, uncompressed, and trained from once reopened to compress. */
+    BenchDB* db;
+    if(fDictionary)
+    {
+        mapArgs["-compress"] = "none";
+        
+        db = new BenchDB(strName);
+        WriteAllData(db, vRecords, std::min((unsigned int)vRecords.size(), (unsigned int)GetArg("-compressdictsamples", LLD::DEFAULT_COMPRESS_DICT_SAMPLES)));
+        delete db;
+        
+        mapArgs["-compress"] = strCompress;
+    }
+    
+    db = new BenchDB(strName);
+    if(fDictionary)
+        db->TrainDictionary();
+    
+    uint64 nWrite  = WriteAllData(db, vRecords, vRecords.size());
+    uint64 nStored = db->StoredBytes();
+    delete db;
+    
+    /* Random order, so the reads go to the sectors rather than the cache or a read ahead. */
+    std::vector<uint64> vKeys;
+    for(unsigned int i = 0; i < vRecords.size(); i++)
+        vKeys.push_back(i);
+    
+    std::random_shuffle(vKeys.begin(), vKeys.end());
+    
+    db = new BenchDB(strName);
+    
+    uint64 nRead;
+    unsigned int nFailed = ReadAllData(db, vKeys, nRead);
+    
+    std::vector<unsigned char> vData;
+    for(unsigned int i = 0; i < vRecords.size(); i += 97)
+        if(!db->ReadData(i, vData) || vData != vRecords[i])
+            nFailed++;
+    
+    printf(ANSI_COLOR_GREEN "%-12s | %-17s | Ratio %5.2fx (%9" PRIu64 " bytes) | Write %7.1f MB/s %8.0f ops/s | Read %7.0f ns | %u failed\n" ANSI_COLOR_RESET, strKind.c_str(), strLabel.c_str(), nRaw / (double)std::max(nStored, (uint64)1), nStored, nRaw / (double)nWrite, (vRecords.size() * 1000000.0) / nWrite, (nRead * 1000.0) / vRecords.size(), nFailed);
+    
+    if(GetArg("-verbose", 0) >= 1)
+        db->PrintFlushStats();
+    
+    delete db;
+}
+
+
+/** Compression of records like a chain's: transactions on their own, small enough to need a dictionary,
+    and blocks of them. Each compression writes its own database, which is then read back at random. **/
+int BenchmarkCompress()
+{
+    unsigned int nTransactions = GetArg("-benchkeys", 20000);
+    unsigned int nBlocks       = std::max(nTransactions / 20, 1u);
+    
+    printf(ANSI_COLOR_BRIGHT_BLUE "\nBenchmarking Sector Compression with %u Transactions and %u Blocks\n\n" ANSI_COLOR_RESET, nTransactions, nBlocks);
+    
+    /* Keys and addresses in use, and the transactions there are to spend from. */
+    std::vector<uint256> vPool(GetArg("-benchaddresses", 2000)), vHashes;
+    for(auto& hash : vPool)
+        hash = GetRand256();
+    
+    std::vector< std::vector<unsigned char> > vTransactions(nTransactions);
+    for(unsigned int i = 0; i < nTransactions; i++)
+    {
+        RandomTransaction(vTransactions[i], vPool, vHashes, 1500000000 + i);
+        vHashes.push_back(LLC::HASH::SK256(vTransactions[i]));
+    }
+    
+    /* Blocks: a header, then 10 to 30 of the transactions. */
+    std::vector< std::vector<unsigned char> > vBlocks(nBlocks);
+    for(unsigned int i = 0; i < nBlocks; i++)
+    {
+        CBlock blk;
+        blk.SetRandom();
+        blk.nHeight = 1000000 + i;
+        LLD::Codec<CBlock>::Encode(blk, vBlocks[i]);
+        
+        unsigned int nCount = 10 + GetRand(21);
+        vBlocks[i].push_back((unsigned char)nCount);
+        for(unsigned int n = 0; n < nCount; n++)
+        {
+            const std::vector<unsigned char>& vTx = vTransactions[GetRand(nTransactions)];
+            vBlocks[i].insert(vBlocks[i].end(), vTx.begin(), vTx.end());
+        }
+    }
+    
+    const char* COMPRESSIONS[] = { "none", "zlib", "lz4", "zstd" };
+    for(auto pszCompress : COMPRESSIONS)
+    {
+        CompressRecords(vTransactions, "transactions", pszCompress, false);
+        if(strcmp(pszCompress, "none") != 0)
+            CompressRecords(vTransactions, "transactions", pszCompress, true);
+    }
+    
+    printf("\n");
+    for(auto pszCompress : COMPRESSIONS)
+        CompressRecords(vBlocks, "blocks", pszCompress, false);
+    
+    return 0;
+}
 
 
 enum
@@ -224,6 +2367,72 @@ int main(int argc, char** argv)
 {
     ParseParameters(argc, argv);
     
+    if(GetBoolArg("-benchmmap", false))
+        return BenchmarkMMAP();
+    
+    if(GetBoolArg("-benchkeychain", false))
+        return BenchmarkKeychain();
+    
+    if(GetBoolArg("-benchcache", false))
+        return BenchmarkCache();
+    
+    if(GetBoolArg("-benchzipf", false))
+        return BenchmarkZipf();
+    
+    if(GetBoolArg("-benchflush", false))
+        return BenchmarkFlush();
+    
+    if(GetBoolArg("-benchmemory", false))
+        return BenchmarkMemory();
+    
+    if(GetBoolArg("-benchread", false))
+        return BenchmarkRead();
+    
+    if(GetBoolArg("-benchbatch", false))
+        return BenchmarkBatch();
+    
+    if(GetBoolArg("-benchio", false))
+        return BenchmarkIO();
+    
+    if(GetBoolArg("-benchtxn", false))
+        return BenchmarkTransactions();
+    
+    if(GetBoolArg("-benchfree", false))
+        return BenchmarkFreeSpace();
+    
+    if(GetBoolArg("-benchcompact", false))
+        return BenchmarkCompact();
+    
+    if(GetBoolArg("-benchbloom", false))
+        return BenchmarkBloom();
+    
+    if(GetBoolArg("-benchscan", false))
+        return BenchmarkScan();
+    
+    if(GetBoolArg("-benchmix", false))
+        return BenchmarkMix();
+    
+    if(GetBoolArg("-benchmvcc", false))
+        return BenchmarkSnapshots();
+    
+    if(GetBoolArg("-benchjournal", false))
+        return BenchmarkJournal();
+    
+    if(GetBoolArg("-benchcodec", false))
+        return BenchmarkCodec();
+    
+    if(GetBoolArg("-benchhash", false))
+        return BenchmarkHash();
+    
+    if(GetBoolArg("-benchchecksum", false))
+        return BenchmarkChecksum();
+    
+    if(GetBoolArg("-benchverify", false))
+        return BenchmarkVerify();
+    
+    if(GetBoolArg("-benchcompress", false))
+        return BenchmarkCompress();
+    
     printf("Lower Level Library Initialization...\n");
     
     TestDB* db = new TestDB();